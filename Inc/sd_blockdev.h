@@ -0,0 +1,132 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_blockdev_H__
+#define __sd_blockdev_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_BLOCKDEV_BLOCK_SIZE          512
+
+// Requests of pass-through layers in flight at once, each remaps one completion back to its layer
+#ifndef SD_BLOCKDEV_FORWARD_DEPTH
+#define SD_BLOCKDEV_FORWARD_DEPTH       32
+#endif
+
+// Capabilities, a layer reports what it offers itself, not what the device below it does
+#define SD_BLOCKDEV_CAP_ASYNC           (1U << 0)   // Callbacks may come later from SD_BlockDev_Process, otherwise before Read/Write return
+#define SD_BLOCKDEV_CAP_ANY_BUFFER      (1U << 1)   // Buffers may be anywhere (DTCM, unaligned), otherwise DMA reachable and 32 byte aligned
+#define SD_BLOCKDEV_CAP_DISCARD         (1U << 2)
+#define SD_BLOCKDEV_CAP_VOLATILE        (1U << 3)   // Holds written data that only Flush makes durable
+#define SD_BLOCKDEV_CAP_PERSISTENT      (1U << 4)   // Contents survive a power cycle
+#define SD_BLOCKDEV_CAP_READ_ONLY       (1U << 5)
+
+// Write flags
+#define SD_BLOCKDEV_FUA                 (1U << 0)   // Durable through every layer and the card cache when the callback runs
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct SD_BlockDev_s SD_BlockDev_t;
+
+// Called once per request, Status is the result of the whole request
+typedef void (*SD_BlockDevCallback_t)(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+
+/**
+  * @brief  Operations of one layer. Read and Write return an error without calling back when the request
+  *         was not accepted. Lba and NumberOfBlocks are checked against the geometry before a layer sees
+  *         them. Flush and Process only handle the layer itself, SD_BlockDev_Flush/Process walk the stack,
+  *         either may be NULL. A NULL Discard means discard is not supported. Barrier is for layers that
+  *         queue requests, it covers that layer and everything below it and completes asynchronously.
+  *         A layer without it must have finished every write it accepted once its Flush returned.
+  */
+typedef struct
+{
+    SD_Error_t (*Read)     (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+    SD_Error_t (*Write)    (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+    SD_Error_t (*Flush)    (SD_BlockDev_t *pDev);
+    SD_Error_t (*Barrier)  (SD_BlockDev_t *pDev, SD_BlockDevCallback_t Callback, void *Context);
+    SD_Error_t (*Discard)  (SD_BlockDev_t *pDev, uint64_t Lba, uint64_t NumberOfBlocks);
+    void       (*Process)  (SD_BlockDev_t *pDev);
+} SD_BlockDevOps_t;
+
+typedef struct
+{
+    uint32_t Reads;
+    uint32_t Writes;
+    uint32_t Flushes;                   // Barriers and flushes
+    uint32_t Fua;                       // FUA writes
+    uint32_t Discards;
+    uint32_t Errors;                    // Rejected requests, and failures seen by the sync helpers
+    uint64_t ReadBlocks;
+    uint64_t WriteBlocks;
+    uint64_t ReadCycles;                // Spent in SD_BlockDev_ReadSync, throughput of this layer alone
+    uint64_t WriteCycles;
+} SD_BlockDevStats_t;
+
+struct SD_BlockDev_s
+{
+    const SD_BlockDevOps_t *pOps;
+    SD_BlockDev_t          *pLower;     // Device this layer is stacked on, NULL for the card itself
+    const char             *pName;
+    void                   *pPrivate;   // Layer state
+    uint64_t                Blocks;     // Geometry, always in SD_BLOCKDEV_BLOCK_SIZE blocks
+    uint64_t                Offset;     // Start on pLower, for layers that map a range of it
+    uint32_t                EraseBlocks;// Allocation unit, writes aligned to it and in multiples of it program fastest
+    uint32_t                Caps;
+    SD_BlockDevStats_t      Stats;
+};
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Layers provided here, call after SD_Init, every call refreshes the geometry from the card
+SD_BlockDev_t   *SD_BlockDev_Card            (void);
+// NULL when the module is not compiled in
+SD_BlockDev_t   *SD_BlockDev_Cache           (void);
+SD_BlockDev_t   *SD_BlockDev_ReadAhead       (void);
+// Topmost layer of the card stack that is compiled in, what MSC and loggers should use by default
+SD_BlockDev_t   *SD_BlockDev_Default         (void);
+
+SD_Error_t       SD_BlockDev_Read            (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+SD_Error_t       SD_BlockDev_Write           (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+// Blocking, run SD_BlockDev_Process until the request completed
+SD_Error_t       SD_BlockDev_ReadSync        (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks);
+SD_Error_t       SD_BlockDev_WriteSync       (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks);
+// Completes once every write submitted before it is durable, writes submitted after it start only then
+SD_Error_t       SD_BlockDev_Barrier         (SD_BlockDev_t *pDev, SD_BlockDevCallback_t Callback, void *Context);
+// Blocking barrier, makes everything written so far durable, through all layers down to the card
+SD_Error_t       SD_BlockDev_Flush           (SD_BlockDev_t *pDev);
+SD_Error_t       SD_BlockDev_Discard         (SD_BlockDev_t *pDev, uint64_t Lba, uint64_t NumberOfBlocks);
+// Progresses asynchronous work of every layer in the stack
+void             SD_BlockDev_Process         (SD_BlockDev_t *pDev);
+// For layers, submits to pDev->pLower at pDev->Offset + Lba, the callback reports pDev
+SD_Error_t       SD_BlockDev_Forward         (SD_BlockDev_t *pDev, bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+void             SD_BlockDev_GetStats        (SD_BlockDev_t *pDev, SD_BlockDevStats_t *pStats);
+void             SD_BlockDev_ResetStats      (SD_BlockDev_t *pDev);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_blockdev_H__
@@ -0,0 +1,110 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_cache_H__
+#define __sd_cache_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Cached 512 byte blocks, data lives in AXI SRAM, directory (24 bytes per entry, twice this many for ARC) in DTCM
+#ifndef SD_CACHE_BLOCKS
+#define SD_CACHE_BLOCKS                 128
+#endif
+
+// Staging buffer in AXI SRAM, longest single card command issued for misses and dirty runs
+#ifndef SD_CACHE_STAGE_BLOCKS
+#define SD_CACHE_STAGE_BLOCKS           32
+#endif
+
+// Requests longer than this go around the cache (bulk data), cached copies are still kept coherent
+#ifndef SD_CACHE_BYPASS_BLOCKS
+#define SD_CACHE_BYPASS_BLOCKS          16
+#endif
+
+// Dirty data older than this is written back by SD_Cache_Process
+#ifndef SD_CACHE_WRITEBACK_MS
+#define SD_CACHE_WRITEBACK_MS           1000
+#endif
+
+// Directory hash buckets, must be a power of two
+#define SD_CACHE_HASH                   256
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_CACHE_LRU            = 0,
+    SD_CACHE_ARC            = 1,        // Adaptive replacement, scan resistant, keeps ghost LBAs of evicted blocks
+} SD_CachePolicy_t;
+
+typedef enum
+{
+    SD_CACHE_WRITE_THROUGH  = 0,
+    SD_CACHE_WRITE_BACK     = 1,        // Only honoured while SD_PowerFail_IsArmed, write-through otherwise
+} SD_CacheMode_t;
+
+typedef struct
+{
+    uint32_t ReadHits;
+    uint32_t ReadMisses;
+    uint32_t WriteHits;
+    uint32_t WriteMisses;
+    uint32_t GhostHits;                 // ARC misses found in B1/B2, adapt the recency/frequency split
+    uint32_t Evictions;
+    uint32_t DirtyEvictions;            // Evictions that had to write the block back first
+    uint32_t Bypassed;                  // Requests longer than SD_CACHE_BYPASS_BLOCKS
+    uint32_t FlushRuns;                 // Multi-block writes issued for dirty runs
+    uint32_t FlushedBlocks;
+    uint32_t Resident;                  // Blocks currently cached
+    uint32_t Dirty;                     // Blocks not written to the card yet
+    uint32_t Target;                    // ARC recency target p, blocks
+} SD_CacheStats_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Flushes and drops whatever was cached, call again to change the policy
+SD_Error_t       SD_Cache_Init               (SD_CachePolicy_t Policy, SD_CacheMode_t Mode);
+// Flushes first when leaving write-back
+SD_Error_t       SD_Cache_SetMode            (SD_CacheMode_t Mode);
+SD_CacheMode_t   SD_Cache_GetMode            (void);
+// Blocking, any buffer alignment and memory, the card only ever DMAs into cache owned AXI buffers
+SD_Error_t       SD_Cache_Read               (uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks);
+SD_Error_t       SD_Cache_Write              (uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks);
+// Writes all dirty blocks in ascending LBA order, consecutive ones coalesced into one CMD25
+SD_Error_t       SD_Cache_Flush              (void);
+// Flushes, then forgets every block, for when something else wrote the card
+SD_Error_t       SD_Cache_Invalidate         (void);
+// Call from the context that issues reads and writes, writes back dirty data older than SD_CACHE_WRITEBACK_MS
+void             SD_Cache_Process            (void);
+void             SD_Cache_GetStats           (SD_CacheStats_t *pStats);
+// Layer below, SD_BlockDev_Cache() sets it, otherwise the first miss builds the stack
+void             SD_Cache_SetLower           (SD_BlockDev_t *pLower);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_cache_H__
@@ -0,0 +1,84 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_cow_H__
+#define __sd_cow_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Blocks that can be rewritten while a snapshot is held, reserved on the lower device. Each one costs a
+// 16 byte remap table entry in AXI SRAM and on the card
+#ifndef SD_COW_POOL_BLOCKS
+#define SD_COW_POOL_BLOCKS              2048
+#endif
+
+// A changed remap table is written back by SD_BlockDev_Process once the oldest change is this old
+#ifndef SD_COW_WRITEBACK_MS
+#define SD_COW_WRITEBACK_MS             1000
+#endif
+
+// Pooled blocks SD_BlockDev_Process copies home per call while no snapshot is held
+#ifndef SD_COW_FOLD_BLOCKS
+#define SD_COW_FOLD_BLOCKS              8
+#endif
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint32_t Snapshots;
+    uint32_t Rollbacks;
+    uint32_t Discards;
+    uint64_t Redirected;                // Blocks written to a fresh pool block to preserve the snapshot
+    uint64_t Rewritten;                 // Blocks written again in the pool block they already had
+    uint64_t Returned;                  // Pool blocks given up by writing their block back home, no snapshot held
+    uint64_t Folded;                    // Pool blocks copied back home in the background
+    uint32_t TableWrites;
+    uint32_t Remapped;                  // Blocks currently living in the pool
+    uint32_t PoolFree;
+} SD_CowStats_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Loads the remap table from pLower, a device without a valid one is formatted, returns the volume
+SD_Error_t       SD_Cow_Mount                (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev);
+// Drops the snapshot and every remap, blocks in the pool are lost
+SD_Error_t       SD_Cow_Format               (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev);
+// Freezes the current contents, durable when it returns, one snapshot at a time
+SD_Error_t       SD_Cow_Snapshot             (void);
+// Returns the volume to the snapshot and releases it
+SD_Error_t       SD_Cow_Rollback             (void);
+// Keeps the current contents and releases the snapshot
+SD_Error_t       SD_Cow_Discard              (void);
+// Read-only view of the snapshot while one is held, NULL otherwise
+SD_BlockDev_t   *SD_Cow_GetSnapshot          (void);
+void             SD_Cow_GetStats             (SD_CowStats_t *pStats);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_cow_H__
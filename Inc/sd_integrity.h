@@ -0,0 +1,97 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_integrity_H__
+#define __sd_integrity_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Blocks checked at once, a read keeps two such pieces in flight and checks one while the other transfers
+#ifndef SD_INTEGRITY_STAGE_BLOCKS
+#define SD_INTEGRITY_STAGE_BLOCKS       16
+#endif
+
+// Tag blocks cached in AXI SRAM, each one covers SD_INTEGRITY_TAGS_PER_BLOCK data blocks
+#ifndef SD_INTEGRITY_CACHE
+#define SD_INTEGRITY_CACHE              8
+#endif
+
+// Dirty tag blocks are written back by SD_BlockDev_Process once the oldest change is this old
+#ifndef SD_INTEGRITY_WRITEBACK_MS
+#define SD_INTEGRITY_WRITEBACK_MS       1000
+#endif
+
+// 1 feeds the CRC unit from MDMA, one linked list per piece, 0 from the CPU
+#ifndef SD_INTEGRITY_MDMA
+#define SD_INTEGRITY_MDMA               1
+#endif
+
+// Channel 0 is the one SD_MDMA_ReadConfig sets up
+#ifndef SD_INTEGRITY_MDMA_CHANNEL
+#define SD_INTEGRITY_MDMA_CHANNEL       MDMA_Channel1
+#endif
+
+#define SD_INTEGRITY_TAGS_PER_BLOCK     126         // The last two words of a tag block are its epoch and CRC
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint64_t TaggedBlocks;              // Written through the layer, tag updated
+    uint64_t VerifiedBlocks;            // Read back matching their tag
+    uint64_t UntaggedBlocks;            // Read without a tag, never written since SD_Integrity_Format
+    uint32_t Mismatches;                // Blocks failing verification, reported as SD_CARD_ECC_FAILED
+    uint64_t LastMismatch;              // Lba of the last one
+    uint32_t TagErrors;                 // Tag blocks failing their own CRC, their blocks read as untagged
+    uint32_t TagReads;
+    uint32_t TagWrites;
+    uint64_t CrcBytes;
+    uint64_t CrcCycles;                 // CPU time the checksums cost, feeding the unit or waiting for MDMA
+} SD_IntegrityStats_t;
+
+typedef struct
+{
+    uint32_t SoftwareCyclesPerByte;     // x100, the bitwise loop sd_journal uses
+    uint32_t CpuCyclesPerByte;          // x100, CRC unit fed by the CPU
+    uint32_t MdmaCyclesPerByte;         // x100, CRC unit fed by MDMA, start to finish, the CPU is free meanwhile
+} SD_IntegrityBench_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Mount formats a device without a valid tag area, Format always does, which only invalidates the old tags
+SD_Error_t       SD_Integrity_Mount          (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev);
+SD_Error_t       SD_Integrity_Format         (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev);
+// Standard CRC-32 (IEEE 802.3, as zlib) of one block from the CRC unit
+uint32_t         SD_Integrity_Crc32          (const uint8_t *pBlock);
+// Checksums Blocks blocks of pBuffer, word aligned, each way, in RAM only
+SD_Error_t       SD_Integrity_Benchmark      (const uint8_t *pBuffer, uint32_t Blocks, SD_IntegrityBench_t *pResult);
+void             SD_Integrity_GetStats       (SD_IntegrityStats_t *pStats);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_integrity_H__
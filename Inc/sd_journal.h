@@ -0,0 +1,87 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_journal_H__
+#define __sd_journal_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Log size, taken from the end of the lower device and rounded to its allocation unit
+#ifndef SD_JOURNAL_BLOCKS
+#define SD_JOURNAL_BLOCKS               2048
+#endif
+
+// Blocks per transaction, with descriptor and commit record the whole group fits one scheduler chunk
+#ifndef SD_JOURNAL_MAX_BLOCKS
+#define SD_JOURNAL_MAX_BLOCKS           30
+#endif
+
+// Logged blocks not yet written home, reads of them are redirected to the log (16 bytes each in DTCM)
+#ifndef SD_JOURNAL_MAP
+#define SD_JOURNAL_MAP                  256
+#endif
+
+// SD_Journal_Process checkpoints once the log was idle this long, or earlier when log or map is half full
+#ifndef SD_JOURNAL_CHECKPOINT_MS
+#define SD_JOURNAL_CHECKPOINT_MS        500
+#endif
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint32_t Commits;
+    uint32_t CommittedBlocks;
+    uint32_t Checkpoints;
+    uint32_t CheckpointedBlocks;
+    uint32_t ForcedCheckpoints;         // Log or map full at commit, or a direct write hit a logged block
+    uint32_t Replayed;                  // Transactions recovered at mount
+    uint32_t ReplayedBlocks;
+    uint32_t Discarded;                 // Torn transactions found at mount, checksum or sequence mismatch
+    uint32_t RedirectedReads;           // Blocks read from the log instead of home
+    uint32_t Used;                      // Log blocks in use right now
+    uint32_t Mapped;                    // Blocks waiting for checkpoint right now
+} SD_JournalStats_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Replays committed transactions and returns the device above the log, its last block ends before the log
+SD_Error_t       SD_Journal_Mount            (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev);
+// One transaction at a time, blocks are copied into the AXI staging buffer, a later copy of a block wins
+SD_Error_t       SD_Journal_Begin            (void);
+SD_Error_t       SD_Journal_Add              (uint64_t Lba, const uint8_t *pData);
+// Blocking, the group is on the card as one sequential write and durable when this returns
+SD_Error_t       SD_Journal_Commit           (void);
+void             SD_Journal_Abort            (void);
+// Writes every committed block home and frees the log
+SD_Error_t       SD_Journal_Checkpoint       (void);
+void             SD_Journal_GetStats         (SD_JournalStats_t *pStats);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_journal_H__
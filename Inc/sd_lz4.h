@@ -0,0 +1,85 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_lz4_H__
+#define __sd_lz4_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Unit of compression and of the extent map, at most 15 blocks, 8 matches a 4 KB FAT cluster
+#ifndef SD_LZ4_CHUNK_BLOCKS
+#define SD_LZ4_CHUNK_BLOCKS             8
+#endif
+
+// Logical size in chunks, the map costs 4 bytes of AXI SRAM and of card space per chunk
+#ifndef SD_LZ4_CHUNKS
+#define SD_LZ4_CHUNKS                   8192
+#endif
+
+// Hash table of the encoder in DTCM, 2 bytes per entry
+#ifndef SD_LZ4_HASH_BITS
+#define SD_LZ4_HASH_BITS                12
+#endif
+
+// SD_BlockDev_Process writes a partly filled chunk and the map back once idle this long
+#ifndef SD_LZ4_WRITEBACK_MS
+#define SD_LZ4_WRITEBACK_MS             1000
+#endif
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint32_t Compressed;                // Chunks written compressed
+    uint32_t Stored;                    // Chunks written as is, compression would not have saved a block
+    uint32_t Merged;                    // Partial chunk writes that had to read and decompress the old chunk
+    uint32_t MapWrites;                 // Map blocks written
+    uint32_t Errors;                    // Corrupt chunks found on read
+    uint64_t InBytes;                   // Logical bytes written to the card
+    uint64_t OutBytes;                  // Physical bytes that took, whole blocks
+    uint64_t CompressCycles;
+    uint64_t DecompressedBytes;
+    uint64_t DecompressCycles;
+    uint32_t Used;                      // Data blocks allocated on the lower device
+    uint32_t Free;
+} SD_Lz4Stats_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Loads the extent map from pLower, a device without a valid one is formatted, returns the logical device
+SD_Error_t       SD_Lz4_Mount                (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev);
+// Drops every chunk and starts over with an empty map
+SD_Error_t       SD_Lz4_Format               (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev);
+void             SD_Lz4_GetStats             (SD_Lz4Stats_t *pStats);
+void             SD_Lz4_ResetStats           (void);
+// Compression ratio, cycles per byte and space use
+void             SD_Lz4_Print                (void);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_lz4_H__
@@ -0,0 +1,88 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_part_H__
+#define __sd_part_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Partitions exposed at once, further entries of the table are ignored
+#ifndef SD_PART_MAX
+#define SD_PART_MAX                     8
+#endif
+
+// Logical partitions followed through the EBR chain of an extended MBR partition, guards against loops
+#ifndef SD_PART_MAX_EBR
+#define SD_PART_MAX_EBR                 32
+#endif
+
+#define SD_PART_NAME_LENGTH             16
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_PART_SCHEME_NONE     = 0,        // No boot signature, the file system starts at block 0 (superfloppy)
+    SD_PART_SCHEME_MBR      = 1,
+    SD_PART_SCHEME_GPT      = 2,
+} SD_PartScheme_t;
+
+typedef struct
+{
+    uint64_t Start;                     // Block on the disk
+    uint64_t Blocks;
+    uint8_t  MbrType;                   // 0xEE for GPT partitions
+    uint8_t  TypeGuid[16];              // GPT only, as stored on disk
+    bool     Aligned;                   // Start is a multiple of the allocation unit
+    char     Name[SD_PART_NAME_LENGTH]; // GPT name reduced to ASCII, "mbrN" for MBR partitions
+} SD_PartInfo_t;
+
+typedef struct
+{
+    SD_PartScheme_t Scheme;
+    uint8_t         Count;
+    uint8_t         Misaligned;         // Partitions whose start is not on an allocation unit boundary
+    uint8_t         Ignored;            // Valid entries beyond SD_PART_MAX
+    bool            BackupGpt;          // Primary GPT was damaged, the backup at the end of the disk was used
+    uint32_t        EraseBlocks;        // Allocation unit the alignment was checked against
+} SD_PartTable_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Reads and validates the partition table of pDisk, a table with overlapping or out of range entries is rejected
+SD_Error_t       SD_Part_Mount               (SD_BlockDev_t *pDisk);
+const SD_PartTable_t *SD_Part_GetTable       (void);
+const SD_PartInfo_t  *SD_Part_GetInfo        (uint8_t Index);
+// Bounds checked view of one partition, stacked on pDisk, NULL past the last partition
+SD_BlockDev_t   *SD_Part_GetDevice           (uint8_t Index);
+// Partition table and alignment warnings on the console
+void             SD_Part_Print               (void);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_part_H__
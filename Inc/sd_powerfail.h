@@ -0,0 +1,118 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_powerfail_H__
+#define __sd_powerfail_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Below the SDMMC interrupt (0), DATAEND and the CMD12 it sends have to get through while the service runs
+#define SD_POWERFAIL_IRQ_PRIORITY       1
+#define SD_POWERFAIL_HOOKS              4
+
+// Board defaults armed by the USB MSC init, the hold-up time depends on the supply capacitance
+#ifndef SD_POWERFAIL_PVD_LEVEL
+#define SD_POWERFAIL_PVD_LEVEL          PWR_PVDLEVEL_6
+#endif
+
+#ifndef SD_POWERFAIL_HOLDUP_US
+#define SD_POWERFAIL_HOLDUP_US          2000
+#endif
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_POWERFAIL_OFF        = 0,        // PVD not configured, callers should stay write-through
+    SD_POWERFAIL_ARMED      = 1,        // Supply good, service armed
+    SD_POWERFAIL_DRAINING   = 2,        // Supply dropping, new writes refused, in-flight transfer finishing
+    SD_POWERFAIL_FLUSHING   = 3,        // Card idle, last-gasp hooks may write
+    SD_POWERFAIL_DONE       = 4,        // Everything written, writes refused until the supply recovers
+} SD_PowerFailState_t;
+
+typedef enum
+{
+    SD_POWERFAIL_STAGE_DETECTED  = 0,
+    SD_POWERFAIL_STAGE_DRAINED   = 1,   // In-flight data phase ended, CMD12 sent by the interrupt
+    SD_POWERFAIL_STAGE_IDLE      = 2,   // Busy end, card back in transfer state
+    SD_POWERFAIL_STAGE_HOOKS     = 3,   // Last-gasp hooks returned
+    SD_POWERFAIL_STAGE_DONE      = 4,   // Card cache flushed
+    SD_POWERFAIL_STAGE_RECOVERED = 5,   // Supply back above the threshold
+} SD_PowerFailStage_t;
+
+typedef struct
+{
+    uint32_t Events;                    // PVD threshold crossings downwards
+    uint32_t Recoveries;                // Supply came back before power was lost
+    uint32_t Aborted;                   // In-flight transfers aborted because the budget ran out
+    int32_t  LastRemainingUs;           // Budget left when the last service finished, negative = overrun
+    int32_t  MinRemainingUs;
+} SD_PowerFailStats_t;
+
+// RemainingUs is what is left of the hold-up budget, hooks must wait for their own writes
+typedef void (*SD_PowerFailHook_t)(int32_t RemainingUs, void *Context);
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// PVDLevel is one of PWR_PVDLEVEL_x, HoldupUs the time the supply capacitance guarantees below that level
+void             SD_PowerFail_Init           (uint32_t PVDLevel, uint32_t HoldupUs);
+// Hooks run in registration order from the PVD interrupt, after the card went idle
+SD_Error_t       SD_PowerFail_RegisterHook   (SD_PowerFailHook_t Hook, void *Context);
+SD_PowerFailState_t SD_PowerFail_GetState    (void);
+// True while a completion window is guaranteed, write-back caching is safe only then
+bool             SD_PowerFail_IsArmed        (void);
+int32_t          SD_PowerFail_RemainingUs    (void);
+void             SD_PowerFail_GetStats       (SD_PowerFailStats_t *pStats);
+
+// Driver hooks
+bool             SD_PowerFail_WriteAllowed   (void);
+void             SD_PowerFail_Service        (void);
+
+#ifdef SDMMC_POWER_FAIL
+
+/**
+  * @brief  Keeps the PVD service out while a command sequence is being issued, BASEPRI only ever
+  *         goes up so nested sections are fine.
+  */
+static inline uint32_t SD_PowerFail_Mask(void)
+{
+    uint32_t BasePri = __get_BASEPRI();
+
+    __set_BASEPRI_MAX(SD_POWERFAIL_IRQ_PRIORITY << (8U - __NVIC_PRIO_BITS));
+    return BasePri;
+}
+
+static inline void SD_PowerFail_Unmask(uint32_t BasePri)
+{
+    __set_BASEPRI(BasePri);
+}
+
+#endif
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_powerfail_H__
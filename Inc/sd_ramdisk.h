@@ -0,0 +1,58 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_ramdisk_H__
+#define __sd_ramdisk_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Blocks in RAM_D2 (SRAM1-3, 288 KB) and RAM_D3 (SRAM4, 64 KB), the rest of each is left for DMA buffers
+// of the peripherals that only reach their own domain. The D2 blocks come first on the device
+#ifndef SD_RAMDISK_D2_BLOCKS
+#define SD_RAMDISK_D2_BLOCKS            512
+#endif
+
+#ifndef SD_RAMDISK_D3_BLOCKS
+#define SD_RAMDISK_D3_BLOCKS            96
+#endif
+
+#define SD_RAMDISK_BLOCKS               (SD_RAMDISK_D2_BLOCKS + SD_RAMDISK_D3_BLOCKS)
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Clocks the D2 SRAMs and returns the RAM disk, zeroed on the first call. Reads and writes complete
+// before they return, Flush has nothing to do, contents are lost with power
+SD_Error_t       SD_RamDisk_Init             (SD_BlockDev_t **ppDev);
+// Block in place, for the CPU and the D2/D3 DMA masters. SDMMC1's IDMA only reaches D1 memory, card
+// transfers of these blocks have to be staged. Cacheable memory, clean it before another bus master
+// reads it and invalidate it after one wrote it
+uint8_t         *SD_RamDisk_GetBlock         (uint64_t Lba);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_ramdisk_H__
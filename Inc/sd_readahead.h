@@ -0,0 +1,93 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_readahead_H__
+#define __sd_readahead_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Independent sequential readers tracked at once
+#ifndef SD_READAHEAD_STREAMS
+#define SD_READAHEAD_STREAMS            4
+#endif
+
+// Prefetch windows in AXI SRAM, two per active stream keep one in flight while the other is consumed
+#ifndef SD_READAHEAD_BUFFERS
+#define SD_READAHEAD_BUFFERS            4
+#endif
+
+// Window limits in blocks, the window doubles with every prefetch of a stream up to the maximum
+#ifndef SD_READAHEAD_MIN_BLOCKS
+#define SD_READAHEAD_MIN_BLOCKS         8
+#endif
+#ifndef SD_READAHEAD_MAX_BLOCKS
+#define SD_READAHEAD_MAX_BLOCKS         32
+#endif
+
+// Back to back requests of a stream before it is considered sequential
+#ifndef SD_READAHEAD_TRIGGER
+#define SD_READAHEAD_TRIGGER            2
+#endif
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint32_t Requests;
+    uint32_t Sequential;                // Requests continuing a stream
+    uint32_t HitBlocks;                 // Blocks served from a prefetch window
+    uint32_t MissBlocks;                // Blocks read from the card on demand
+    uint32_t Prefetches;
+    uint32_t PrefetchedBlocks;
+    uint32_t Waits;                     // Requests that had to wait for their window to arrive
+    uint32_t Preempts;                  // Foreground driver calls that waited for a prefetch to finish
+    uint32_t Invalidated;               // Prefetched blocks dropped because they were written
+    uint32_t Unused;                    // Prefetched blocks recycled without being read
+    uint32_t Errors;                    // Prefetches that failed on the card
+} SD_ReadAheadStats_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+void             SD_ReadAhead_Enable         (void);
+// Waits for a prefetch in flight and drops all windows
+void             SD_ReadAhead_Disable        (void);
+// Blocking, blocks not prefetched are read straight into pBuffer which must be DMA reachable (AXI SRAM)
+SD_Error_t       SD_ReadAhead_Read           (uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks);
+// Optional idle step, collects a finished prefetch and starts the next window without waiting for a request
+void             SD_ReadAhead_Process        (void);
+void             SD_ReadAhead_GetStats       (SD_ReadAheadStats_t *pStats);
+// Layer below, SD_BlockDev_ReadAhead() sets it, otherwise the first card read builds the stack
+void             SD_ReadAhead_SetLower       (SD_BlockDev_t *pLower);
+
+// Driver hooks, called on entry of every foreground request and for every write
+void             SD_ReadAhead_Preempt        (void);
+void             SD_ReadAhead_Invalidate     (uint64_t Lba, uint32_t NumberOfBlocks);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_readahead_H__
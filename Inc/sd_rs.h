@@ -0,0 +1,97 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_rs_H__
+#define __sd_rs_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Stripe geometry, data blocks followed by parity blocks, up to SD_RS_PARITY lost blocks per stripe are rebuilt.
+// The layout on the card follows from these alone, an archive must be read back with the same values.
+#ifndef SD_RS_DATA
+#define SD_RS_DATA                      8
+#endif
+
+#ifndef SD_RS_PARITY
+#define SD_RS_PARITY                    2
+#endif
+
+// Stripes per staging buffer, two of them in AXI SRAM so one is encoded while the other is written
+#ifndef SD_RS_STAGE_STRIPES
+#define SD_RS_STAGE_STRIPES             2
+#endif
+
+// 1 writes rebuilt blocks back, a failed sector usually reads again once the card has remapped it
+#ifndef SD_RS_REPAIR
+#define SD_RS_REPAIR                    1
+#endif
+
+// Placement of the GF(2^8) multiply-accumulate loop, copied to ITCM by the startup code
+#ifndef SD_RS_ITCM
+#define SD_RS_ITCM                      __attribute__((section(".itcm"), noinline))
+#endif
+
+#define SD_RS_STRIPE_BLOCKS             (SD_RS_DATA + SD_RS_PARITY)
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint64_t EncodedBytes;              // Data bytes of the stripes encoded
+    uint64_t EncodeCycles;
+    uint64_t DecodedBytes;              // Bytes rebuilt
+    uint64_t DecodeCycles;
+    uint32_t PartialStripes;            // Writes that did not cover a whole stripe, read-modify-write
+    uint32_t ReadErrors;                // Blocks the lower device failed to read, CRC or card ECC
+    uint32_t Reconstructed;             // Blocks rebuilt from the rest of their stripe
+    uint32_t Repaired;                  // Rebuilt blocks written back
+    uint32_t Unrecoverable;             // Stripes with more than SD_RS_PARITY blocks lost
+} SD_RsStats_t;
+
+typedef struct
+{
+    uint32_t EncodeCyclesPerByte;       // x100, per data byte of a stripe
+    uint32_t DecodeCyclesPerByte;       // x100, SD_RS_PARITY data blocks lost, the worst case
+    uint32_t EncodeKBsPerMHz;           // Throughput per MHz of core clock, scales with SystemCoreClock
+    uint32_t DecodeKBsPerMHz;
+} SD_RsBench_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+SD_Error_t       SD_Rs_Mount                 (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev);
+// pStripe holds SD_RS_STRIPE_BLOCKS word aligned blocks, data first, Encode fills in the parity blocks
+SD_Error_t       SD_Rs_EncodeStripe          (uint8_t *pStripe);
+// Rebuilds the blocks set in Erased, bit n is block n of the stripe, from the others
+SD_Error_t       SD_Rs_DecodeStripe          (uint8_t *pStripe, uint32_t Erased);
+// Encodes and rebuilds one stripe in pBuffer, in RAM only, its parity blocks are overwritten
+SD_Error_t       SD_Rs_Benchmark             (uint8_t *pBuffer, SD_RsBench_t *pResult);
+void             SD_Rs_GetStats              (SD_RsStats_t *pStats);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_rs_H__
@@ -0,0 +1,145 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_sched_H__
+#define __sd_sched_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Requests pending at once, each slot is about 56 bytes of DTCM
+#ifndef SD_SCHED_DEPTH
+#define SD_SCHED_DEPTH                  32
+#endif
+
+// Longest single command, merged requests are gathered and long ones split at this size, 512 bytes each in AXI SRAM
+#ifndef SD_SCHED_CHUNK_BLOCKS
+#define SD_SCHED_CHUNK_BLOCKS           32
+#endif
+
+// Only the oldest requests (by arrival) of a direction are sorted, bounds how far one can be overtaken
+#ifndef SD_SCHED_SORT_WINDOW
+#define SD_SCHED_SORT_WINDOW            8
+#endif
+
+// Clients with their own class and bandwidth limit, client 0 is the default one used by SD_Sched_Read/Write
+#ifndef SD_SCHED_CLIENTS
+#define SD_SCHED_CLIENTS                4
+#endif
+
+// Past its deadline a request is dispatched before anything else, normal class values, real-time gets a
+// quarter, background eight times as long
+#ifndef SD_SCHED_READ_DEADLINE_MS
+#define SD_SCHED_READ_DEADLINE_MS       20
+#endif
+#ifndef SD_SCHED_WRITE_DEADLINE_MS
+#define SD_SCHED_WRITE_DEADLINE_MS      250
+#endif
+
+// Highest priority (lowest number) of the interrupts that call into the scheduler, USB MSC in this project.
+// The scheduler holds those off through BASEPRI, SysTick, SDMMC and the PVD service stay above it
+#ifndef SD_SCHED_IRQ_PRIORITY
+#define SD_SCHED_IRQ_PRIORITY           6
+#endif
+
+#define SD_SCHED_NO_REQUEST             0xFF
+#define SD_SCHED_DEFAULT_CLIENT         0
+
+// Write flags
+#define SD_SCHED_FUA                    (1U << 0)   // Durable when completed, the card cache is flushed behind it
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_SCHED_CLASS_RT         = 0,      // Always dispatched first, e.g. a logger that must not lose samples
+    SD_SCHED_CLASS_NORMAL     = 1,
+    SD_SCHED_CLASS_BACKGROUND = 2,      // Only when nothing else is pending, or past its (long) deadline
+    SD_SCHED_CLASSES          = 3,
+} SD_SchedClass_t;
+
+typedef struct
+{
+    uint32_t Submitted;
+    uint32_t Completed;
+    uint32_t Dispatches;                // Card commands issued
+    uint32_t Merged;                    // Requests that shared a command with another one, merge rate = Merged / Submitted
+    uint32_t Chunks;                    // Extra commands caused by splitting long requests
+    uint32_t Sorted;                    // Dispatches that overtook an older request of the same direction
+    uint32_t Expired;                   // Dispatches forced by a deadline
+    uint32_t Late;                      // Requests completed after their deadline
+    uint32_t Depth;                     // Requests pending right now
+    uint32_t MaxDepth;
+    uint64_t DepthSum;                  // Depth seen by every submit, average = DepthSum / Submitted
+    uint32_t Barriers;
+    uint32_t CacheFlushes;              // Card cache flushes, one serves every barrier and FUA write waiting
+} SD_SchedStats_t;
+
+typedef struct
+{
+    uint32_t Completed;
+    uint32_t Errors;
+    uint32_t Pending;
+    uint32_t Throttled;                 // Dispatch decisions that skipped the client for lack of tokens
+    uint64_t Blocks;
+    uint32_t ThroughputKBs;             // Since the client was configured
+    uint32_t LatencyAvgUs;              // Submit to completion
+    uint32_t LatencyMaxUs;
+} SD_SchedClientStats_t;
+
+// Called from SD_Sched_Process with interrupts enabled, the request slot is already free again
+typedef void (*SD_SchedCallback_t)(uint8_t RequestId, SD_Error_t Status, void *Context);
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+void             SD_Sched_Init               (void);
+// RateKBs 0 means unlimited, BurstKB is the bucket size, how much can go at full speed after an idle period
+SD_Error_t       SD_Sched_OpenClient         (SD_SchedClass_t Class, uint32_t RateKBs, uint32_t BurstKB, uint8_t *pClient);
+SD_Error_t       SD_Sched_SetClient          (uint8_t Client, SD_SchedClass_t Class, uint32_t RateKBs, uint32_t BurstKB);
+void             SD_Sched_GetClientStats     (uint8_t Client, SD_SchedClientStats_t *pStats);
+// Buffers can be anywhere, data is gathered into a DMA staging buffer, they must stay valid until the callback
+SD_Error_t       SD_Sched_Read               (uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId);
+SD_Error_t       SD_Sched_Write              (uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId);
+SD_Error_t       SD_Sched_ClientRead         (uint8_t Client, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId);
+SD_Error_t       SD_Sched_ClientWrite        (uint8_t Client, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId);
+// Completes once every request submitted before it, of any client, is durable, later requests wait for it
+SD_Error_t       SD_Sched_Barrier            (uint8_t Client, SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId);
+// Blocking, submits and runs SD_Sched_Process until the request completed, usable from interrupts at
+// SD_SCHED_IRQ_PRIORITY or below (the token bucket refills from the tick)
+SD_Error_t       SD_Sched_Transfer           (uint8_t Client, bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks);
+// Completes the command in flight and dispatches the next one, never waits for the card
+void             SD_Sched_Process            (void);
+// Runs SD_Sched_Process until nothing is pending
+SD_Error_t       SD_Sched_Drain              (void);
+bool             SD_Sched_IsIdle             (void);
+void             SD_Sched_GetStats           (SD_SchedStats_t *pStats);
+
+// Driver hook, called on entry of every foreground request
+void             SD_Sched_Preempt            (void);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_sched_H__
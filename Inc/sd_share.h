@@ -0,0 +1,82 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_share_H__
+#define __sd_share_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Interrupts the USB MSC host is served from, masked while the firmware uses the volume
+#ifndef SD_SHARE_HOST_IRQS
+#define SD_SHARE_HOST_IRQS              { OTG_FS_IRQn, OTG_FS_EP1_OUT_IRQn, OTG_FS_EP1_IN_IRQn }
+#endif
+
+// Longest request the firmware makes with the host masked, bounds how long the host waits for it
+#ifndef SD_SHARE_SLICE_BLOCKS
+#define SD_SHARE_SLICE_BLOCKS           16
+#endif
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint64_t Appended;                  // Blocks written to the reserved region
+    uint64_t Written;                   // Blocks written by the firmware outside of it
+    uint32_t Slices;                    // Times the host was masked
+    uint32_t Refused;                   // Calls made from an interrupt that preempted the host, SD_BUSY
+    uint32_t HostRejected;              // Host writes that touched the reserved region
+    uint32_t MediaChanges;              // Raised to the host
+    uint32_t MaxHoldUs;                 // Longest time the host was masked
+} SD_ShareStats_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Returns the device the USB MSC host is given, over pLower. Mounting the same pLower again keeps the
+// reserved region, so it can be called on every USB init
+SD_Error_t       SD_Share_Mount              (SD_BlockDev_t *pLower, SD_BlockDev_t **ppHost);
+// Region the firmware appends to, read-only to the host. Head is where appending resumes, relative to Lba.
+// A file preallocated contiguously by the host works, its size is then already what the host expects
+SD_Error_t       SD_Share_Reserve            (uint64_t Lba, uint64_t NumberOfBlocks, uint64_t Head);
+SD_Error_t       SD_Share_Release            (void);
+// Writes at the head of the region and advances it, in slices. SD_ADDR_OUT_OF_RANGE when it does not fit
+SD_Error_t       SD_Share_Append             (const uint8_t *pBuffer, uint32_t NumberOfBlocks);
+// Firmware access anywhere on the volume, in slices. A write outside of the region raises a media change
+SD_Error_t       SD_Share_Read               (uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks);
+SD_Error_t       SD_Share_Write              (uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks);
+SD_Error_t       SD_Share_Flush              (void);
+// Call from the main loop instead of SD_BlockDev_Process while the host is attached
+void             SD_Share_Process            (void);
+// Makes the host drop what it cached, e.g. after the firmware closed a file it appended to
+void             SD_Share_NotifyChange       (void);
+// True once after a change, the next host command then fails with UNIT ATTENTION
+bool             SD_Share_MediaChanged       (void);
+void             SD_Share_GetStats           (SD_ShareStats_t *pStats);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_share_H__
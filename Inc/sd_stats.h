@@ -0,0 +1,123 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_stats_H__
+#define __sd_stats_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Log-linear buckets, 4 per power of two, covers full 32 bit cycle range with 25% resolution
+#define SD_STATS_SUB_BUCKETS            4
+#define SD_STATS_BUCKETS                124
+#define SD_STATS_COMMANDS               64
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_STATS_OP_READ        = 0,        // SD_ReadBlocks_DMA
+    SD_STATS_OP_WRITE       = 1,        // SD_WriteBlocks_DMA
+    SD_STATS_OP_QREAD       = 2,        // SD_CQ_QueueRead
+    SD_STATS_OP_QWRITE      = 3,        // SD_CQ_QueueWrite
+    SD_STATS_OP_COUNT
+} SD_StatsOp_t;
+
+typedef enum
+{
+    SD_STATS_PHASE_COMMAND    = 0,      // Issue -> data command response (queued: includes wait for ready)
+    SD_STATS_PHASE_DATA       = 1,      // Data command response -> DATAEND
+    SD_STATS_PHASE_BUSY       = 2,      // DATAEND -> card back in transfer state (legacy writes)
+    SD_STATS_PHASE_COMPLETION = 3,      // DATAEND -> completion seen by caller (SD_Check*, CQ callback)
+    SD_STATS_PHASE_TOTAL      = 4,      // Issue -> last of busy end and completion
+    SD_STATS_PHASE_COUNT
+} SD_StatsPhase_t;
+
+typedef enum
+{
+    SD_STATS_SIZE_1         = 0,        // 1 block
+    SD_STATS_SIZE_8         = 1,        // 2..8 blocks
+    SD_STATS_SIZE_64        = 2,        // 9..64 blocks
+    SD_STATS_SIZE_256       = 3,        // 65..256 blocks
+    SD_STATS_SIZE_LARGE     = 4,        // more than 256 blocks
+    SD_STATS_SIZE_COUNT
+} SD_StatsSize_t;
+
+typedef struct
+{
+    uint32_t Count;
+    uint32_t Min;                       // Cycles
+    uint32_t Max;                       // Cycles
+    uint64_t Sum;                       // Cycles
+    uint32_t Bucket[SD_STATS_BUCKETS];
+} SD_Histogram_t;
+
+typedef struct
+{
+    uint32_t Count;
+    uint32_t Errors;
+    uint32_t Max;                       // Cycles
+    uint64_t Sum;                       // Cycles
+} SD_CommandStats_t;
+
+typedef struct
+{
+    SD_Histogram_t    Phase[SD_STATS_OP_COUNT][SD_STATS_PHASE_COUNT];
+    SD_Histogram_t    Total[SD_STATS_OP_COUNT][SD_STATS_SIZE_COUNT];
+    SD_Histogram_t    Command;          // Every command, issue -> response
+    SD_CommandStats_t PerCommand[SD_STATS_COMMANDS];
+} SD_Stats_t;
+
+// Timestamps of one request, kept by the driver while request is in flight
+typedef struct
+{
+    uint32_t         Issue;
+    uint32_t         Response;
+    uint32_t         DataEnd;
+    uint32_t         Completion;
+    uint8_t          Op;
+    uint8_t          SizeClass;
+    volatile uint8_t Active;
+} SD_StatsRequest_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+void             SD_Stats_Reset              (void);
+// Consistent copy of all histograms, taken with interrupts masked
+void             SD_Stats_Snapshot           (SD_Stats_t *pSnapshot);
+// PartsPer10k: 5000 = p50, 9900 = p99, 9990 = p999. Returns upper bound of bucket in cycles
+uint32_t         SD_Stats_Percentile         (const SD_Histogram_t *pHistogram, uint32_t PartsPer10k);
+uint32_t         SD_Stats_CyclesToUs         (uint32_t Cycles);
+void             SD_Stats_Print              (const SD_Stats_t *pStats);
+
+// Driver hooks
+void             SD_Stats_Begin              (SD_StatsRequest_t *pRequest, SD_StatsOp_t Op, uint32_t NumberOfBlocks);
+void             SD_Stats_Finish             (SD_StatsRequest_t *pRequest, uint32_t BusyEnd);
+void             SD_Stats_Command            (uint8_t CmdIndex, uint32_t Start, SD_Error_t ErrorState);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_stats_H__
@@ -0,0 +1,131 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_trace_H__
+#define __sd_trace_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Must be a power of two, each entry is 12 bytes
+#ifndef SD_TRACE_ENTRIES
+#define SD_TRACE_ENTRIES                1024
+#endif
+
+#define SD_TRACE_MAGIC                  ((uint32_t)0x53445452)  // "SDTR", marks raw memory dumps
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_TRACE_CMD        = 1,            // Aux = command index, Data = argument
+    SD_TRACE_RESP       = 2,            // Aux = command index, Aux16 = SD_Error_t, Data = RESP1
+    SD_TRACE_STA        = 3,            // Aux = SD_TraceSite_t, Aux16 = command index at SD_TRACE_SITE_COMMAND, Data = STA register
+    SD_TRACE_IDMA       = 4,            // Aux = direction, Aux16 = blocks, Data = IDMABASE0
+    SD_TRACE_DATAEND    = 5,            // Aux = operation flags, Data = DLEN
+    SD_TRACE_ERROR      = 6,            // Aux = SD_TraceSite_t, Aux16 = SD_Error_t, Data = STA register
+    SD_TRACE_XFER       = 7,            // Aux = SD_TraceXfer_t, Aux16 = blocks, Data = block address
+    SD_TRACE_CQ         = 8,            // Aux = task ID, Aux16 = SD_CQ_TaskState_t, Data = QSR or address
+    SD_TRACE_MARK       = 9,            // Free for application use
+    SD_TRACE_POWER      = 10,           // Aux = SD_PowerFailStage_t, Data = remaining hold-up budget in us
+} SD_TraceType_t;
+
+typedef enum
+{
+    SD_TRACE_SITE_IRQ        = 0,
+    SD_TRACE_SITE_CHECKREAD  = 1,
+    SD_TRACE_SITE_CHECKWRITE = 2,
+    SD_TRACE_SITE_ABORT      = 3,
+    SD_TRACE_SITE_CQ         = 4,
+    SD_TRACE_SITE_EXTREG     = 5,
+    SD_TRACE_SITE_COMMAND    = 6,       // Command without a valid response
+} SD_TraceSite_t;
+
+typedef enum
+{
+    SD_TRACE_XFER_READ   = 0,
+    SD_TRACE_XFER_WRITE  = 1,
+    SD_TRACE_XFER_QREAD  = 2,
+    SD_TRACE_XFER_QWRITE = 3,
+} SD_TraceXfer_t;
+
+typedef struct
+{
+    uint32_t Cycles;                    // DWT->CYCCNT
+    uint32_t Header;                    // [7:0] type, [15:8] aux, [31:16] aux16
+    uint32_t Data;
+} SD_TraceEntry_t;
+
+typedef struct
+{
+    uint32_t          Magic;
+    uint32_t          Entries;
+    volatile uint32_t Head;             // Total number of events recorded, slot = Head % Entries
+    SD_TraceEntry_t   Entry[SD_TRACE_ENTRIES];
+} SD_TraceRing_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+#ifdef SDMMC_TRACE
+
+extern SD_TraceRing_t                SD_TraceRing;
+
+/**
+  * @brief  Records one event. Slot is claimed with LDREX/STREX so thread and interrupt
+  *         context can record at the same time without locks, oldest events get overwritten.
+  */
+static inline void SD_Trace(SD_TraceType_t Type, uint8_t Aux, uint16_t Aux16, uint32_t Data)
+{
+    SD_TraceEntry_t *pEntry;
+    uint32_t         Index;
+
+    do {
+        Index = __LDREXW(&SD_TraceRing.Head);
+    } while (__STREXW(Index + 1, &SD_TraceRing.Head) != 0);
+
+    pEntry         = &SD_TraceRing.Entry[Index & (SD_TRACE_ENTRIES - 1)];
+    pEntry->Cycles = DWT->CYCCNT;
+    pEntry->Header = (uint32_t)Type | ((uint32_t)Aux << 8) | ((uint32_t)Aux16 << 16);
+    pEntry->Data   = Data;
+}
+
+#define SD_TRACE(Type, Aux, Aux16, Data)    SD_Trace((Type), (uint8_t)(Aux), (uint16_t)(Aux16), (uint32_t)(Data))
+
+#else
+
+#define SD_TRACE(Type, Aux, Aux16, Data)
+
+#endif
+
+void             SD_Trace_Reset              (void);
+// Copies up to MaxEntries newest events, oldest first. Returns number copied
+uint32_t         SD_Trace_Snapshot           (SD_TraceEntry_t *pEntries, uint32_t MaxEntries);
+// Prints the ring as text for tools/sd_trace_decode.py
+void             SD_Trace_Dump               (void);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_trace_H__
@@ -0,0 +1,89 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_tune_H__
+#define __sd_tune_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Clock dividers tried from fastest to slowest, anything above SD_TUNE_MAX_CLOCK is skipped
+#ifndef SD_TUNE_DIVIDERS
+#define SD_TUNE_DIVIDERS                { 1, 2, 3, 4, 6 }
+#endif
+#define SD_TUNE_MAX_CLOCK               50000000
+
+// Write/read request sizes tried, in blocks, limited by the scratch buffer
+#ifndef SD_TUNE_CHUNKS
+#define SD_TUNE_CHUNKS                  { 8, 32, 128, 256 }
+#endif
+
+// Data moved by one sequential probe, the scratch area has to be at least this large
+#define SD_TUNE_PROBE_BLOCKS            1024
+// Requests issued by one random probe
+#define SD_TUNE_RANDOM_REQUESTS         64
+// Single request taking longer than this fails the probe
+#define SD_TUNE_TIMEOUT_MS              500
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_TUNE_SPEED_DEFAULT   = 0,        // Default speed bus timing, the driver does not issue the CMD6 switch
+    SD_TUNE_SPEED_HIGH      = 1,
+} SD_TuneSpeed_t;
+
+typedef struct
+{
+    bool               Valid;
+    SD_TuneSpeed_t     SpeedMode;           // Bus timing mode the card was calibrated in
+    uint8_t            ClockDivider;        // Fastest divider that passed all probes without errors
+    uint32_t           BusClock;            // Hz
+    uint16_t           ReadChunk;           // Blocks per read request with best sequential throughput
+    uint16_t           WriteChunk;          // Blocks per write request with best sequential throughput
+    SD_WriteStrategy_t WriteStrategy;       // Strategy that won at WriteChunk
+    uint32_t           SeqReadKBs;          // KB/s at the selected configuration
+    uint32_t           SeqWriteKBs;
+    uint32_t           RandReadIops;        // 4KB requests per second within the scratch area
+    uint32_t           RandWriteIops;
+    uint8_t            RejectedDividers;    // Dividers that failed with CRC, timeout or data mismatch
+    uint32_t           ProbeTransfers;      // Requests issued over the whole calibration
+    uint32_t           ProbeErrors;         // Requests that failed, mostly at rejected dividers
+} SD_TuneProfile_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Optional, after SD_Init. Overwrites the scratch area, pBuffer must be in AXI SRAM and hold BufferBlocks blocks
+SD_Error_t       SD_Tune_Run                 (uint64_t ScratchLba, uint32_t ScratchBlocks, uint32_t *pBuffer, uint32_t BufferBlocks);
+// Applies a profile from SD_Tune_Run or one stored earlier
+SD_Error_t       SD_Tune_Apply               (const SD_TuneProfile_t *pProfile);
+// Selected configuration for upper layers, Valid is false until a calibration ran
+const SD_TuneProfile_t *SD_Tune_GetProfile   (void);
+void             SD_Tune_Print               (const SD_TuneProfile_t *pProfile);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_tune_H__
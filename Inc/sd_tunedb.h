@@ -0,0 +1,86 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_tunedb_H__
+#define __sd_tunedb_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_tune.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Bank 2 sector 7, taken out of the FLASH region in STM32H743ZITx_FLASH.ld
+#define SD_TUNEDB_ADDRESS               ((uint32_t)0x081E0000)
+#define SD_TUNEDB_SIZE                  ((uint32_t)(128 * 1024))
+
+#define SD_TUNEDB_MAGIC                 ((uint32_t)0x53445442)  // "SDTB"
+
+// Distinct cards kept when a full sector is compacted, newest first
+#define SD_TUNEDB_MAX_CARDS             32
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+// One record is two 256 bit flash words, records are only ever appended
+typedef struct
+{
+    uint32_t Magic;                     // SD_TUNEDB_MAGIC, erased flash marks a free slot
+    uint32_t Sequence;                  // Newest record of a card wins
+    // Key, parsed from the CID
+    uint8_t  ManufacturerID;
+    uint8_t  ProdName2;
+    uint16_t OEM_AppliID;
+    uint32_t ProdName1;
+    uint32_t ProdSN;
+    // Profile
+    uint8_t  SpeedMode;
+    uint8_t  ClockDivider;
+    uint8_t  WriteStrategy;
+    uint8_t  RejectedDividers;
+    uint16_t ReadChunk;
+    uint16_t WriteChunk;
+    uint32_t BusClock;
+    uint32_t SeqReadKBs;
+    uint32_t SeqWriteKBs;
+    uint32_t RandReadIops;
+    uint32_t RandWriteIops;
+    uint32_t ProbeTransfers;
+    uint32_t ProbeErrors;
+    uint32_t Reserved;
+    uint32_t Crc;                       // CRC32 of all fields above
+} SD_TuneDBRecord_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// SD_REQUEST_NOT_APPLICABLE when the card has no stored profile
+SD_Error_t       SD_TuneDB_Lookup            (const SD_CID_t *pCID, SD_TuneProfile_t *pProfile);
+// Appends a record unless the newest one for this card is identical, compacts the sector when it is full
+SD_Error_t       SD_TuneDB_Store             (const SD_CID_t *pCID, const SD_TuneProfile_t *pProfile);
+// Looks up the card in SD_CardInfo and applies its profile, called by SD_Init
+SD_Error_t       SD_TuneDB_ApplyCard         (void);
+SD_Error_t       SD_TuneDB_Erase             (void);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_tunedb_H__
@@ -0,0 +1,89 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_verify_H__
+#define __sd_verify_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Written blocks remembered for verification, must be a power of two, each entry is 16 bytes of DTCM
+#ifndef SD_VERIFY_ENTRIES
+#define SD_VERIFY_ENTRIES               256
+#endif
+
+// Blocks read back with one command when the recorded LBAs are consecutive
+#ifndef SD_VERIFY_BATCH
+#define SD_VERIFY_BATCH                 8
+#endif
+
+// Card has to be left alone by foreground I/O this long before verification starts
+#ifndef SD_VERIFY_IDLE_MS
+#define SD_VERIFY_IDLE_MS               5
+#endif
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint64_t Lba;
+    uint32_t Checksum;                  // SD_Verify_Checksum of the 512 byte block as written
+    uint32_t Reserved;
+} SD_VerifyEntry_t;
+
+typedef struct
+{
+    uint32_t Recorded;                  // Blocks recorded from the write path
+    uint32_t Verified;                  // Blocks read back and matching
+    uint32_t Mismatches;                // Blocks read back with a different checksum
+    uint32_t ReadErrors;                // Blocks that could not be read back
+    uint32_t Superseded;                // Stale blocks skipped because a newer write is pending verification
+    uint32_t Dropped;                   // Oldest entries lost because the ring was full
+    uint32_t Preempted;                 // Verification reads aborted for foreground I/O
+} SD_VerifyStats_t;
+
+// Status is the driver error of the read back, or SD_ERROR when the data came back different
+typedef void (*SD_VerifyCallback_t)(uint64_t Lba, SD_Error_t Status, void *Context);
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Starts recording writes, Callback is called from SD_Verify_Process for every block that failed verification
+void             SD_Verify_Enable            (SD_VerifyCallback_t Callback, void *Context);
+void             SD_Verify_Disable           (void);
+// Call from the idle loop, verifies one batch at a time and never blocks on the card
+void             SD_Verify_Process           (void);
+// Blocks recorded but not verified yet
+uint32_t         SD_Verify_Pending           (void);
+void             SD_Verify_GetStats          (SD_VerifyStats_t *pStats);
+uint32_t         SD_Verify_Checksum          (const uint32_t *pBlock);
+
+// Driver hooks, called from the foreground data path
+void             SD_Verify_Record            (uint64_t Lba, const uint32_t *pBuffer, uint32_t NumberOfBlocks);
+void             SD_Verify_Preempt           (void);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_verify_H__
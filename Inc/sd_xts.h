@@ -0,0 +1,87 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+#ifndef __sd_xts_H__
+#define __sd_xts_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Blocks per staging buffer, two of them in AXI SRAM so one is encrypted while the other is written
+#ifndef SD_XTS_STAGE_BLOCKS
+#define SD_XTS_STAGE_BLOCKS             16
+#endif
+
+// 1 selects the constant-time bitsliced AES, 0 the T-table one, which has no cache timing in DTCM but is data dependent
+#ifndef SD_XTS_BITSLICED
+#define SD_XTS_BITSLICED                0
+#endif
+
+// Placement of the cipher hot loop, copied to ITCM by the startup code
+#ifndef SD_XTS_ITCM
+#define SD_XTS_ITCM                     __attribute__((section(".itcm"), noinline))
+#endif
+
+#define SD_XTS_KEY_128                  32          // Two AES-128 keys, data key first, then tweak key
+#define SD_XTS_KEY_256                  64
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint64_t EncryptedBytes;
+    uint64_t EncryptCycles;
+    uint64_t DecryptedBytes;
+    uint64_t DecryptCycles;
+    uint32_t InPlaceReads;              // Read straight into the caller's buffer and decrypted there
+    uint32_t StagedReads;               // Caller's buffer not DMA reachable, went through the stage
+} SD_XtsStats_t;
+
+typedef struct
+{
+    uint32_t EncryptCyclesPerByte;      // x100
+    uint32_t DecryptCyclesPerByte;      // x100
+    uint32_t EncryptKBsPerMHz;          // Throughput per MHz of core clock, scales with SystemCoreClock
+    uint32_t DecryptKBsPerMHz;
+} SD_XtsBench_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+// Key must be set first, the device above uses the block number of pLower as the XTS tweak
+SD_Error_t       SD_Xts_SetKey               (const uint8_t *pKey, uint32_t KeyLength);
+void             SD_Xts_ClearKey             (void);
+SD_Error_t       SD_Xts_Mount                (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev);
+// One 512 byte data unit, pIn and pOut may be the same buffer
+SD_Error_t       SD_Xts_EncryptSector        (const uint8_t *pIn, uint8_t *pOut, uint64_t Sector);
+SD_Error_t       SD_Xts_DecryptSector        (const uint8_t *pIn, uint8_t *pOut, uint64_t Sector);
+// Encrypts and decrypts Blocks sectors of pBuffer in place, in RAM only, restores its contents
+SD_Error_t       SD_Xts_Benchmark            (uint8_t *pBuffer, uint32_t Blocks, SD_XtsBench_t *pResult);
+void             SD_Xts_GetStats             (SD_XtsStats_t *pStats);
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+
+#endif // __sd_xts_H__
@@ -61,6 +61,55 @@
 
 #define SDMMC_CACHE_MAINTANANCE
 
+// Optional modules, each one is off unless the build defines it. The Debug configuration of the test
+// project turns them all on
+
+// DWT cycle latency histograms of every command and transfer, see sd_stats.h
+// #define SDMMC_STATS
+
+// Binary event trace ring, dump with SD_Trace_Dump and decode with tools/sd_trace_decode.py
+// #define SDMMC_TRACE
+
+// Background read-after-write verification of recent writes, see sd_verify.h
+// #define SDMMC_VERIFY
+
+// SD_Init applies the calibrated profile stored for the card in internal flash, see sd_tunedb.h
+// #define SDMMC_TUNE_DB
+
+// PVD power-fail service, finishes in-flight writes and runs last-gasp hooks, see sd_powerfail.h
+// #define SDMMC_POWER_FAIL
+
+// LRU/ARC block cache in AXI SRAM in front of the USB MSC storage path, see sd_cache.h
+// #define SDMMC_BLOCK_CACHE
+
+// Sequential stream detection with asynchronous prefetch windows below the block cache, see sd_readahead.h
+// #define SDMMC_READAHEAD
+
+// Pending queue with merging, C-SCAN sorting and read/write deadlines for asynchronous clients, see sd_sched.h
+// #define SDMMC_SCHED
+
+// LZ4 compression layer for compressible logged data, packs chunks into an extent map, see sd_lz4.h
+// #define SDMMC_LZ4
+
+// AES-XTS sector encryption layer, software AES with tables in DTCM and the hot loop in ITCM, see sd_xts.h
+// #define SDMMC_XTS
+
+// Reed-Solomon erasure coded archive layer, rebuilds sectors the card fails to read, see sd_rs.h
+// #define SDMMC_RS
+
+// End-to-end CRC32 tag per block from the CRC unit fed by MDMA, tags kept at the end of the device, see sd_integrity.h
+// #define SDMMC_INTEGRITY
+
+// Copy-on-write snapshot layer, O(1) snapshot, rollback and discard through a remap table, see sd_cow.h
+// #define SDMMC_COW
+
+// RAM disk in RAM_D2 and RAM_D3, USB MSC exposes it as LUN 1 next to the card, see sd_ramdisk.h
+// #define SDMMC_RAMDISK
+
+// Arbitration between the USB MSC host and on-device writers, reserved append region, UNIT ATTENTION on
+// layout change, see sd_share.h
+// #define SDMMC_SHARE
+
 #ifndef SDMMC_4BIT
 #define USE_SDIO_1BIT
 #endif
@@ -105,6 +154,7 @@ typedef enum
     SD_SDMMC_UNKNOWN_FUNCTION          = (33),
     SD_OUT_OF_BOUND                    = (34),
     SD_IDMA_ERROR                      = (44),
+    SD_POWER_FAIL                      = (45),  // Write refused, supply is going down
 
 
     // Standard error defines
@@ -201,16 +251,63 @@ typedef enum
     SD_HIGH_SPEED_MULTIMEDIA   = 5,
     SD_SECURE_DIGITAL_IO_COMBO = 6,
     SD_HIGH_CAPACITY_MMC       = 7,
+    SD_ULTRA_CAPACITY          = 8,     // SDUC, more than 2TB, block addresses above 32 bits through CMD22
 } SD_CardType_t;
 
+typedef enum
+{
+    SD_WRITE_OPEN_ENDED   = 0,          // CMD25 ... CMD12
+    SD_WRITE_PRE_ERASE    = 1,          // ACMD23 with the block count ahead of CMD25
+} SD_WriteStrategy_t;
+
 typedef struct
 {
   volatile SD_CSD_t    SD_csd;          // SD card specific data register
   volatile SD_CID_t    SD_cid;          // SD card identification number register
-  uint64_t             CardCapacity;    // Card capacity
+  uint64_t             CardCapacity;    // Card capacity, in blocks for SDHC/SDXC/SDUC
   uint32_t             CardBlockSize;   // Card block size
 } SD_CardInfo_t;
 
+#define SD_CQ_MAX_TASKS                         32
+
+// Called from SD_CQ_Process() when a queued task finished, in the order the card executed them
+typedef void (*SD_CQ_Callback_t)(uint8_t TaskId, SD_Error_t Status, void *Context);
+
+#define SD_EXT_MAX_FUNCTIONS                    8
+
+typedef struct
+{
+    uint16_t SFC;                       // Standard function code, 0x0001 power management, 0x0002 performance enhancement
+    uint8_t  FNO;                       // Function number used in CMD48/CMD49
+    uint8_t  Page;                      // Page of the register set
+    uint16_t Offset;                    // Offset of the register set inside the page
+} SD_ExtFunction_t;
+
+typedef struct
+{
+    bool     Present;
+    uint8_t  FNO;
+    uint8_t  Page;
+    uint16_t Offset;
+    uint8_t  Revision;
+    bool     FxEvent;                   // FX_EVENT supported
+    bool     CardMaintenance;           // Card initiated self maintenance
+    bool     HostMaintenance;           // Host initiated self maintenance
+    bool     Cache;                     // Volatile write cache supported
+    bool     CacheEnabled;
+    uint8_t  QueueDepth;                // Command queue depth, 0 when not supported
+} SD_ExtPerformance_t;
+
+typedef struct
+{
+    uint16_t            Revision;           // General information revision
+    uint16_t            Length;             // General information length in bytes
+    uint8_t             NumberOfExtensions; // Extensions reported by card
+    uint8_t             NumberOfFunctions;  // Extensions parsed into Functions
+    SD_ExtFunction_t    Functions[SD_EXT_MAX_FUNCTIONS];
+    SD_ExtPerformance_t Perf;               // Performance enhancement function
+} SD_ExtInfo_t;
+
 #define SDMMC_4BIT
 
 // SDMMC1 PINS
@@ -287,6 +384,14 @@ bool             SD_Init                     (uint8_t clk_div);
 bool             SD_IsDetected				 (void);
 bool             SD_GetState                 (void);
 SD_Error_t       SD_GetCardInfo              (void);
+// Number of 512 byte blocks on the card, valid after SD_GetCardInfo
+uint64_t         SD_GetBlockCount            (void);
+// Bus clock and multi block write strategy of an initialized card, see sd_tune.h for picking them
+SD_Error_t       SD_SetClockDivider          (uint8_t clk_div);
+uint8_t          SD_GetClockDivider          (void);
+uint32_t         SD_GetBusClock              (uint8_t clk_div);
+void             SD_SetWriteStrategy         (SD_WriteStrategy_t Strategy);
+SD_WriteStrategy_t SD_GetWriteStrategy       (void);
 
 // SD ReadBlocks_DMA should be followed by SD_CheckRead and SD_GetState
 SD_Error_t       SD_ReadBlocks_DMA           (uint64_t ReadAddress, uint32_t *buffer, uint32_t BlockSize, uint32_t NumberOfBlocks);
@@ -294,6 +399,32 @@ SD_Error_t       SD_CheckRead                (void);
 // SD WriteBlocks_DMA should be followed by SD_CheckWrite and SD_GetState
 SD_Error_t       SD_WriteBlocks_DMA          (uint64_t WriteAddress, uint32_t *buffer, uint32_t BlockSize, uint32_t NumberOfBlocks);
 SD_Error_t       SD_CheckWrite               (void);
+// For background users: no transfer in flight, abort the one in flight, error of the last one
+bool             SD_IsIdle                   (void);
+SD_Error_t       SD_AbortTransfer            (void);
+SD_Error_t       SD_GetTransferError         (void);
+
+// Command queueing (CMD44-CMD47), A2 cards only. Queue tasks, then call SD_CQ_Process until it returns SD_OK
+bool             SD_CQ_IsSupported           (void);
+uint8_t          SD_CQ_GetDepth              (void);
+SD_Error_t       SD_CQ_Enable                (bool Enable);
+SD_Error_t       SD_CQ_QueueRead             (uint64_t Address, uint32_t *buffer, uint32_t NumberOfBlocks, SD_CQ_Callback_t Callback, void *Context, uint8_t *pTaskId);
+SD_Error_t       SD_CQ_QueueWrite            (uint64_t Address, uint32_t *buffer, uint32_t NumberOfBlocks, SD_CQ_Callback_t Callback, void *Context, uint8_t *pTaskId);
+SD_Error_t       SD_CQ_Process               (void);
+
+// Extension registers (CMD48/CMD49), available when SCR reports CMD48 support
+const SD_ExtInfo_t *SD_GetExtInfo            (void);
+SD_Error_t       SD_ReadExtRegister          (uint8_t FNO, uint8_t Page, uint16_t Offset, uint16_t Length, uint8_t *pData);
+SD_Error_t       SD_WriteExtRegister         (uint8_t FNO, uint8_t Page, uint16_t Offset, const uint8_t *pData, uint16_t Length);
+SD_Error_t       SD_WriteExtRegisterMasked   (uint8_t FNO, uint8_t Page, uint16_t Offset, uint8_t Mask, uint8_t Value);
+
+// Card volatile write cache, flush is ordered after all queued tasks
+SD_Error_t       SD_CardCacheEnable          (bool Enable);
+bool             SD_CardCacheIsEnabled       (void);
+SD_Error_t       SD_CardCacheFlush           (void);
+// Same flush without waiting, poll until it stops returning SD_BUSY, nothing else may use the card meanwhile
+SD_Error_t       SD_CardCacheFlushStart      (void);
+SD_Error_t       SD_CardCacheFlushPoll       (void);
 
 // Not implemented
 SD_Error_t       SD_Erase                    (uint64_t StartAddress, uint64_t EndAddress);
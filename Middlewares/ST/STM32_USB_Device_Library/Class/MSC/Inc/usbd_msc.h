@@ -72,11 +72,11 @@
 typedef struct _USBD_STORAGE
 {
   int8_t (* Init) (uint8_t lun);
-  int8_t (* GetCapacity) (uint8_t lun, uint32_t *block_num, uint16_t *block_size);
+  int8_t (* GetCapacity) (uint8_t lun, uint64_t *block_num, uint16_t *block_size);
   int8_t (* IsReady) (uint8_t lun);
   int8_t (* IsWriteProtected) (uint8_t lun);
-  int8_t (* Read) (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
-  int8_t (* Write)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+  int8_t (* Read) (uint8_t lun, uint8_t *buf, uint64_t blk_addr, uint16_t blk_len);
+  int8_t (* Write)(uint8_t lun, uint8_t *buf, uint64_t blk_addr, uint16_t blk_len);
   int8_t (* GetMaxLun)(void);
   int8_t *pInquiry;
   
@@ -99,10 +99,10 @@ typedef struct
   uint8_t                  scsi_sense_tail;
   
   uint16_t                 scsi_blk_size;
-  uint32_t                 scsi_blk_nbr;
+  uint64_t                 scsi_blk_nbr;
   
-  uint32_t                 scsi_blk_addr;
-  uint32_t                 scsi_blk_len;
+  uint64_t                 scsi_blk_addr;   /* in blocks, byte offsets overflow past 4GB */
+  uint32_t                 scsi_blk_len;    /* in bytes */
 }
 USBD_MSC_BOT_HandleTypeDef; 
 
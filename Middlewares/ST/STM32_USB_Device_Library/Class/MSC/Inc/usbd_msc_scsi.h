@@ -66,9 +66,12 @@
 
 #define SCSI_READ_CAPACITY10                        0x25
 #define SCSI_READ_CAPACITY16                        0x9E
+#define SCSI_SA_READ_CAPACITY16                     0x10
 
 #define SCSI_REQUEST_SENSE                          0x03
 #define SCSI_START_STOP_UNIT                        0x1B
+#define SCSI_SYNCHRONIZE_CACHE10                    0x35
+#define SCSI_SYNCHRONIZE_CACHE16                    0x91
 #define SCSI_TEST_UNIT_READY                        0x00
 #define SCSI_WRITE6                                 0x0A
 #define SCSI_WRITE10                                0x2A
@@ -111,6 +114,7 @@
 
 #define READ_FORMAT_CAPACITY_DATA_LEN               0x0C
 #define READ_CAPACITY10_DATA_LEN                    0x08
+#define READ_CAPACITY16_DATA_LEN                    0x20
 #define MODE_SENSE10_DATA_LEN                       0x08
 #define MODE_SENSE6_DATA_LEN                        0x04
 #define REQUEST_SENSE_DATA_LEN                      0x12
@@ -176,6 +180,10 @@ void   SCSI_SenseCode(USBD_HandleTypeDef  *pdev,
                       uint8_t sKey, 
                       uint8_t ASC);
 
+int8_t SCSI_MediaChanged(uint8_t lun);
+
+int8_t SCSI_FlushCache(uint8_t lun);
+
 /**
   * @}
   */ 
@@ -84,17 +84,22 @@ static int8_t SCSI_TestUnitReady(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t
 static int8_t SCSI_Inquiry(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_ReadFormatCapacity(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_ReadCapacity10(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_ReadCapacity16(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_RequestSense (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_StartStopUnit(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_SynchronizeCache(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_ModeSense6 (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_ModeSense10 (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_Write10(USBD_HandleTypeDef  *pdev, uint8_t lun , uint8_t *params);
 static int8_t SCSI_Read10(USBD_HandleTypeDef  *pdev, uint8_t lun , uint8_t *params);
 static int8_t SCSI_Verify10(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_ParseBlocks (USBD_HandleTypeDef  *pdev,
+                                uint8_t lun,
+                                uint8_t *params);
 static int8_t SCSI_CheckAddressRange (USBD_HandleTypeDef  *pdev,
                                       uint8_t lun ,
-                                      uint32_t blk_offset ,
-                                      uint16_t blk_nbr);
+                                      uint64_t blk_offset ,
+                                      uint32_t blk_nbr);
 static int8_t SCSI_ProcessRead (USBD_HandleTypeDef  *pdev,
                                 uint8_t lun);
 
@@ -122,6 +127,26 @@ int8_t SCSI_ProcessCmd(USBD_HandleTypeDef  *pdev,
                            uint8_t lun,
                            uint8_t *params)
 {
+  USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*)pdev->pMSC_ClassData;
+
+  /* A medium change is reported once, on a new command (not on the data
+     stages of the one in progress), INQUIRY and REQUEST SENSE never fail */
+  if ((hmsc->bot_state == USBD_BOT_IDLE) &&
+      (params[0] != SCSI_INQUIRY) &&
+      (params[0] != SCSI_REQUEST_SENSE) &&
+      (SCSI_MediaChanged(lun) != 0))
+  {
+    SCSI_SenseCode(pdev,
+                   lun,
+                   UNIT_ATTENTION,
+                   MEDIUM_HAVE_CHANGED);
+
+    if (hmsc->cbw.dDataLength == 0)
+    {
+      hmsc->bot_state = USBD_BOT_NO_DATA;
+    }
+    return -1;
+  }
 
   switch (params[0])
   {
@@ -139,6 +164,10 @@ int8_t SCSI_ProcessCmd(USBD_HandleTypeDef  *pdev,
   case SCSI_ALLOW_MEDIUM_REMOVAL:
     return SCSI_StartStopUnit(pdev, lun, params);
 
+  case SCSI_SYNCHRONIZE_CACHE10:
+  case SCSI_SYNCHRONIZE_CACHE16:
+    return SCSI_SynchronizeCache(pdev, lun, params);
+
   case SCSI_MODE_SENSE6:
     return SCSI_ModeSense6 (pdev, lun, params);
 
@@ -151,10 +180,15 @@ int8_t SCSI_ProcessCmd(USBD_HandleTypeDef  *pdev,
   case SCSI_READ_CAPACITY10:
     return SCSI_ReadCapacity10(pdev, lun, params);
 
+  case SCSI_READ_CAPACITY16:
+    return SCSI_ReadCapacity16(pdev, lun, params);
+
   case SCSI_READ10:
+  case SCSI_READ16:
     return SCSI_Read10(pdev, lun, params);
 
   case SCSI_WRITE10:
+  case SCSI_WRITE16:
     return SCSI_Write10(pdev, lun, params);
 
   case SCSI_VERIFY10:
@@ -265,11 +299,13 @@ static int8_t SCSI_ReadCapacity10(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_
   }
   else
   {
+    /* Media too large for 32 bit LBAs: report 0xFFFFFFFF so the host switches to READ CAPACITY(16) */
+    uint32_t last_lba = (hmsc->scsi_blk_nbr > 0xFFFFFFFFULL) ? 0xFFFFFFFFU : (uint32_t)(hmsc->scsi_blk_nbr - 1);
 
-    hmsc->bot_data[0] = (uint8_t)((hmsc->scsi_blk_nbr - 1) >> 24);
-    hmsc->bot_data[1] = (uint8_t)((hmsc->scsi_blk_nbr - 1) >> 16);
-    hmsc->bot_data[2] = (uint8_t)((hmsc->scsi_blk_nbr - 1) >>  8);
-    hmsc->bot_data[3] = (uint8_t)(hmsc->scsi_blk_nbr - 1);
+    hmsc->bot_data[0] = (uint8_t)(last_lba >> 24);
+    hmsc->bot_data[1] = (uint8_t)(last_lba >> 16);
+    hmsc->bot_data[2] = (uint8_t)(last_lba >>  8);
+    hmsc->bot_data[3] = (uint8_t)(last_lba);
 
     hmsc->bot_data[4] = (uint8_t)(hmsc->scsi_blk_size >>  24);
     hmsc->bot_data[5] = (uint8_t)(hmsc->scsi_blk_size >>  16);
@@ -280,6 +316,62 @@ static int8_t SCSI_ReadCapacity10(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_
     return 0;
   }
 }
+
+/**
+* @brief  SCSI_ReadCapacity16
+*         Process Read Capacity 16 command (SERVICE ACTION IN(16))
+* @param  lun: Logical unit number
+* @param  params: Command parameters
+* @retval status
+*/
+static int8_t SCSI_ReadCapacity16(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params)
+{
+  USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*)pdev->pMSC_ClassData;
+  uint64_t last_lba;
+  uint32_t alloc_len;
+  uint8_t i;
+
+  if ((params[1] & 0x1F) != SCSI_SA_READ_CAPACITY16)
+  {
+    SCSI_SenseCode(pdev,
+                   lun,
+                   ILLEGAL_REQUEST,
+                   INVALID_CDB);
+    return -1;
+  }
+
+  if(((USBD_StorageTypeDef *)pdev->pMSC_UserData)->GetCapacity(lun, &hmsc->scsi_blk_nbr, &hmsc->scsi_blk_size) != 0)
+  {
+    SCSI_SenseCode(pdev,
+                   lun,
+                   NOT_READY,
+                   MEDIUM_NOT_PRESENT);
+    return -1;
+  }
+
+  for(i = 0 ; i < READ_CAPACITY16_DATA_LEN ; i++)
+  {
+    hmsc->bot_data[i] = 0;
+  }
+
+  last_lba = hmsc->scsi_blk_nbr - 1;
+  for(i = 0 ; i < 8 ; i++)
+  {
+    hmsc->bot_data[i] = (uint8_t)(last_lba >> (56 - (8 * i)));
+  }
+
+  hmsc->bot_data[8]  = (uint8_t)(hmsc->scsi_blk_size >>  24);
+  hmsc->bot_data[9]  = (uint8_t)(hmsc->scsi_blk_size >>  16);
+  hmsc->bot_data[10] = (uint8_t)(hmsc->scsi_blk_size >>  8);
+  hmsc->bot_data[11] = (uint8_t)(hmsc->scsi_blk_size);
+
+  alloc_len = ((uint32_t)params[10] << 24) | ((uint32_t)params[11] << 16) |
+              ((uint32_t)params[12] <<  8) | params[13];
+
+  hmsc->bot_data_length = MIN(alloc_len, READ_CAPACITY16_DATA_LEN);
+  return 0;
+}
+
 /**
 * @brief  SCSI_ReadFormatCapacity
 *         Process Read Format Capacity command
@@ -292,7 +384,7 @@ static int8_t SCSI_ReadFormatCapacity(USBD_HandleTypeDef  *pdev, uint8_t lun, ui
   USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*)pdev->pMSC_ClassData;
 
   uint16_t blk_size;
-  uint32_t blk_nbr;
+  uint64_t blk_nbr;
   uint16_t i;
 
   for(i=0 ; i < 12 ; i++)
@@ -310,6 +402,11 @@ static int8_t SCSI_ReadFormatCapacity(USBD_HandleTypeDef  *pdev, uint8_t lun, ui
   }
   else
   {
+    if (blk_nbr > 0xFFFFFFFFULL)
+    {
+      blk_nbr = 0xFFFFFFFFULL;
+    }
+
     hmsc->bot_data[3] = 0x08;
     hmsc->bot_data[4] = (uint8_t)((blk_nbr - 1) >> 24);
     hmsc->bot_data[5] = (uint8_t)((blk_nbr - 1) >> 16);
@@ -410,6 +507,32 @@ static int8_t SCSI_RequestSense (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t
   return 0;
 }
 
+/**
+* @brief  SCSI_MediaChanged
+*         Tells whether the medium changed since the last call, the
+*         application overrides it when it changes the medium under the host
+* @param  lun: Logical unit number
+* @retval 1 when changed, 0 otherwise
+*/
+__weak int8_t SCSI_MediaChanged(uint8_t lun)
+{
+  UNUSED(lun);
+  return 0;
+}
+
+/**
+* @brief  SCSI_FlushCache
+*         Writes back what the application caches for the medium, the
+*         application overrides it when it caches writes
+* @param  lun: Logical unit number
+* @retval 0 when the medium holds every write, nonzero otherwise
+*/
+__weak int8_t SCSI_FlushCache(uint8_t lun)
+{
+  UNUSED(lun);
+  return 0;
+}
+
 /**
 * @brief  SCSI_SenseCode
 *         Load the last error code in the error list
@@ -439,8 +562,32 @@ void SCSI_SenseCode(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t sKey, uint8_
 * @retval status
 */
 static int8_t SCSI_StartStopUnit(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params)
+{
+  /* The host ejects or stops the medium, cached writes have to reach it */
+  return SCSI_SynchronizeCache(pdev, lun, params);
+}
+
+/**
+* @brief  SCSI_SynchronizeCache
+*         Process SCSI Synchronize Cache Command
+* @param  lun: Logical unit number
+* @param  params: Command parameters
+* @retval status
+*/
+static int8_t SCSI_SynchronizeCache(USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params)
 {
   USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pMSC_ClassData;
+
+  if (SCSI_FlushCache(lun) != 0)
+  {
+    SCSI_SenseCode(pdev,
+                   lun,
+                   HARDWARE_ERROR,
+                   WRITE_FAULT);
+
+    hmsc->bot_state = USBD_BOT_NO_DATA;
+    return -1;
+  }
   hmsc->bot_data_length = 0;
   return 0;
 }
@@ -479,24 +626,12 @@ static int8_t SCSI_Read10(USBD_HandleTypeDef  *pdev, uint8_t lun , uint8_t *para
       return -1;
     }
 
-    hmsc->scsi_blk_addr = (params[2] << 24) | \
-      (params[3] << 16) | \
-        (params[4] <<  8) | \
-          params[5];
-
-    hmsc->scsi_blk_len =  (params[7] <<  8) | \
-      params[8];
-
-
-
-    if( SCSI_CheckAddressRange(pdev, lun, hmsc->scsi_blk_addr, hmsc->scsi_blk_len) < 0)
+    if (SCSI_ParseBlocks(pdev, lun, params) < 0)
     {
       return -1; /* error */
     }
 
     hmsc->bot_state = USBD_BOT_DATA_IN;
-    hmsc->scsi_blk_addr *= hmsc->scsi_blk_size;
-    hmsc->scsi_blk_len  *= hmsc->scsi_blk_size;
 
     /* cases 4,5 : Hi <> Dn */
     if (hmsc->cbw.dDataLength != hmsc->scsi_blk_len)
@@ -560,25 +695,12 @@ static int8_t SCSI_Write10 (USBD_HandleTypeDef  *pdev, uint8_t lun , uint8_t *pa
     }
 
 
-    hmsc->scsi_blk_addr = (params[2] << 24) | \
-      (params[3] << 16) | \
-        (params[4] <<  8) | \
-          params[5];
-    hmsc->scsi_blk_len = (params[7] <<  8) | \
-      params[8];
-
     /* check if LBA address is in the right range */
-    if(SCSI_CheckAddressRange(pdev,
-                              lun,
-                              hmsc->scsi_blk_addr,
-                              hmsc->scsi_blk_len) < 0)
+    if (SCSI_ParseBlocks(pdev, lun, params) < 0)
     {
       return -1; /* error */
     }
 
-    hmsc->scsi_blk_addr *= hmsc->scsi_blk_size;
-    hmsc->scsi_blk_len  *= hmsc->scsi_blk_size;
-
     /* cases 3,11,13 : Hn,Ho <> D0 */
     if (hmsc->cbw.dDataLength != hmsc->scsi_blk_len)
     {
@@ -628,7 +750,7 @@ static int8_t SCSI_Verify10(USBD_HandleTypeDef  *pdev, uint8_t lun , uint8_t *pa
   if(SCSI_CheckAddressRange(pdev,
                             lun,
                             hmsc->scsi_blk_addr,
-                            hmsc->scsi_blk_len) < 0)
+                            hmsc->scsi_blk_len / hmsc->scsi_blk_size) < 0)
   {
     return -1; /* error */
   }
@@ -636,6 +758,56 @@ static int8_t SCSI_Verify10(USBD_HandleTypeDef  *pdev, uint8_t lun , uint8_t *pa
   return 0;
 }
 
+/**
+* @brief  SCSI_ParseBlocks
+*         Extract LBA and transfer length of a (10) or (16) read/write CDB
+*         into scsi_blk_addr (blocks) and scsi_blk_len (bytes)
+* @param  lun: Logical unit number
+* @param  params: Command parameters
+* @retval status
+*/
+static int8_t SCSI_ParseBlocks (USBD_HandleTypeDef  *pdev, uint8_t lun, uint8_t *params)
+{
+  USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pMSC_ClassData;
+  uint32_t blk_len;
+  uint8_t i;
+
+  if ((params[0] == SCSI_READ16) || (params[0] == SCSI_WRITE16))
+  {
+    hmsc->scsi_blk_addr = 0;
+    for (i = 2; i < 10; i++)
+    {
+      hmsc->scsi_blk_addr = (hmsc->scsi_blk_addr << 8) | params[i];
+    }
+    blk_len = ((uint32_t)params[10] << 24) | ((uint32_t)params[11] << 16) |
+              ((uint32_t)params[12] <<  8) | params[13];
+  }
+  else
+  {
+    hmsc->scsi_blk_addr = ((uint32_t)params[2] << 24) | ((uint32_t)params[3] << 16) |
+                          ((uint32_t)params[4] <<  8) | params[5];
+    blk_len = ((uint32_t)params[7] <<  8) | params[8];
+  }
+
+  if (SCSI_CheckAddressRange(pdev, lun, hmsc->scsi_blk_addr, blk_len) < 0)
+  {
+    return -1;
+  }
+
+  /* Byte count has to fit the 32 bit CBW data length */
+  if (blk_len > (0xFFFFFFFFU / hmsc->scsi_blk_size))
+  {
+    SCSI_SenseCode(pdev,
+                   lun,
+                   ILLEGAL_REQUEST,
+                   INVALID_CDB);
+    return -1;
+  }
+
+  hmsc->scsi_blk_len = blk_len * hmsc->scsi_blk_size;
+  return 0;
+}
+
 /**
 * @brief  SCSI_CheckAddressRange
 *         Check address range
@@ -644,11 +816,21 @@ static int8_t SCSI_Verify10(USBD_HandleTypeDef  *pdev, uint8_t lun , uint8_t *pa
 * @param  blk_nbr: number of block to be processed
 * @retval status
 */
-static int8_t SCSI_CheckAddressRange (USBD_HandleTypeDef  *pdev, uint8_t lun , uint32_t blk_offset , uint16_t blk_nbr)
+static int8_t SCSI_CheckAddressRange (USBD_HandleTypeDef  *pdev, uint8_t lun , uint64_t blk_offset , uint32_t blk_nbr)
 {
   USBD_MSC_BOT_HandleTypeDef  *hmsc = (USBD_MSC_BOT_HandleTypeDef*) pdev->pMSC_ClassData;
 
-  if ((blk_offset + blk_nbr) > hmsc->scsi_blk_nbr )
+  /* Capacity of this LUN, the one kept from the last READ CAPACITY may be another LUN's */
+  if(((USBD_StorageTypeDef *)pdev->pMSC_UserData)->GetCapacity(lun, &hmsc->scsi_blk_nbr, &hmsc->scsi_blk_size) != 0)
+  {
+    SCSI_SenseCode(pdev,
+                   lun,
+                   NOT_READY,
+                   MEDIUM_NOT_PRESENT);
+    return -1;
+  }
+
+  if ((blk_offset > hmsc->scsi_blk_nbr) || (blk_nbr > (hmsc->scsi_blk_nbr - blk_offset)))
   {
     SCSI_SenseCode(pdev,
                    lun,
@@ -674,7 +856,7 @@ static int8_t SCSI_ProcessRead (USBD_HandleTypeDef  *pdev, uint8_t lun)
 
   if( ((USBD_StorageTypeDef *)pdev->pMSC_UserData)->Read(lun ,
                               hmsc->bot_data,
-                              hmsc->scsi_blk_addr / hmsc->scsi_blk_size,
+                              hmsc->scsi_blk_addr,
                               len / hmsc->scsi_blk_size) < 0)
   {
 
@@ -692,7 +874,7 @@ static int8_t SCSI_ProcessRead (USBD_HandleTypeDef  *pdev, uint8_t lun)
              len);
 
 
-  hmsc->scsi_blk_addr   += len;
+  hmsc->scsi_blk_addr   += len / hmsc->scsi_blk_size;
   hmsc->scsi_blk_len    -= len;
 
   /* case 6 : Hi = Di */
@@ -721,7 +903,7 @@ static int8_t SCSI_ProcessWrite (USBD_HandleTypeDef  *pdev, uint8_t lun)
 
   if(((USBD_StorageTypeDef *)pdev->pMSC_UserData)->Write(lun ,
                               hmsc->bot_data,
-                              hmsc->scsi_blk_addr / hmsc->scsi_blk_size,
+                              hmsc->scsi_blk_addr,
                               len / hmsc->scsi_blk_size) < 0)
   {
     SCSI_SenseCode(pdev,
@@ -732,7 +914,7 @@ static int8_t SCSI_ProcessWrite (USBD_HandleTypeDef  *pdev, uint8_t lun)
   }
 
 
-  hmsc->scsi_blk_addr  += len;
+  hmsc->scsi_blk_addr  += len / hmsc->scsi_blk_size;
   hmsc->scsi_blk_len   -= len;
 
   /* case 12 : Ho = Do */
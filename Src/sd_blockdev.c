@@ -0,0 +1,727 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_cache.h"
+#include "sd_readahead.h"
+#include "sd_sched.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+// Used when the SD status cannot be read, 4MB is the largest AU the spec allows below 64GB
+#define SD_BLOCKDEV_DEFAULT_ERASE       8192
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    bool                  Used;
+    SD_BlockDev_t        *pDev;
+    SD_BlockDevCallback_t Callback;
+    void                 *Context;
+} SD_BlockDevPending_t;
+
+/* Prototype(s) -----------------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_BlockDev_CardRead        (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_BlockDev_CardWrite       (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+#ifdef SDMMC_SCHED
+static SD_Error_t       SD_BlockDev_CardBarrier     (SD_BlockDev_t *pDev, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_BlockDev_CardSubmit      (SD_BlockDev_t *pDev, bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static void             SD_BlockDev_CardDone        (uint8_t RequestId, SD_Error_t Status, void *Context);
+static void             SD_BlockDev_CardProcess     (SD_BlockDev_t *pDev);
+#else
+static SD_Error_t       SD_BlockDev_CardFlush       (SD_BlockDev_t *pDev);
+#endif
+static uint32_t         SD_BlockDev_EraseBlocks     (void);
+static SD_BlockDevPending_t *SD_BlockDev_Claim      (SD_BlockDevPending_t *pPool, uint32_t Size, SD_BlockDev_t *pDev, SD_BlockDevCallback_t Callback, void *Context);
+static void             SD_BlockDev_ForwardDone     (SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+#ifdef SDMMC_BLOCK_CACHE
+static SD_Error_t       SD_BlockDev_CacheRead       (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_BlockDev_CacheWrite      (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_BlockDev_CacheFlush      (SD_BlockDev_t *pDev);
+static void             SD_BlockDev_CacheProcess    (SD_BlockDev_t *pDev);
+#endif
+#ifdef SDMMC_READAHEAD
+static SD_Error_t       SD_BlockDev_ReadAheadRead   (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_BlockDev_ReadAheadWrite  (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static void             SD_BlockDev_ReadAheadProcess(SD_BlockDev_t *pDev);
+#endif
+static void             SD_BlockDev_SyncDone        (SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static const SD_BlockDevOps_t      SD_BlockDevCardOps =
+{
+    .Read       = SD_BlockDev_CardRead,
+    .Write      = SD_BlockDev_CardWrite,
+#ifdef SDMMC_SCHED
+    .Barrier    = SD_BlockDev_CardBarrier,
+    .Process    = SD_BlockDev_CardProcess,
+#else
+    .Flush      = SD_BlockDev_CardFlush,
+#endif
+};
+static SD_BlockDev_t               SD_BlockDevCard = { .pOps = &SD_BlockDevCardOps, .pName = "card" };
+
+#ifdef SDMMC_SCHED
+static SD_BlockDevPending_t        SD_BlockDevPending[SD_SCHED_DEPTH];
+#endif
+static SD_BlockDevPending_t        SD_BlockDevForward[SD_BLOCKDEV_FORWARD_DEPTH];
+
+#ifdef SDMMC_BLOCK_CACHE
+static const SD_BlockDevOps_t      SD_BlockDevCacheOps =
+{
+    .Read       = SD_BlockDev_CacheRead,
+    .Write      = SD_BlockDev_CacheWrite,
+    .Flush      = SD_BlockDev_CacheFlush,
+    .Process    = SD_BlockDev_CacheProcess,
+};
+static SD_BlockDev_t               SD_BlockDevCache = { .pOps = &SD_BlockDevCacheOps, .pName = "cache" };
+#endif
+
+#ifdef SDMMC_READAHEAD
+static const SD_BlockDevOps_t      SD_BlockDevReadAheadOps =
+{
+    .Read       = SD_BlockDev_ReadAheadRead,
+    .Write      = SD_BlockDev_ReadAheadWrite,
+    .Process    = SD_BlockDev_ReadAheadProcess,
+};
+static SD_BlockDev_t               SD_BlockDevReadAhead = { .pOps = &SD_BlockDevReadAheadOps, .pName = "readahead" };
+#endif
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  The card itself, bottom of every stack. With the scheduler compiled in requests are queued
+  *         as its default client and complete from SD_BlockDev_Process, otherwise they block.
+  * @retval Device
+  */
+SD_BlockDev_t *SD_BlockDev_Card(void)
+{
+    SD_BlockDevCard.Blocks      = SD_GetBlockCount();
+    SD_BlockDevCard.EraseBlocks = SD_BlockDev_EraseBlocks();
+    SD_BlockDevCard.Caps        = SD_BLOCKDEV_CAP_PERSISTENT;
+#ifdef SDMMC_SCHED
+    SD_BlockDevCard.Caps       |= SD_BLOCKDEV_CAP_ASYNC | SD_BLOCKDEV_CAP_ANY_BUFFER;
+#endif
+    if (SD_CardCacheIsEnabled()) {
+        SD_BlockDevCard.Caps   |= SD_BLOCKDEV_CAP_VOLATILE;
+    }
+    return &SD_BlockDevCard;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Block cache, stacked on the read-ahead layer when that is compiled in, on the card otherwise.
+  * @retval Device, NULL without SDMMC_BLOCK_CACHE
+  */
+SD_BlockDev_t *SD_BlockDev_Cache(void)
+{
+#ifdef SDMMC_BLOCK_CACHE
+    SD_BlockDev_t *pLower = SD_BlockDev_ReadAhead();
+
+    SD_BlockDevCache.pLower      = pLower ? pLower : SD_BlockDev_Card();
+    SD_Cache_SetLower(SD_BlockDevCache.pLower);
+    SD_BlockDevCache.Blocks      = SD_BlockDevCache.pLower->Blocks;
+    SD_BlockDevCache.EraseBlocks = SD_BlockDevCache.pLower->EraseBlocks;
+    SD_BlockDevCache.Caps        = SD_BLOCKDEV_CAP_ANY_BUFFER | SD_BLOCKDEV_CAP_PERSISTENT;
+    if (SD_Cache_GetMode() == SD_CACHE_WRITE_BACK) {
+        SD_BlockDevCache.Caps   |= SD_BLOCKDEV_CAP_VOLATILE;
+    }
+    return &SD_BlockDevCache;
+#else
+    return NULL;
+#endif
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Sequential read-ahead, stacked on the card. Writes go straight to the card, the driver hook
+  *         drops overlapping prefetch windows.
+  * @retval Device, NULL without SDMMC_READAHEAD
+  */
+SD_BlockDev_t *SD_BlockDev_ReadAhead(void)
+{
+#ifdef SDMMC_READAHEAD
+    SD_BlockDevReadAhead.pLower      = SD_BlockDev_Card();
+    SD_ReadAhead_SetLower(SD_BlockDevReadAhead.pLower);
+    SD_BlockDevReadAhead.Blocks      = SD_BlockDevReadAhead.pLower->Blocks;
+    SD_BlockDevReadAhead.EraseBlocks = SD_BlockDevReadAhead.pLower->EraseBlocks;
+    SD_BlockDevReadAhead.Caps        = SD_BLOCKDEV_CAP_PERSISTENT;
+#ifdef SDMMC_SCHED
+    SD_BlockDevReadAhead.Caps       |= SD_BLOCKDEV_CAP_ANY_BUFFER;
+#endif
+    return &SD_BlockDevReadAhead;
+#else
+    return NULL;
+#endif
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_BlockDev_t *SD_BlockDev_Default(void)
+{
+    SD_BlockDev_t *pDev;
+
+    if ((pDev = SD_BlockDev_Cache()) != NULL) {
+        return pDev;
+    }
+    if ((pDev = SD_BlockDev_ReadAhead()) != NULL) {
+        return pDev;
+    }
+    return SD_BlockDev_Card();
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Submits a read.
+  * @param  pDev: Device
+  * @param  Lba: First block
+  * @param  pBuffer: Destination, see SD_BLOCKDEV_CAP_ANY_BUFFER
+  * @param  NumberOfBlocks: Number of blocks
+  * @param  Callback: Called once with the result, may be NULL
+  * @param  Context: Passed to Callback
+  * @retval SD Card error state, SD_ADDR_OUT_OF_RANGE past the end of the device
+  */
+SD_Error_t SD_BlockDev_Read(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                            SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_Error_t ErrorState;
+
+    if ((pDev == NULL) || (pBuffer == NULL) || (NumberOfBlocks == 0)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if ((Lba >= pDev->Blocks) || (NumberOfBlocks > (pDev->Blocks - Lba))) {
+        ErrorState = SD_ADDR_OUT_OF_RANGE;
+    } else {
+        ErrorState = pDev->pOps->Read(pDev, Lba, pBuffer, NumberOfBlocks, Callback, Context);
+    }
+    if (ErrorState != SD_OK) {
+        pDev->Stats.Errors++;
+        return ErrorState;
+    }
+    pDev->Stats.Reads++;
+    pDev->Stats.ReadBlocks += NumberOfBlocks;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Submits a write, same rules as SD_BlockDev_Read().
+  * @param  Flags: SD_BLOCKDEV_FUA to have this write durable when it completes, without a full barrier
+  * @retval SD Card error state, SD_REQUEST_NOT_APPLICABLE on a read-only device
+  */
+SD_Error_t SD_BlockDev_Write(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                             SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_Error_t ErrorState;
+
+    if ((pDev == NULL) || (pBuffer == NULL) || (NumberOfBlocks == 0)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (pDev->Caps & SD_BLOCKDEV_CAP_READ_ONLY) {
+        ErrorState = SD_REQUEST_NOT_APPLICABLE;
+    } else if ((Lba >= pDev->Blocks) || (NumberOfBlocks > (pDev->Blocks - Lba))) {
+        ErrorState = SD_ADDR_OUT_OF_RANGE;
+    } else {
+        ErrorState = pDev->pOps->Write(pDev, Lba, pBuffer, NumberOfBlocks, Flags, Callback, Context);
+    }
+    if (ErrorState != SD_OK) {
+        pDev->Stats.Errors++;
+        return ErrorState;
+    }
+    if (Flags & SD_BLOCKDEV_FUA) {
+        pDev->Stats.Fua++;
+    }
+    pDev->Stats.Writes++;
+    pDev->Stats.WriteBlocks += NumberOfBlocks;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_BlockDev_ReadSync(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    volatile SD_Error_t Status = SD_BUSY;
+    SD_Error_t          ErrorState;
+    uint32_t            Start  = DWT->CYCCNT;
+
+    if ((ErrorState = SD_BlockDev_Read(pDev, Lba, pBuffer, NumberOfBlocks, SD_BlockDev_SyncDone, (void*)&Status)) != SD_OK) {
+        return ErrorState;
+    }
+    while (Status == SD_BUSY) {
+        SD_BlockDev_Process(pDev);
+    }
+    pDev->Stats.ReadCycles += DWT->CYCCNT - Start;
+    if (Status != SD_OK) {
+        pDev->Stats.Errors++;
+    }
+    return Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_BlockDev_WriteSync(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    volatile SD_Error_t Status = SD_BUSY;
+    SD_Error_t          ErrorState;
+    uint32_t            Start  = DWT->CYCCNT;
+
+    if ((ErrorState = SD_BlockDev_Write(pDev, Lba, pBuffer, NumberOfBlocks, 0, SD_BlockDev_SyncDone, (void*)&Status)) != SD_OK) {
+        return ErrorState;
+    }
+    while (Status == SD_BUSY) {
+        SD_BlockDev_Process(pDev);
+    }
+    pDev->Stats.WriteCycles += DWT->CYCCNT - Start;
+    if (Status != SD_OK) {
+        pDev->Stats.Errors++;
+    }
+    return Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Ordering point. Synchronous layers are flushed from the top down, a layer's data has to reach
+  *         the one below before that one can make it durable. The first layer that queues requests takes
+  *         over with its Barrier, everything below it is its business.
+  * @param  pDev: Device
+  * @param  Callback: Called with pDev once everything written before is durable
+  * @param  Context: Passed to Callback
+  * @retval SD Card error state
+  */
+SD_Error_t SD_BlockDev_Barrier(SD_BlockDev_t *pDev, SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_BlockDevPending_t *pPending;
+    SD_BlockDev_t        *pLayer;
+    SD_Error_t            ErrorState;
+
+    for (pLayer = pDev; pLayer != NULL; pLayer = pLayer->pLower) {
+        pLayer->Stats.Flushes++;
+        if (pLayer->pOps->Barrier) {
+            if ((pPending = SD_BlockDev_Claim(SD_BlockDevForward, SD_BLOCKDEV_FORWARD_DEPTH, pDev, Callback, Context)) == NULL) {
+                return SD_BUSY;
+            }
+            if ((ErrorState = pLayer->pOps->Barrier(pLayer, SD_BlockDev_ForwardDone, pPending)) != SD_OK) {
+                pPending->Used = false;
+                pLayer->Stats.Errors++;
+            }
+            return ErrorState;
+        }
+        if (pLayer->pOps->Flush && ((ErrorState = pLayer->pOps->Flush(pLayer)) != SD_OK)) {
+            pLayer->Stats.Errors++;
+            return ErrorState;
+        }
+    }
+    if (Callback) {
+        Callback(pDev, SD_OK, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_BlockDev_Flush(SD_BlockDev_t *pDev)
+{
+    volatile SD_Error_t Status = SD_BUSY;
+    SD_Error_t          ErrorState;
+
+    if ((ErrorState = SD_BlockDev_Barrier(pDev, SD_BlockDev_SyncDone, (void*)&Status)) != SD_OK) {
+        return ErrorState;
+    }
+    while (Status == SD_BUSY) {
+        SD_BlockDev_Process(pDev);
+    }
+    return Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_BlockDev_Discard(SD_BlockDev_t *pDev, uint64_t Lba, uint64_t NumberOfBlocks)
+{
+    if ((pDev == NULL) || (NumberOfBlocks == 0)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if ((Lba >= pDev->Blocks) || (NumberOfBlocks > (pDev->Blocks - Lba))) {
+        return SD_ADDR_OUT_OF_RANGE;
+    }
+    if (pDev->pOps->Discard == NULL) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    pDev->Stats.Discards++;
+    return pDev->pOps->Discard(pDev, Lba, NumberOfBlocks);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_BlockDev_Process(SD_BlockDev_t *pDev)
+{
+    for (; pDev != NULL; pDev = pDev->pLower) {
+        if (pDev->pOps->Process) {
+            pDev->pOps->Process(pDev);
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Pass-through for layers that map a range of the device below them (partitions). Geometry
+  *         checks of pDev are already done, the request is checked again against pLower.
+  * @param  pDev: Layer the request was submitted to
+  * @param  Write: Direction
+  * @param  Lba: Block on pDev
+  * @param  pBuffer: Data
+  * @param  NumberOfBlocks: Number of blocks
+  * @param  Flags: Write flags, passed on
+  * @param  Callback: Called with pDev once the device below completed
+  * @param  Context: Passed to Callback
+  * @retval SD Card error state, SD_BUSY when SD_BLOCKDEV_FORWARD_DEPTH requests are in flight
+  */
+SD_Error_t SD_BlockDev_Forward(SD_BlockDev_t *pDev, bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                               SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_BlockDevPending_t *pPending;
+    SD_Error_t            ErrorState;
+
+    if ((pPending = SD_BlockDev_Claim(SD_BlockDevForward, SD_BLOCKDEV_FORWARD_DEPTH, pDev, Callback, Context)) == NULL) {
+        return SD_BUSY;
+    }
+    if (Write) {
+        ErrorState = SD_BlockDev_Write(pDev->pLower, pDev->Offset + Lba, pBuffer, NumberOfBlocks, Flags, SD_BlockDev_ForwardDone, pPending);
+    } else {
+        ErrorState = SD_BlockDev_Read(pDev->pLower, pDev->Offset + Lba, pBuffer, NumberOfBlocks, SD_BlockDev_ForwardDone, pPending);
+    }
+    if (ErrorState != SD_OK) {
+        pPending->Used = false;
+    }
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_BlockDev_GetStats(SD_BlockDev_t *pDev, SD_BlockDevStats_t *pStats)
+{
+    *pStats = pDev->Stats;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_BlockDev_ResetStats(SD_BlockDev_t *pDev)
+{
+    memset(&pDev->Stats, 0, sizeof(pDev->Stats));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_BlockDev_CardRead(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                                       SD_BlockDevCallback_t Callback, void *Context)
+{
+#ifdef SDMMC_SCHED
+    return SD_BlockDev_CardSubmit(pDev, false, Lba, pBuffer, NumberOfBlocks, 0, Callback, Context);
+#else
+    SD_Error_t ErrorState;
+
+    if ((ErrorState = SD_ReadBlocks_DMA(Lba, (uint32_t*)pBuffer, SD_BLOCKDEV_BLOCK_SIZE, NumberOfBlocks)) != SD_OK) {
+        return ErrorState;
+    }
+    while (SD_CheckRead());
+    while (SD_GetState() == false);
+    if (Callback) {
+        Callback(pDev, SD_GetTransferError(), Context);
+    }
+    return SD_OK;
+#endif
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_BlockDev_CardWrite(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                                        SD_BlockDevCallback_t Callback, void *Context)
+{
+#ifdef SDMMC_SCHED
+    return SD_BlockDev_CardSubmit(pDev, true, Lba, (uint8_t*)pBuffer, NumberOfBlocks, Flags, Callback, Context);
+#else
+    SD_Error_t ErrorState;
+
+    if ((ErrorState = SD_WriteBlocks_DMA(Lba, (uint32_t*)pBuffer, SD_BLOCKDEV_BLOCK_SIZE, NumberOfBlocks)) != SD_OK) {
+        return ErrorState;
+    }
+    while (SD_CheckWrite());
+    while (SD_GetState() == false);
+    // Programming finished, only the card cache can still hold the data
+    if (((ErrorState = SD_GetTransferError()) == SD_OK) && (Flags & SD_BLOCKDEV_FUA)) {
+        ErrorState = SD_BlockDev_CardFlush(pDev);
+    }
+    if (Callback) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+#endif
+}
+
+
+#ifdef SDMMC_SCHED
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Queued behind everything submitted so far, see SD_Sched_Barrier().
+  */
+static SD_Error_t SD_BlockDev_CardBarrier(SD_BlockDev_t *pDev, SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_BlockDevPending_t *pPending;
+    SD_Error_t            ErrorState;
+
+    if ((pPending = SD_BlockDev_Claim(SD_BlockDevPending, SD_SCHED_DEPTH, pDev, Callback, Context)) == NULL) {
+        return SD_BUSY;
+    }
+    if ((ErrorState = SD_Sched_Barrier(SD_SCHED_DEFAULT_CLIENT, SD_BlockDev_CardDone, pPending, NULL)) != SD_OK) {
+        pPending->Used = false;
+    }
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_BlockDev_CardSubmit(SD_BlockDev_t *pDev, bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                                         uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_BlockDevPending_t *pPending;
+    SD_Error_t            ErrorState;
+
+    if ((pPending = SD_BlockDev_Claim(SD_BlockDevPending, SD_SCHED_DEPTH, pDev, Callback, Context)) == NULL) {
+        return SD_BUSY;
+    }
+    if (Write) {
+        ErrorState = SD_Sched_ClientWrite(SD_SCHED_DEFAULT_CLIENT, Lba, pBuffer, NumberOfBlocks, (Flags & SD_BLOCKDEV_FUA) ? SD_SCHED_FUA : 0,
+                                          SD_BlockDev_CardDone, pPending, NULL);
+    } else {
+        ErrorState = SD_Sched_Read(Lba, pBuffer, NumberOfBlocks, SD_BlockDev_CardDone, pPending, NULL);
+    }
+    if (ErrorState != SD_OK) {
+        pPending->Used = false;
+    }
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_BlockDev_CardDone(uint8_t RequestId, SD_Error_t Status, void *Context)
+{
+    (void)RequestId;
+    SD_BlockDev_ForwardDone(NULL, Status, Context);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_BlockDev_CardProcess(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+    SD_Sched_Process();
+}
+
+#else
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Every write has finished programming when it returns, only the card cache can hold data back.
+  */
+static SD_Error_t SD_BlockDev_CardFlush(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+
+    if (SD_CardCacheIsEnabled()) {
+        return SD_CardCacheFlush();
+    }
+    return SD_OK;
+}
+#endif
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Allocation unit from the SD status, the unit the card manages its flash in.
+  * @retval Blocks
+  */
+static uint32_t SD_BlockDev_EraseBlocks(void)
+{
+    static const uint16_t LargeAU[5] = { 12, 16, 24, 32, 64 };  // MB, AU_SIZE 0xB..0xF
+    SD_CardStatus_t       Status;
+
+    if ((SD_GetCardStatus(&Status) != SD_OK) || (Status.AU_SIZE == 0)) {
+        return SD_BLOCKDEV_DEFAULT_ERASE;
+    }
+    if (Status.AU_SIZE <= 0x0A) {
+        return 32U << (Status.AU_SIZE - 1);                         // 16KB << (AU_SIZE - 1)
+    }
+    return (uint32_t)LargeAU[Status.AU_SIZE - 0x0B] * 2048;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Takes a free completion slot, submits may come from interrupt context.
+  * @retval Slot, NULL when all are in use
+  */
+static SD_BlockDevPending_t *SD_BlockDev_Claim(SD_BlockDevPending_t *pPool, uint32_t Size, SD_BlockDev_t *pDev,
+                                               SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_BlockDevPending_t *pPending = NULL;
+    uint32_t              primask  = __get_PRIMASK();
+
+    __disable_irq();
+    for (uint32_t i = 0; i < Size; i++) {
+        if (!pPool[i].Used) {
+            pPending       = &pPool[i];
+            pPending->Used = true;
+            break;
+        }
+    }
+    __set_PRIMASK(primask);
+
+    if (pPending) {
+        pPending->pDev     = pDev;
+        pPending->Callback = Callback;
+        pPending->Context  = Context;
+    }
+    return pPending;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Frees the slot before calling back, the callback may submit again.
+  */
+static void SD_BlockDev_ForwardDone(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context)
+{
+    SD_BlockDevPending_t Pending = *(SD_BlockDevPending_t*)Context;
+
+    (void)pDev;
+    ((SD_BlockDevPending_t*)Context)->Used = false;
+    if (Pending.Callback) {
+        Pending.Callback(Pending.pDev, Status, Pending.Context);
+    }
+}
+
+
+#ifdef SDMMC_BLOCK_CACHE
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_BlockDev_CacheRead(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                                        SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_Error_t ErrorState = SD_Cache_Read(Lba, pBuffer, NumberOfBlocks);
+
+    if (Callback) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  The cache cannot write back a single range, a FUA write costs a full flush of the stack.
+  */
+static SD_Error_t SD_BlockDev_CacheWrite(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                                         SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_Error_t ErrorState = SD_Cache_Write(Lba, pBuffer, NumberOfBlocks);
+
+    if ((ErrorState == SD_OK) && (Flags & SD_BLOCKDEV_FUA)) {
+        ErrorState = SD_BlockDev_Flush(pDev);
+    }
+
+    if (Callback) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_BlockDev_CacheFlush(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+    return SD_Cache_Flush();
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_BlockDev_CacheProcess(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+    SD_Cache_Process();
+}
+#endif
+
+
+#ifdef SDMMC_READAHEAD
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_BlockDev_ReadAheadRead(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                                            SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_Error_t ErrorState = SD_ReadAhead_Read(Lba, pBuffer, NumberOfBlocks);
+
+    if (Callback) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_BlockDev_ReadAheadWrite(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                                             SD_BlockDevCallback_t Callback, void *Context)
+{
+    return SD_BlockDev_Forward(pDev, true, Lba, (uint8_t*)pBuffer, NumberOfBlocks, Flags, Callback, Context);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_BlockDev_ReadAheadProcess(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+    SD_ReadAhead_Process();
+}
+#endif
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_BlockDev_SyncDone(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context)
+{
+    (void)pDev;
+    *(volatile SD_Error_t*)Context = Status;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
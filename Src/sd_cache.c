@@ -0,0 +1,952 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_cache.h"
+#include "sd_powerfail.h"
+
+#ifdef SDMMC_BLOCK_CACHE
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_CACHE_WORDS                  (SD_BLOCKDEV_BLOCK_SIZE / 4)
+// ARC keeps as many ghost LBAs as it keeps blocks
+#define SD_CACHE_NODES                  (2 * SD_CACHE_BLOCKS)
+#define SD_CACHE_NIL                    0xFFFF
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_CACHE_LIST_T1        = 0,        // Resident, referenced once, the only list LRU uses
+    SD_CACHE_LIST_T2        = 1,        // Resident, referenced at least twice
+    SD_CACHE_LIST_B1        = 2,        // Ghost, evicted from T1
+    SD_CACHE_LIST_B2        = 3,        // Ghost, evicted from T2
+    SD_CACHE_LIST_FREE      = 4,
+    SD_CACHE_LISTS          = 5,
+} SD_CacheListId_t;
+
+typedef struct
+{
+    uint64_t Lba;
+    uint16_t Prev;                      // Towards MRU
+    uint16_t Next;                      // Towards LRU
+    uint16_t HashNext;
+    uint16_t Slot;                      // Index into SD_CacheData, SD_CACHE_NIL for ghosts and free nodes
+    uint8_t  List;
+    uint8_t  Dirty;
+} SD_CacheNode_t;
+
+typedef struct
+{
+    uint16_t Head;                      // MRU
+    uint16_t Tail;                      // LRU
+    uint32_t Count;
+} SD_CacheList_t;
+
+typedef struct
+{
+    SD_CachePolicy_t    Policy;
+    SD_CacheMode_t      Mode;
+    bool                Enabled;
+    volatile bool       Busy;           // Inside a cache call, the power-fail hook must leave the directory alone
+    bool                HookRegistered;
+    bool                LastGasp;       // Flushing from the PVD interrupt, writes go straight to the driver
+    SD_BlockDev_t      *pLower;         // Layer below, set by SD_BlockDev_Cache
+    uint32_t            DirtySince;     // HAL tick the oldest dirty block was written
+    uint32_t            Target;         // ARC p, blocks T1 should get
+    uint32_t            FreeCount;
+    uint16_t            FreeSlot[SD_CACHE_BLOCKS];
+    uint16_t            Hash[SD_CACHE_HASH];
+    SD_CacheList_t      List[SD_CACHE_LISTS];
+    SD_CacheNode_t      Node[SD_CACHE_NODES];
+    SD_CacheStats_t     Stats;
+} SD_Cache_t;
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_Cache_t                  SD_Cache;
+// 512 bytes per block keeps every block on its own cache lines, no maintenance can touch a neighbour
+static uint32_t                    SD_CacheData[SD_CACHE_BLOCKS][SD_CACHE_WORDS] __attribute__((section(".ram_d1"), aligned(32)));
+static uint32_t                    SD_CacheStage[SD_CACHE_STAGE_BLOCKS * SD_CACHE_WORDS] __attribute__((section(".ram_d1"), aligned(32)));
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static void             SD_Cache_Reset              (void);
+static uint32_t         SD_Cache_HashOf             (uint64_t Lba);
+static uint16_t         SD_Cache_Lookup             (uint64_t Lba);
+static bool             SD_Cache_IsResident         (uint16_t Idx);
+static bool             SD_Cache_IsDirty            (uint64_t Lba);
+static void             SD_Cache_Unlink             (uint16_t Idx);
+static void             SD_Cache_PushHead           (uint16_t Idx, SD_CacheListId_t List);
+static void             SD_Cache_Move               (uint16_t Idx, SD_CacheListId_t List);
+static void             SD_Cache_Touch              (uint16_t Idx);
+static void             SD_Cache_Forget             (uint16_t Idx);
+static SD_Error_t       SD_Cache_Release            (uint16_t Idx);
+static void             SD_Cache_Drop               (uint64_t Lba, uint32_t NumberOfBlocks);
+static SD_Error_t       SD_Cache_Replace            (bool InB2);
+static SD_Error_t       SD_Cache_ArcMiss            (uint64_t Lba, uint16_t *pIdx);
+static SD_Error_t       SD_Cache_Get                (uint64_t Lba, uint16_t *pIdx, bool *pHit);
+static void             SD_Cache_MarkDirty          (uint16_t Idx);
+static SD_Error_t       SD_Cache_WriteRun           (uint64_t Lba);
+static SD_Error_t       SD_Cache_FlushAll           (void);
+static SD_Error_t       SD_Cache_ReadBlocks         (uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks);
+static SD_Error_t       SD_Cache_WriteBlocks        (uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks);
+static bool             SD_Cache_WriteBackAllowed   (void);
+static SD_BlockDev_t   *SD_Cache_Lower              (void);
+static SD_Error_t       SD_Cache_CardRead           (uint64_t Lba, uint32_t *pBuffer, uint32_t NumberOfBlocks);
+static SD_Error_t       SD_Cache_CardWrite          (uint64_t Lba, uint32_t *pBuffer, uint32_t NumberOfBlocks);
+#ifdef SDMMC_POWER_FAIL
+static void             SD_Cache_PowerFailHook      (int32_t RemainingUs, void *Context);
+#endif
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Sets up an empty cache. Dirty blocks of a previous configuration are written back first.
+  * @param  Policy: Replacement policy
+  * @param  Mode: Write policy
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Cache_Init(SD_CachePolicy_t Policy, SD_CacheMode_t Mode)
+{
+    SD_Error_t ErrorState = SD_OK;
+
+    SD_Cache.Busy = true;
+    if (SD_Cache.Enabled) {
+        ErrorState = SD_Cache_FlushAll();
+    }
+    if (ErrorState == SD_OK) {
+        SD_Cache.Policy  = Policy;
+        SD_Cache.Mode    = Mode;
+        SD_Cache_Reset();
+        SD_Cache.Enabled = true;
+    }
+    SD_Cache.Busy = false;
+
+#ifdef SDMMC_POWER_FAIL
+    if (!SD_Cache.HookRegistered && (SD_PowerFail_RegisterHook(SD_Cache_PowerFailHook, NULL) == SD_OK)) {
+        SD_Cache.HookRegistered = true;
+    }
+#endif
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Cache_SetMode(SD_CacheMode_t Mode)
+{
+    SD_Error_t ErrorState = SD_OK;
+
+    SD_Cache.Busy = true;
+    if (SD_Cache.Enabled && (Mode == SD_CACHE_WRITE_THROUGH)) {
+        ErrorState = SD_Cache_FlushAll();
+    }
+    if (ErrorState == SD_OK) {
+        SD_Cache.Mode = Mode;
+    }
+    SD_Cache.Busy = false;
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_CacheMode_t SD_Cache_GetMode(void)
+{
+    return SD_Cache.Mode;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads blocks, hits are copied from AXI SRAM, runs of consecutive misses are fetched with one
+  *         multi-block read through the staging buffer.
+  * @param  Lba: First block
+  * @param  pBuffer: Destination, no alignment or memory region requirements
+  * @param  NumberOfBlocks: Number of blocks
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Cache_Read(uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    SD_Error_t ErrorState;
+
+    if (!SD_Cache.Enabled) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    SD_Cache.Busy = true;
+    ErrorState    = SD_Cache_ReadBlocks(Lba, pBuffer, NumberOfBlocks);
+    SD_Cache.Busy = false;
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Writes blocks. In write-back mode short requests only update the cache, everything else goes
+  *         to the card first and cached copies are updated afterwards.
+  * @param  Lba: First block
+  * @param  pBuffer: Source, no alignment or memory region requirements
+  * @param  NumberOfBlocks: Number of blocks
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Cache_Write(uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    SD_Error_t ErrorState;
+
+    if (!SD_Cache.Enabled) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    SD_Cache.Busy = true;
+    ErrorState    = SD_Cache_WriteBlocks(Lba, pBuffer, NumberOfBlocks);
+    SD_Cache.Busy = false;
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Cache_Flush(void)
+{
+    SD_Error_t ErrorState;
+
+    if (!SD_Cache.Enabled) {
+        return SD_OK;
+    }
+    SD_Cache.Busy = true;
+    ErrorState    = SD_Cache_FlushAll();
+    SD_Cache.Busy = false;
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Cache_Invalidate(void)
+{
+    SD_Error_t ErrorState;
+
+    if (!SD_Cache.Enabled) {
+        return SD_OK;
+    }
+    SD_Cache.Busy = true;
+    if ((ErrorState = SD_Cache_FlushAll()) == SD_OK) {
+        SD_Cache_Reset();
+    }
+    SD_Cache.Busy = false;
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Ages dirty data. Everything is written back once the oldest dirty block is older than
+  *         SD_CACHE_WRITEBACK_MS, or at once when write-back is no longer safe.
+  */
+void SD_Cache_Process(void)
+{
+    if (!SD_Cache.Enabled || SD_Cache.Busy || (SD_Cache.Stats.Dirty == 0)) {
+        return;
+    }
+    if (((HAL_GetTick() - SD_Cache.DirtySince) < SD_CACHE_WRITEBACK_MS) && SD_Cache_WriteBackAllowed()) {
+        return;
+    }
+    SD_Cache.Busy = true;
+    SD_Cache_FlushAll();
+    SD_Cache.Busy = false;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Cache_GetStats(SD_CacheStats_t *pStats)
+{
+    *pStats        = SD_Cache.Stats;
+    pStats->Target = SD_Cache.Target;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Sets the layer misses and write-backs go to, called by SD_BlockDev_Cache().
+  */
+void SD_Cache_SetLower(SD_BlockDev_t *pLower)
+{
+    SD_Cache.pLower = pLower;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Cache_Reset(void)
+{
+    memset(SD_Cache.List, 0xFF, sizeof(SD_Cache.List));
+    memset(SD_Cache.Hash, 0xFF, sizeof(SD_Cache.Hash));
+    for (uint32_t i = 0; i < SD_CACHE_LISTS; i++) {
+        SD_Cache.List[i].Count = 0;
+    }
+    for (uint16_t i = 0; i < SD_CACHE_NODES; i++) {
+        SD_Cache.Node[i].Slot  = SD_CACHE_NIL;
+        SD_Cache.Node[i].Dirty = 0;
+        SD_Cache_PushHead(i, SD_CACHE_LIST_FREE);
+    }
+    for (uint16_t i = 0; i < SD_CACHE_BLOCKS; i++) {
+        SD_Cache.FreeSlot[i] = i;
+    }
+    SD_Cache.FreeCount = SD_CACHE_BLOCKS;
+    SD_Cache.Target    = 0;
+    memset(&SD_Cache.Stats, 0, sizeof(SD_Cache.Stats));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint32_t SD_Cache_HashOf(uint64_t Lba)
+{
+    // Fibonacci hashing, consecutive LBAs land in different buckets
+    return (((uint32_t)(Lba ^ (Lba >> 32)) * 2654435761U) >> 16) & (SD_CACHE_HASH - 1);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @retval Directory entry of the LBA, resident or ghost, SD_CACHE_NIL if unknown
+  */
+static uint16_t SD_Cache_Lookup(uint64_t Lba)
+{
+    uint16_t Idx;
+
+    for (Idx = SD_Cache.Hash[SD_Cache_HashOf(Lba)]; Idx != SD_CACHE_NIL; Idx = SD_Cache.Node[Idx].HashNext) {
+        if (SD_Cache.Node[Idx].Lba == Lba) {
+            break;
+        }
+    }
+    return Idx;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static bool SD_Cache_IsResident(uint16_t Idx)
+{
+    return (Idx != SD_CACHE_NIL) && (SD_Cache.Node[Idx].Slot != SD_CACHE_NIL);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static bool SD_Cache_IsDirty(uint64_t Lba)
+{
+    uint16_t Idx = SD_Cache_Lookup(Lba);
+
+    return (Idx != SD_CACHE_NIL) && SD_Cache.Node[Idx].Dirty;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Cache_Unlink(uint16_t Idx)
+{
+    SD_CacheNode_t *pNode = &SD_Cache.Node[Idx];
+    SD_CacheList_t *pList = &SD_Cache.List[pNode->List];
+
+    if (pNode->Prev != SD_CACHE_NIL) {
+        SD_Cache.Node[pNode->Prev].Next = pNode->Next;
+    } else {
+        pList->Head = pNode->Next;
+    }
+    if (pNode->Next != SD_CACHE_NIL) {
+        SD_Cache.Node[pNode->Next].Prev = pNode->Prev;
+    } else {
+        pList->Tail = pNode->Prev;
+    }
+    pList->Count--;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Cache_PushHead(uint16_t Idx, SD_CacheListId_t List)
+{
+    SD_CacheNode_t *pNode = &SD_Cache.Node[Idx];
+    SD_CacheList_t *pList = &SD_Cache.List[List];
+
+    pNode->List = List;
+    pNode->Prev = SD_CACHE_NIL;
+    pNode->Next = pList->Head;
+    if (pList->Head != SD_CACHE_NIL) {
+        SD_Cache.Node[pList->Head].Prev = Idx;
+    } else {
+        pList->Tail = Idx;
+    }
+    pList->Head = Idx;
+    pList->Count++;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Cache_Move(uint16_t Idx, SD_CacheListId_t List)
+{
+    SD_Cache_Unlink(Idx);
+    SD_Cache_PushHead(Idx, List);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Cache_Touch(uint16_t Idx)
+{
+    SD_Cache_Move(Idx, (SD_Cache.Policy == SD_CACHE_ARC) ? SD_CACHE_LIST_T2 : SD_CACHE_LIST_T1);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Removes a ghost, or a resident entry whose slot was already released, from the directory.
+  */
+static void SD_Cache_Forget(uint16_t Idx)
+{
+    uint16_t *pLink = &SD_Cache.Hash[SD_Cache_HashOf(SD_Cache.Node[Idx].Lba)];
+
+    while (*pLink != Idx) {
+        pLink = &SD_Cache.Node[*pLink].HashNext;
+    }
+    *pLink = SD_Cache.Node[Idx].HashNext;
+    SD_Cache_Move(Idx, SD_CACHE_LIST_FREE);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Gives the data slot of a resident entry back, writing its dirty run to the card first.
+  *         On error the entry stays resident and dirty.
+  */
+static SD_Error_t SD_Cache_Release(uint16_t Idx)
+{
+    SD_CacheNode_t *pNode = &SD_Cache.Node[Idx];
+    SD_Error_t      ErrorState;
+
+    if (pNode->Dirty) {
+        if ((ErrorState = SD_Cache_WriteRun(pNode->Lba)) != SD_OK) {
+            return ErrorState;
+        }
+        SD_Cache.Stats.DirtyEvictions++;
+    }
+    SD_Cache.FreeSlot[SD_Cache.FreeCount++] = pNode->Slot;
+    pNode->Slot = SD_CACHE_NIL;
+    SD_Cache.Stats.Resident--;
+    SD_Cache.Stats.Evictions++;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Forgets cached copies of a range whose state on the card is unknown after a failed write.
+  */
+static void SD_Cache_Drop(uint64_t Lba, uint32_t NumberOfBlocks)
+{
+    uint16_t Idx;
+
+    for (uint32_t i = 0; i < NumberOfBlocks; i++) {
+        Idx = SD_Cache_Lookup(Lba + i);
+        if (!SD_Cache_IsResident(Idx)) {
+            continue;
+        }
+        if (SD_Cache.Node[Idx].Dirty) {
+            SD_Cache.Node[Idx].Dirty = 0;
+            SD_Cache.Stats.Dirty--;
+        }
+        SD_Cache.FreeSlot[SD_Cache.FreeCount++] = SD_Cache.Node[Idx].Slot;
+        SD_Cache.Node[Idx].Slot = SD_CACHE_NIL;
+        SD_Cache.Stats.Resident--;
+        SD_Cache_Forget(Idx);
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  ARC REPLACE, frees one data slot by demoting the LRU block of T1 or T2 to its ghost list.
+  *         T1 gives up the block while it holds more than the target p.
+  * @param  InB2: The request hit a B2 ghost
+  */
+static SD_Error_t SD_Cache_Replace(bool InB2)
+{
+    SD_CacheListId_t Ghost  = SD_CACHE_LIST_B2;
+    uint16_t         Victim = SD_Cache.List[SD_CACHE_LIST_T2].Tail;
+    uint32_t         T1     = SD_Cache.List[SD_CACHE_LIST_T1].Count;
+    SD_Error_t       ErrorState;
+
+    if ((T1 > 0) && ((Victim == SD_CACHE_NIL) || (T1 > SD_Cache.Target) || (InB2 && (T1 == SD_Cache.Target)))) {
+        Ghost  = SD_CACHE_LIST_B1;
+        Victim = SD_Cache.List[SD_CACHE_LIST_T1].Tail;
+    }
+    if ((ErrorState = SD_Cache_Release(Victim)) != SD_OK) {
+        return ErrorState;
+    }
+    SD_Cache_Move(Victim, Ghost);
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  ARC case IV, the LBA is in none of the four lists. Keeps |T1| + |B1| <= c and the whole
+  *         directory <= 2c, then enters the LBA at the MRU end of T1.
+  */
+static SD_Error_t SD_Cache_ArcMiss(uint64_t Lba, uint16_t *pIdx)
+{
+    SD_CacheList_t *pList = SD_Cache.List;
+    uint32_t        Total = pList[SD_CACHE_LIST_T1].Count + pList[SD_CACHE_LIST_T2].Count +
+                            pList[SD_CACHE_LIST_B1].Count + pList[SD_CACHE_LIST_B2].Count;
+    SD_Error_t      ErrorState = SD_OK;
+    uint16_t        Idx;
+
+    if ((pList[SD_CACHE_LIST_T1].Count + pList[SD_CACHE_LIST_B1].Count) >= SD_CACHE_BLOCKS) {
+        if (pList[SD_CACHE_LIST_T1].Count < SD_CACHE_BLOCKS) {
+            SD_Cache_Forget(pList[SD_CACHE_LIST_B1].Tail);
+            if (SD_Cache.FreeCount == 0) {
+                ErrorState = SD_Cache_Replace(false);
+            }
+        } else {
+            Idx = pList[SD_CACHE_LIST_T1].Tail;
+            if ((ErrorState = SD_Cache_Release(Idx)) == SD_OK) {
+                SD_Cache_Forget(Idx);
+            }
+        }
+    } else if (Total >= SD_CACHE_BLOCKS) {
+        if (Total >= SD_CACHE_NODES) {
+            SD_Cache_Forget(pList[SD_CACHE_LIST_B2].Tail);
+        }
+        if (SD_Cache.FreeCount == 0) {
+            ErrorState = SD_Cache_Replace(false);
+        }
+    }
+    if (ErrorState != SD_OK) {
+        return ErrorState;
+    }
+
+    Idx = pList[SD_CACHE_LIST_FREE].Head;
+    SD_Cache.Node[Idx].Lba      = Lba;
+    SD_Cache.Node[Idx].HashNext = SD_Cache.Hash[SD_Cache_HashOf(Lba)];
+    SD_Cache.Hash[SD_Cache_HashOf(Lba)] = Idx;
+    SD_Cache_Move(Idx, SD_CACHE_LIST_T1);
+    *pIdx = Idx;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Finds or makes room for a block and returns its resident entry. Data of a new entry is
+  *         undefined, the caller fills it.
+  * @param  Lba: Block
+  * @param  pIdx: Resident directory entry
+  * @param  pHit: Set when the block was already cached
+  * @retval SD Card error state, only write-back of an evicted dirty run can fail
+  */
+static SD_Error_t SD_Cache_Get(uint64_t Lba, uint16_t *pIdx, bool *pHit)
+{
+    uint16_t   Idx = SD_Cache_Lookup(Lba);
+    SD_Error_t ErrorState;
+    uint32_t   B1, B2, Delta;
+
+    *pHit = SD_Cache_IsResident(Idx);
+    if (*pHit) {
+        SD_Cache_Touch(Idx);
+        *pIdx = Idx;
+        return SD_OK;
+    }
+
+    if (SD_Cache.Policy == SD_CACHE_LRU) {
+        if (SD_Cache.FreeCount == 0) {
+            Idx = SD_Cache.List[SD_CACHE_LIST_T1].Tail;
+            if ((ErrorState = SD_Cache_Release(Idx)) != SD_OK) {
+                return ErrorState;
+            }
+            SD_Cache_Forget(Idx);
+        }
+        Idx = SD_Cache.List[SD_CACHE_LIST_FREE].Head;
+        SD_Cache.Node[Idx].Lba      = Lba;
+        SD_Cache.Node[Idx].HashNext = SD_Cache.Hash[SD_Cache_HashOf(Lba)];
+        SD_Cache.Hash[SD_Cache_HashOf(Lba)] = Idx;
+        SD_Cache_Move(Idx, SD_CACHE_LIST_T1);
+    } else if (Idx != SD_CACHE_NIL) {
+        // Ghost hit, shift the target towards the list that would have kept the block
+        B1 = SD_Cache.List[SD_CACHE_LIST_B1].Count;
+        B2 = SD_Cache.List[SD_CACHE_LIST_B2].Count;
+        if (SD_Cache.Node[Idx].List == SD_CACHE_LIST_B1) {
+            Delta           = (B2 > B1) ? (B2 / B1) : 1;
+            SD_Cache.Target = ((SD_Cache.Target + Delta) < SD_CACHE_BLOCKS) ? (SD_Cache.Target + Delta) : SD_CACHE_BLOCKS;
+        } else {
+            Delta           = (B1 > B2) ? (B1 / B2) : 1;
+            SD_Cache.Target = (SD_Cache.Target > Delta) ? (SD_Cache.Target - Delta) : 0;
+        }
+        SD_Cache.Stats.GhostHits++;
+        if ((SD_Cache.FreeCount == 0) &&
+            ((ErrorState = SD_Cache_Replace(SD_Cache.Node[Idx].List == SD_CACHE_LIST_B2)) != SD_OK)) {
+            return ErrorState;
+        }
+        SD_Cache_Move(Idx, SD_CACHE_LIST_T2);
+    } else if ((ErrorState = SD_Cache_ArcMiss(Lba, &Idx)) != SD_OK) {
+        return ErrorState;
+    }
+
+    SD_Cache.Node[Idx].Slot  = SD_Cache.FreeSlot[--SD_Cache.FreeCount];
+    SD_Cache.Node[Idx].Dirty = 0;
+    SD_Cache.Stats.Resident++;
+    *pIdx = Idx;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Cache_MarkDirty(uint16_t Idx)
+{
+    if (SD_Cache.Node[Idx].Dirty) {
+        return;
+    }
+    SD_Cache.Node[Idx].Dirty = 1;
+    if (SD_Cache.Stats.Dirty++ == 0) {
+        SD_Cache.DirtySince = HAL_GetTick();
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Writes the run of consecutive dirty blocks around an LBA with one multi-block write. The run
+  *         is capped at SD_CACHE_STAGE_BLOCKS and always contains the LBA.
+  */
+static SD_Error_t SD_Cache_WriteRun(uint64_t Lba)
+{
+    uint16_t   Run[SD_CACHE_STAGE_BLOCKS];
+    uint64_t   Start = Lba;
+    uint32_t   Count = 0;
+    uint16_t   Idx;
+    SD_Error_t ErrorState;
+
+    while ((Start > 0) && ((Lba - Start) < (SD_CACHE_STAGE_BLOCKS - 1)) && SD_Cache_IsDirty(Start - 1)) {
+        Start--;
+    }
+    while (Count < SD_CACHE_STAGE_BLOCKS) {
+        Idx = SD_Cache_Lookup(Start + Count);
+        if ((Idx == SD_CACHE_NIL) || !SD_Cache.Node[Idx].Dirty) {
+            break;
+        }
+        memcpy(&SD_CacheStage[Count * SD_CACHE_WORDS], SD_CacheData[SD_Cache.Node[Idx].Slot], SD_BLOCKDEV_BLOCK_SIZE);
+        Run[Count++] = Idx;
+    }
+
+    if ((ErrorState = SD_Cache_CardWrite(Start, SD_CacheStage, Count)) != SD_OK) {
+        return ErrorState;
+    }
+    for (uint32_t i = 0; i < Count; i++) {
+        SD_Cache.Node[Run[i]].Dirty = 0;
+    }
+    SD_Cache.Stats.Dirty         -= Count;
+    SD_Cache.Stats.FlushRuns++;
+    SD_Cache.Stats.FlushedBlocks += Count;
+    if (SD_Cache.Stats.Dirty != 0) {
+        SD_Cache.DirtySince = HAL_GetTick();
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Writes every dirty block, lowest LBA first so the card sees an ascending stream of runs.
+  */
+static SD_Error_t SD_Cache_FlushAll(void)
+{
+    SD_Error_t ErrorState;
+    uint16_t   Min;
+
+    while (SD_Cache.Stats.Dirty != 0) {
+        Min = SD_CACHE_NIL;
+        for (uint16_t i = 0; i < SD_CACHE_NODES; i++) {
+            if (SD_Cache.Node[i].Dirty && ((Min == SD_CACHE_NIL) || (SD_Cache.Node[i].Lba < SD_Cache.Node[Min].Lba))) {
+                Min = i;
+            }
+        }
+        if ((ErrorState = SD_Cache_WriteRun(SD_Cache.Node[Min].Lba)) != SD_OK) {
+            return ErrorState;
+        }
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Cache_ReadBlocks(uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    bool       Bypass = (NumberOfBlocks > SD_CACHE_BYPASS_BLOCKS);
+    uint32_t   i = 0, Run;
+    uint16_t   Idx;
+    bool       Hit;
+    SD_Error_t ErrorState;
+
+    if (Bypass) {
+        SD_Cache.Stats.Bypassed++;
+    }
+
+    while (i < NumberOfBlocks) {
+        Idx = SD_Cache_Lookup(Lba + i);
+        if (SD_Cache_IsResident(Idx)) {
+            // Bulk transfers do not promote, a long scan must not look like reuse
+            if (!Bypass) {
+                SD_Cache_Touch(Idx);
+            }
+            memcpy(&pBuffer[i * SD_BLOCKDEV_BLOCK_SIZE], SD_CacheData[SD_Cache.Node[Idx].Slot], SD_BLOCKDEV_BLOCK_SIZE);
+            SD_Cache.Stats.ReadHits++;
+            i++;
+            continue;
+        }
+
+        Run = 1;
+        while (((i + Run) < NumberOfBlocks) && (Run < SD_CACHE_STAGE_BLOCKS) && !SD_Cache_IsResident(SD_Cache_Lookup(Lba + i + Run))) {
+            Run++;
+        }
+        if ((ErrorState = SD_Cache_CardRead(Lba + i, SD_CacheStage, Run)) != SD_OK) {
+            return ErrorState;
+        }
+        // Out of the staging buffer before an eviction below reuses it for a dirty run
+        memcpy(&pBuffer[i * SD_BLOCKDEV_BLOCK_SIZE], SD_CacheStage, Run * SD_BLOCKDEV_BLOCK_SIZE);
+        SD_Cache.Stats.ReadMisses += Run;
+
+        for (uint32_t j = 0; !Bypass && (j < Run); j++) {
+            if ((ErrorState = SD_Cache_Get(Lba + i + j, &Idx, &Hit)) != SD_OK) {
+                return ErrorState;
+            }
+            memcpy(SD_CacheData[SD_Cache.Node[Idx].Slot], &pBuffer[(i + j) * SD_BLOCKDEV_BLOCK_SIZE], SD_BLOCKDEV_BLOCK_SIZE);
+        }
+        i += Run;
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Cache_WriteBlocks(uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    bool       Bypass = (NumberOfBlocks > SD_CACHE_BYPASS_BLOCKS);
+    uint32_t   Run;
+    uint16_t   Idx;
+    bool       Hit;
+    SD_Error_t ErrorState;
+
+    if (Bypass) {
+        SD_Cache.Stats.Bypassed++;
+    }
+
+    if ((SD_Cache.Mode == SD_CACHE_WRITE_BACK) && !Bypass && SD_Cache_WriteBackAllowed()) {
+        for (uint32_t i = 0; i < NumberOfBlocks; i++) {
+            if ((ErrorState = SD_Cache_Get(Lba + i, &Idx, &Hit)) != SD_OK) {
+                return ErrorState;
+            }
+            memcpy(SD_CacheData[SD_Cache.Node[Idx].Slot], &pBuffer[i * SD_BLOCKDEV_BLOCK_SIZE], SD_BLOCKDEV_BLOCK_SIZE);
+            SD_Cache_MarkDirty(Idx);
+            if (Hit) {
+                SD_Cache.Stats.WriteHits++;
+            } else {
+                SD_Cache.Stats.WriteMisses++;
+            }
+        }
+        return SD_OK;
+    }
+
+    for (uint32_t i = 0; i < NumberOfBlocks; i += Run) {
+        Run = ((NumberOfBlocks - i) < SD_CACHE_STAGE_BLOCKS) ? (NumberOfBlocks - i) : SD_CACHE_STAGE_BLOCKS;
+        memcpy(SD_CacheStage, &pBuffer[i * SD_BLOCKDEV_BLOCK_SIZE], Run * SD_BLOCKDEV_BLOCK_SIZE);
+        if ((ErrorState = SD_Cache_CardWrite(Lba + i, SD_CacheStage, Run)) != SD_OK) {
+            SD_Cache_Drop(Lba, NumberOfBlocks);
+            return ErrorState;
+        }
+    }
+
+    // Card holds the data now, cached copies follow and a dirty older version becomes clean
+    for (uint32_t i = 0; i < NumberOfBlocks; i++) {
+        Idx = SD_Cache_Lookup(Lba + i);
+        Hit = SD_Cache_IsResident(Idx);
+        if (Hit) {
+            if (!Bypass) {
+                SD_Cache_Touch(Idx);
+            }
+        } else if (Bypass || (SD_Cache_Get(Lba + i, &Idx, &Hit) != SD_OK)) {
+            SD_Cache.Stats.WriteMisses++;
+            continue;
+        }
+        memcpy(SD_CacheData[SD_Cache.Node[Idx].Slot], &pBuffer[i * SD_BLOCKDEV_BLOCK_SIZE], SD_BLOCKDEV_BLOCK_SIZE);
+        if (SD_Cache.Node[Idx].Dirty) {
+            SD_Cache.Node[Idx].Dirty = 0;
+            SD_Cache.Stats.Dirty--;
+        }
+        if (Hit) {
+            SD_Cache.Stats.WriteHits++;
+        } else {
+            SD_Cache.Stats.WriteMisses++;
+        }
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  With the power-fail service compiled in dirty data is only held while it is armed, the
+  *         hold-up budget then covers the flush. Without it write-back is the caller's risk.
+  */
+static bool SD_Cache_WriteBackAllowed(void)
+{
+#ifdef SDMMC_POWER_FAIL
+    return SD_PowerFail_IsArmed();
+#else
+    return true;
+#endif
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Layer the cache is stacked on. A cache used without the block device stack builds it on first use.
+  */
+static SD_BlockDev_t *SD_Cache_Lower(void)
+{
+    if (SD_Cache.pLower == NULL) {
+        SD_BlockDev_Cache();
+    }
+    return SD_Cache.pLower;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Cache_CardRead(uint64_t Lba, uint32_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    return SD_BlockDev_ReadSync(SD_Cache_Lower(), Lba, (uint8_t*)pBuffer, NumberOfBlocks);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  The last gasp cannot go through the layers below, PVD may have interrupted the scheduler half
+  *         way through a step. The power-fail service has let the transfer in flight end, the driver is
+  *         idle by then.
+  */
+static SD_Error_t SD_Cache_CardWrite(uint64_t Lba, uint32_t *pBuffer, uint32_t NumberOfBlocks)
+{
+#ifdef SDMMC_POWER_FAIL
+    SD_Error_t ErrorState;
+
+    if (SD_Cache.LastGasp) {
+        if ((ErrorState = SD_WriteBlocks_DMA(Lba, pBuffer, SD_BLOCKDEV_BLOCK_SIZE, NumberOfBlocks)) != SD_OK) {
+            return ErrorState;
+        }
+        while (SD_CheckWrite());
+        while (SD_GetState() == false);
+        return SD_GetTransferError();
+    }
+#endif
+    return SD_BlockDev_WriteSync(SD_Cache_Lower(), Lba, (const uint8_t*)pBuffer, NumberOfBlocks);
+}
+
+
+#ifdef SDMMC_POWER_FAIL
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Last-gasp flush from the PVD interrupt. Skipped when the interrupt landed inside a cache call,
+  *         the directory may be half updated then. Writes bypass the scheduler, see SD_Cache_CardWrite().
+  */
+static void SD_Cache_PowerFailHook(int32_t RemainingUs, void *Context)
+{
+    (void)Context;
+
+    if (!SD_Cache.Enabled || SD_Cache.Busy || (RemainingUs <= 0)) {
+        return;
+    }
+    SD_Cache.LastGasp = true;
+    SD_Cache_FlushAll();
+    SD_Cache.LastGasp = false;
+}
+#endif
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#else
+
+SD_Error_t SD_Cache_Init(SD_CachePolicy_t Policy, SD_CacheMode_t Mode)
+{
+    (void)Policy;
+    (void)Mode;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Cache_SetMode(SD_CacheMode_t Mode)
+{
+    (void)Mode;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_CacheMode_t SD_Cache_GetMode(void)
+{
+    return SD_CACHE_WRITE_THROUGH;
+}
+
+SD_Error_t SD_Cache_Read(uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    (void)Lba;
+    (void)pBuffer;
+    (void)NumberOfBlocks;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Cache_Write(uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    (void)Lba;
+    (void)pBuffer;
+    (void)NumberOfBlocks;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Cache_Flush(void)
+{
+    return SD_OK;
+}
+
+SD_Error_t SD_Cache_Invalidate(void)
+{
+    return SD_OK;
+}
+
+void SD_Cache_Process(void)
+{
+}
+
+void SD_Cache_GetStats(SD_CacheStats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+void SD_Cache_SetLower(SD_BlockDev_t *pLower)
+{
+    (void)pLower;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
@@ -0,0 +1,771 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_cow.h"
+
+#ifdef SDMMC_COW
+
+/*
+ * Layout on the lower device:
+ *
+ *   0..Virtual-1            home of every block of the volume
+ *   next SD_COW_POOL_BLOCKS pool, where blocks go that may not overwrite their home
+ *   next two copies         remap table, header block then entries, written alternately
+ *
+ * The remap table lists the blocks living in the pool, sorted by block: Slot is the pool block holding
+ * the current contents, Old the one holding the snapshot's when they differ, and Gen the snapshot the
+ * entry was last redirected under. Taking a snapshot only bumps Gen, so every block of the volume,
+ * home or pool, now belongs to the snapshot. A write to a block without an entry of the current Gen
+ * goes to a fresh pool block and the entry remembers where the snapshot's copy is, a second write goes
+ * in place. Rollback points those entries back at Old, discard frees Old, neither moves data. Without
+ * a snapshot a write to a pooled block goes home and returns its pool block, and SD_BlockDev_Process
+ * copies the remaining ones home a few at a time, so the pool is empty again for the next snapshot.
+ *
+ * The table is written as a whole to the older copy with FUA, after a flush of the data it refers to,
+ * so a power loss leaves the last complete table and data blocks that were not written since. Pool
+ * blocks freed since the last table write are not reused before the next one.
+ */
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_COW_MAGIC                    0x574F4353   // "SCOW"
+#define SD_COW_VERSION                  1
+#define SD_COW_HOME                     0xFFFFFFFF
+#define SD_COW_ENTRY_BLOCKS(n)          (((n) * sizeof(SD_CowEntry_t) + SD_BLOCKDEV_BLOCK_SIZE - 1) / SD_BLOCKDEV_BLOCK_SIZE)
+#define SD_COW_COPY_BLOCKS              (1 + SD_COW_ENTRY_BLOCKS(SD_COW_POOL_BLOCKS))
+#define SD_COW_FREE_WORDS               (SD_COW_POOL_BLOCKS / 32)
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t Sequence;                  // The copy with the higher one is current
+    uint32_t PoolBlocks;
+    uint64_t Virtual;
+    uint32_t Count;
+    uint32_t Gen;
+    uint32_t Active;                    // A snapshot is held
+    uint32_t EntryCrc;
+    uint32_t Crc;                       // Of the words before it
+} SD_CowHeader_t;
+
+typedef struct
+{
+    uint32_t Virtual;
+    uint32_t Slot;
+    uint32_t Old;                       // SD_COW_HOME when the snapshot's copy is the home block
+    uint32_t Gen;
+} SD_CowEntry_t;
+
+// The table as written to the card, header block first
+typedef struct
+{
+    SD_CowHeader_t Header;
+    uint8_t        Reserved[SD_BLOCKDEV_BLOCK_SIZE - sizeof(SD_CowHeader_t)];
+    SD_CowEntry_t  Entry[SD_COW_POOL_BLOCKS];
+} SD_CowTable_t;
+
+typedef struct
+{
+    SD_BlockDev_t *pLower;
+    uint64_t       Virtual;
+    uint64_t       Copy[2];             // Lba of both table copies
+    uint32_t       Current;             // Copy written last
+    uint32_t       Sequence;
+    uint32_t       Gen;
+    bool           Active;
+    bool           Dirty;
+    uint32_t       DirtySince;
+    uint32_t       Next;                // Pool allocation rotor
+    uint32_t       FreeCount;
+    uint32_t       PendingCount;
+    uint32_t       Free[SD_COW_FREE_WORDS];
+    uint32_t       Pending[SD_COW_FREE_WORDS];  // Freed since the last table write
+} SD_Cow_t;
+
+_Static_assert((SD_COW_POOL_BLOCKS % 32) == 0, "SD_COW_POOL_BLOCKS must be a multiple of 32");
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_Cow_t                    SD_Cow;
+static SD_CowStats_t               SD_CowStats;
+static SD_BlockDev_t               SD_CowDevice;
+static SD_BlockDev_t               SD_CowSnapshotDevice;
+static SD_CowTable_t               SD_CowTable __attribute__((section(".ram_d1"), aligned(32)));
+static uint8_t                     SD_CowStage[SD_COW_FOLD_BLOCKS * SD_BLOCKDEV_BLOCK_SIZE] __attribute__((section(".ram_d1"), aligned(32)));
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_Cow_Read                 (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Cow_Write                (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Cow_Flush                (SD_BlockDev_t *pDev);
+static void             SD_Cow_Process              (SD_BlockDev_t *pDev);
+static SD_Error_t       SD_Cow_Setup                (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev, bool Format);
+static bool             SD_Cow_Valid                (const SD_CowHeader_t *pHeader);
+static SD_Error_t       SD_Cow_Commit               (void);
+static SD_Error_t       SD_Cow_Fold                 (void);
+static uint32_t         SD_Cow_Find                 (uint32_t Virtual);
+static uint64_t         SD_Cow_Map                  (uint32_t Virtual, bool Snapshot);
+static SD_Error_t       SD_Cow_Redirect             (uint32_t Virtual, uint64_t *pPhysical);
+static bool             SD_Cow_Alloc                (uint32_t *pSlot);
+static void             SD_Cow_Release              (uint32_t Slot);
+static void             SD_Cow_Changed              (void);
+static SD_Error_t       SD_Cow_Transfer             (bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags);
+static void             SD_Cow_TransferDone         (SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+static uint32_t         SD_Cow_Crc32                (uint32_t Crc, const uint8_t *pData, uint32_t Length);
+
+static const SD_BlockDevOps_t      SD_CowOps =
+{
+    .Read       = SD_Cow_Read,
+    .Write      = SD_Cow_Write,
+    .Flush      = SD_Cow_Flush,
+    .Process    = SD_Cow_Process,
+};
+
+// Read-only, SD_BlockDev_Write turns writes away before they get here
+static const SD_BlockDevOps_t      SD_CowSnapshotOps =
+{
+    .Read       = SD_Cow_Read,
+    .Write      = SD_Cow_Write,
+};
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Cow_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    return SD_Cow_Setup(pLower, ppDev, false);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Cow_Format(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    return SD_Cow_Setup(pLower, ppDev, true);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Takes a snapshot with one table write, whatever the size of the volume.
+  * @retval SD Card error state, SD_REQUEST_NOT_APPLICABLE when not mounted or a snapshot is already held
+  */
+SD_Error_t SD_Cow_Snapshot(void)
+{
+    SD_Error_t ErrorState;
+
+    if ((SD_Cow.pLower == NULL) || (SD_Cow.Active == true)) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    SD_Cow.Gen++;
+    SD_Cow.Active = true;
+    if ((ErrorState = SD_Cow_Commit()) != SD_OK) {
+        SD_Cow.Active = false;
+        return ErrorState;
+    }
+    SD_CowStats.Snapshots++;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Points every block written since the snapshot back at the snapshot's copy, in the table only.
+  */
+SD_Error_t SD_Cow_Rollback(void)
+{
+    SD_CowEntry_t *pEntry = SD_CowTable.Entry;
+    uint32_t       Count = 0;
+
+    if ((SD_Cow.pLower == NULL) || (SD_Cow.Active == false)) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    for (uint32_t Index = 0; Index < SD_CowTable.Header.Count; Index++) {
+        if (pEntry[Index].Gen == SD_Cow.Gen) {
+            SD_Cow_Release(pEntry[Index].Slot);
+            if (pEntry[Index].Old == SD_COW_HOME) {
+                continue;
+            }
+            pEntry[Index].Slot = pEntry[Index].Old;
+            pEntry[Index].Old  = SD_COW_HOME;
+        }
+        pEntry[Count++] = pEntry[Index];
+    }
+    SD_CowTable.Header.Count = Count;
+    SD_Cow.Active = false;
+    SD_CowStats.Rollbacks++;
+    return SD_Cow_Commit();
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Cow_Discard(void)
+{
+    SD_CowEntry_t *pEntry = SD_CowTable.Entry;
+
+    if ((SD_Cow.pLower == NULL) || (SD_Cow.Active == false)) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    for (uint32_t Index = 0; Index < SD_CowTable.Header.Count; Index++) {
+        if ((pEntry[Index].Gen == SD_Cow.Gen) && (pEntry[Index].Old != SD_COW_HOME)) {
+            SD_Cow_Release(pEntry[Index].Old);
+            pEntry[Index].Old = SD_COW_HOME;
+        }
+    }
+    SD_Cow.Active = false;
+    SD_CowStats.Discards++;
+    return SD_Cow_Commit();
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @retval Read-only device of the snapshot's contents, to back them up from, NULL when none is held
+  */
+SD_BlockDev_t *SD_Cow_GetSnapshot(void)
+{
+    return ((SD_Cow.pLower != NULL) && (SD_Cow.Active == true)) ? &SD_CowSnapshotDevice : NULL;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Cow_GetStats(SD_CowStats_t *pStats)
+{
+    *pStats          = SD_CowStats;
+    pStats->Remapped = SD_CowTable.Header.Count;
+    pStats->PoolFree = SD_Cow.FreeCount + SD_Cow.PendingCount;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads the volume or, for the snapshot device, the snapshot, one lower request per run of
+  *         blocks that are contiguous on the lower device.
+  */
+static SD_Error_t SD_Cow_Read(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                              SD_BlockDevCallback_t Callback, void *Context)
+{
+    bool       Snapshot = (pDev == &SD_CowSnapshotDevice);
+    SD_Error_t ErrorState = SD_OK;
+    uint64_t   Physical;
+    uint32_t   Block = 0, Run;
+
+    while ((Block < NumberOfBlocks) && (ErrorState == SD_OK)) {
+        Physical = SD_Cow_Map((uint32_t)(Lba + Block), Snapshot);
+        for (Run = 1; ((Block + Run) < NumberOfBlocks) && (SD_Cow_Map((uint32_t)(Lba + Block + Run), Snapshot) == (Physical + Run)); Run++) {
+        }
+        ErrorState = SD_Cow_Transfer(false, Physical, &pBuffer[Block * SD_BLOCKDEV_BLOCK_SIZE], Run, 0);
+        Block += Run;
+    }
+
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Redirects every block first, then writes the runs that came out contiguous. Consecutive
+  *         blocks redirected together get consecutive pool blocks from the rotor.
+  * @retval SD Card error state through the callback, SD_ADDR_OUT_OF_RANGE once the pool is exhausted
+  */
+static SD_Error_t SD_Cow_Write(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                               SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_Error_t ErrorState = SD_OK, Result = SD_OK;
+    uint64_t   Physical = 0, Next = 0;
+    uint32_t   Block = 0, Run;
+    bool       Carried = false;
+
+    while ((Block < NumberOfBlocks) && (ErrorState == SD_OK) && (Result == SD_OK)) {
+        if (Carried == true) {
+            Physical = Next;
+        } else if ((Result = SD_Cow_Redirect((uint32_t)(Lba + Block), &Physical)) != SD_OK) {
+            break;
+        }
+        Carried = false;
+        for (Run = 1; (Block + Run) < NumberOfBlocks; Run++) {
+            if ((Result = SD_Cow_Redirect((uint32_t)(Lba + Block + Run), &Next)) != SD_OK) {
+                break;
+            }
+            if (Next != (Physical + Run)) {
+                Carried = true;
+                break;
+            }
+        }
+        // Blocks already redirected are written even when the pool ran out behind them
+        ErrorState = SD_Cow_Transfer(true, Physical, (uint8_t*)&pBuffer[Block * SD_BLOCKDEV_BLOCK_SIZE], Run, Flags);
+        Block += Run;
+    }
+    if (ErrorState == SD_OK) {
+        ErrorState = Result;
+    }
+
+    if ((ErrorState == SD_OK) && ((Flags & SD_BLOCKDEV_FUA) != 0) && (SD_Cow.Dirty == true)) {
+        ErrorState = SD_Cow_Commit();
+    }
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Cow_Flush(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+    return (SD_Cow.Dirty == true) ? SD_Cow_Commit() : SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Cow_Process(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+    if ((SD_Cow.Active == false) && (SD_CowTable.Header.Count > 0)) {
+        SD_Cow_Fold();
+    }
+    if ((SD_Cow.Dirty == true) && ((HAL_GetTick() - SD_Cow.DirtySince) >= SD_COW_WRITEBACK_MS)) {
+        SD_Cow_Commit();
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Loads the newer valid table copy, or starts an empty one. Format writes an empty table with a
+  *         sequence above both copies, which only costs its header block.
+  */
+static SD_Error_t SD_Cow_Setup(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev, bool Format)
+{
+    SD_CowHeader_t *pHeader = &SD_CowTable.Header;
+    SD_Error_t      ErrorState;
+    uint32_t        Sequence[2] = { 0, 0 };
+    bool            Valid[2], Loaded = false;
+    uint64_t        Virtual;
+
+    if ((pLower == NULL) || (ppDev == NULL) || (pLower->Blocks <= (SD_COW_POOL_BLOCKS + 2 * SD_COW_COPY_BLOCKS))) {
+        return SD_INVALID_PARAMETER;
+    }
+    Virtual = pLower->Blocks - SD_COW_POOL_BLOCKS - 2 * SD_COW_COPY_BLOCKS;
+    if (pLower->EraseBlocks > 1) {
+        Virtual -= Virtual % pLower->EraseBlocks;
+    }
+    // Entries hold 32 bit block numbers, and SD_COW_HOME is not one
+    if (Virtual >= SD_COW_HOME) {
+        Virtual = SD_COW_HOME - 1;
+    }
+    if (Virtual == 0) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    memset(&SD_Cow, 0, sizeof(SD_Cow));
+    SD_Cow.pLower  = pLower;
+    SD_Cow.Virtual = Virtual;
+    SD_Cow.Copy[0] = Virtual + SD_COW_POOL_BLOCKS;
+    SD_Cow.Copy[1] = Virtual + SD_COW_POOL_BLOCKS + SD_COW_COPY_BLOCKS;
+
+    for (uint32_t Copy = 0; Copy < 2; Copy++) {
+        if ((ErrorState = SD_Cow_Transfer(false, SD_Cow.Copy[Copy], (uint8_t*)pHeader, 1, 0)) != SD_OK) {
+            SD_Cow.pLower = NULL;
+            return ErrorState;
+        }
+        if ((Valid[Copy] = SD_Cow_Valid(pHeader)) == true) {
+            Sequence[Copy] = pHeader->Sequence;
+        }
+    }
+    SD_Cow.Current  = (Sequence[1] > Sequence[0]) ? 1 : 0;
+    SD_Cow.Sequence = Sequence[SD_Cow.Current];
+
+    // Newer copy first, the older one if the newer was torn
+    for (uint32_t Try = 0; (Try < 2) && (Format == false) && (Loaded == false); Try++) {
+        uint32_t Copy = SD_Cow.Current ^ Try;
+
+        if (Valid[Copy] == false) {
+            continue;
+        }
+        ErrorState = SD_Cow_Transfer(false, SD_Cow.Copy[Copy], (uint8_t*)&SD_CowTable, 1, 0);
+        if ((ErrorState == SD_OK) && (SD_Cow_Valid(pHeader) == true) && (pHeader->Count > 0)) {
+            ErrorState = SD_Cow_Transfer(false, SD_Cow.Copy[Copy] + 1, (uint8_t*)SD_CowTable.Entry, SD_COW_ENTRY_BLOCKS(pHeader->Count), 0);
+        }
+        if (ErrorState != SD_OK) {
+            SD_Cow.pLower = NULL;
+            return ErrorState;
+        }
+        Loaded = (SD_Cow_Valid(pHeader) == true) &&
+                 ((SD_Cow_Crc32(0xFFFFFFFF, (uint8_t*)SD_CowTable.Entry, pHeader->Count * sizeof(SD_CowEntry_t)) ^ 0xFFFFFFFF) == pHeader->EntryCrc);
+    }
+
+    if (Loaded == true) {
+        SD_Cow.Gen    = pHeader->Gen;
+        SD_Cow.Active = (pHeader->Active != 0);
+    } else {
+        memset(pHeader, 0, sizeof(*pHeader));
+    }
+    memset(SD_Cow.Free, 0xFF, sizeof(SD_Cow.Free));
+    SD_Cow.FreeCount = SD_COW_POOL_BLOCKS;
+    for (uint32_t Index = 0; Index < pHeader->Count; Index++) {
+        SD_Cow.Free[SD_CowTable.Entry[Index].Slot / 32] &= ~(1UL << (SD_CowTable.Entry[Index].Slot % 32));
+        SD_Cow.FreeCount--;
+        if (SD_CowTable.Entry[Index].Old != SD_COW_HOME) {
+            SD_Cow.Free[SD_CowTable.Entry[Index].Old / 32] &= ~(1UL << (SD_CowTable.Entry[Index].Old % 32));
+            SD_Cow.FreeCount--;
+        }
+    }
+    if ((Loaded == false) && ((ErrorState = SD_Cow_Commit()) != SD_OK)) {
+        SD_Cow.pLower = NULL;
+        return ErrorState;
+    }
+
+    SD_CowDevice.pOps        = &SD_CowOps;
+    SD_CowDevice.pLower      = pLower;
+    SD_CowDevice.pName       = "cow";
+    SD_CowDevice.pPrivate    = &SD_Cow;
+    SD_CowDevice.Blocks      = Virtual;
+    SD_CowDevice.Offset      = 0;
+    SD_CowDevice.EraseBlocks = pLower->EraseBlocks;
+    SD_CowDevice.Caps        = SD_BLOCKDEV_CAP_VOLATILE |
+                               (pLower->Caps & (SD_BLOCKDEV_CAP_ANY_BUFFER | SD_BLOCKDEV_CAP_PERSISTENT | SD_BLOCKDEV_CAP_READ_ONLY));
+    SD_CowSnapshotDevice             = SD_CowDevice;
+    SD_CowSnapshotDevice.pOps        = &SD_CowSnapshotOps;
+    SD_CowSnapshotDevice.pName       = "snapshot";
+    SD_CowSnapshotDevice.Caps        = SD_BLOCKDEV_CAP_READ_ONLY | (pLower->Caps & (SD_BLOCKDEV_CAP_ANY_BUFFER | SD_BLOCKDEV_CAP_PERSISTENT));
+    *ppDev = &SD_CowDevice;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static bool SD_Cow_Valid(const SD_CowHeader_t *pHeader)
+{
+    return (pHeader->Magic == SD_COW_MAGIC) && (pHeader->Version == SD_COW_VERSION) &&
+           (pHeader->PoolBlocks == SD_COW_POOL_BLOCKS) && (pHeader->Virtual == SD_Cow.Virtual) &&
+           (pHeader->Count <= SD_COW_POOL_BLOCKS) &&
+           ((SD_Cow_Crc32(0xFFFFFFFF, (const uint8_t*)pHeader, offsetof(SD_CowHeader_t, Crc)) ^ 0xFFFFFFFF) == pHeader->Crc);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Writes the table to the older copy once the data it refers to is durable, then pool blocks
+  *         freed since the last commit can be reused.
+  */
+static SD_Error_t SD_Cow_Commit(void)
+{
+    SD_CowHeader_t *pHeader = &SD_CowTable.Header;
+    SD_Error_t      ErrorState;
+    uint32_t        Copy = SD_Cow.Current ^ 1;
+
+    if ((ErrorState = SD_BlockDev_Flush(SD_Cow.pLower)) != SD_OK) {
+        return ErrorState;
+    }
+    memset(SD_CowTable.Reserved, 0, sizeof(SD_CowTable.Reserved));
+    pHeader->Magic      = SD_COW_MAGIC;
+    pHeader->Version    = SD_COW_VERSION;
+    pHeader->Sequence   = SD_Cow.Sequence + 1;
+    pHeader->PoolBlocks = SD_COW_POOL_BLOCKS;
+    pHeader->Virtual    = SD_Cow.Virtual;
+    pHeader->Gen        = SD_Cow.Gen;
+    pHeader->Active     = (SD_Cow.Active == true) ? 1 : 0;
+    pHeader->EntryCrc   = SD_Cow_Crc32(0xFFFFFFFF, (uint8_t*)SD_CowTable.Entry, pHeader->Count * sizeof(SD_CowEntry_t)) ^ 0xFFFFFFFF;
+    pHeader->Crc        = SD_Cow_Crc32(0xFFFFFFFF, (uint8_t*)pHeader, offsetof(SD_CowHeader_t, Crc)) ^ 0xFFFFFFFF;
+    if ((ErrorState = SD_Cow_Transfer(true, SD_Cow.Copy[Copy], (uint8_t*)&SD_CowTable, 1 + SD_COW_ENTRY_BLOCKS(pHeader->Count), SD_BLOCKDEV_FUA)) != SD_OK) {
+        return ErrorState;
+    }
+
+    SD_Cow.Current  = Copy;
+    SD_Cow.Sequence = pHeader->Sequence;
+    SD_Cow.Dirty    = false;
+    for (uint32_t Word = 0; Word < SD_COW_FREE_WORDS; Word++) {
+        SD_Cow.Free[Word]   |= SD_Cow.Pending[Word];
+        SD_Cow.Pending[Word] = 0;
+    }
+    SD_Cow.FreeCount   += SD_Cow.PendingCount;
+    SD_Cow.PendingCount = 0;
+    SD_CowStats.TableWrites++;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Copies the last run of pooled blocks home, up to SD_COW_FOLD_BLOCKS. The pool blocks are only
+  *         reused after the next table write, until then the table on the card still finds them.
+  */
+static SD_Error_t SD_Cow_Fold(void)
+{
+    SD_CowEntry_t *pEntry = &SD_CowTable.Entry[SD_CowTable.Header.Count - 1];
+    SD_Error_t     ErrorState;
+    uint32_t       Run = 1;
+
+    while ((Run < SD_COW_FOLD_BLOCKS) && (Run < SD_CowTable.Header.Count) &&
+           ((pEntry - 1)->Virtual == (pEntry->Virtual - 1)) && ((pEntry - 1)->Slot == (pEntry->Slot - 1))) {
+        pEntry--;
+        Run++;
+    }
+    if ((ErrorState = SD_Cow_Transfer(false, SD_Cow.Virtual + pEntry->Slot, SD_CowStage, Run, 0)) != SD_OK) {
+        return ErrorState;
+    }
+    if ((ErrorState = SD_Cow_Transfer(true, pEntry->Virtual, SD_CowStage, Run, 0)) != SD_OK) {
+        return ErrorState;
+    }
+    for (uint32_t Index = 0; Index < Run; Index++) {
+        SD_Cow_Release(pEntry[Index].Slot);
+    }
+    SD_CowTable.Header.Count -= Run;
+    SD_CowStats.Folded       += Run;
+    SD_Cow_Changed();
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @retval Index of the entry of Virtual, or where it would be inserted
+  */
+static uint32_t SD_Cow_Find(uint32_t Virtual)
+{
+    uint32_t Low = 0, High = SD_CowTable.Header.Count;
+
+    while (Low < High) {
+        uint32_t Middle = (Low + High) / 2;
+
+        if (SD_CowTable.Entry[Middle].Virtual < Virtual) {
+            Low = Middle + 1;
+        } else {
+            High = Middle;
+        }
+    }
+    return Low;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint64_t SD_Cow_Map(uint32_t Virtual, bool Snapshot)
+{
+    uint32_t       Index = SD_Cow_Find(Virtual);
+    SD_CowEntry_t *pEntry = &SD_CowTable.Entry[Index];
+    uint32_t       Slot;
+
+    if ((Index >= SD_CowTable.Header.Count) || (pEntry->Virtual != Virtual)) {
+        return Virtual;
+    }
+    Slot = ((Snapshot == true) && (pEntry->Gen == SD_Cow.Gen)) ? pEntry->Old : pEntry->Slot;
+    return (Slot == SD_COW_HOME) ? Virtual : (SD_Cow.Virtual + Slot);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Where a write of Virtual goes, updating the table for it.
+  * @retval SD Card error state, SD_ADDR_OUT_OF_RANGE when a fresh pool block is needed and none is free
+  */
+static SD_Error_t SD_Cow_Redirect(uint32_t Virtual, uint64_t *pPhysical)
+{
+    uint32_t       Index = SD_Cow_Find(Virtual);
+    SD_CowEntry_t *pEntry = &SD_CowTable.Entry[Index];
+    bool           Found = (Index < SD_CowTable.Header.Count) && (pEntry->Virtual == Virtual);
+    uint32_t       Slot;
+
+    if (SD_Cow.Active == false) {
+        if (Found == true) {
+            // Nothing else refers to the home block, go back there and return the pool block
+            SD_Cow_Release(pEntry->Slot);
+            memmove(pEntry, pEntry + 1, (SD_CowTable.Header.Count - Index - 1) * sizeof(SD_CowEntry_t));
+            SD_CowTable.Header.Count--;
+            SD_CowStats.Returned++;
+            SD_Cow_Changed();
+        }
+        *pPhysical = Virtual;
+        return SD_OK;
+    }
+
+    if ((Found == true) && (pEntry->Gen == SD_Cow.Gen)) {
+        SD_CowStats.Rewritten++;
+        *pPhysical = SD_Cow.Virtual + pEntry->Slot;
+        return SD_OK;
+    }
+    if (SD_Cow_Alloc(&Slot) == false) {
+        return SD_ADDR_OUT_OF_RANGE;
+    }
+    if (Found == false) {
+        memmove(pEntry + 1, pEntry, (SD_CowTable.Header.Count - Index) * sizeof(SD_CowEntry_t));
+        SD_CowTable.Header.Count++;
+        pEntry->Virtual = Virtual;
+        pEntry->Old     = SD_COW_HOME;
+    } else {
+        pEntry->Old     = pEntry->Slot;
+    }
+    pEntry->Slot = Slot;
+    pEntry->Gen  = SD_Cow.Gen;
+    SD_CowStats.Redirected++;
+    SD_Cow_Changed();
+    *pPhysical = SD_Cow.Virtual + Slot;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Next free pool block from the rotor on. Both a block and its snapshot copy take a pool block,
+  *         so the table never outgrows the pool.
+  */
+static bool SD_Cow_Alloc(uint32_t *pSlot)
+{
+    uint32_t Word = SD_Cow.Next / 32;
+    uint32_t Bits = SD_Cow.Free[Word] & (0xFFFFFFFF << (SD_Cow.Next % 32));
+
+    if (SD_Cow.FreeCount == 0) {
+        return false;
+    }
+    for (uint32_t Step = 0; Bits == 0; Step++) {
+        Word = (Word + 1) % SD_COW_FREE_WORDS;
+        Bits = SD_Cow.Free[Word];
+        if (Step > SD_COW_FREE_WORDS) {
+            return false;
+        }
+    }
+    *pSlot = Word * 32 + __CLZ(__RBIT(Bits));
+    SD_Cow.Free[Word] &= ~(1UL << (*pSlot % 32));
+    SD_Cow.FreeCount--;
+    SD_Cow.Next = (*pSlot + 1) % SD_COW_POOL_BLOCKS;
+    return true;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Cow_Release(uint32_t Slot)
+{
+    SD_Cow.Pending[Slot / 32] |= 1UL << (Slot % 32);
+    SD_Cow.PendingCount++;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Cow_Changed(void)
+{
+    if (SD_Cow.Dirty == false) {
+        SD_Cow.Dirty      = true;
+        SD_Cow.DirtySince = HAL_GetTick();
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Cow_Transfer(bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags)
+{
+    volatile SD_Error_t Status = SD_BUSY;
+    SD_Error_t          ErrorState;
+
+    if (Write == true) {
+        ErrorState = SD_BlockDev_Write(SD_Cow.pLower, Lba, pBuffer, NumberOfBlocks, Flags, SD_Cow_TransferDone, (void*)&Status);
+    } else {
+        ErrorState = SD_BlockDev_Read(SD_Cow.pLower, Lba, pBuffer, NumberOfBlocks, SD_Cow_TransferDone, (void*)&Status);
+    }
+    if (ErrorState != SD_OK) {
+        return ErrorState;
+    }
+    while (Status == SD_BUSY) {
+        SD_BlockDev_Process(SD_Cow.pLower);
+    }
+    return Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Cow_TransferDone(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context)
+{
+    (void)pDev;
+    *(volatile SD_Error_t*)Context = Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint32_t SD_Cow_Crc32(uint32_t Crc, const uint8_t *pData, uint32_t Length)
+{
+    while (Length--) {
+        Crc ^= *pData++;
+        for (uint32_t Bit = 0; Bit < 8; Bit++) {
+            Crc = (Crc >> 1) ^ (0xEDB88320 & (0 - (Crc & 1)));
+        }
+    }
+    return Crc;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#else
+
+SD_Error_t SD_Cow_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    (void)pLower;
+    (void)ppDev;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Cow_Format(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    (void)pLower;
+    (void)ppDev;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Cow_Snapshot(void)
+{
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Cow_Rollback(void)
+{
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Cow_Discard(void)
+{
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_BlockDev_t *SD_Cow_GetSnapshot(void)
+{
+    return NULL;
+}
+
+void SD_Cow_GetStats(SD_CowStats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
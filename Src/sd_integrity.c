@@ -0,0 +1,791 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_integrity.h"
+
+#ifdef SDMMC_INTEGRITY
+
+/*
+ * Every data block has a 32 bit tag, its CRC-32 xor its Lba, so a block written to or read from the
+ * wrong address fails as well as a corrupted one. Data blocks keep their Lba on the lower device, the
+ * tag area sits behind them at the end: a header, then tag blocks of SD_INTEGRITY_TAGS_PER_BLOCK tags
+ * with the format epoch and a CRC of their own. A tag block from another epoch, which is whatever the
+ * card held before, reads as all untagged, so formatting only writes the header with a new epoch.
+ *
+ * The CRC unit computes the standard CRC-32 a word per AHB cycle. With SD_INTEGRITY_MDMA a piece is
+ * checksummed by one MDMA linked list, three nodes per block: reset the unit, feed it the block, copy
+ * the result to SD_IntegrityCrc. Writes checksum a piece while the card receives it, reads checksum
+ * one piece while the next one transfers, so the checksum is hidden behind the card.
+ *
+ * Tags of a write are cached and written back on Flush, on SD_INTEGRITY_WRITEBACK_MS or with a FUA
+ * write. A block written since then may fail verification after a power loss, its data and tag being
+ * from different writes.
+ */
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_INTEGRITY_WORDS              (SD_BLOCKDEV_BLOCK_SIZE / sizeof(uint32_t))
+#define SD_INTEGRITY_MAGIC              0x54494453   // "SDIT"
+#define SD_INTEGRITY_VERSION            1
+#define SD_INTEGRITY_NONE               0xFFFFFFFF
+#define SD_INTEGRITY_UNTAGGED           0
+#define SD_INTEGRITY_AXI_START          0x24000000
+#define SD_INTEGRITY_AXI_END            0x24080000
+
+// 32 bit polynomial, input reversed by word and output reversed, with the default 0x04C11DB7 and
+// 0xFFFFFFFF initial value that is the reflected CRC-32 of the bytes in memory order, less the final xor
+#define SD_INTEGRITY_CRC_CR             (CRC_CR_REV_IN | CRC_CR_REV_OUT)
+
+#define SD_INTEGRITY_MDMA_WORDS         (MDMA_SRC_DATASIZE_WORD | MDMA_DEST_DATASIZE_WORD | MDMA_FULL_TRANSFER | MDMA_CTCR_SWRM)
+// MDMA reaches the TCMs through the AHBS port of the core, everything else through AXI
+#define SD_INTEGRITY_MDMA_TCM(a)        ((((uint32_t)(a) & 0xFF000000) == 0x20000000) || (((uint32_t)(a) & 0xFF000000) == 0x00000000))
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t Epoch;
+    uint32_t TagsPerBlock;
+    uint64_t DataBlocks;
+} SD_IntegrityHeader_t;
+
+typedef struct
+{
+    uint32_t Tag[SD_INTEGRITY_TAGS_PER_BLOCK];
+    uint32_t Epoch;
+    uint32_t Crc;                       // Of the words before it
+} SD_IntegrityTags_t;
+
+typedef struct
+{
+    uint32_t Block;                     // Tag block held, SD_INTEGRITY_NONE when empty
+    uint32_t LastUse;
+    bool     Dirty;
+} SD_IntegrityEntry_t;
+
+typedef struct
+{
+    uint8_t            *pData;
+    uint32_t            Block;          // First block of the piece inside the request
+    uint32_t            Count;          // 0 when the slot is free
+    volatile SD_Error_t Status;
+} SD_IntegrityPiece_t;
+
+typedef struct
+{
+    SD_BlockDev_t      *pLower;
+    uint64_t            Start;          // Header block, tag blocks follow, blocks below it are data
+    uint32_t            TagBlocks;
+    uint32_t            Epoch;
+    uint32_t            Clock;          // LRU of the tag cache
+    bool                Dirty;
+    uint32_t            DirtySince;
+    const uint8_t      *pPending;       // Piece MDMA is checksumming, redone by the CPU on a transfer error
+    uint32_t            PendingCount;
+    uint32_t           *pPendingCrc;
+} SD_Integrity_t;
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_Integrity_t              SD_Integrity;
+static SD_IntegrityStats_t         SD_IntegrityStats;
+static SD_BlockDev_t               SD_IntegrityDevice;
+static SD_IntegrityEntry_t         SD_IntegrityEntry[SD_INTEGRITY_CACHE];
+// Raw CRC unit results, written by MDMA through AHBS, DTCM needs no cache maintenance
+static uint32_t                    SD_IntegrityCrc[2][SD_INTEGRITY_STAGE_BLOCKS];
+static SD_IntegrityTags_t          SD_IntegrityCache[SD_INTEGRITY_CACHE] __attribute__((section(".ram_d1"), aligned(32)));
+static uint32_t                    SD_IntegrityStage[2][SD_INTEGRITY_STAGE_BLOCKS * SD_INTEGRITY_WORDS] __attribute__((section(".ram_d1"), aligned(32)));
+#if SD_INTEGRITY_MDMA
+static MDMA_LinkNodeTypeDef        SD_IntegrityNode[3 * SD_INTEGRITY_STAGE_BLOCKS] __attribute__((section(".ram_d1"), aligned(32)));
+static const uint32_t              SD_IntegrityReset = SD_INTEGRITY_CRC_CR | CRC_CR_RESET;
+#endif
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_Integrity_Read           (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Integrity_Write          (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Integrity_Flush          (SD_BlockDev_t *pDev);
+static void             SD_Integrity_Process        (SD_BlockDev_t *pDev);
+static SD_Error_t       SD_Integrity_Setup          (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev, bool Format);
+static SD_Error_t       SD_Integrity_Transfer       (bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags);
+static void             SD_Integrity_TransferDone   (SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+static SD_Error_t       SD_Integrity_Lookup         (uint64_t Lba, SD_IntegrityEntry_t **ppEntry);
+static SD_Error_t       SD_Integrity_WriteBack      (SD_IntegrityEntry_t *pEntry, uint32_t Flags);
+static SD_Error_t       SD_Integrity_Sync           (uint32_t Flags);
+static SD_Error_t       SD_Integrity_Verify         (uint64_t Lba, uint32_t Count, const uint32_t *pCrc);
+static void             SD_Integrity_CrcStart       (const uint8_t *pData, uint32_t Count, uint32_t *pCrc);
+static void             SD_Integrity_CrcWait        (void);
+static uint32_t         SD_Integrity_CrcCpu         (const uint8_t *pData, uint32_t Words);
+static uint32_t         SD_Integrity_Tag            (uint32_t Raw, uint64_t Lba);
+
+static const SD_BlockDevOps_t      SD_IntegrityOps =
+{
+    .Read       = SD_Integrity_Read,
+    .Write      = SD_Integrity_Write,
+    .Flush      = SD_Integrity_Flush,
+    .Process    = SD_Integrity_Process,
+};
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Places the tag area at the end of pLower and stacks the checking layer on the blocks before it.
+  * @param  pLower: Device to protect, the card or a partition
+  * @param  ppDev: Receives the checked device
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Integrity_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    return SD_Integrity_Setup(pLower, ppDev, false);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Integrity_Format(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    return SD_Integrity_Setup(pLower, ppDev, true);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+uint32_t SD_Integrity_Crc32(const uint8_t *pBlock)
+{
+    __HAL_RCC_CRC_CLK_ENABLE();
+    CRC->INIT = 0xFFFFFFFF;
+    CRC->POL  = 0x04C11DB7;
+    return SD_Integrity_CrcCpu(pBlock, SD_INTEGRITY_WORDS) ^ 0xFFFFFFFF;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Checksum cost without the card, compare it with the card transfer time of the same data.
+  * @param  pBuffer: Blocks blocks of scratch, word aligned, at most SD_INTEGRITY_STAGE_BLOCKS for MDMA
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Integrity_Benchmark(const uint8_t *pBuffer, uint32_t Blocks, SD_IntegrityBench_t *pResult)
+{
+    uint32_t Bytes = Blocks * SD_BLOCKDEV_BLOCK_SIZE;
+    uint32_t Start, Cycles, Crc = 0xFFFFFFFF;
+
+    if ((pBuffer == NULL) || (((uint32_t)pBuffer & 3) != 0) || (Blocks == 0) || (Blocks > SD_INTEGRITY_STAGE_BLOCKS) || (pResult == NULL)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (SD_Integrity.pLower == NULL) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    SD_Integrity_CrcWait();
+
+    Start = DWT->CYCCNT;
+    for (uint32_t Index = 0; Index < Bytes; Index++) {
+        Crc ^= pBuffer[Index];
+        for (uint32_t Bit = 0; Bit < 8; Bit++) {
+            Crc = (Crc >> 1) ^ (0xEDB88320 & (0 - (Crc & 1)));
+        }
+    }
+    Cycles = DWT->CYCCNT - Start;
+    pResult->SoftwareCyclesPerByte = (uint32_t)(((uint64_t)Cycles * 100) / Bytes);
+    SD_IntegrityCrc[1][0] = Crc;        // Keeps the loop
+
+    Start = DWT->CYCCNT;
+    for (uint32_t Block = 0; Block < Blocks; Block++) {
+        SD_IntegrityCrc[0][Block] = SD_Integrity_CrcCpu(&pBuffer[Block * SD_BLOCKDEV_BLOCK_SIZE], SD_INTEGRITY_WORDS);
+    }
+    Cycles = DWT->CYCCNT - Start;
+    pResult->CpuCyclesPerByte = (uint32_t)(((uint64_t)Cycles * 100) / Bytes);
+
+#if SD_INTEGRITY_MDMA
+    Start = DWT->CYCCNT;
+    SD_Integrity_CrcStart(pBuffer, Blocks, SD_IntegrityCrc[1]);
+    SD_Integrity_CrcWait();
+    Cycles = DWT->CYCCNT - Start;
+    pResult->MdmaCyclesPerByte = (uint32_t)(((uint64_t)Cycles * 100) / Bytes);
+    if (memcmp(SD_IntegrityCrc[0], SD_IntegrityCrc[1], Blocks * sizeof(uint32_t)) != 0) {
+        return SD_ERROR;
+    }
+#else
+    pResult->MdmaCyclesPerByte = 0;
+#endif
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Integrity_GetStats(SD_IntegrityStats_t *pStats)
+{
+    *pStats = SD_IntegrityStats;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Keeps two reads of up to SD_INTEGRITY_STAGE_BLOCKS in flight and verifies each piece while the
+  *         next one transfers. Every piece is read, a mismatch fails the request with SD_CARD_ECC_FAILED,
+  *         which is what an uncorrectable block looks like to the layers above, sd_rs in particular.
+  */
+static SD_Error_t SD_Integrity_Read(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                                    SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_IntegrityPiece_t Piece[2] = { 0 };
+    SD_IntegrityPiece_t *pPiece;
+    SD_Error_t          ErrorState = SD_OK, Result = SD_OK;
+    uint32_t            Next = 0, Done = 0, Head = 0;
+    bool                InPlace;
+
+    InPlace = ((pDev->pLower->Caps & SD_BLOCKDEV_CAP_ANY_BUFFER) != 0) ||
+              ((((uint32_t)pBuffer & 31) == 0) && ((uint32_t)pBuffer >= SD_INTEGRITY_AXI_START) && ((uint32_t)pBuffer < SD_INTEGRITY_AXI_END));
+
+    while ((Done < Next) || ((Next < NumberOfBlocks) && (ErrorState == SD_OK))) {
+        for (uint32_t Index = 0; (Index < 2) && (Next < NumberOfBlocks) && (ErrorState == SD_OK); Index++) {
+            uint32_t Slot = (Head + Index) & 1;
+
+            pPiece = &Piece[Slot];
+            if (pPiece->Count != 0) {
+                continue;
+            }
+            pPiece->Count  = ((NumberOfBlocks - Next) > SD_INTEGRITY_STAGE_BLOCKS) ? SD_INTEGRITY_STAGE_BLOCKS : (NumberOfBlocks - Next);
+            pPiece->Block  = Next;
+            pPiece->pData  = (InPlace == true) ? &pBuffer[Next * SD_BLOCKDEV_BLOCK_SIZE] : (uint8_t*)SD_IntegrityStage[Slot];
+            pPiece->Status = SD_BUSY;
+            if ((ErrorState = SD_BlockDev_Read(pDev->pLower, Lba + Next, pPiece->pData, pPiece->Count, SD_Integrity_TransferDone, (void*)&pPiece->Status)) != SD_OK) {
+                pPiece->Count = 0;
+                break;
+            }
+            Next += pPiece->Count;
+        }
+
+        pPiece = &Piece[Head];
+        if (pPiece->Count == 0) {
+            break;
+        }
+        while (pPiece->Status == SD_BUSY) {
+            SD_BlockDev_Process(pDev->pLower);
+        }
+        if ((ErrorState == SD_OK) && ((ErrorState = pPiece->Status) == SD_OK)) {
+            SD_Integrity_CrcStart(pPiece->pData, pPiece->Count, SD_IntegrityCrc[Head]);
+            SD_Integrity_CrcWait();
+            if ((ErrorState = SD_Integrity_Verify(Lba + pPiece->Block, pPiece->Count, SD_IntegrityCrc[Head])) == SD_CARD_ECC_FAILED) {
+                // Reported once the whole request is read, the other blocks are still delivered
+                Result     = ErrorState;
+                ErrorState = SD_OK;
+            }
+            if ((ErrorState == SD_OK) && (InPlace == false)) {
+                memcpy(&pBuffer[pPiece->Block * SD_BLOCKDEV_BLOCK_SIZE], pPiece->pData, pPiece->Count * SD_BLOCKDEV_BLOCK_SIZE);
+            }
+        }
+        Done         += pPiece->Count;
+        pPiece->Count = 0;
+        Head         ^= 1;
+    }
+
+    if (ErrorState == SD_OK) {
+        ErrorState = Result;
+    }
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Checksums each piece while the lower device writes it, from the caller's buffer when it is DMA
+  *         reachable. A FUA write also writes the tags back with FUA before it completes.
+  */
+static SD_Error_t SD_Integrity_Write(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                                     SD_BlockDevCallback_t Callback, void *Context)
+{
+    volatile SD_Error_t Status;
+    SD_Error_t          ErrorState = SD_OK;
+    SD_IntegrityEntry_t *pEntry;
+    const uint8_t      *pData;
+    uint32_t            Next = 0, Count;
+    bool                Direct;
+
+    Direct = ((pDev->pLower->Caps & SD_BLOCKDEV_CAP_ANY_BUFFER) != 0) ||
+             ((((uint32_t)pBuffer & 31) == 0) && ((uint32_t)pBuffer >= SD_INTEGRITY_AXI_START) && ((uint32_t)pBuffer < SD_INTEGRITY_AXI_END));
+
+    while ((Next < NumberOfBlocks) && (ErrorState == SD_OK)) {
+        Count = ((NumberOfBlocks - Next) > SD_INTEGRITY_STAGE_BLOCKS) ? SD_INTEGRITY_STAGE_BLOCKS : (NumberOfBlocks - Next);
+        pData = &pBuffer[Next * SD_BLOCKDEV_BLOCK_SIZE];
+        if (Direct == false) {
+            memcpy(SD_IntegrityStage[0], pData, Count * SD_BLOCKDEV_BLOCK_SIZE);
+            pData = (const uint8_t*)SD_IntegrityStage[0];
+        }
+
+        SD_Integrity_CrcStart(pData, Count, SD_IntegrityCrc[0]);
+        Status = SD_BUSY;
+        if ((ErrorState = SD_BlockDev_Write(pDev->pLower, Lba + Next, pData, Count, Flags, SD_Integrity_TransferDone, (void*)&Status)) == SD_OK) {
+            while (Status == SD_BUSY) {
+                SD_BlockDev_Process(pDev->pLower);
+            }
+            ErrorState = Status;
+        }
+        SD_Integrity_CrcWait();
+
+        for (uint32_t Block = 0; (Block < Count) && (ErrorState == SD_OK); Block++) {
+            uint64_t Address = Lba + Next + Block;
+
+            if ((ErrorState = SD_Integrity_Lookup(Address, &pEntry)) == SD_OK) {
+                SD_IntegrityCache[pEntry - SD_IntegrityEntry].Tag[Address % SD_INTEGRITY_TAGS_PER_BLOCK] =
+                    SD_Integrity_Tag(SD_IntegrityCrc[0][Block], Address);
+                if (SD_Integrity.Dirty == false) {
+                    SD_Integrity.Dirty      = true;
+                    SD_Integrity.DirtySince = HAL_GetTick();
+                }
+                pEntry->Dirty = true;
+                SD_IntegrityStats.TaggedBlocks++;
+            }
+        }
+        Next += Count;
+    }
+
+    if ((ErrorState == SD_OK) && ((Flags & SD_BLOCKDEV_FUA) != 0)) {
+        ErrorState = SD_Integrity_Sync(SD_BLOCKDEV_FUA);
+    }
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Integrity_Flush(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+    return SD_Integrity_Sync(0);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Integrity_Process(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+    if ((SD_Integrity.Dirty == true) && ((HAL_GetTick() - SD_Integrity.DirtySince) >= SD_INTEGRITY_WRITEBACK_MS)) {
+        SD_Integrity_Sync(0);
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Tag area of 1 + TagBlocks blocks, starting on an allocation unit boundary so the data blocks
+  *         end on one. TagBlocks covers the data blocks below it by construction: with at most
+  *         (Blocks + 126) / 127 blocks of tag area there are fewer than 126 data blocks per tag block.
+  */
+static SD_Error_t SD_Integrity_Setup(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev, bool Format)
+{
+    SD_IntegrityHeader_t *pHeader = (SD_IntegrityHeader_t*)SD_IntegrityStage[0];
+    SD_Error_t            ErrorState;
+    uint64_t              Start;
+
+    if ((pLower == NULL) || (ppDev == NULL) || (pLower->Blocks < 2 * (SD_INTEGRITY_TAGS_PER_BLOCK + 1))) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    __HAL_RCC_CRC_CLK_ENABLE();
+#if SD_INTEGRITY_MDMA
+    __HAL_RCC_MDMA_CLK_ENABLE();
+#endif
+    CRC->INIT = 0xFFFFFFFF;
+    CRC->POL  = 0x04C11DB7;
+    CRC->CR   = SD_INTEGRITY_CRC_CR | CRC_CR_RESET;
+
+    Start = pLower->Blocks - ((pLower->Blocks + SD_INTEGRITY_TAGS_PER_BLOCK) / (SD_INTEGRITY_TAGS_PER_BLOCK + 1)) - 1;
+    if (pLower->EraseBlocks > 1) {
+        Start -= Start % pLower->EraseBlocks;
+    }
+    if (Start == 0) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    memset(&SD_Integrity, 0, sizeof(SD_Integrity));
+    memset(&SD_IntegrityStats, 0, sizeof(SD_IntegrityStats));
+    for (uint32_t Index = 0; Index < SD_INTEGRITY_CACHE; Index++) {
+        SD_IntegrityEntry[Index].Block = SD_INTEGRITY_NONE;
+        SD_IntegrityEntry[Index].Dirty = false;
+    }
+    SD_Integrity.pLower    = pLower;
+    SD_Integrity.Start     = Start;
+    SD_Integrity.TagBlocks = (uint32_t)((Start + SD_INTEGRITY_TAGS_PER_BLOCK - 1) / SD_INTEGRITY_TAGS_PER_BLOCK);
+
+    if ((ErrorState = SD_Integrity_Transfer(false, Start, (uint8_t*)pHeader, 1, 0)) != SD_OK) {
+        return ErrorState;
+    }
+    if ((Format == false) && (pHeader->Magic == SD_INTEGRITY_MAGIC) && (pHeader->Version == SD_INTEGRITY_VERSION) &&
+        (pHeader->TagsPerBlock == SD_INTEGRITY_TAGS_PER_BLOCK) && (pHeader->DataBlocks == Start)) {
+        SD_Integrity.Epoch = pHeader->Epoch;
+    } else {
+        // Any value unlike the last one will do, the tick and cycle counter make a match with tag blocks
+        // of a format before that unlikely
+        SD_Integrity.Epoch = (HAL_GetTick() << 16) ^ DWT->CYCCNT;
+        if ((pHeader->Magic == SD_INTEGRITY_MAGIC) && (SD_Integrity.Epoch == pHeader->Epoch)) {
+            SD_Integrity.Epoch++;
+        }
+        memset(pHeader, 0, SD_BLOCKDEV_BLOCK_SIZE);
+        pHeader->Magic        = SD_INTEGRITY_MAGIC;
+        pHeader->Version      = SD_INTEGRITY_VERSION;
+        pHeader->Epoch        = SD_Integrity.Epoch;
+        pHeader->TagsPerBlock = SD_INTEGRITY_TAGS_PER_BLOCK;
+        pHeader->DataBlocks   = Start;
+        if ((ErrorState = SD_Integrity_Transfer(true, Start, (uint8_t*)pHeader, 1, SD_BLOCKDEV_FUA)) != SD_OK) {
+            return ErrorState;
+        }
+    }
+
+    SD_IntegrityDevice.pOps        = &SD_IntegrityOps;
+    SD_IntegrityDevice.pLower      = pLower;
+    SD_IntegrityDevice.pName       = "integrity";
+    SD_IntegrityDevice.pPrivate    = &SD_Integrity;
+    SD_IntegrityDevice.Blocks      = Start;
+    SD_IntegrityDevice.Offset      = 0;
+    SD_IntegrityDevice.EraseBlocks = pLower->EraseBlocks;
+    SD_IntegrityDevice.Caps        = SD_BLOCKDEV_CAP_ANY_BUFFER | SD_BLOCKDEV_CAP_VOLATILE |
+                                     (pLower->Caps & (SD_BLOCKDEV_CAP_PERSISTENT | SD_BLOCKDEV_CAP_READ_ONLY));
+    *ppDev = &SD_IntegrityDevice;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Integrity_Transfer(bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags)
+{
+    volatile SD_Error_t Status = SD_BUSY;
+    SD_Error_t          ErrorState;
+
+    if (Write == true) {
+        ErrorState = SD_BlockDev_Write(SD_Integrity.pLower, Lba, pBuffer, NumberOfBlocks, Flags, SD_Integrity_TransferDone, (void*)&Status);
+    } else {
+        ErrorState = SD_BlockDev_Read(SD_Integrity.pLower, Lba, pBuffer, NumberOfBlocks, SD_Integrity_TransferDone, (void*)&Status);
+    }
+    if (ErrorState != SD_OK) {
+        return ErrorState;
+    }
+    while (Status == SD_BUSY) {
+        SD_BlockDev_Process(SD_Integrity.pLower);
+    }
+    return Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Integrity_TransferDone(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context)
+{
+    (void)pDev;
+    *(volatile SD_Error_t*)Context = Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Finds the cache entry holding the tag of Lba, loading its tag block in place of the least
+  *         recently used one. A tag block of another epoch, or failing its CRC, loads as all untagged.
+  */
+static SD_Error_t SD_Integrity_Lookup(uint64_t Lba, SD_IntegrityEntry_t **ppEntry)
+{
+    uint32_t             Block = (uint32_t)(Lba / SD_INTEGRITY_TAGS_PER_BLOCK);
+    SD_IntegrityEntry_t *pEntry = &SD_IntegrityEntry[0];
+    SD_IntegrityTags_t  *pTags;
+    SD_Error_t           ErrorState;
+
+    for (uint32_t Index = 0; Index < SD_INTEGRITY_CACHE; Index++) {
+        if (SD_IntegrityEntry[Index].Block == Block) {
+            pEntry = &SD_IntegrityEntry[Index];
+            pEntry->LastUse = ++SD_Integrity.Clock;
+            *ppEntry = pEntry;
+            return SD_OK;
+        }
+        if ((SD_IntegrityEntry[Index].Block == SD_INTEGRITY_NONE) ||
+            ((pEntry->Block != SD_INTEGRITY_NONE) && (SD_IntegrityEntry[Index].LastUse < pEntry->LastUse))) {
+            pEntry = &SD_IntegrityEntry[Index];
+        }
+    }
+
+    if ((pEntry->Dirty == true) && ((ErrorState = SD_Integrity_WriteBack(pEntry, 0)) != SD_OK)) {
+        return ErrorState;
+    }
+    pTags        = &SD_IntegrityCache[pEntry - SD_IntegrityEntry];
+    pEntry->Block = SD_INTEGRITY_NONE;
+    if ((ErrorState = SD_Integrity_Transfer(false, SD_Integrity.Start + 1 + Block, (uint8_t*)pTags, 1, 0)) != SD_OK) {
+        return ErrorState;
+    }
+    SD_IntegrityStats.TagReads++;
+    if ((pTags->Epoch != SD_Integrity.Epoch) ||
+        ((SD_Integrity_CrcCpu((uint8_t*)pTags, SD_INTEGRITY_WORDS - 1) ^ 0xFFFFFFFF) != pTags->Crc)) {
+        if (pTags->Epoch == SD_Integrity.Epoch) {
+            SD_IntegrityStats.TagErrors++;
+        }
+        memset(pTags, 0, sizeof(*pTags));
+    }
+    pEntry->Block   = Block;
+    pEntry->LastUse = ++SD_Integrity.Clock;
+    *ppEntry = pEntry;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Integrity_WriteBack(SD_IntegrityEntry_t *pEntry, uint32_t Flags)
+{
+    SD_IntegrityTags_t *pTags = &SD_IntegrityCache[pEntry - SD_IntegrityEntry];
+    SD_Error_t          ErrorState;
+
+    pTags->Epoch = SD_Integrity.Epoch;
+    pTags->Crc   = SD_Integrity_CrcCpu((uint8_t*)pTags, SD_INTEGRITY_WORDS - 1) ^ 0xFFFFFFFF;
+    if ((ErrorState = SD_Integrity_Transfer(true, SD_Integrity.Start + 1 + pEntry->Block, (uint8_t*)pTags, 1, Flags)) == SD_OK) {
+        pEntry->Dirty = false;
+        SD_IntegrityStats.TagWrites++;
+    }
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Integrity_Sync(uint32_t Flags)
+{
+    SD_Error_t ErrorState = SD_OK;
+
+    for (uint32_t Index = 0; (Index < SD_INTEGRITY_CACHE) && (ErrorState == SD_OK); Index++) {
+        if (SD_IntegrityEntry[Index].Dirty == true) {
+            ErrorState = SD_Integrity_WriteBack(&SD_IntegrityEntry[Index], Flags);
+        }
+    }
+    if (ErrorState == SD_OK) {
+        SD_Integrity.Dirty = false;
+    }
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @retval SD Card error state, SD_CARD_ECC_FAILED when a block does not match its tag
+  */
+static SD_Error_t SD_Integrity_Verify(uint64_t Lba, uint32_t Count, const uint32_t *pCrc)
+{
+    SD_IntegrityEntry_t *pEntry;
+    SD_Error_t           ErrorState = SD_OK, Result = SD_OK;
+    uint32_t             Tag;
+
+    for (uint32_t Block = 0; (Block < Count) && (ErrorState == SD_OK); Block++) {
+        if ((ErrorState = SD_Integrity_Lookup(Lba + Block, &pEntry)) != SD_OK) {
+            break;
+        }
+        Tag = SD_IntegrityCache[pEntry - SD_IntegrityEntry].Tag[(Lba + Block) % SD_INTEGRITY_TAGS_PER_BLOCK];
+        if (Tag == SD_INTEGRITY_UNTAGGED) {
+            SD_IntegrityStats.UntaggedBlocks++;
+        } else if (Tag == SD_Integrity_Tag(pCrc[Block], Lba + Block)) {
+            SD_IntegrityStats.VerifiedBlocks++;
+        } else {
+            SD_IntegrityStats.Mismatches++;
+            SD_IntegrityStats.LastMismatch = Lba + Block;
+            Result = SD_CARD_ECC_FAILED;
+        }
+    }
+    return (ErrorState == SD_OK) ? Result : ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Starts checksumming Count blocks into pCrc, SD_Integrity_CrcWait finishes it. Without MDMA,
+  *         or for a buffer that is not word aligned, the CPU does it all here.
+  */
+static void SD_Integrity_CrcStart(const uint8_t *pData, uint32_t Count, uint32_t *pCrc)
+{
+    uint32_t Start = DWT->CYCCNT;
+
+    SD_IntegrityStats.CrcBytes += Count * SD_BLOCKDEV_BLOCK_SIZE;
+#if SD_INTEGRITY_MDMA
+    if (((uint32_t)pData & 3) == 0) {
+        MDMA_Channel_TypeDef *pChannel = SD_INTEGRITY_MDMA_CHANNEL;
+        MDMA_LinkNodeTypeDef *pNode = SD_IntegrityNode;
+
+        for (uint32_t Block = 0; Block < Count; Block++, pNode += 3) {
+            pNode[0].CTCR   = SD_INTEGRITY_MDMA_WORDS | MDMA_SRC_INC_DISABLE | MDMA_DEST_INC_DISABLE | ((4 - 1) << MDMA_CTCR_TLEN_Pos);
+            pNode[0].CBNDTR = 4;
+            pNode[0].CSAR   = (uint32_t)&SD_IntegrityReset;
+            pNode[0].CDAR   = (uint32_t)&CRC->CR;
+            pNode[0].CTBR   = 0;
+
+            pNode[1].CTCR   = SD_INTEGRITY_MDMA_WORDS | MDMA_SRC_INC_WORD | MDMA_DEST_INC_DISABLE | ((128 - 1) << MDMA_CTCR_TLEN_Pos);
+            pNode[1].CBNDTR = SD_BLOCKDEV_BLOCK_SIZE;
+            pNode[1].CSAR   = (uint32_t)&pData[Block * SD_BLOCKDEV_BLOCK_SIZE];
+            pNode[1].CDAR   = (uint32_t)&CRC->DR;
+            pNode[1].CTBR   = SD_INTEGRITY_MDMA_TCM(pNode[1].CSAR) ? MDMA_CTBR_SBUS : 0;
+
+            pNode[2].CTCR   = SD_INTEGRITY_MDMA_WORDS | MDMA_SRC_INC_DISABLE | MDMA_DEST_INC_DISABLE | ((4 - 1) << MDMA_CTCR_TLEN_Pos);
+            pNode[2].CBNDTR = 4;
+            pNode[2].CSAR   = (uint32_t)&CRC->DR;
+            pNode[2].CDAR   = (uint32_t)&pCrc[Block];
+            pNode[2].CTBR   = SD_INTEGRITY_MDMA_TCM(pNode[2].CDAR) ? MDMA_CTBR_DBUS : 0;
+
+            for (uint32_t Index = 0; Index < 3; Index++) {
+                pNode[Index].CBRUR = 0;
+                pNode[Index].CMAR  = 0;
+                pNode[Index].CMDR  = 0;
+                pNode[Index].CLAR  = (uint32_t)&pNode[Index + 1];
+            }
+        }
+        pNode[-1].CLAR = 0;
+
+        if (SCB->CCR & SCB_CCR_DC_Msk) {
+            SCB_CleanDCache_by_Addr((uint32_t*)SD_IntegrityNode, Count * 3 * sizeof(MDMA_LinkNodeTypeDef));
+            SCB_CleanDCache_by_Addr((uint32_t*)((uint32_t)pData & ~0x1F), Count * SD_BLOCKDEV_BLOCK_SIZE + ((uint32_t)pData & 0x1F));
+        }
+
+        // The channel starts with the first node loaded into its registers, CLAR chains the rest
+        pChannel->CCR    = 0;
+        pChannel->CIFCR  = MDMA_CIFCR_CTEIF | MDMA_CIFCR_CCTCIF | MDMA_CIFCR_CBRTIF | MDMA_CIFCR_CBTIF | MDMA_CIFCR_CLTCIF;
+        pChannel->CTCR   = SD_IntegrityNode[0].CTCR;
+        pChannel->CBNDTR = SD_IntegrityNode[0].CBNDTR;
+        pChannel->CSAR   = SD_IntegrityNode[0].CSAR;
+        pChannel->CDAR   = SD_IntegrityNode[0].CDAR;
+        pChannel->CBRUR  = 0;
+        pChannel->CLAR   = SD_IntegrityNode[0].CLAR;
+        pChannel->CTBR   = SD_IntegrityNode[0].CTBR;
+        pChannel->CMAR   = 0;
+        pChannel->CMDR   = 0;
+        pChannel->CCR    = MDMA_PRIORITY_HIGH | MDMA_CCR_EN;
+        pChannel->CCR   |= MDMA_CCR_SWRQ;
+
+        SD_Integrity.pPending     = pData;
+        SD_Integrity.PendingCount = Count;
+        SD_Integrity.pPendingCrc  = pCrc;
+        SD_IntegrityStats.CrcCycles += DWT->CYCCNT - Start;
+        return;
+    }
+#endif
+    for (uint32_t Block = 0; Block < Count; Block++) {
+        pCrc[Block] = SD_Integrity_CrcCpu(&pData[Block * SD_BLOCKDEV_BLOCK_SIZE], SD_INTEGRITY_WORDS);
+    }
+    SD_IntegrityStats.CrcCycles += DWT->CYCCNT - Start;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Waits for the MDMA checksums, progressing the lower device meanwhile. On a transfer error the
+  *         CPU checksums the piece again.
+  */
+static void SD_Integrity_CrcWait(void)
+{
+#if SD_INTEGRITY_MDMA
+    MDMA_Channel_TypeDef *pChannel = SD_INTEGRITY_MDMA_CHANNEL;
+    uint32_t              Start = DWT->CYCCNT;
+
+    if (SD_Integrity.pPending == NULL) {
+        return;
+    }
+    while ((pChannel->CISR & (MDMA_CISR_CTCIF | MDMA_CISR_TEIF)) == 0) {
+        SD_BlockDev_Process(SD_Integrity.pLower);
+    }
+    if ((pChannel->CISR & MDMA_CISR_TEIF) != 0) {
+        for (uint32_t Block = 0; Block < SD_Integrity.PendingCount; Block++) {
+            SD_Integrity.pPendingCrc[Block] = SD_Integrity_CrcCpu(&SD_Integrity.pPending[Block * SD_BLOCKDEV_BLOCK_SIZE], SD_INTEGRITY_WORDS);
+        }
+    }
+    pChannel->CCR   = 0;
+    pChannel->CIFCR = MDMA_CIFCR_CTEIF | MDMA_CIFCR_CCTCIF | MDMA_CIFCR_CBRTIF | MDMA_CIFCR_CBTIF | MDMA_CIFCR_CLTCIF;
+    SD_Integrity.pPending = NULL;
+    SD_IntegrityStats.CrcCycles += DWT->CYCCNT - Start;
+#endif
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  CRC unit fed by the CPU, a store per word that the unit absorbs without wait states.
+  * @retval Raw result, the standard CRC-32 xor 0xFFFFFFFF
+  */
+static uint32_t SD_Integrity_CrcCpu(const uint8_t *pData, uint32_t Words)
+{
+    CRC->CR = SD_INTEGRITY_CRC_CR | CRC_CR_RESET;
+    for (uint32_t Word = 0; Word < Words; Word++) {
+        CRC->DR = __UNALIGNED_UINT32(&pData[Word * sizeof(uint32_t)]);
+    }
+    return CRC->DR;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Tag of a block from the raw CRC unit result, never SD_INTEGRITY_UNTAGGED.
+  */
+static uint32_t SD_Integrity_Tag(uint32_t Raw, uint64_t Lba)
+{
+    uint32_t Tag = Raw ^ 0xFFFFFFFF ^ (uint32_t)Lba;
+
+    return (Tag != SD_INTEGRITY_UNTAGGED) ? Tag : 1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#else
+
+SD_Error_t SD_Integrity_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    (void)pLower;
+    (void)ppDev;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Integrity_Format(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    (void)pLower;
+    (void)ppDev;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+uint32_t SD_Integrity_Crc32(const uint8_t *pBlock)
+{
+    (void)pBlock;
+    return 0;
+}
+
+SD_Error_t SD_Integrity_Benchmark(const uint8_t *pBuffer, uint32_t Blocks, SD_IntegrityBench_t *pResult)
+{
+    (void)pBuffer;
+    (void)Blocks;
+    (void)pResult;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+void SD_Integrity_GetStats(SD_IntegrityStats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
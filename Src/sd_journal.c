@@ -0,0 +1,645 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_journal.h"
+
+/*
+ * Log layout, offsets relative to the first block of the log:
+ *
+ *   0            superblock, where recovery starts (Tail) and the sequence number expected there
+ *   1..Blocks-1  transactions, written circularly: descriptor, data blocks, commit record
+ *
+ * A transaction goes to the card as one write of Count + 2 blocks. The commit record carries the
+ * CRC of descriptor and data, so a torn write is found at mount without ordering the commit record
+ * behind the data. A transaction never wraps, when it does not fit before the end it starts at 1.
+ * Checkpointing writes the logged blocks home, flushes, and only then moves Tail in the superblock.
+ */
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_JOURNAL_WORDS                (SD_BLOCKDEV_BLOCK_SIZE / sizeof(uint32_t))
+#define SD_JOURNAL_VERSION              1
+#define SD_JOURNAL_MAGIC_SUPER          0x534A4453   // "SDJS"
+#define SD_JOURNAL_MAGIC_DESCRIPTOR     0x444A4453   // "SDJD"
+#define SD_JOURNAL_MAGIC_COMMIT         0x434A4453   // "SDJC"
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t Start;                     // Geometry the log was formatted with, a mismatch reformats
+    uint32_t Blocks;
+    uint32_t Tail;
+    uint64_t Sequence;                  // Expected in the transaction at Tail
+    uint32_t Crc;
+} SD_JournalSuper_t;
+
+typedef struct
+{
+    uint32_t Magic;
+    uint32_t Count;
+    uint64_t Sequence;
+    uint64_t Lba[SD_JOURNAL_MAX_BLOCKS];
+} SD_JournalDescriptor_t;
+
+typedef struct
+{
+    uint32_t Magic;
+    uint32_t Count;
+    uint64_t Sequence;
+    uint32_t Crc;                       // Over descriptor and data blocks
+} SD_JournalCommit_t;
+
+typedef struct
+{
+    uint64_t HomeLba;
+    uint32_t Offset;                    // Log block holding the newest committed copy
+} SD_JournalMap_t;
+
+typedef struct
+{
+    SD_BlockDev_t *pLower;
+    uint64_t       Start;               // First block of the log on pLower
+    uint32_t       Blocks;
+    uint32_t       Head;                // Where the next transaction goes
+    uint32_t       Used;                // Since Tail, including blocks skipped at a wrap
+    uint64_t       Sequence;            // Of the next transaction
+    uint32_t       Count;               // Blocks in the open transaction
+    bool           Open;
+    bool           Mounted;
+    uint32_t       Mapped;
+    uint64_t       MapMin;              // Range of mapped home blocks, cheap miss for most reads
+    uint64_t       MapMax;
+    uint32_t       LastCommit;
+} SD_Journal_t;
+
+_Static_assert(sizeof(SD_JournalDescriptor_t) <= SD_BLOCKDEV_BLOCK_SIZE, "SD_JOURNAL_MAX_BLOCKS too large for one descriptor");
+_Static_assert(SD_JOURNAL_BLOCKS > 4 * (SD_JOURNAL_MAX_BLOCKS + 2), "SD_JOURNAL_BLOCKS too small");
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_Journal_t                SD_Journal;
+static SD_JournalMap_t             SD_JournalMapTable[SD_JOURNAL_MAP];
+static SD_JournalStats_t           SD_JournalStats;
+static SD_BlockDev_t               SD_JournalDevice;
+// Descriptor, data and commit record of one transaction, written to the log as is
+static uint32_t                    SD_JournalStage[(SD_JOURNAL_MAX_BLOCKS + 2) * SD_JOURNAL_WORDS] __attribute__((section(".ram_d1"), aligned(32)));
+// Superblock and checkpoint copies, kept apart so checkpointing never touches an open transaction
+static uint32_t                    SD_JournalBlock[SD_JOURNAL_WORDS] __attribute__((section(".ram_d1"), aligned(32)));
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_Journal_Read             (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Journal_Write            (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static void             SD_Journal_Process          (SD_BlockDev_t *pDev);
+static SD_Error_t       SD_Journal_Transfer         (bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags);
+static void             SD_Journal_TransferDone     (SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+static SD_Error_t       SD_Journal_WriteSuper       (uint32_t Tail, uint64_t Sequence);
+static SD_Error_t       SD_Journal_Scan             (uint32_t Offset, uint64_t Sequence, uint32_t *pCount);
+static SD_Error_t       SD_Journal_Replay           (void);
+static SD_JournalMap_t *SD_Journal_Lookup           (uint64_t Lba);
+static void             SD_Journal_MapInsert        (uint64_t Lba, uint32_t Offset);
+static uint32_t         SD_Journal_Crc32            (uint32_t Crc, const uint8_t *pData, uint32_t Length);
+
+static const SD_BlockDevOps_t      SD_JournalOps =
+{
+    .Read       = SD_Journal_Read,
+    .Write      = SD_Journal_Write,
+    .Process    = SD_Journal_Process,
+};
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Places the log at the end of a device, rounded down to its allocation unit so log writes never
+  *         straddle one, replays every committed transaction found there and moves the superblock past
+  *         them. A log without a valid superblock, or one formatted for another geometry, is reformatted.
+  * @param  pLower: Device to journal, the card or a partition, a volatile layer works as long as FUA does
+  * @param  ppDev: Receives the device above the log, journaled or not its writes land on pLower
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Journal_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    SD_JournalSuper_t *pSuper = (SD_JournalSuper_t*)SD_JournalBlock;
+    SD_Error_t         ErrorState;
+    uint64_t           Start;
+
+    if ((pLower == NULL) || (ppDev == NULL) || (pLower->Blocks < 2 * SD_JOURNAL_BLOCKS)) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    Start = pLower->Blocks - SD_JOURNAL_BLOCKS;
+    if (pLower->EraseBlocks > 1) {
+        Start -= Start % pLower->EraseBlocks;
+    }
+
+    memset(&SD_Journal, 0, sizeof(SD_Journal));
+    memset(&SD_JournalStats, 0, sizeof(SD_JournalStats));
+    SD_Journal.pLower = pLower;
+    SD_Journal.Start  = Start;
+    SD_Journal.Blocks = (uint32_t)(pLower->Blocks - Start);
+
+    if ((ErrorState = SD_Journal_Transfer(false, Start, (uint8_t*)SD_JournalBlock, 1, 0)) != SD_OK) {
+        return ErrorState;
+    }
+
+    if ((pSuper->Magic != SD_JOURNAL_MAGIC_SUPER) || (pSuper->Version != SD_JOURNAL_VERSION) ||
+        (pSuper->Start != Start) || (pSuper->Blocks != SD_Journal.Blocks) ||
+        (pSuper->Tail == 0) || (pSuper->Tail > SD_Journal.Blocks) ||
+        ((SD_Journal_Crc32(0xFFFFFFFF, (uint8_t*)pSuper, offsetof(SD_JournalSuper_t, Crc)) ^ 0xFFFFFFFF) != pSuper->Crc)) {
+        SD_Journal.Head     = 1;
+        SD_Journal.Sequence = 1;
+        ErrorState = SD_Journal_WriteSuper(SD_Journal.Head, SD_Journal.Sequence);
+    } else {
+        SD_Journal.Head     = pSuper->Tail;
+        SD_Journal.Sequence = pSuper->Sequence;
+        ErrorState = SD_Journal_Replay();
+    }
+    if (ErrorState != SD_OK) {
+        return ErrorState;
+    }
+
+    SD_JournalDevice.pOps        = &SD_JournalOps;
+    SD_JournalDevice.pLower      = pLower;
+    SD_JournalDevice.pName       = "journal";
+    SD_JournalDevice.pPrivate    = &SD_Journal;
+    SD_JournalDevice.Blocks      = Start;
+    SD_JournalDevice.Offset      = 0;
+    SD_JournalDevice.EraseBlocks = pLower->EraseBlocks;
+    SD_JournalDevice.Caps        = pLower->Caps & (SD_BLOCKDEV_CAP_ANY_BUFFER | SD_BLOCKDEV_CAP_VOLATILE |
+                                                   SD_BLOCKDEV_CAP_PERSISTENT | SD_BLOCKDEV_CAP_READ_ONLY);
+
+    SD_Journal.LastCommit = HAL_GetTick();
+    SD_Journal.Mounted    = true;
+    *ppDev = &SD_JournalDevice;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Journal_Begin(void)
+{
+    if (SD_Journal.Mounted == false) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    if (SD_Journal.Open == true) {
+        return SD_BUSY;
+    }
+    SD_Journal.Open  = true;
+    SD_Journal.Count = 0;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Adds one block to the open transaction. The data is copied, pData may be reused right away.
+  * @param  Lba: Block on the journaled device
+  * @param  pData: One block, any alignment
+  * @retval SD Card error state, SD_BUSY when the transaction is full
+  */
+SD_Error_t SD_Journal_Add(uint64_t Lba, const uint8_t *pData)
+{
+    SD_JournalDescriptor_t *pDescriptor = (SD_JournalDescriptor_t*)SD_JournalStage;
+    uint32_t                Slot;
+
+    if (SD_Journal.Open == false) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    if (pData == NULL) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (Lba >= SD_JournalDevice.Blocks) {
+        return SD_ADDR_OUT_OF_RANGE;
+    }
+
+    for (Slot = 0; Slot < SD_Journal.Count; Slot++) {
+        if (pDescriptor->Lba[Slot] == Lba) {
+            break;
+        }
+    }
+    if (Slot == SD_JOURNAL_MAX_BLOCKS) {
+        return SD_BUSY;
+    }
+    if (Slot == SD_Journal.Count) {
+        pDescriptor->Lba[SD_Journal.Count++] = Lba;
+    }
+    memcpy(&SD_JournalStage[(1 + Slot) * SD_JOURNAL_WORDS], pData, SD_BLOCKDEV_BLOCK_SIZE);
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Writes descriptor, data and commit record as one sequential FUA write, a single CMD25 on the
+  *         card, and redirects reads of the logged blocks to the log until they are checkpointed. The
+  *         transaction is closed whatever the outcome, on an error none of it is applied.
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Journal_Commit(void)
+{
+    SD_JournalDescriptor_t *pDescriptor;
+    SD_JournalCommit_t     *pCommit;
+    SD_Error_t              ErrorState;
+    uint32_t                Count = SD_Journal.Count;
+    uint32_t                Length = Count + 2;
+    uint32_t                Offset, Skip = 0;
+
+    if (SD_Journal.Open == false) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    SD_Journal.Open = false;
+    if (Count == 0) {
+        return SD_OK;
+    }
+
+    // Needs the log blocks, blocks lost to a wrap, and a map entry per block in the worst case
+    Offset = SD_Journal.Head;
+    if ((Offset + Length) > SD_Journal.Blocks) {
+        Skip   = SD_Journal.Blocks - Offset;
+        Offset = 1;
+    }
+    if (((SD_Journal.Used + Skip + Length) > (SD_Journal.Blocks - 1)) || ((SD_Journal.Mapped + Count) > SD_JOURNAL_MAP)) {
+        SD_JournalStats.ForcedCheckpoints++;
+        if ((ErrorState = SD_Journal_Checkpoint()) != SD_OK) {
+            return ErrorState;
+        }
+    }
+
+    pDescriptor = (SD_JournalDescriptor_t*)SD_JournalStage;
+    pDescriptor->Magic    = SD_JOURNAL_MAGIC_DESCRIPTOR;
+    pDescriptor->Count    = Count;
+    pDescriptor->Sequence = SD_Journal.Sequence;
+    memset(&pDescriptor->Lba[Count], 0, SD_BLOCKDEV_BLOCK_SIZE - offsetof(SD_JournalDescriptor_t, Lba) - Count * sizeof(uint64_t));
+
+    pCommit = (SD_JournalCommit_t*)&SD_JournalStage[(Count + 1) * SD_JOURNAL_WORDS];
+    memset(pCommit, 0, SD_BLOCKDEV_BLOCK_SIZE);
+    pCommit->Magic    = SD_JOURNAL_MAGIC_COMMIT;
+    pCommit->Count    = Count;
+    pCommit->Sequence = SD_Journal.Sequence;
+    pCommit->Crc      = SD_Journal_Crc32(0xFFFFFFFF, (uint8_t*)SD_JournalStage, (Count + 1) * SD_BLOCKDEV_BLOCK_SIZE) ^ 0xFFFFFFFF;
+
+    if ((ErrorState = SD_Journal_Transfer(true, SD_Journal.Start + Offset, (uint8_t*)SD_JournalStage, Length, SD_BLOCKDEV_FUA)) != SD_OK) {
+        return ErrorState;
+    }
+
+    for (uint32_t Index = 0; Index < Count; Index++) {
+        SD_Journal_MapInsert(pDescriptor->Lba[Index], Offset + 1 + Index);
+    }
+    SD_Journal.Head        = Offset + Length;
+    SD_Journal.Used       += Skip + Length;
+    SD_Journal.Sequence++;
+    SD_Journal.LastCommit  = HAL_GetTick();
+    SD_JournalStats.Commits++;
+    SD_JournalStats.CommittedBlocks += Count;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Journal_Abort(void)
+{
+    SD_Journal.Open = false;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Copies every mapped block from the log to its home, flushes pLower, then frees the log by moving
+  *         Tail to Head. Power loss before the superblock update only means the same blocks are replayed.
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Journal_Checkpoint(void)
+{
+    SD_Error_t ErrorState;
+
+    if (SD_Journal.Mounted == false) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    if (SD_Journal.Used == 0) {
+        return SD_OK;
+    }
+
+    for (uint32_t Index = 0; Index < SD_Journal.Mapped; Index++) {
+        SD_JournalMap_t *pMap = &SD_JournalMapTable[Index];
+
+        if (((ErrorState = SD_Journal_Transfer(false, SD_Journal.Start + pMap->Offset, (uint8_t*)SD_JournalBlock, 1, 0)) != SD_OK) ||
+            ((ErrorState = SD_Journal_Transfer(true, pMap->HomeLba, (uint8_t*)SD_JournalBlock, 1, 0)) != SD_OK)) {
+            return ErrorState;
+        }
+    }
+    if ((ErrorState = SD_BlockDev_Flush(SD_Journal.pLower)) != SD_OK) {
+        return ErrorState;
+    }
+    if ((ErrorState = SD_Journal_WriteSuper(SD_Journal.Head, SD_Journal.Sequence)) != SD_OK) {
+        return ErrorState;
+    }
+
+    SD_JournalStats.Checkpoints++;
+    SD_JournalStats.CheckpointedBlocks += SD_Journal.Mapped;
+    SD_Journal.Mapped = 0;
+    SD_Journal.Used   = 0;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Journal_GetStats(SD_JournalStats_t *pStats)
+{
+    *pStats        = SD_JournalStats;
+    pStats->Used   = SD_Journal.Used;
+    pStats->Mapped = SD_Journal.Mapped;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Unmapped runs are read from home in one request, mapped blocks one by one from the log.
+  */
+static SD_Error_t SD_Journal_Read(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                                  SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_JournalMap_t *pMap;
+    SD_Error_t       ErrorState = SD_OK;
+    uint32_t         Run;
+
+    while ((NumberOfBlocks != 0) && (ErrorState == SD_OK)) {
+        if ((pMap = SD_Journal_Lookup(Lba)) != NULL) {
+            SD_JournalStats.RedirectedReads++;
+            ErrorState = SD_Journal_Transfer(false, SD_Journal.Start + pMap->Offset, pBuffer, 1, 0);
+            Run = 1;
+        } else {
+            for (Run = 1; (Run < NumberOfBlocks) && (SD_Journal_Lookup(Lba + Run) == NULL); Run++);
+            ErrorState = SD_Journal_Transfer(false, Lba, pBuffer, Run, 0);
+        }
+        Lba            += Run;
+        pBuffer        += Run * SD_BLOCKDEV_BLOCK_SIZE;
+        NumberOfBlocks -= Run;
+    }
+
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Plain writes bypass the log. One that hits a logged block checkpoints first, otherwise a later
+  *         checkpoint would put the older logged copy back over it.
+  */
+static SD_Error_t SD_Journal_Write(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                                   SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_Error_t ErrorState = SD_OK;
+
+    for (uint32_t Index = 0; Index < NumberOfBlocks; Index++) {
+        if (SD_Journal_Lookup(Lba + Index) != NULL) {
+            SD_JournalStats.ForcedCheckpoints++;
+            ErrorState = SD_Journal_Checkpoint();
+            break;
+        }
+    }
+    if (ErrorState == SD_OK) {
+        ErrorState = SD_Journal_Transfer(true, Lba, (uint8_t*)pBuffer, NumberOfBlocks, Flags);
+    }
+
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Background checkpoint, when the log went quiet or before it or the map run out at a commit.
+  */
+static void SD_Journal_Process(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+
+    if ((SD_Journal.Used == 0) || (SD_Journal.Open == true)) {
+        return;
+    }
+    if (((HAL_GetTick() - SD_Journal.LastCommit) >= SD_JOURNAL_CHECKPOINT_MS) ||
+        ((SD_Journal.Used * 2) >= SD_Journal.Blocks) || ((SD_Journal.Mapped * 2) >= SD_JOURNAL_MAP)) {
+        SD_Journal_Checkpoint();
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Blocking request on pLower at an absolute block, Flags as for SD_BlockDev_Write.
+  */
+static SD_Error_t SD_Journal_Transfer(bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags)
+{
+    volatile SD_Error_t Status = SD_BUSY;
+    SD_Error_t          ErrorState;
+
+    if (Write == true) {
+        ErrorState = SD_BlockDev_Write(SD_Journal.pLower, Lba, pBuffer, NumberOfBlocks, Flags, SD_Journal_TransferDone, (void*)&Status);
+    } else {
+        ErrorState = SD_BlockDev_Read(SD_Journal.pLower, Lba, pBuffer, NumberOfBlocks, SD_Journal_TransferDone, (void*)&Status);
+    }
+    if (ErrorState != SD_OK) {
+        return ErrorState;
+    }
+    while (Status == SD_BUSY) {
+        SD_BlockDev_Process(SD_Journal.pLower);
+    }
+    return Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Journal_TransferDone(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context)
+{
+    (void)pDev;
+    *(volatile SD_Error_t*)Context = Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Journal_WriteSuper(uint32_t Tail, uint64_t Sequence)
+{
+    SD_JournalSuper_t *pSuper = (SD_JournalSuper_t*)SD_JournalBlock;
+
+    memset(SD_JournalBlock, 0, sizeof(SD_JournalBlock));
+    pSuper->Magic    = SD_JOURNAL_MAGIC_SUPER;
+    pSuper->Version  = SD_JOURNAL_VERSION;
+    pSuper->Start    = SD_Journal.Start;
+    pSuper->Blocks   = SD_Journal.Blocks;
+    pSuper->Tail     = Tail;
+    pSuper->Sequence = Sequence;
+    pSuper->Crc      = SD_Journal_Crc32(0xFFFFFFFF, (uint8_t*)pSuper, offsetof(SD_JournalSuper_t, Crc)) ^ 0xFFFFFFFF;
+    return SD_Journal_Transfer(true, SD_Journal.Start, (uint8_t*)SD_JournalBlock, 1, SD_BLOCKDEV_FUA);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads the transaction at Offset into SD_JournalStage and checks it is complete and the one
+  *         expected next.
+  * @param  pCount: Receives the number of data blocks
+  * @retval SD_OK for a committed transaction, SD_ERROR for anything else
+  */
+static SD_Error_t SD_Journal_Scan(uint32_t Offset, uint64_t Sequence, uint32_t *pCount)
+{
+    SD_JournalDescriptor_t *pDescriptor = (SD_JournalDescriptor_t*)SD_JournalStage;
+    SD_JournalCommit_t     *pCommit;
+    SD_Error_t              ErrorState;
+    uint32_t                Count;
+
+    if ((ErrorState = SD_Journal_Transfer(false, SD_Journal.Start + Offset, (uint8_t*)SD_JournalStage, 1, 0)) != SD_OK) {
+        return ErrorState;
+    }
+    Count = pDescriptor->Count;
+    if ((pDescriptor->Magic != SD_JOURNAL_MAGIC_DESCRIPTOR) || (pDescriptor->Sequence != Sequence) ||
+        (Count == 0) || (Count > SD_JOURNAL_MAX_BLOCKS) || ((Offset + Count + 2) > SD_Journal.Blocks)) {
+        return SD_ERROR;
+    }
+    if ((ErrorState = SD_Journal_Transfer(false, SD_Journal.Start + Offset + 1, (uint8_t*)&SD_JournalStage[SD_JOURNAL_WORDS], Count + 1, 0)) != SD_OK) {
+        return ErrorState;
+    }
+
+    pCommit = (SD_JournalCommit_t*)&SD_JournalStage[(Count + 1) * SD_JOURNAL_WORDS];
+    if ((pCommit->Magic != SD_JOURNAL_MAGIC_COMMIT) || (pCommit->Sequence != Sequence) || (pCommit->Count != Count) ||
+        ((SD_Journal_Crc32(0xFFFFFFFF, (uint8_t*)SD_JournalStage, (Count + 1) * SD_BLOCKDEV_BLOCK_SIZE) ^ 0xFFFFFFFF) != pCommit->Crc)) {
+        SD_JournalStats.Discarded++;
+        return SD_ERROR;
+    }
+    *pCount = Count;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Walks the log from Tail, writing every committed transaction home straight from the stage,
+  *         and stops at the first one that is missing or torn. A transaction that did not fit before the
+  *         end of the log is looked for at offset 1.
+  */
+static SD_Error_t SD_Journal_Replay(void)
+{
+    SD_JournalDescriptor_t *pDescriptor = (SD_JournalDescriptor_t*)SD_JournalStage;
+    SD_Error_t              ErrorState;
+    uint32_t                Count, Offset = SD_Journal.Head;
+
+    for (uint32_t Walked = 0; Walked < SD_Journal.Blocks; Walked += Count + 2) {
+        if ((ErrorState = SD_Journal_Scan(Offset, SD_Journal.Sequence, &Count)) == SD_ERROR) {
+            if ((Offset == 1) || ((ErrorState = SD_Journal_Scan(1, SD_Journal.Sequence, &Count)) == SD_ERROR)) {
+                break;
+            }
+            Walked += SD_Journal.Blocks - Offset;
+            Offset  = 1;
+        }
+        if (ErrorState != SD_OK) {
+            return ErrorState;
+        }
+
+        for (uint32_t Index = 0; Index < Count; Index++) {
+            if ((ErrorState = SD_Journal_Transfer(true, pDescriptor->Lba[Index], (uint8_t*)&SD_JournalStage[(1 + Index) * SD_JOURNAL_WORDS], 1, 0)) != SD_OK) {
+                return ErrorState;
+            }
+        }
+        SD_JournalStats.Replayed++;
+        SD_JournalStats.ReplayedBlocks += Count;
+        SD_Journal.Sequence++;
+        Offset += Count + 2;
+    }
+
+    if (SD_JournalStats.Replayed == 0) {
+        return SD_OK;
+    }
+    SD_Journal.Head = Offset;
+    if ((ErrorState = SD_BlockDev_Flush(SD_Journal.pLower)) != SD_OK) {
+        return ErrorState;
+    }
+    return SD_Journal_WriteSuper(SD_Journal.Head, SD_Journal.Sequence);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_JournalMap_t *SD_Journal_Lookup(uint64_t Lba)
+{
+    if ((SD_Journal.Mapped == 0) || (Lba < SD_Journal.MapMin) || (Lba > SD_Journal.MapMax)) {
+        return NULL;
+    }
+    for (uint32_t Index = 0; Index < SD_Journal.Mapped; Index++) {
+        if (SD_JournalMapTable[Index].HomeLba == Lba) {
+            return &SD_JournalMapTable[Index];
+        }
+    }
+    return NULL;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Journal_MapInsert(uint64_t Lba, uint32_t Offset)
+{
+    SD_JournalMap_t *pMap = SD_Journal_Lookup(Lba);
+
+    if (pMap == NULL) {
+        if (SD_Journal.Mapped == 0) {
+            SD_Journal.MapMin = Lba;
+            SD_Journal.MapMax = Lba;
+        }
+        pMap = &SD_JournalMapTable[SD_Journal.Mapped++];
+        pMap->HomeLba = Lba;
+        SD_Journal.MapMin = (Lba < SD_Journal.MapMin) ? Lba : SD_Journal.MapMin;
+        SD_Journal.MapMax = (Lba > SD_Journal.MapMax) ? Lba : SD_Journal.MapMax;
+    }
+    pMap->Offset = Offset;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reflected CRC-32, continued across calls, start with and finally xor 0xFFFFFFFF.
+  */
+static uint32_t SD_Journal_Crc32(uint32_t Crc, const uint8_t *pData, uint32_t Length)
+{
+    while (Length--) {
+        Crc ^= *pData++;
+        for (uint32_t Bit = 0; Bit < 8; Bit++) {
+            Crc = (Crc >> 1) ^ (0xEDB88320 & (0 - (Crc & 1)));
+        }
+    }
+    return Crc;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
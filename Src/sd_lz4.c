@@ -0,0 +1,730 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_lz4.h"
+
+#ifdef SDMMC_LZ4
+
+/*
+ * Layout on the lower device:
+ *
+ *   0                       header, geometry and the allocation head
+ *   1..SD_LZ4_MAP_BLOCKS    extent map, one word per chunk: first data block << 4 | blocks
+ *   after the map           chunk data, allocated by appending
+ *
+ * A chunk is stored as is when compression would not save a block, otherwise as a 16 bit length
+ * followed by one LZ4 block (standard block format, readable by any LZ4 tool). Chunks are
+ * compressed independently so any of them can be read without its neighbours. A rewrite goes back
+ * in place when it fits the old extent, otherwise it is appended and the old extent is not reused
+ * until SD_Lz4_Format, which suits logs that are written once.
+ */
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_LZ4_CHUNK_SIZE               (SD_LZ4_CHUNK_BLOCKS * SD_BLOCKDEV_BLOCK_SIZE)
+#define SD_LZ4_MAP_BLOCKS               ((SD_LZ4_CHUNKS * sizeof(uint32_t) + SD_BLOCKDEV_BLOCK_SIZE - 1) / SD_BLOCKDEV_BLOCK_SIZE)
+#define SD_LZ4_MAP_PER_BLOCK            (SD_BLOCKDEV_BLOCK_SIZE / sizeof(uint32_t))
+#define SD_LZ4_DATA_START               (1 + SD_LZ4_MAP_BLOCKS)
+#define SD_LZ4_UNMAPPED                 0xFFFFFFFF
+#define SD_LZ4_NONE                     0xFFFFFFFF
+#define SD_LZ4_MAGIC                    0x345A4C53   // "SLZ4"
+#define SD_LZ4_VERSION                  1
+
+#define SD_LZ4_MIN_MATCH                4
+#define SD_LZ4_LAST_LITERALS            5            // Format rules: the last 5 bytes are literals,
+#define SD_LZ4_MF_LIMIT                 12           // and no match starts in the last 12
+#define SD_LZ4_SKIP_TRIGGER             6            // Search step grows by one every 64 bytes without a match
+
+#define SD_LZ4_READ32(p)                __UNALIGNED_UINT32(p)
+#define SD_LZ4_HASH(v)                  (((v) * 2654435761U) >> (32 - SD_LZ4_HASH_BITS))
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t Chunks;
+    uint32_t ChunkBlocks;
+    uint32_t DataBlocks;
+    uint32_t Head;
+} SD_Lz4Header_t;
+
+typedef struct
+{
+    SD_BlockDev_t *pLower;
+    uint32_t       DataBlocks;
+    uint32_t       Head;                // Next free data block
+    uint32_t       Open;                // Chunk held in SD_Lz4Chunk
+    bool           Dirty;
+    uint32_t       DirtySince;
+    uint32_t       Decoded;             // Chunk held in SD_Lz4Decoded
+    bool           HeaderDirty;
+    uint32_t       MapDirty[(SD_LZ4_MAP_BLOCKS + 31) / 32];
+} SD_Lz4_t;
+
+_Static_assert(SD_LZ4_CHUNK_BLOCKS >= 2 && SD_LZ4_CHUNK_BLOCKS <= 15, "SD_LZ4_CHUNK_BLOCKS out of range");
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_Lz4_t                    SD_Lz4;
+static SD_Lz4Stats_t               SD_Lz4Stats;
+static SD_BlockDev_t               SD_Lz4Device;
+// Encoder match positions, DTCM like the rest of .bss, single cycle access on the hot path
+static uint16_t                    SD_Lz4Hash[1 << SD_LZ4_HASH_BITS];
+static uint32_t                    SD_Lz4Map[SD_LZ4_MAP_BLOCKS * SD_LZ4_MAP_PER_BLOCK] __attribute__((section(".ram_d1"), aligned(32)));
+// Chunk being written, chunk last read, compressed chunk on its way to or from the card
+static uint8_t                     SD_Lz4Chunk[SD_LZ4_CHUNK_SIZE] __attribute__((section(".ram_d1"), aligned(32)));
+static uint8_t                     SD_Lz4Decoded[SD_LZ4_CHUNK_SIZE] __attribute__((section(".ram_d1"), aligned(32)));
+static uint8_t                     SD_Lz4Stage[SD_LZ4_CHUNK_SIZE] __attribute__((section(".ram_d1"), aligned(32)));
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_Lz4_Read                 (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Lz4_Write                (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Lz4_Flush                (SD_BlockDev_t *pDev);
+static void             SD_Lz4_Process              (SD_BlockDev_t *pDev);
+static SD_Error_t       SD_Lz4_Setup                (SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev, bool Format);
+static SD_Error_t       SD_Lz4_Load                 (uint32_t Chunk, uint8_t *pChunk);
+static SD_Error_t       SD_Lz4_Commit               (void);
+static SD_Error_t       SD_Lz4_Sync                 (void);
+static SD_Error_t       SD_Lz4_Transfer             (bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks);
+static void             SD_Lz4_TransferDone         (SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+static int32_t          SD_Lz4_Compress             (const uint8_t *pSrc, uint32_t Length, uint8_t *pDst, uint32_t Limit);
+static int32_t          SD_Lz4_Decompress           (const uint8_t *pSrc, uint32_t Length, uint8_t *pDst, uint32_t Capacity);
+
+static const SD_BlockDevOps_t      SD_Lz4Ops =
+{
+    .Read       = SD_Lz4_Read,
+    .Write      = SD_Lz4_Write,
+    .Flush      = SD_Lz4_Flush,
+    .Process    = SD_Lz4_Process,
+};
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Loads the extent map kept at the start of pLower. A device without a valid header, or one
+  *         formatted with another chunk geometry, is formatted.
+  * @param  pLower: Device to compress onto, the whole of it is used
+  * @param  ppDev: Receives the logical device, SD_LZ4_CHUNKS * SD_LZ4_CHUNK_BLOCKS blocks
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Lz4_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    return SD_Lz4_Setup(pLower, ppDev, false);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Lz4_Format(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    return SD_Lz4_Setup(pLower, ppDev, true);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Lz4_GetStats(SD_Lz4Stats_t *pStats)
+{
+    *pStats      = SD_Lz4Stats;
+    pStats->Used = SD_Lz4.Head;
+    pStats->Free = SD_Lz4.DataBlocks - SD_Lz4.Head;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Lz4_ResetStats(void)
+{
+    memset(&SD_Lz4Stats, 0, sizeof(SD_Lz4Stats));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Lz4_Print(void)
+{
+    uint64_t Ratio   = (SD_Lz4Stats.OutBytes != 0) ? (SD_Lz4Stats.InBytes * 100) / SD_Lz4Stats.OutBytes : 0;
+    uint64_t Encode  = (SD_Lz4Stats.InBytes != 0) ? (SD_Lz4Stats.CompressCycles * 100) / SD_Lz4Stats.InBytes : 0;
+    uint64_t Decode  = (SD_Lz4Stats.DecompressedBytes != 0) ? (SD_Lz4Stats.DecompressCycles * 100) / SD_Lz4Stats.DecompressedBytes : 0;
+
+    printf("LZ4: %lu chunks compressed, %lu stored, %lu merged, %lu corrupt\n",
+           SD_Lz4Stats.Compressed, SD_Lz4Stats.Stored, SD_Lz4Stats.Merged, SD_Lz4Stats.Errors);
+    printf("  ratio %lu.%02lu, encode %lu.%02lu cycles/byte, decode %lu.%02lu cycles/byte\n",
+           (uint32_t)(Ratio / 100), (uint32_t)(Ratio % 100), (uint32_t)(Encode / 100), (uint32_t)(Encode % 100),
+           (uint32_t)(Decode / 100), (uint32_t)(Decode % 100));
+    printf("  %lu of %lu data blocks used\n", SD_Lz4.Head, SD_Lz4.DataBlocks);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Serves the chunk being written from memory, any other through SD_Lz4Decoded, which keeps the
+  *         last chunk read so a stream of small reads decompresses each chunk once.
+  */
+static SD_Error_t SD_Lz4_Read(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                              SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_Error_t ErrorState = SD_OK;
+
+    while ((NumberOfBlocks != 0) && (ErrorState == SD_OK)) {
+        uint32_t Chunk = (uint32_t)(Lba / SD_LZ4_CHUNK_BLOCKS);
+        uint32_t First = (uint32_t)(Lba % SD_LZ4_CHUNK_BLOCKS);
+        uint32_t Count = SD_LZ4_CHUNK_BLOCKS - First;
+
+        Count = (Count > NumberOfBlocks) ? NumberOfBlocks : Count;
+        if (Chunk == SD_Lz4.Open) {
+            memcpy(pBuffer, &SD_Lz4Chunk[First * SD_BLOCKDEV_BLOCK_SIZE], Count * SD_BLOCKDEV_BLOCK_SIZE);
+        } else {
+            if (Chunk != SD_Lz4.Decoded) {
+                SD_Lz4.Decoded = SD_LZ4_NONE;
+                if ((ErrorState = SD_Lz4_Load(Chunk, SD_Lz4Decoded)) != SD_OK) {
+                    break;
+                }
+                SD_Lz4.Decoded = Chunk;
+            }
+            memcpy(pBuffer, &SD_Lz4Decoded[First * SD_BLOCKDEV_BLOCK_SIZE], Count * SD_BLOCKDEV_BLOCK_SIZE);
+        }
+        Lba            += Count;
+        pBuffer        += Count * SD_BLOCKDEV_BLOCK_SIZE;
+        NumberOfBlocks -= Count;
+    }
+
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Collects a chunk in SD_Lz4Chunk and compresses it once its last block is written, or when a write
+  *         moves on to another chunk. A write that starts a chunk partway merges with its old contents.
+  */
+static SD_Error_t SD_Lz4_Write(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                               SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_Error_t ErrorState = SD_OK;
+
+    while ((NumberOfBlocks != 0) && (ErrorState == SD_OK)) {
+        uint32_t Chunk = (uint32_t)(Lba / SD_LZ4_CHUNK_BLOCKS);
+        uint32_t First = (uint32_t)(Lba % SD_LZ4_CHUNK_BLOCKS);
+        uint32_t Count = SD_LZ4_CHUNK_BLOCKS - First;
+
+        Count = (Count > NumberOfBlocks) ? NumberOfBlocks : Count;
+        if (Chunk != SD_Lz4.Open) {
+            if ((ErrorState = SD_Lz4_Commit()) != SD_OK) {
+                break;
+            }
+            SD_Lz4.Open = SD_LZ4_NONE;
+            if (Count != SD_LZ4_CHUNK_BLOCKS) {
+                if (SD_Lz4Map[Chunk] != SD_LZ4_UNMAPPED) {
+                    SD_Lz4Stats.Merged++;
+                }
+                if ((ErrorState = SD_Lz4_Load(Chunk, SD_Lz4Chunk)) != SD_OK) {
+                    break;
+                }
+            }
+            SD_Lz4.Open = Chunk;
+        }
+        if (SD_Lz4.Decoded == Chunk) {
+            SD_Lz4.Decoded = SD_LZ4_NONE;
+        }
+
+        memcpy(&SD_Lz4Chunk[First * SD_BLOCKDEV_BLOCK_SIZE], pBuffer, Count * SD_BLOCKDEV_BLOCK_SIZE);
+        if (SD_Lz4.Dirty == false) {
+            SD_Lz4.Dirty      = true;
+            SD_Lz4.DirtySince = HAL_GetTick();
+        }
+        if ((First + Count) == SD_LZ4_CHUNK_BLOCKS) {
+            ErrorState = SD_Lz4_Commit();
+        }
+        Lba            += Count;
+        pBuffer        += Count * SD_BLOCKDEV_BLOCK_SIZE;
+        NumberOfBlocks -= Count;
+    }
+
+    if ((ErrorState == SD_OK) && ((Flags & SD_BLOCKDEV_FUA) != 0)) {
+        ErrorState = SD_Lz4_Flush(pDev);
+        if (ErrorState == SD_OK) {
+            ErrorState = SD_BlockDev_Flush(SD_Lz4.pLower);
+        }
+    }
+
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Lz4_Flush(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+    return SD_Lz4_Sync();
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Lz4_Process(SD_BlockDev_t *pDev)
+{
+    (void)pDev;
+
+    if ((SD_Lz4.Dirty == true) && ((HAL_GetTick() - SD_Lz4.DirtySince) >= SD_LZ4_WRITEBACK_MS)) {
+        SD_Lz4_Sync();
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Lz4_Setup(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev, bool Format)
+{
+    SD_Lz4Header_t *pHeader = (SD_Lz4Header_t*)SD_Lz4Stage;
+    SD_Error_t      ErrorState;
+    uint64_t        DataBlocks;
+
+    if ((pLower == NULL) || (ppDev == NULL) || (pLower->Blocks < (SD_LZ4_DATA_START + SD_LZ4_CHUNK_BLOCKS))) {
+        return SD_INVALID_PARAMETER;
+    }
+    DataBlocks = pLower->Blocks - SD_LZ4_DATA_START;
+
+    memset(&SD_Lz4, 0, sizeof(SD_Lz4));
+    SD_Lz4.pLower     = pLower;
+    SD_Lz4.DataBlocks = (DataBlocks > (SD_LZ4_UNMAPPED >> 4)) ? (SD_LZ4_UNMAPPED >> 4) : (uint32_t)DataBlocks;
+    SD_Lz4.Open       = SD_LZ4_NONE;
+    SD_Lz4.Decoded    = SD_LZ4_NONE;
+
+    if ((ErrorState = SD_Lz4_Transfer(false, 0, SD_Lz4Stage, 1)) != SD_OK) {
+        return ErrorState;
+    }
+    if ((Format == false) && (pHeader->Magic == SD_LZ4_MAGIC) && (pHeader->Version == SD_LZ4_VERSION) &&
+        (pHeader->Chunks == SD_LZ4_CHUNKS) && (pHeader->ChunkBlocks == SD_LZ4_CHUNK_BLOCKS) &&
+        (pHeader->DataBlocks == SD_Lz4.DataBlocks) && (pHeader->Head <= SD_Lz4.DataBlocks)) {
+        SD_Lz4.Head = pHeader->Head;
+        ErrorState  = SD_Lz4_Transfer(false, 1, (uint8_t*)SD_Lz4Map, SD_LZ4_MAP_BLOCKS);
+    } else {
+        memset(SD_Lz4Map, 0xFF, sizeof(SD_Lz4Map));
+        memset(SD_Lz4.MapDirty, 0xFF, sizeof(SD_Lz4.MapDirty));
+        SD_Lz4.HeaderDirty = true;
+        ErrorState = SD_Lz4_Sync();
+    }
+    if (ErrorState != SD_OK) {
+        return ErrorState;
+    }
+
+    SD_Lz4Device.pOps        = &SD_Lz4Ops;
+    SD_Lz4Device.pLower      = pLower;
+    SD_Lz4Device.pName       = "lz4";
+    SD_Lz4Device.pPrivate    = &SD_Lz4;
+    SD_Lz4Device.Blocks      = (uint64_t)SD_LZ4_CHUNKS * SD_LZ4_CHUNK_BLOCKS;
+    SD_Lz4Device.Offset      = 0;
+    SD_Lz4Device.EraseBlocks = SD_LZ4_CHUNK_BLOCKS;
+    SD_Lz4Device.Caps        = SD_BLOCKDEV_CAP_ANY_BUFFER | SD_BLOCKDEV_CAP_VOLATILE |
+                               (pLower->Caps & (SD_BLOCKDEV_CAP_PERSISTENT | SD_BLOCKDEV_CAP_READ_ONLY));
+    *ppDev = &SD_Lz4Device;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads a chunk into pChunk, decompressing it when needed. Chunks never written read as zeros.
+  * @retval SD Card error state, SD_ERROR for a chunk that does not decompress to its full size
+  */
+static SD_Error_t SD_Lz4_Load(uint32_t Chunk, uint8_t *pChunk)
+{
+    uint32_t   Entry  = SD_Lz4Map[Chunk];
+    uint32_t   Blocks = Entry & 0x0F;
+    uint32_t   Bytes, Start;
+    SD_Error_t ErrorState;
+    int32_t    Length;
+
+    if (Entry == SD_LZ4_UNMAPPED) {
+        memset(pChunk, 0, SD_LZ4_CHUNK_SIZE);
+        return SD_OK;
+    }
+    if (Blocks == SD_LZ4_CHUNK_BLOCKS) {
+        return SD_Lz4_Transfer(false, SD_LZ4_DATA_START + (Entry >> 4), pChunk, Blocks);
+    }
+    if ((ErrorState = SD_Lz4_Transfer(false, SD_LZ4_DATA_START + (Entry >> 4), SD_Lz4Stage, Blocks)) != SD_OK) {
+        return ErrorState;
+    }
+
+    Start  = DWT->CYCCNT;
+    Bytes  = SD_Lz4Stage[0] | ((uint32_t)SD_Lz4Stage[1] << 8);
+    Length = ((Bytes + 2) <= (Blocks * SD_BLOCKDEV_BLOCK_SIZE)) ? SD_Lz4_Decompress(&SD_Lz4Stage[2], Bytes, pChunk, SD_LZ4_CHUNK_SIZE) : -1;
+    SD_Lz4Stats.DecompressCycles += DWT->CYCCNT - Start;
+    if (Length != SD_LZ4_CHUNK_SIZE) {
+        SD_Lz4Stats.Errors++;
+        return SD_ERROR;
+    }
+    SD_Lz4Stats.DecompressedBytes += SD_LZ4_CHUNK_SIZE;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Compresses the open chunk if it is dirty and writes it, in place when it fits its old extent.
+  *         The chunk stays open, later reads of it are served from memory.
+  */
+static SD_Error_t SD_Lz4_Commit(void)
+{
+    uint32_t   Entry, Block, Blocks;
+    uint32_t   Start = DWT->CYCCNT;
+    uint8_t   *pData = SD_Lz4Stage;
+    SD_Error_t ErrorState;
+    int32_t    Bytes;
+
+    if (SD_Lz4.Dirty == false) {
+        return SD_OK;
+    }
+
+    // Only worth it when at least one block is saved
+    Bytes = SD_Lz4_Compress(SD_Lz4Chunk, SD_LZ4_CHUNK_SIZE, &SD_Lz4Stage[2], (SD_LZ4_CHUNK_BLOCKS - 1) * SD_BLOCKDEV_BLOCK_SIZE - 2);
+    SD_Lz4Stats.CompressCycles += DWT->CYCCNT - Start;
+    if (Bytes < 0) {
+        pData  = SD_Lz4Chunk;
+        Blocks = SD_LZ4_CHUNK_BLOCKS;
+    } else {
+        SD_Lz4Stage[0] = (uint8_t)Bytes;
+        SD_Lz4Stage[1] = (uint8_t)(Bytes >> 8);
+        Blocks = (Bytes + 2 + SD_BLOCKDEV_BLOCK_SIZE - 1) / SD_BLOCKDEV_BLOCK_SIZE;
+        memset(&SD_Lz4Stage[Bytes + 2], 0, Blocks * SD_BLOCKDEV_BLOCK_SIZE - (Bytes + 2));
+    }
+
+    Entry = SD_Lz4Map[SD_Lz4.Open];
+    if ((Entry != SD_LZ4_UNMAPPED) && ((Entry & 0x0F) >= Blocks)) {
+        Block = Entry >> 4;
+    } else {
+        if ((SD_Lz4.Head + Blocks) > SD_Lz4.DataBlocks) {
+            return SD_ADDR_OUT_OF_RANGE;
+        }
+        Block               = SD_Lz4.Head;
+        SD_Lz4.Head        += Blocks;
+        SD_Lz4.HeaderDirty  = true;
+    }
+    if ((ErrorState = SD_Lz4_Transfer(true, SD_LZ4_DATA_START + Block, pData, Blocks)) != SD_OK) {
+        return ErrorState;
+    }
+
+    SD_Lz4Map[SD_Lz4.Open] = (Block << 4) | Blocks;
+    SD_Lz4.MapDirty[(SD_Lz4.Open / SD_LZ4_MAP_PER_BLOCK) / 32] |= 1U << ((SD_Lz4.Open / SD_LZ4_MAP_PER_BLOCK) % 32);
+    SD_Lz4.Dirty = false;
+    if (Bytes < 0) {
+        SD_Lz4Stats.Stored++;
+    } else {
+        SD_Lz4Stats.Compressed++;
+    }
+    SD_Lz4Stats.InBytes  += SD_LZ4_CHUNK_SIZE;
+    SD_Lz4Stats.OutBytes += Blocks * SD_BLOCKDEV_BLOCK_SIZE;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Commits the open chunk, then writes the map blocks it changed in runs and the header last.
+  */
+static SD_Error_t SD_Lz4_Sync(void)
+{
+    SD_Lz4Header_t *pHeader = (SD_Lz4Header_t*)SD_Lz4Stage;
+    SD_Error_t      ErrorState;
+    uint32_t        Block = 0, Run;
+
+    if ((ErrorState = SD_Lz4_Commit()) != SD_OK) {
+        return ErrorState;
+    }
+
+    while (Block < SD_LZ4_MAP_BLOCKS) {
+        if ((SD_Lz4.MapDirty[Block / 32] & (1U << (Block % 32))) == 0) {
+            Block++;
+            continue;
+        }
+        for (Run = 0; ((Block + Run) < SD_LZ4_MAP_BLOCKS) && (SD_Lz4.MapDirty[(Block + Run) / 32] & (1U << ((Block + Run) % 32))); Run++) {
+            SD_Lz4.MapDirty[(Block + Run) / 32] &= ~(1U << ((Block + Run) % 32));
+        }
+        if ((ErrorState = SD_Lz4_Transfer(true, 1 + Block, (uint8_t*)&SD_Lz4Map[Block * SD_LZ4_MAP_PER_BLOCK], Run)) != SD_OK) {
+            return ErrorState;
+        }
+        SD_Lz4Stats.MapWrites += Run;
+        Block += Run;
+    }
+
+    if (SD_Lz4.HeaderDirty == true) {
+        memset(SD_Lz4Stage, 0, SD_BLOCKDEV_BLOCK_SIZE);
+        pHeader->Magic       = SD_LZ4_MAGIC;
+        pHeader->Version     = SD_LZ4_VERSION;
+        pHeader->Chunks      = SD_LZ4_CHUNKS;
+        pHeader->ChunkBlocks = SD_LZ4_CHUNK_BLOCKS;
+        pHeader->DataBlocks  = SD_Lz4.DataBlocks;
+        pHeader->Head        = SD_Lz4.Head;
+        if ((ErrorState = SD_Lz4_Transfer(true, 0, SD_Lz4Stage, 1)) != SD_OK) {
+            return ErrorState;
+        }
+        SD_Lz4.HeaderDirty = false;
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Lz4_Transfer(bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    volatile SD_Error_t Status = SD_BUSY;
+    SD_Error_t          ErrorState;
+
+    if (Write == true) {
+        ErrorState = SD_BlockDev_Write(SD_Lz4.pLower, Lba, pBuffer, NumberOfBlocks, 0, SD_Lz4_TransferDone, (void*)&Status);
+    } else {
+        ErrorState = SD_BlockDev_Read(SD_Lz4.pLower, Lba, pBuffer, NumberOfBlocks, SD_Lz4_TransferDone, (void*)&Status);
+    }
+    if (ErrorState != SD_OK) {
+        return ErrorState;
+    }
+    while (Status == SD_BUSY) {
+        SD_BlockDev_Process(SD_Lz4.pLower);
+    }
+    return Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Lz4_TransferDone(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context)
+{
+    (void)pDev;
+    *(volatile SD_Error_t*)Context = Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Greedy LZ4 block encoder. Candidates come from a hash of the next four bytes, matches are
+  *         extended a word at a time with the first differing byte found by RBIT and CLZ, the search
+  *         steps faster through data that does not match.
+  * @param  Limit: Output capacity, the encoder gives up rather than exceed it
+  * @retval Compressed length, -1 when it did not fit in Limit
+  */
+static int32_t SD_Lz4_Compress(const uint8_t *pSrc, uint32_t Length, uint8_t *pDst, uint32_t Limit)
+{
+    uint32_t Ip = 1, Anchor = 0, Op = 0;
+    uint32_t MatchLimit = Length - SD_LZ4_LAST_LITERALS;
+    uint32_t InputLimit = Length - SD_LZ4_MF_LIMIT;
+    uint32_t Literals, Remain;
+
+    memset(SD_Lz4Hash, 0, sizeof(SD_Lz4Hash));
+
+    while (Ip < InputLimit) {
+        uint32_t Sequence = SD_LZ4_READ32(&pSrc[Ip]);
+        uint32_t Hash     = SD_LZ4_HASH(Sequence);
+        uint32_t Ref      = SD_Lz4Hash[Hash];
+        uint32_t Match, Diff;
+        uint8_t *pToken;
+
+        SD_Lz4Hash[Hash] = (uint16_t)Ip;
+        if (SD_LZ4_READ32(&pSrc[Ref]) != Sequence) {
+            Ip += 1 + ((Ip - Anchor) >> SD_LZ4_SKIP_TRIGGER);
+            continue;
+        }
+
+        while ((Ip > Anchor) && (Ref > 0) && (pSrc[Ip - 1] == pSrc[Ref - 1])) {
+            Ip--;
+            Ref--;
+        }
+        Match = SD_LZ4_MIN_MATCH;
+        while ((Ip + Match + 4) <= MatchLimit) {
+            if ((Diff = SD_LZ4_READ32(&pSrc[Ip + Match]) ^ SD_LZ4_READ32(&pSrc[Ref + Match])) != 0) {
+                Match += __CLZ(__RBIT(Diff)) >> 3;
+                break;
+            }
+            Match += 4;
+        }
+        if ((Ip + Match + 4) > MatchLimit) {
+            while (((Ip + Match) < MatchLimit) && (pSrc[Ip + Match] == pSrc[Ref + Match])) {
+                Match++;
+            }
+        }
+
+        Literals = Ip - Anchor;
+        if ((Op + Literals + (Literals / 255) + (Match / 255) + 5) > Limit) {
+            return -1;
+        }
+        pToken = &pDst[Op++];
+        if (Literals >= 15) {
+            *pToken = 15 << 4;
+            for (Remain = Literals - 15; Remain >= 255; Remain -= 255) {
+                pDst[Op++] = 255;
+            }
+            pDst[Op++] = (uint8_t)Remain;
+        } else {
+            *pToken = (uint8_t)(Literals << 4);
+        }
+        memcpy(&pDst[Op], &pSrc[Anchor], Literals);
+        Op += Literals;
+        pDst[Op++] = (uint8_t)(Ip - Ref);
+        pDst[Op++] = (uint8_t)((Ip - Ref) >> 8);
+        if ((Match - SD_LZ4_MIN_MATCH) >= 15) {
+            *pToken |= 15;
+            for (Remain = Match - SD_LZ4_MIN_MATCH - 15; Remain >= 255; Remain -= 255) {
+                pDst[Op++] = 255;
+            }
+            pDst[Op++] = (uint8_t)Remain;
+        } else {
+            *pToken |= (uint8_t)(Match - SD_LZ4_MIN_MATCH);
+        }
+
+        Ip    += Match;
+        Anchor = Ip;
+        if (Ip < InputLimit) {
+            SD_Lz4Hash[SD_LZ4_HASH(SD_LZ4_READ32(&pSrc[Ip - 2]))] = (uint16_t)(Ip - 2);
+        }
+    }
+
+    Literals = Length - Anchor;
+    if ((Op + Literals + (Literals / 255) + 2) > Limit) {
+        return -1;
+    }
+    if (Literals >= 15) {
+        pDst[Op++] = 15 << 4;
+        for (Remain = Literals - 15; Remain >= 255; Remain -= 255) {
+            pDst[Op++] = 255;
+        }
+        pDst[Op++] = (uint8_t)Remain;
+    } else {
+        pDst[Op++] = (uint8_t)(Literals << 4);
+    }
+    memcpy(&pDst[Op], &pSrc[Anchor], Literals);
+    return (int32_t)(Op + Literals);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  LZ4 block decoder, checks every length against both buffers so a corrupt chunk cannot overrun.
+  *         Matches at least a word back are copied a word at a time.
+  * @retval Decompressed length, -1 for malformed input
+  */
+static int32_t SD_Lz4_Decompress(const uint8_t *pSrc, uint32_t Length, uint8_t *pDst, uint32_t Capacity)
+{
+    uint32_t Ip = 0, Op = 0;
+    uint32_t Literals, Match, Offset, Byte;
+
+    while (Ip < Length) {
+        uint32_t Token = pSrc[Ip++];
+
+        Literals = Token >> 4;
+        if (Literals == 15) {
+            do {
+                if (Ip >= Length) {
+                    return -1;
+                }
+                Byte      = pSrc[Ip++];
+                Literals += Byte;
+            } while (Byte == 255);
+        }
+        if ((Literals > (Length - Ip)) || (Literals > (Capacity - Op))) {
+            return -1;
+        }
+        memcpy(&pDst[Op], &pSrc[Ip], Literals);
+        Ip += Literals;
+        Op += Literals;
+        if (Ip == Length) {
+            break;
+        }
+
+        if ((Length - Ip) < 2) {
+            return -1;
+        }
+        Offset = pSrc[Ip] | ((uint32_t)pSrc[Ip + 1] << 8);
+        Ip    += 2;
+        if ((Offset == 0) || (Offset > Op)) {
+            return -1;
+        }
+        Match = Token & 0x0F;
+        if (Match == 15) {
+            do {
+                if (Ip >= Length) {
+                    return -1;
+                }
+                Byte   = pSrc[Ip++];
+                Match += Byte;
+            } while (Byte == 255);
+        }
+        Match += SD_LZ4_MIN_MATCH;
+        if (Match > (Capacity - Op)) {
+            return -1;
+        }
+
+        if (Offset >= 4) {
+            for (; Match >= 4; Match -= 4, Op += 4) {
+                __UNALIGNED_UINT32(&pDst[Op]) = __UNALIGNED_UINT32(&pDst[Op - Offset]);
+            }
+        }
+        for (; Match != 0; Match--, Op++) {
+            pDst[Op] = pDst[Op - Offset];
+        }
+    }
+    return (int32_t)Op;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#else
+
+SD_Error_t SD_Lz4_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    (void)pLower;
+    (void)ppDev;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Lz4_Format(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    (void)pLower;
+    (void)ppDev;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+void SD_Lz4_GetStats(SD_Lz4Stats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+void SD_Lz4_ResetStats(void)
+{
+}
+
+void SD_Lz4_Print(void)
+{
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
@@ -0,0 +1,453 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_part.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_PART_MBR_TABLE               446
+#define SD_PART_MBR_ENTRY               16
+#define SD_PART_MBR_SIGNATURE           510
+#define SD_PART_MBR_PROTECTIVE          0xEE
+
+#define SD_PART_GPT_HEADER_MIN          92
+#define SD_PART_GPT_ENTRY_MIN           128
+#define SD_PART_GPT_ENTRIES_MAX         1024   // Spec minimum is 128, anything far beyond is corruption
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint64_t FirstUsable;
+    uint64_t LastUsable;
+    uint64_t EntryLba;
+    uint32_t Entries;
+    uint32_t EntrySize;
+    uint32_t EntriesCrc;
+} SD_PartGpt_t;
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_PartTable_t              SD_PartTable;
+static SD_PartInfo_t               SD_PartInfo[SD_PART_MAX];
+static SD_BlockDev_t               SD_PartDevice[SD_PART_MAX];
+static SD_BlockDev_t              *SD_PartDisk;
+static uint8_t                     SD_PartSector[SD_BLOCKDEV_BLOCK_SIZE] __attribute__((section(".ram_d1"), aligned(32)));
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_Part_Read                (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Part_Write               (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Part_Discard             (SD_BlockDev_t *pDev, uint64_t Lba, uint64_t NumberOfBlocks);
+static SD_Error_t       SD_Part_ParseMbr            (void);
+static SD_Error_t       SD_Part_ParseGpt            (void);
+static SD_Error_t       SD_Part_ReadGptHeader       (uint64_t Lba, SD_PartGpt_t *pGpt);
+static SD_Error_t       SD_Part_ReadGptEntries      (const SD_PartGpt_t *pGpt);
+static SD_Error_t       SD_Part_Add                 (uint64_t Start, uint64_t Blocks, uint8_t MbrType, const uint8_t *pTypeGuid, const char *pName);
+static SD_Error_t       SD_Part_Validate            (void);
+static uint32_t         SD_Part_Crc32               (uint32_t Crc, const uint8_t *pData, uint32_t Length);
+static uint32_t         SD_Part_Get32               (const uint8_t *pData);
+static uint64_t         SD_Part_Get64               (const uint8_t *pData);
+
+static const SD_BlockDevOps_t      SD_PartOps =
+{
+    .Read       = SD_Part_Read,
+    .Write      = SD_Part_Write,
+    .Discard    = SD_Part_Discard,
+};
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads the partition table of a disk. GPT is used when the MBR holds a protective entry, the
+  *         backup header at the end of the disk stands in for a damaged primary. Every partition must lie
+  *         inside the disk (GPT: inside the usable area) and must not overlap another one, otherwise
+  *         nothing is exposed. Starts off the allocation unit are accepted but counted as misaligned.
+  * @param  pDisk: Whole disk, usually SD_BlockDev_Default()
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Part_Mount(SD_BlockDev_t *pDisk)
+{
+    SD_Error_t ErrorState;
+    bool       Protective = false;
+
+    memset(&SD_PartTable, 0, sizeof(SD_PartTable));
+    memset(SD_PartInfo, 0, sizeof(SD_PartInfo));
+    SD_PartDisk              = pDisk;
+    SD_PartTable.EraseBlocks = pDisk->EraseBlocks ? pDisk->EraseBlocks : 1;
+
+    if ((ErrorState = SD_BlockDev_ReadSync(pDisk, 0, SD_PartSector, 1)) != SD_OK) {
+        return ErrorState;
+    }
+    if ((SD_PartSector[SD_PART_MBR_SIGNATURE] != 0x55) || (SD_PartSector[SD_PART_MBR_SIGNATURE + 1] != 0xAA)) {
+        return SD_OK;
+    }
+    for (uint32_t i = 0; i < 4; i++) {
+        if (SD_PartSector[SD_PART_MBR_TABLE + i * SD_PART_MBR_ENTRY + 4] == SD_PART_MBR_PROTECTIVE) {
+            Protective = true;
+        }
+    }
+
+    if (Protective) {
+        SD_PartTable.Scheme = SD_PART_SCHEME_GPT;
+        ErrorState          = SD_Part_ParseGpt();
+    } else {
+        SD_PartTable.Scheme = SD_PART_SCHEME_MBR;
+        ErrorState          = SD_Part_ParseMbr();
+    }
+    if ((ErrorState == SD_OK) && ((ErrorState = SD_Part_Validate()) == SD_OK)) {
+        return SD_OK;
+    }
+    SD_PartTable.Count      = 0;
+    SD_PartTable.Misaligned = 0;
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+const SD_PartTable_t *SD_Part_GetTable(void)
+{
+    return &SD_PartTable;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+const SD_PartInfo_t *SD_Part_GetInfo(uint8_t Index)
+{
+    return (Index < SD_PartTable.Count) ? &SD_PartInfo[Index] : NULL;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_BlockDev_t *SD_Part_GetDevice(uint8_t Index)
+{
+    return (Index < SD_PartTable.Count) ? &SD_PartDevice[Index] : NULL;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Part_Print(void)
+{
+    static const char *Scheme[] = { "none", "MBR", "GPT" };
+    const SD_PartInfo_t *pInfo;
+
+    printf("SD partitions: %s, %u found, AU %lu blocks%s\n", Scheme[SD_PartTable.Scheme], SD_PartTable.Count,
+           SD_PartTable.EraseBlocks, SD_PartTable.BackupGpt ? ", backup GPT" : "");
+    for (uint8_t i = 0; i < SD_PartTable.Count; i++) {
+        pInfo = &SD_PartInfo[i];
+        printf("  %u %-16s type %02x start %-10lu blocks %-10lu%s\n", i, pInfo->Name, pInfo->MbrType, (uint32_t)pInfo->Start,
+               (uint32_t)pInfo->Blocks, pInfo->Aligned ? "" : " MISALIGNED");
+    }
+    if (SD_PartTable.Misaligned) {
+        printf("  warning: %u partition(s) not aligned to the %lu KB allocation unit, writes will straddle AUs\n",
+               SD_PartTable.Misaligned, SD_PartTable.EraseBlocks / 2);
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Part_Read(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                               SD_BlockDevCallback_t Callback, void *Context)
+{
+    return SD_BlockDev_Forward(pDev, false, Lba, pBuffer, NumberOfBlocks, 0, Callback, Context);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Part_Write(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                                SD_BlockDevCallback_t Callback, void *Context)
+{
+    return SD_BlockDev_Forward(pDev, true, Lba, (uint8_t*)pBuffer, NumberOfBlocks, Flags, Callback, Context);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Part_Discard(SD_BlockDev_t *pDev, uint64_t Lba, uint64_t NumberOfBlocks)
+{
+    return SD_BlockDev_Discard(pDev->pLower, pDev->Offset + Lba, NumberOfBlocks);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Primary entries of the MBR in SD_PartSector, logical partitions of an extended one through
+  *         its EBR chain. EBR entries are relative, the logical one to its EBR, the link to the extended
+  *         partition.
+  */
+static SD_Error_t SD_Part_ParseMbr(void)
+{
+    uint8_t    Table[4 * SD_PART_MBR_ENTRY];
+    uint64_t   Extended = 0, Ebr;
+    SD_Error_t ErrorState;
+    char       Name[SD_PART_NAME_LENGTH];
+    uint8_t    Type, Index = 0;
+
+    memcpy(Table, &SD_PartSector[SD_PART_MBR_TABLE], sizeof(Table));
+    for (uint32_t i = 0; i < 4; i++) {
+        Type = Table[i * SD_PART_MBR_ENTRY + 4];
+        if (Type == 0) {
+            continue;
+        }
+        if ((Type == 0x05) || (Type == 0x0F) || (Type == 0x85)) {
+            Extended = SD_Part_Get32(&Table[i * SD_PART_MBR_ENTRY + 8]);
+            continue;
+        }
+        snprintf(Name, sizeof(Name), "mbr%u", Index++);
+        if ((ErrorState = SD_Part_Add(SD_Part_Get32(&Table[i * SD_PART_MBR_ENTRY + 8]), SD_Part_Get32(&Table[i * SD_PART_MBR_ENTRY + 12]),
+                                      Type, NULL, Name)) != SD_OK) {
+            return ErrorState;
+        }
+    }
+
+    Ebr = Extended;
+    for (uint32_t Links = 0; Extended && (Links < SD_PART_MAX_EBR); Links++) {
+        if ((ErrorState = SD_BlockDev_ReadSync(SD_PartDisk, Ebr, SD_PartSector, 1)) != SD_OK) {
+            return ErrorState;
+        }
+        if ((SD_PartSector[SD_PART_MBR_SIGNATURE] != 0x55) || (SD_PartSector[SD_PART_MBR_SIGNATURE + 1] != 0xAA)) {
+            return SD_ERROR;
+        }
+        if ((Type = SD_PartSector[SD_PART_MBR_TABLE + 4]) != 0) {
+            snprintf(Name, sizeof(Name), "mbr%u", Index++);
+            if ((ErrorState = SD_Part_Add(Ebr + SD_Part_Get32(&SD_PartSector[SD_PART_MBR_TABLE + 8]),
+                                          SD_Part_Get32(&SD_PartSector[SD_PART_MBR_TABLE + 12]), Type, NULL, Name)) != SD_OK) {
+                return ErrorState;
+            }
+        }
+        if (SD_PartSector[SD_PART_MBR_TABLE + SD_PART_MBR_ENTRY + 4] == 0) {
+            break;
+        }
+        Ebr = Extended + SD_Part_Get32(&SD_PartSector[SD_PART_MBR_TABLE + SD_PART_MBR_ENTRY + 8]);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Part_ParseGpt(void)
+{
+    SD_PartGpt_t Gpt;
+    SD_Error_t   ErrorState;
+
+    if (((ErrorState = SD_Part_ReadGptHeader(1, &Gpt)) == SD_OK) && ((ErrorState = SD_Part_ReadGptEntries(&Gpt)) == SD_OK)) {
+        return SD_OK;
+    }
+
+    // Whatever was added from the damaged primary is dropped
+    SD_PartTable.Count     = 0;
+    SD_PartTable.Ignored   = 0;
+    SD_PartTable.BackupGpt = true;
+    if ((ErrorState = SD_Part_ReadGptHeader(SD_PartDisk->Blocks - 1, &Gpt)) != SD_OK) {
+        return ErrorState;
+    }
+    return SD_Part_ReadGptEntries(&Gpt);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads and checks a GPT header, signature, header CRC, its own location and the usable range.
+  */
+static SD_Error_t SD_Part_ReadGptHeader(uint64_t Lba, SD_PartGpt_t *pGpt)
+{
+    SD_Error_t ErrorState;
+    uint32_t   Size, Crc;
+
+    if ((ErrorState = SD_BlockDev_ReadSync(SD_PartDisk, Lba, SD_PartSector, 1)) != SD_OK) {
+        return ErrorState;
+    }
+    Size = SD_Part_Get32(&SD_PartSector[12]);
+    if ((memcmp(SD_PartSector, "EFI PART", 8) != 0) || (Size < SD_PART_GPT_HEADER_MIN) || (Size > SD_BLOCKDEV_BLOCK_SIZE)) {
+        return SD_ERROR;
+    }
+    Crc = SD_Part_Get32(&SD_PartSector[16]);
+    memset(&SD_PartSector[16], 0, 4);
+    if ((SD_Part_Crc32(0xFFFFFFFF, SD_PartSector, Size) ^ 0xFFFFFFFF) != Crc) {
+        return SD_ERROR;
+    }
+
+    pGpt->FirstUsable = SD_Part_Get64(&SD_PartSector[40]);
+    pGpt->LastUsable  = SD_Part_Get64(&SD_PartSector[48]);
+    pGpt->EntryLba    = SD_Part_Get64(&SD_PartSector[72]);
+    pGpt->Entries     = SD_Part_Get32(&SD_PartSector[80]);
+    pGpt->EntrySize   = SD_Part_Get32(&SD_PartSector[84]);
+    pGpt->EntriesCrc  = SD_Part_Get32(&SD_PartSector[88]);
+
+    if ((SD_Part_Get64(&SD_PartSector[24]) != Lba) || (pGpt->FirstUsable > pGpt->LastUsable) ||
+        (pGpt->LastUsable >= SD_PartDisk->Blocks) || (pGpt->Entries > SD_PART_GPT_ENTRIES_MAX) ||
+        (pGpt->EntrySize < SD_PART_GPT_ENTRY_MIN) || (pGpt->EntrySize > SD_BLOCKDEV_BLOCK_SIZE) ||
+        ((SD_BLOCKDEV_BLOCK_SIZE % pGpt->EntrySize) != 0)) {
+        return SD_ERROR;
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Walks the entry array block by block, the CRC covers all of it, used or not.
+  */
+static SD_Error_t SD_Part_ReadGptEntries(const SD_PartGpt_t *pGpt)
+{
+    static const uint8_t Unused[16] = { 0 };
+    uint32_t             PerBlock = SD_BLOCKDEV_BLOCK_SIZE / pGpt->EntrySize;
+    uint32_t             Crc      = 0xFFFFFFFF;
+    uint64_t             First, Last;
+    SD_Error_t           ErrorState;
+    uint8_t             *pEntry;
+    char                 Name[SD_PART_NAME_LENGTH];
+    uint32_t             Index    = 0;
+
+    for (uint64_t Lba = pGpt->EntryLba; Index < pGpt->Entries; Lba++) {
+        if ((ErrorState = SD_BlockDev_ReadSync(SD_PartDisk, Lba, SD_PartSector, 1)) != SD_OK) {
+            return ErrorState;
+        }
+        for (uint32_t i = 0; (i < PerBlock) && (Index < pGpt->Entries); i++, Index++) {
+            pEntry = &SD_PartSector[i * pGpt->EntrySize];
+            Crc    = SD_Part_Crc32(Crc, pEntry, pGpt->EntrySize);
+            if (memcmp(pEntry, Unused, sizeof(Unused)) == 0) {
+                continue;
+            }
+            First = SD_Part_Get64(&pEntry[32]);
+            Last  = SD_Part_Get64(&pEntry[40]);
+            if ((First < pGpt->FirstUsable) || (Last > pGpt->LastUsable) || (Last < First)) {
+                return SD_ADDR_OUT_OF_RANGE;
+            }
+            // UTF-16LE name, anything outside ASCII becomes '?'
+            memset(Name, 0, sizeof(Name));
+            for (uint32_t c = 0; c < (SD_PART_NAME_LENGTH - 1); c++) {
+                uint16_t Char = pEntry[56 + c * 2] | (pEntry[57 + c * 2] << 8);
+                if (Char == 0) break;
+                Name[c] = ((Char >= 0x20) && (Char < 0x7F)) ? (char)Char : '?';
+            }
+            if ((ErrorState = SD_Part_Add(First, Last - First + 1, SD_PART_MBR_PROTECTIVE, pEntry, Name)) != SD_OK) {
+                return ErrorState;
+            }
+        }
+    }
+    return ((Crc ^ 0xFFFFFFFF) == pGpt->EntriesCrc) ? SD_OK : SD_ERROR;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Records a partition and sets up its block device.
+  */
+static SD_Error_t SD_Part_Add(uint64_t Start, uint64_t Blocks, uint8_t MbrType, const uint8_t *pTypeGuid, const char *pName)
+{
+    SD_PartInfo_t *pInfo;
+    SD_BlockDev_t *pDev;
+
+    if ((Start == 0) || (Blocks == 0) || (Start >= SD_PartDisk->Blocks) || (Blocks > (SD_PartDisk->Blocks - Start))) {
+        return SD_ADDR_OUT_OF_RANGE;
+    }
+    if (SD_PartTable.Count >= SD_PART_MAX) {
+        SD_PartTable.Ignored++;
+        return SD_OK;
+    }
+
+    pInfo          = &SD_PartInfo[SD_PartTable.Count];
+    pInfo->Start   = Start;
+    pInfo->Blocks  = Blocks;
+    pInfo->MbrType = MbrType;
+    pInfo->Aligned = (Start % SD_PartTable.EraseBlocks) == 0;
+    if (pTypeGuid) {
+        memcpy(pInfo->TypeGuid, pTypeGuid, sizeof(pInfo->TypeGuid));
+    }
+    strncpy(pInfo->Name, pName, SD_PART_NAME_LENGTH - 1);
+
+    pDev              = &SD_PartDevice[SD_PartTable.Count];
+    memset(pDev, 0, sizeof(*pDev));
+    pDev->pOps        = &SD_PartOps;
+    pDev->pLower      = SD_PartDisk;
+    pDev->pName       = pInfo->Name;
+    pDev->Blocks      = Blocks;
+    pDev->Offset      = Start;
+    pDev->EraseBlocks = SD_PartDisk->EraseBlocks;
+    pDev->Caps        = SD_PartDisk->Caps;
+
+    SD_PartTable.Count++;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Part_Validate(void)
+{
+    SD_PartInfo_t *pA, *pB;
+
+    for (uint8_t i = 0; i < SD_PartTable.Count; i++) {
+        pA = &SD_PartInfo[i];
+        for (uint8_t j = i + 1; j < SD_PartTable.Count; j++) {
+            pB = &SD_PartInfo[j];
+            if ((pA->Start < (pB->Start + pB->Blocks)) && (pB->Start < (pA->Start + pA->Blocks))) {
+                return SD_ERROR;
+            }
+        }
+        if (!pA->Aligned) {
+            SD_PartTable.Misaligned++;
+        }
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reflected CRC-32 as used by GPT, continued across calls, start with and finally xor 0xFFFFFFFF.
+  */
+static uint32_t SD_Part_Crc32(uint32_t Crc, const uint8_t *pData, uint32_t Length)
+{
+    while (Length--) {
+        Crc ^= *pData++;
+        for (uint32_t Bit = 0; Bit < 8; Bit++) {
+            Crc = (Crc >> 1) ^ (0xEDB88320 & (0 - (Crc & 1)));
+        }
+    }
+    return Crc;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint32_t SD_Part_Get32(const uint8_t *pData)
+{
+    return (uint32_t)pData[0] | ((uint32_t)pData[1] << 8) | ((uint32_t)pData[2] << 16) | ((uint32_t)pData[3] << 24);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint64_t SD_Part_Get64(const uint8_t *pData)
+{
+    return (uint64_t)SD_Part_Get32(pData) | ((uint64_t)SD_Part_Get32(&pData[4]) << 32);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
@@ -0,0 +1,282 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_trace.h"
+#include "sd_powerfail.h"
+
+#ifdef SDMMC_POWER_FAIL
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    SD_PowerFailHook_t  Hook;
+    void               *Context;
+} SD_PowerFailHookEntry_t;
+
+typedef struct
+{
+    volatile SD_PowerFailState_t State;
+    uint32_t                HoldupUs;
+    uint32_t                Start;              // CYCCNT when the threshold was crossed
+    uint8_t                 Hooks;
+    SD_PowerFailHookEntry_t Hook[SD_POWERFAIL_HOOKS];
+    SD_PowerFailStats_t     Stats;
+} SD_PowerFail_t;
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_PowerFail_t              SD_PowerFail;
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static void             SD_PowerFail_Stage          (SD_PowerFailStage_t Stage);
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Configures the PVD on both edges and arms the service. The interrupt sits just below SDMMC
+  *         so the in-flight transfer can finish underneath it.
+  * @param  PVDLevel: PWR_PVDLEVEL_x threshold
+  * @param  HoldupUs: Time the supply is guaranteed to stay usable after crossing the threshold
+  */
+void SD_PowerFail_Init(uint32_t PVDLevel, uint32_t HoldupUs)
+{
+    PWR_PVDTypeDef Config;
+
+    SD_PowerFail.HoldupUs              = HoldupUs;
+    SD_PowerFail.Stats.MinRemainingUs  = (int32_t)HoldupUs;
+    SD_PowerFail.Stats.LastRemainingUs = (int32_t)HoldupUs;
+
+    Config.PVDLevel = PVDLevel;
+    Config.Mode     = PWR_PVD_MODE_IT_RISING_FALLING;
+    HAL_PWR_ConfigPVD(&Config);
+    HAL_PWR_EnablePVD();
+
+    NVIC_SetPriority(PVD_AVD_IRQn, NVIC_EncodePriority(NVIC_GetPriorityGrouping(), SD_POWERFAIL_IRQ_PRIORITY, 0));
+    NVIC_EnableIRQ(PVD_AVD_IRQn);
+
+    SD_PowerFail.State = SD_POWERFAIL_ARMED;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_PowerFail_RegisterHook(SD_PowerFailHook_t Hook, void *Context)
+{
+    if (Hook == NULL) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (SD_PowerFail.Hooks >= SD_POWERFAIL_HOOKS) {
+        return SD_BUSY;
+    }
+    SD_PowerFail.Hook[SD_PowerFail.Hooks].Hook    = Hook;
+    SD_PowerFail.Hook[SD_PowerFail.Hooks].Context = Context;
+    SD_PowerFail.Hooks++;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_PowerFailState_t SD_PowerFail_GetState(void)
+{
+    return SD_PowerFail.State;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+bool SD_PowerFail_IsArmed(void)
+{
+    return SD_PowerFail.State == SD_POWERFAIL_ARMED;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Hold-up budget left since the threshold was crossed.
+  * @retval Microseconds, the full budget while armed, negative once overrun
+  */
+int32_t SD_PowerFail_RemainingUs(void)
+{
+    uint32_t Elapsed;
+
+    if (SD_PowerFail.State <= SD_POWERFAIL_ARMED) {
+        return (int32_t)SD_PowerFail.HoldupUs;
+    }
+    Elapsed = (DWT->CYCCNT - SD_PowerFail.Start) / (SystemCoreClock / 1000000);
+    return (int32_t)SD_PowerFail.HoldupUs - (int32_t)Elapsed;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_PowerFail_GetStats(SD_PowerFailStats_t *pStats)
+{
+    *pStats = SD_PowerFail.Stats;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Checked by the driver before a write is started. Only the last-gasp hooks may write once
+  *         the supply is going down.
+  */
+bool SD_PowerFail_WriteAllowed(void)
+{
+    return (SD_PowerFail.State <= SD_POWERFAIL_ARMED) || (SD_PowerFail.State == SD_POWERFAIL_FLUSHING);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_PowerFail_Stage(SD_PowerFailStage_t Stage)
+{
+    SD_TRACE(SD_TRACE_POWER, Stage, 0, SD_PowerFail_RemainingUs());
+    (void)Stage;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  PVD interrupt body. On the way down: refuse new writes, let the data phase in flight end
+  *         (the SDMMC interrupt sends CMD12 after a CMD25), wait for busy end, run the hooks and
+  *         flush the card cache. Every wait is bounded by the hold-up budget, a transfer that cannot
+  *         finish in time is aborted rather than left running into the power cut.
+  *         On the way up the service re-arms.
+  */
+void SD_PowerFail_Service(void)
+{
+    if (SD_PowerFail.State == SD_POWERFAIL_OFF) {
+        return;
+    }
+
+    // PVDO set means VDD is below the threshold
+    if (!__HAL_PWR_GET_FLAG(PWR_FLAG_PVDO)) {
+        if (SD_PowerFail.State != SD_POWERFAIL_ARMED) {
+            SD_PowerFail.State = SD_POWERFAIL_ARMED;
+            SD_PowerFail.Stats.Recoveries++;
+            SD_PowerFail_Stage(SD_POWERFAIL_STAGE_RECOVERED);
+        }
+        return;
+    }
+    if (SD_PowerFail.State != SD_POWERFAIL_ARMED) {
+        return;
+    }
+
+    SD_PowerFail.Start = DWT->CYCCNT;
+    SD_PowerFail.State = SD_POWERFAIL_DRAINING;
+    SD_PowerFail.Stats.Events++;
+    SD_PowerFail_Stage(SD_POWERFAIL_STAGE_DETECTED);
+
+    // Data phase in flight, legacy or queued, ends in the SDMMC interrupt
+    while ((SD_CheckWrite() == SD_BUSY) || (SD_CheckRead() == SD_BUSY)) {
+        if (SD_PowerFail_RemainingUs() <= 0) {
+            SD_AbortTransfer();
+            SD_PowerFail.Stats.Aborted++;
+            break;
+        }
+    }
+    SD_PowerFail_Stage(SD_POWERFAIL_STAGE_DRAINED);
+
+    while (SD_GetState() == false) {
+        if (SD_PowerFail_RemainingUs() <= 0) break;
+    }
+    SD_PowerFail_Stage(SD_POWERFAIL_STAGE_IDLE);
+
+    SD_PowerFail.State = SD_POWERFAIL_FLUSHING;
+    for (uint8_t i = 0; i < SD_PowerFail.Hooks; i++) {
+        SD_PowerFail.Hook[i].Hook(SD_PowerFail_RemainingUs(), SD_PowerFail.Hook[i].Context);
+    }
+    SD_PowerFail_Stage(SD_POWERFAIL_STAGE_HOOKS);
+
+    // Hooks may have left data in the card's volatile cache
+    if (SD_CardCacheIsEnabled() && (SD_PowerFail_RemainingUs() > 0)) {
+        SD_CardCacheFlush();
+    }
+    SD_PowerFail.State = SD_POWERFAIL_DONE;
+
+    SD_PowerFail.Stats.LastRemainingUs = SD_PowerFail_RemainingUs();
+    if (SD_PowerFail.Stats.LastRemainingUs < SD_PowerFail.Stats.MinRemainingUs) {
+        SD_PowerFail.Stats.MinRemainingUs = SD_PowerFail.Stats.LastRemainingUs;
+    }
+    SD_PowerFail_Stage(SD_POWERFAIL_STAGE_DONE);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void PVD_AVD_IRQHandler(void)
+{
+    __HAL_PWR_PVD_EXTI_CLEAR_FLAG();
+    SD_PowerFail_Service();
+}
+
+#else
+
+void SD_PowerFail_Init(uint32_t PVDLevel, uint32_t HoldupUs)
+{
+    (void)PVDLevel;
+    (void)HoldupUs;
+}
+
+SD_Error_t SD_PowerFail_RegisterHook(SD_PowerFailHook_t Hook, void *Context)
+{
+    (void)Hook;
+    (void)Context;
+    return SD_UNSUPPORTED_FEATURE;
+}
+
+SD_PowerFailState_t SD_PowerFail_GetState(void)
+{
+    return SD_POWERFAIL_OFF;
+}
+
+bool SD_PowerFail_IsArmed(void)
+{
+    return false;
+}
+
+int32_t SD_PowerFail_RemainingUs(void)
+{
+    return 0;
+}
+
+void SD_PowerFail_GetStats(SD_PowerFailStats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+bool SD_PowerFail_WriteAllowed(void)
+{
+    return true;
+}
+
+void SD_PowerFail_Service(void)
+{
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
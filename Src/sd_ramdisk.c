@@ -0,0 +1,198 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_ramdisk.h"
+
+#ifdef SDMMC_RAMDISK
+
+/*
+ * Two arrays of blocks, one in each of the SRAM domains the card stack does not otherwise use, seen
+ * as one device. Every block starts on a cache line, so a block handed out by SD_RamDisk_GetBlock can
+ * be cleaned or invalidated without touching its neighbours. Requests are a memcpy, which makes the
+ * device a reference with no media latency: the same transfer through the same stack against the
+ * card and against the RAM disk separates the card's share from the USB and SCSI overhead.
+ */
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_BlockDev_t               SD_RamDiskDevice;
+static uint8_t                     SD_RamDiskD2[SD_RAMDISK_D2_BLOCKS][SD_BLOCKDEV_BLOCK_SIZE] __attribute__((section(".ram_d2"), aligned(32)));
+#if SD_RAMDISK_D3_BLOCKS
+static uint8_t                     SD_RamDiskD3[SD_RAMDISK_D3_BLOCKS][SD_BLOCKDEV_BLOCK_SIZE] __attribute__((section(".ram_d3"), aligned(32)));
+#endif
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_RamDisk_Read             (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_RamDisk_Write            (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_RamDisk_Discard          (SD_BlockDev_t *pDev, uint64_t Lba, uint64_t NumberOfBlocks);
+static uint32_t         SD_RamDisk_Run              (uint64_t Lba, uint64_t NumberOfBlocks);
+
+static const SD_BlockDevOps_t      SD_RamDiskOps =
+{
+    .Read       = SD_RamDisk_Read,
+    .Write      = SD_RamDisk_Write,
+    .Discard    = SD_RamDisk_Discard,
+};
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_RamDisk_Init(SD_BlockDev_t **ppDev)
+{
+    if (ppDev == NULL) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    // SRAM4 runs with the D3 domain, SRAM1-3 have their own clock enables
+    __HAL_RCC_D2SRAM1_CLK_ENABLE();
+    __HAL_RCC_D2SRAM2_CLK_ENABLE();
+    __HAL_RCC_D2SRAM3_CLK_ENABLE();
+
+    if (SD_RamDiskDevice.pOps == NULL) {
+        // .ram_d2 and .ram_d3 are NOLOAD and the startup code does not zero them
+        SD_RamDisk_Discard(&SD_RamDiskDevice, 0, SD_RAMDISK_BLOCKS);
+        SD_RamDiskDevice.pOps        = &SD_RamDiskOps;
+        SD_RamDiskDevice.pLower      = NULL;
+        SD_RamDiskDevice.pName       = "ramdisk";
+        SD_RamDiskDevice.pPrivate    = NULL;
+        SD_RamDiskDevice.Blocks      = SD_RAMDISK_BLOCKS;
+        SD_RamDiskDevice.Offset      = 0;
+        SD_RamDiskDevice.EraseBlocks = 1;
+        SD_RamDiskDevice.Caps        = SD_BLOCKDEV_CAP_ANY_BUFFER | SD_BLOCKDEV_CAP_DISCARD;
+    }
+    *ppDev = &SD_RamDiskDevice;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+uint8_t *SD_RamDisk_GetBlock(uint64_t Lba)
+{
+    if (Lba < SD_RAMDISK_D2_BLOCKS) {
+        return SD_RamDiskD2[Lba];
+    }
+#if SD_RAMDISK_D3_BLOCKS
+    if (Lba < SD_RAMDISK_BLOCKS) {
+        return SD_RamDiskD3[Lba - SD_RAMDISK_D2_BLOCKS];
+    }
+#endif
+    return NULL;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_RamDisk_Read(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                                  SD_BlockDevCallback_t Callback, void *Context)
+{
+    while (NumberOfBlocks > 0) {
+        uint32_t Count = SD_RamDisk_Run(Lba, NumberOfBlocks);
+
+        memcpy(pBuffer, SD_RamDisk_GetBlock(Lba), Count * SD_BLOCKDEV_BLOCK_SIZE);
+        Lba            += Count;
+        pBuffer        += Count * SD_BLOCKDEV_BLOCK_SIZE;
+        NumberOfBlocks -= Count;
+    }
+    if (Callback != NULL) {
+        Callback(pDev, SD_OK, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Durable as far as RAM goes once copied, FUA needs nothing more.
+  */
+static SD_Error_t SD_RamDisk_Write(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                                   SD_BlockDevCallback_t Callback, void *Context)
+{
+    (void)Flags;
+    while (NumberOfBlocks > 0) {
+        uint32_t Count = SD_RamDisk_Run(Lba, NumberOfBlocks);
+
+        memcpy(SD_RamDisk_GetBlock(Lba), pBuffer, Count * SD_BLOCKDEV_BLOCK_SIZE);
+        Lba            += Count;
+        pBuffer        += Count * SD_BLOCKDEV_BLOCK_SIZE;
+        NumberOfBlocks -= Count;
+    }
+    if (Callback != NULL) {
+        Callback(pDev, SD_OK, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Discarded blocks read back as zeroes.
+  */
+static SD_Error_t SD_RamDisk_Discard(SD_BlockDev_t *pDev, uint64_t Lba, uint64_t NumberOfBlocks)
+{
+    (void)pDev;
+    while (NumberOfBlocks > 0) {
+        uint32_t Count = SD_RamDisk_Run(Lba, NumberOfBlocks);
+
+        memset(SD_RamDisk_GetBlock(Lba), 0, Count * SD_BLOCKDEV_BLOCK_SIZE);
+        Lba            += Count;
+        NumberOfBlocks -= Count;
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @retval Blocks from Lba on that are contiguous in memory, a request crossing into D3 is split there
+  */
+static uint32_t SD_RamDisk_Run(uint64_t Lba, uint64_t NumberOfBlocks)
+{
+    uint64_t End = (Lba < SD_RAMDISK_D2_BLOCKS) ? SD_RAMDISK_D2_BLOCKS : SD_RAMDISK_BLOCKS;
+
+    return (uint32_t)(((Lba + NumberOfBlocks) > End) ? (End - Lba) : NumberOfBlocks);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#else
+
+SD_Error_t SD_RamDisk_Init(SD_BlockDev_t **ppDev)
+{
+    (void)ppDev;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+uint8_t *SD_RamDisk_GetBlock(uint64_t Lba)
+{
+    (void)Lba;
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
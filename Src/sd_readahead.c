@@ -0,0 +1,544 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_readahead.h"
+#include "sd_sched.h"
+
+#ifdef SDMMC_READAHEAD
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_READAHEAD_WORDS              (SD_BLOCKDEV_BLOCK_SIZE / 4)
+#define SD_READAHEAD_NONE               (-1)
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_READAHEAD_EMPTY      = 0,
+    SD_READAHEAD_INFLIGHT   = 1,
+    SD_READAHEAD_VALID      = 2,
+} SD_ReadAheadState_t;
+
+typedef struct
+{
+    uint64_t Lba;
+    uint32_t Count;
+    uint32_t Used;                      // Blocks handed out, re-reads count again
+    uint32_t LastUse;
+    uint8_t  State;
+    bool     Stale;                     // Written while in flight, dropped on completion
+} SD_ReadAheadBuffer_t;
+
+typedef struct
+{
+    uint64_t NextLba;                   // Where the next request continues the stream
+    uint64_t PrefetchLba;               // First block not prefetched yet
+    uint32_t Window;                    // Blocks of the next prefetch, 0 until the stream is sequential
+    uint32_t Sequential;                // Back to back requests seen
+    uint32_t LastUse;
+} SD_ReadAheadStream_t;
+
+typedef struct
+{
+    bool                 Enabled;
+    bool                 Issuing;       // Our own SD_ReadBlocks_DMA call, not foreground activity
+    bool                 Queued;        // The prefetch in flight was submitted to pLower, it completes from there
+    int8_t               InFlight;      // Buffer being filled, the driver runs one transfer at a time
+    SD_BlockDev_t       *pLower;        // Layer below, set by SD_BlockDev_ReadAhead
+    uint32_t             Clock;         // Request counter for LRU decisions
+    SD_ReadAheadStream_t Stream[SD_READAHEAD_STREAMS];
+    SD_ReadAheadBuffer_t Buffer[SD_READAHEAD_BUFFERS];
+    SD_ReadAheadStats_t  Stats;
+} SD_ReadAhead_t;
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_ReadAhead_t              SD_ReadAhead = { .InFlight = SD_READAHEAD_NONE };
+static uint32_t                    SD_ReadAheadData[SD_READAHEAD_BUFFERS][SD_READAHEAD_MAX_BLOCKS * SD_READAHEAD_WORDS] __attribute__((section(".ram_d1"), aligned(32)));
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_ReadAheadStream_t *SD_ReadAhead_FindStream(uint64_t Lba, bool *pSequential);
+static int32_t          SD_ReadAhead_FindBuffer     (uint64_t Lba);
+static int32_t          SD_ReadAhead_Victim         (const SD_ReadAheadStream_t *pStream);
+static void             SD_ReadAhead_Issue          (SD_ReadAheadStream_t *pStream);
+static void             SD_ReadAhead_Complete       (bool Wait);
+static void             SD_ReadAhead_Finish         (SD_Error_t Status);
+static void             SD_ReadAhead_Done           (SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+static uint32_t         SD_ReadAhead_Unread         (const SD_ReadAheadBuffer_t *pBuf);
+static SD_BlockDev_t   *SD_ReadAhead_Lower          (void);
+static SD_Error_t       SD_ReadAhead_CardRead       (uint64_t Lba, uint32_t *pBuffer, uint32_t NumberOfBlocks);
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_ReadAhead_Enable(void)
+{
+    SD_ReadAhead_Disable();
+    memset(&SD_ReadAhead.Stats, 0, sizeof(SD_ReadAhead.Stats));
+    SD_ReadAhead.Enabled = true;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_ReadAhead_Disable(void)
+{
+    SD_ReadAhead_Complete(true);
+    SD_ReadAhead.Enabled = false;
+    memset(SD_ReadAhead.Stream, 0, sizeof(SD_ReadAhead.Stream));
+    memset(SD_ReadAhead.Buffer, 0, sizeof(SD_ReadAhead.Buffer));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads blocks, serving them from prefetch windows where possible. A request continuing a
+  *         stream grows its window and starts the next prefetch before returning, so the card
+  *         transfers the following window while the caller consumes this one.
+  * @param  Lba: First block
+  * @param  pBuffer: Destination, DMA reachable
+  * @param  NumberOfBlocks: Number of blocks
+  * @retval SD Card error state
+  */
+SD_Error_t SD_ReadAhead_Read(uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    SD_ReadAheadStream_t *pStream;
+    SD_ReadAheadBuffer_t *pBuf;
+    SD_Error_t            ErrorState;
+    bool                  Sequential;
+    uint32_t              i = 0, Run, Offset;
+    int32_t               Idx;
+
+    if (!SD_ReadAhead.Enabled) {
+        return SD_ReadAhead_CardRead(Lba, (uint32_t*)pBuffer, NumberOfBlocks);
+    }
+
+    SD_ReadAhead.Clock++;
+    SD_ReadAhead.Stats.Requests++;
+    SD_ReadAhead_Complete(false);
+
+    while (i < NumberOfBlocks) {
+        if ((Idx = SD_ReadAhead_FindBuffer(Lba + i)) != SD_READAHEAD_NONE) {
+            pBuf = &SD_ReadAhead.Buffer[Idx];
+            if (pBuf->State == SD_READAHEAD_INFLIGHT) {
+                // Caller caught up with the card, the window may still turn out stale or failed
+                SD_ReadAhead.Stats.Waits++;
+                SD_ReadAhead_Complete(true);
+                continue;
+            }
+            Offset = (uint32_t)(Lba + i - pBuf->Lba);
+            Run    = ((pBuf->Count - Offset) < (NumberOfBlocks - i)) ? (pBuf->Count - Offset) : (NumberOfBlocks - i);
+            memcpy(&pBuffer[i * SD_BLOCKDEV_BLOCK_SIZE], &SD_ReadAheadData[Idx][Offset * SD_READAHEAD_WORDS], Run * SD_BLOCKDEV_BLOCK_SIZE);
+            pBuf->Used    += Run;
+            pBuf->LastUse  = SD_ReadAhead.Clock;
+            SD_ReadAhead.Stats.HitBlocks += Run;
+            i += Run;
+            continue;
+        }
+
+        Run = 1;
+        while (((i + Run) < NumberOfBlocks) && (SD_ReadAhead_FindBuffer(Lba + i + Run) == SD_READAHEAD_NONE)) {
+            Run++;
+        }
+        SD_ReadAhead_Complete(true);
+        if ((ErrorState = SD_ReadAhead_CardRead(Lba + i, (uint32_t*)&pBuffer[i * SD_BLOCKDEV_BLOCK_SIZE], Run)) != SD_OK) {
+            return ErrorState;
+        }
+        SD_ReadAhead.Stats.MissBlocks += Run;
+        i += Run;
+    }
+
+    pStream = SD_ReadAhead_FindStream(Lba, &Sequential);
+    if (Sequential) {
+        pStream->Sequential++;
+        SD_ReadAhead.Stats.Sequential++;
+    } else {
+        pStream->Sequential  = 0;
+        pStream->Window      = 0;
+        pStream->PrefetchLba = Lba + NumberOfBlocks;
+    }
+    pStream->NextLba = Lba + NumberOfBlocks;
+    pStream->LastUse = SD_ReadAhead.Clock;
+    if (pStream->PrefetchLba < pStream->NextLba) {
+        pStream->PrefetchLba = pStream->NextLba;
+    }
+    if ((pStream->Sequential >= SD_READAHEAD_TRIGGER) && (pStream->Window == 0)) {
+        pStream->Window = SD_READAHEAD_MIN_BLOCKS;
+    }
+    SD_ReadAhead_Issue(pStream);
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_ReadAhead_Process(void)
+{
+    if (!SD_ReadAhead.Enabled) {
+        return;
+    }
+    SD_ReadAhead_Complete(false);
+    for (uint32_t i = 0; (i < SD_READAHEAD_STREAMS) && (SD_ReadAhead.InFlight == SD_READAHEAD_NONE); i++) {
+        SD_ReadAhead_Issue(&SD_ReadAhead.Stream[i]);
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_ReadAhead_GetStats(SD_ReadAheadStats_t *pStats)
+{
+    *pStats = SD_ReadAhead.Stats;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Sets the layer demand reads and prefetches go to, called by SD_BlockDev_ReadAhead().
+  */
+void SD_ReadAhead_SetLower(SD_BlockDev_t *pLower)
+{
+    SD_ReadAhead.pLower = pLower;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Called by the driver on entry of every foreground request. A prefetch in flight is allowed
+  *         to finish rather than aborted, its window is usually what the next request wants. One queued
+  *         on the layer below is ordered by that layer, which is what calls the driver then.
+  */
+void SD_ReadAhead_Preempt(void)
+{
+    if (SD_ReadAhead.Issuing || SD_ReadAhead.Queued || (SD_ReadAhead.InFlight == SD_READAHEAD_NONE)) {
+        return;
+    }
+    SD_ReadAhead.Stats.Preempts++;
+    SD_ReadAhead_Complete(true);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Called by the driver for every write before it is issued. Overlapping windows are dropped,
+  *         a window still in flight is dropped when it completes. Streams re-prefetch the range.
+  * @param  Lba: First block written
+  * @param  NumberOfBlocks: Number of blocks
+  */
+void SD_ReadAhead_Invalidate(uint64_t Lba, uint32_t NumberOfBlocks)
+{
+    SD_ReadAheadBuffer_t *pBuf;
+    SD_ReadAheadStream_t *pStream;
+
+    for (uint32_t i = 0; i < SD_READAHEAD_BUFFERS; i++) {
+        pBuf = &SD_ReadAhead.Buffer[i];
+        if ((pBuf->State == SD_READAHEAD_EMPTY) || (Lba >= (pBuf->Lba + pBuf->Count)) || ((Lba + NumberOfBlocks) <= pBuf->Lba)) {
+            continue;
+        }
+        if (pBuf->State == SD_READAHEAD_INFLIGHT) {
+            pBuf->Stale = true;
+        } else {
+            pBuf->State = SD_READAHEAD_EMPTY;
+        }
+        SD_ReadAhead.Stats.Invalidated += SD_ReadAhead_Unread(pBuf);
+    }
+
+    for (uint32_t i = 0; i < SD_READAHEAD_STREAMS; i++) {
+        pStream = &SD_ReadAhead.Stream[i];
+        if ((Lba < pStream->PrefetchLba) && ((Lba + NumberOfBlocks) > pStream->NextLba)) {
+            pStream->PrefetchLba = (Lba > pStream->NextLba) ? Lba : pStream->NextLba;
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Finds the stream a request continues, or recycles the least recently used one.
+  * @param  pSequential: Set when the request starts where the stream stopped
+  */
+static SD_ReadAheadStream_t *SD_ReadAhead_FindStream(uint64_t Lba, bool *pSequential)
+{
+    SD_ReadAheadStream_t *pOldest = &SD_ReadAhead.Stream[0];
+
+    for (uint32_t i = 0; i < SD_READAHEAD_STREAMS; i++) {
+        if ((SD_ReadAhead.Stream[i].LastUse != 0) && (SD_ReadAhead.Stream[i].NextLba == Lba)) {
+            *pSequential = true;
+            return &SD_ReadAhead.Stream[i];
+        }
+        if (SD_ReadAhead.Stream[i].LastUse < pOldest->LastUse) {
+            pOldest = &SD_ReadAhead.Stream[i];
+        }
+    }
+    *pSequential = false;
+    return pOldest;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static int32_t SD_ReadAhead_FindBuffer(uint64_t Lba)
+{
+    SD_ReadAheadBuffer_t *pBuf;
+
+    for (int32_t i = 0; i < SD_READAHEAD_BUFFERS; i++) {
+        pBuf = &SD_ReadAhead.Buffer[i];
+        if ((pBuf->State != SD_READAHEAD_EMPTY) && !pBuf->Stale && (Lba >= pBuf->Lba) && (Lba < (pBuf->Lba + pBuf->Count))) {
+            return i;
+        }
+    }
+    return SD_READAHEAD_NONE;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Picks the buffer for a new window. Empty ones first, then the least recently used window
+  *         that is not the one the stream is reading from right now.
+  */
+static int32_t SD_ReadAhead_Victim(const SD_ReadAheadStream_t *pStream)
+{
+    SD_ReadAheadBuffer_t *pBuf;
+    int32_t               Victim = SD_READAHEAD_NONE;
+
+    for (int32_t i = 0; i < SD_READAHEAD_BUFFERS; i++) {
+        pBuf = &SD_ReadAhead.Buffer[i];
+        if (pBuf->State == SD_READAHEAD_EMPTY) {
+            return i;
+        }
+        if ((pBuf->State == SD_READAHEAD_INFLIGHT) ||
+            ((pStream->NextLba >= pBuf->Lba) && (pStream->NextLba < (pBuf->Lba + pBuf->Count)))) {
+            continue;
+        }
+        if ((Victim == SD_READAHEAD_NONE) || (pBuf->LastUse < SD_ReadAhead.Buffer[Victim].LastUse)) {
+            Victim = i;
+        }
+    }
+    return Victim;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Starts the next window of a sequential stream once less than a window is left ahead of the
+  *         reader. Never waits, the prefetch is skipped when the card is busy with something else.
+  */
+static void SD_ReadAhead_Issue(SD_ReadAheadStream_t *pStream)
+{
+    SD_BlockDev_t        *pLower = SD_ReadAhead_Lower();
+    SD_ReadAheadBuffer_t *pBuf;
+    uint64_t              Blocks = SD_GetBlockCount();
+    uint32_t              Count  = pStream->Window;
+    SD_Error_t            ErrorState;
+    int32_t               Idx;
+
+    if ((pStream->Window == 0) || (SD_ReadAhead.InFlight != SD_READAHEAD_NONE) ||
+        ((pStream->PrefetchLba - pStream->NextLba) >= pStream->Window) || (pStream->PrefetchLba >= Blocks) ||
+        !SD_IsIdle() || !SD_Sched_IsIdle()) {
+        return;
+    }
+    if ((Idx = SD_ReadAhead_Victim(pStream)) == SD_READAHEAD_NONE) {
+        return;
+    }
+    if ((pStream->PrefetchLba + Count) > Blocks) {
+        Count = (uint32_t)(Blocks - pStream->PrefetchLba);
+    }
+
+    pBuf = &SD_ReadAhead.Buffer[Idx];
+    if (pBuf->State == SD_READAHEAD_VALID) {
+        SD_ReadAhead.Stats.Unused += SD_ReadAhead_Unread(pBuf);
+    }
+    pBuf->Lba             = pStream->PrefetchLba;
+    pBuf->Count           = Count;
+    pBuf->Used            = 0;
+    pBuf->LastUse         = SD_ReadAhead.Clock;
+    pBuf->Stale           = false;
+    pBuf->State           = SD_READAHEAD_INFLIGHT;
+    SD_ReadAhead.InFlight = (int8_t)Idx;
+
+    // A synchronous layer below would hold the reader for the whole window, the idle card is driven directly
+    if (pLower->Caps & SD_BLOCKDEV_CAP_ASYNC) {
+        SD_ReadAhead.Queued = true;
+        ErrorState = SD_BlockDev_Read(pLower, pStream->PrefetchLba, (uint8_t*)SD_ReadAheadData[Idx], Count, SD_ReadAhead_Done, NULL);
+    } else {
+        SD_ReadAhead.Issuing = true;
+        ErrorState = SD_ReadBlocks_DMA(pStream->PrefetchLba, SD_ReadAheadData[Idx], SD_BLOCKDEV_BLOCK_SIZE, Count);
+        SD_ReadAhead.Issuing = false;
+    }
+    if (ErrorState != SD_OK) {
+        pBuf->State           = SD_READAHEAD_EMPTY;
+        SD_ReadAhead.InFlight = SD_READAHEAD_NONE;
+        SD_ReadAhead.Queued   = false;
+        // Command queue holding the card is not a failure, the window is retried on the next request
+        if (ErrorState != SD_BUSY) {
+            SD_ReadAhead.Stats.Errors++;
+        }
+        return;
+    }
+    if (SD_ReadAhead.Queued) {
+        // Starts it on the card now instead of on the next request
+        SD_BlockDev_Process(pLower);
+    }
+
+    pStream->PrefetchLba += Count;
+    pStream->Window       = ((pStream->Window * 2) < SD_READAHEAD_MAX_BLOCKS) ? (pStream->Window * 2) : SD_READAHEAD_MAX_BLOCKS;
+    SD_ReadAhead.Stats.Prefetches++;
+    SD_ReadAhead.Stats.PrefetchedBlocks += Count;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Collects the prefetch in flight.
+  * @param  Wait: Block until it is done, otherwise return if it is still running
+  */
+static void SD_ReadAhead_Complete(bool Wait)
+{
+    if (SD_ReadAhead.InFlight == SD_READAHEAD_NONE) {
+        return;
+    }
+    if (SD_ReadAhead.Queued) {
+        do {
+            SD_BlockDev_Process(SD_ReadAhead.pLower);
+        } while (Wait && (SD_ReadAhead.InFlight != SD_READAHEAD_NONE));
+        return;
+    }
+    if (!Wait && (SD_CheckRead() == SD_BUSY)) {
+        return;
+    }
+    while (SD_CheckRead());
+    while (SD_GetState() == false);
+    SD_ReadAhead_Finish(SD_GetTransferError());
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Makes the window in flight valid, or drops it when it failed or was written meanwhile.
+  */
+static void SD_ReadAhead_Finish(SD_Error_t Status)
+{
+    SD_ReadAheadBuffer_t *pBuf = &SD_ReadAhead.Buffer[SD_ReadAhead.InFlight];
+
+    SD_ReadAhead.InFlight = SD_READAHEAD_NONE;
+    SD_ReadAhead.Queued   = false;
+    if (Status != SD_OK) {
+        SD_ReadAhead.Stats.Errors++;
+        pBuf->State = SD_READAHEAD_EMPTY;
+    } else {
+        pBuf->State = pBuf->Stale ? SD_READAHEAD_EMPTY : SD_READAHEAD_VALID;
+    }
+    pBuf->Stale = false;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_ReadAhead_Done(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context)
+{
+    (void)pDev;
+    (void)Context;
+    SD_ReadAhead_Finish(Status);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint32_t SD_ReadAhead_Unread(const SD_ReadAheadBuffer_t *pBuf)
+{
+    return (pBuf->Used < pBuf->Count) ? (pBuf->Count - pBuf->Used) : 0;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Layer the read-ahead is stacked on. Used without the block device stack it builds it on first use.
+  */
+static SD_BlockDev_t *SD_ReadAhead_Lower(void)
+{
+    if (SD_ReadAhead.pLower == NULL) {
+        SD_BlockDev_ReadAhead();
+    }
+    return SD_ReadAhead.pLower;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_ReadAhead_CardRead(uint64_t Lba, uint32_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    // Demand reads compete with everything else queued below, prefetches only use an idle card
+    return SD_BlockDev_ReadSync(SD_ReadAhead_Lower(), Lba, (uint8_t*)pBuffer, NumberOfBlocks);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#else
+
+void SD_ReadAhead_Enable(void)
+{
+}
+
+void SD_ReadAhead_Disable(void)
+{
+}
+
+SD_Error_t SD_ReadAhead_Read(uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    SD_Error_t ErrorState;
+
+    if ((ErrorState = SD_ReadBlocks_DMA(Lba, (uint32_t*)pBuffer, SD_BLOCKDEV_BLOCK_SIZE, NumberOfBlocks)) != SD_OK) {
+        return ErrorState;
+    }
+    while (SD_CheckRead());
+    while (SD_GetState() == false);
+    return SD_GetTransferError();
+}
+
+void SD_ReadAhead_Process(void)
+{
+}
+
+void SD_ReadAhead_GetStats(SD_ReadAheadStats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+void SD_ReadAhead_Preempt(void)
+{
+}
+
+void SD_ReadAhead_Invalidate(uint64_t Lba, uint32_t NumberOfBlocks)
+{
+    (void)Lba;
+    (void)NumberOfBlocks;
+}
+
+void SD_ReadAhead_SetLower(SD_BlockDev_t *pLower)
+{
+    (void)pLower;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
@@ -0,0 +1,681 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_rs.h"
+
+#ifdef SDMMC_RS
+
+/*
+ * Systematic Reed-Solomon erasure code over GF(2^8), polynomial 0x11D. Every stripe of SD_RS_DATA
+ * blocks is followed on the lower device by SD_RS_PARITY parity blocks, parity j byte n being the sum
+ * of Coef[j][i] * data i byte n. Coef is a Cauchy matrix, so any SD_RS_DATA blocks out of a stripe
+ * determine the rest, scaled so that its first row and column are all ones: parity 0 is a plain XOR
+ * and every parity block starts as a copy of data block 0.
+ *
+ * A block is multiplied four bytes at a time with the ARMv7E-M SIMD instructions: UADD8 of a word
+ * with itself shifts every byte left on its own and sets the GE flag of each byte that overflowed,
+ * SEL then picks the reduction polynomial for exactly those bytes. That doubles four field elements
+ * in three instructions, a constant multiplier is a sum of doublings.
+ *
+ * Only the card's own read errors are handled, a stripe whose blocks read back without error is
+ * trusted, silent corruption needs a checksum above this layer.
+ */
+
+#if (SD_RS_DATA < 1) || (SD_RS_PARITY < 1) || (SD_RS_STRIPE_BLOCKS > 32)
+#error "SD_RS_DATA + SD_RS_PARITY must be at most 32 blocks"
+#endif
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_RS_WORDS                     (SD_BLOCKDEV_BLOCK_SIZE / sizeof(uint32_t))
+#define SD_RS_STRIPE_WORDS              (SD_RS_STRIPE_BLOCKS * SD_RS_WORDS)
+#define SD_RS_POLY                      0x11D
+#define SD_RS_POLY4                     0x1D1D1D1D  // Low byte of the polynomial in every lane
+#define SD_RS_ALL                       (0xFFFFFFFFUL >> (32 - SD_RS_STRIPE_BLOCKS))
+#define SD_RS_DATA_MASK                 (0xFFFFFFFFUL >> (32 - SD_RS_DATA))
+#define SD_RS_PARITY_MASK               (SD_RS_ALL & ~SD_RS_DATA_MASK)
+
+#define SD_RS_MEDIA_ERROR(e)            (((e) == SD_DATA_CRC_FAIL) || ((e) == SD_CARD_ECC_FAILED))
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_RsStats_t                SD_RsStats;
+static SD_BlockDev_t               SD_RsDevice;
+static bool                        SD_RsTables;
+static uint8_t                     SD_RsExp[512];
+static uint8_t                     SD_RsLog[256];
+static uint8_t                     SD_RsCoef[SD_RS_PARITY][SD_RS_DATA];
+// Decode matrix, the rows of the surviving blocks next to the identity that becomes their inverse
+static uint8_t                     SD_RsMatrix[SD_RS_DATA][2 * SD_RS_DATA];
+// Whole stripes with their parity, one is encoded while the other is written
+static uint32_t                    SD_RsStage[2][SD_RS_STAGE_STRIPES * SD_RS_STRIPE_WORDS] __attribute__((section(".ram_d1"), aligned(32)));
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_Rs_Read                  (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Rs_Write                 (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Rs_Transfer              (bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags);
+static void             SD_Rs_TransferDone          (SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+static SD_Error_t       SD_Rs_ReadStripe            (uint64_t Stripe, uint32_t *pStripe);
+static SD_Error_t       SD_Rs_Recover               (uint64_t Stripe, uint32_t *pStripe);
+static SD_Error_t       SD_Rs_Code                  (uint32_t *pStripe, uint32_t Valid, uint32_t Wanted);
+static SD_Error_t       SD_Rs_Rebuild               (uint32_t *pStripe, uint32_t Valid, uint32_t Wanted);
+static void             SD_Rs_MulAdd                (uint32_t *pDst, const uint32_t *pSrc, uint8_t Coef);
+static void             SD_Rs_InitTables            (void);
+static uint8_t          SD_Rs_Mul                   (uint8_t a, uint8_t b);
+static uint8_t          SD_Rs_Inv                   (uint8_t a);
+
+static const SD_BlockDevOps_t      SD_RsOps =
+{
+    .Read       = SD_Rs_Read,
+    .Write      = SD_Rs_Write,
+};
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Stacks the erasure coded layer on pLower. Stripe n occupies blocks n * SD_RS_STRIPE_BLOCKS
+  *         onwards, so the device above is SD_RS_DATA / SD_RS_STRIPE_BLOCKS of pLower, and whole stripe
+  *         writes, its EraseBlocks, go out as a single multi-block write with their parity.
+  * @param  pLower: Device holding the archive, the card or a partition
+  * @param  ppDev: Receives the protected device
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Rs_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    if ((pLower == NULL) || (ppDev == NULL) || (pLower->Blocks < SD_RS_STRIPE_BLOCKS)) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    if (SD_RsTables == false) {
+        SD_Rs_InitTables();
+    }
+    memset(&SD_RsStats, 0, sizeof(SD_RsStats));
+
+    SD_RsDevice.pOps        = &SD_RsOps;
+    SD_RsDevice.pLower      = pLower;
+    SD_RsDevice.pName       = "rs";
+    SD_RsDevice.pPrivate    = NULL;
+    SD_RsDevice.Blocks      = (pLower->Blocks / SD_RS_STRIPE_BLOCKS) * SD_RS_DATA;
+    SD_RsDevice.Offset      = 0;
+    SD_RsDevice.EraseBlocks = SD_RS_DATA;
+    SD_RsDevice.Caps        = SD_BLOCKDEV_CAP_ANY_BUFFER |
+                              (pLower->Caps & (SD_BLOCKDEV_CAP_VOLATILE | SD_BLOCKDEV_CAP_PERSISTENT | SD_BLOCKDEV_CAP_READ_ONLY));
+    *ppDev = &SD_RsDevice;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Rs_EncodeStripe(uint8_t *pStripe)
+{
+    if ((pStripe == NULL) || (((uint32_t)pStripe & 3) != 0)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (SD_RsTables == false) {
+        SD_Rs_InitTables();
+    }
+    return SD_Rs_Code((uint32_t*)pStripe, SD_RS_DATA_MASK, SD_RS_PARITY_MASK);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Rebuilds lost blocks of a stripe in place.
+  * @param  pStripe: Stripe as read from the card, the blocks in Erased are overwritten
+  * @param  Erased: Lost blocks, at most SD_RS_PARITY of them
+  * @retval SD Card error state, SD_ERROR when too many blocks are lost
+  */
+SD_Error_t SD_Rs_DecodeStripe(uint8_t *pStripe, uint32_t Erased)
+{
+    if ((pStripe == NULL) || (((uint32_t)pStripe & 3) != 0) || ((Erased & ~SD_RS_ALL) != 0)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (__builtin_popcount(Erased) > SD_RS_PARITY) {
+        return SD_ERROR;
+    }
+    if (SD_RsTables == false) {
+        SD_Rs_InitTables();
+    }
+    return SD_Rs_Code((uint32_t*)pStripe, SD_RS_ALL & ~Erased, Erased);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Coding throughput without the card, KB/s per MHz being bytes per cycle as for SD_Xts_Benchmark.
+  *         Encode must keep up with the card write rate, decode only runs for stripes with lost blocks.
+  * @param  pBuffer: One stripe of scratch, SD_RS_STRIPE_BLOCKS blocks, word aligned
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Rs_Benchmark(uint8_t *pBuffer, SD_RsBench_t *pResult)
+{
+    uint32_t Bytes = SD_RS_DATA * SD_BLOCKDEV_BLOCK_SIZE;
+    uint32_t Erased = 0, Start, Encode, Decode;
+
+    if ((pBuffer == NULL) || (((uint32_t)pBuffer & 3) != 0) || (pResult == NULL)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (SD_RsTables == false) {
+        SD_Rs_InitTables();
+    }
+    for (uint32_t Block = 0; (Block < SD_RS_PARITY) && (Block < SD_RS_DATA); Block++) {
+        Erased |= 1UL << Block;
+    }
+
+    Start  = DWT->CYCCNT;
+    SD_Rs_Rebuild((uint32_t*)pBuffer, SD_RS_DATA_MASK, SD_RS_PARITY_MASK);
+    Encode = DWT->CYCCNT - Start;
+    Start  = DWT->CYCCNT;
+    SD_Rs_Rebuild((uint32_t*)pBuffer, SD_RS_ALL & ~Erased, Erased);
+    Decode = DWT->CYCCNT - Start;
+    Encode = (Encode != 0) ? Encode : 1;
+    Decode = (Decode != 0) ? Decode : 1;
+
+    pResult->EncodeCyclesPerByte = (uint32_t)(((uint64_t)Encode * 100) / Bytes);
+    pResult->DecodeCyclesPerByte = (uint32_t)(((uint64_t)Decode * 100) / Bytes);
+    pResult->EncodeKBsPerMHz     = (uint32_t)(((uint64_t)Bytes * 1000) / Encode);
+    pResult->DecodeKBsPerMHz     = (uint32_t)(((uint64_t)Bytes * 1000) / Decode);
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Rs_GetStats(SD_RsStats_t *pStats)
+{
+    *pStats = SD_RsStats;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads up to SD_RS_STAGE_STRIPES stripes at a time as one span, parity blocks in between
+  *         included, which costs less than a command per stripe. A span that fails with a CRC or card ECC
+  *         error is read again stripe by stripe, rebuilding what cannot be read.
+  */
+static SD_Error_t SD_Rs_Read(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                             SD_BlockDevCallback_t Callback, void *Context)
+{
+    uint8_t   *pStage = (uint8_t*)SD_RsStage[0];
+    SD_Error_t ErrorState = SD_OK;
+    uint64_t   Next = Lba, End = Lba + NumberOfBlocks, Last, Run, First;
+
+    while ((Next < End) && (ErrorState == SD_OK)) {
+        Last  = ((Next / SD_RS_DATA) + SD_RS_STAGE_STRIPES) * SD_RS_DATA;
+        Last  = (Last < End) ? Last : End;
+        First = (Next / SD_RS_DATA) * SD_RS_STRIPE_BLOCKS + (Next % SD_RS_DATA);
+
+        ErrorState = SD_Rs_Transfer(false, First, pStage, (uint32_t)((((Last - 1) / SD_RS_DATA) * SD_RS_STRIPE_BLOCKS +
+                                                                      ((Last - 1) % SD_RS_DATA)) - First + 1), 0);
+        if (SD_RS_MEDIA_ERROR(ErrorState)) {
+            ErrorState = SD_OK;
+            for (; (Next < Last) && (ErrorState == SD_OK); Next = Run) {
+                Run = ((Next / SD_RS_DATA) + 1) * SD_RS_DATA;
+                Run = (Run < Last) ? Run : Last;
+                if ((ErrorState = SD_Rs_ReadStripe(Next / SD_RS_DATA, SD_RsStage[1])) == SD_OK) {
+                    memcpy(&pBuffer[(Next - Lba) * SD_BLOCKDEV_BLOCK_SIZE],
+                           &((uint8_t*)SD_RsStage[1])[(Next % SD_RS_DATA) * SD_BLOCKDEV_BLOCK_SIZE], (Run - Next) * SD_BLOCKDEV_BLOCK_SIZE);
+                }
+            }
+        } else if (ErrorState == SD_OK) {
+            for (; Next < Last; Next = Run) {
+                Run = ((Next / SD_RS_DATA) + 1) * SD_RS_DATA;
+                Run = (Run < Last) ? Run : Last;
+                memcpy(&pBuffer[(Next - Lba) * SD_BLOCKDEV_BLOCK_SIZE],
+                       &pStage[((Next / SD_RS_DATA) * SD_RS_STRIPE_BLOCKS + (Next % SD_RS_DATA) - First) * SD_BLOCKDEV_BLOCK_SIZE],
+                       (Run - Next) * SD_BLOCKDEV_BLOCK_SIZE);
+            }
+        }
+    }
+
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Encodes whole stripes into one staging buffer while the other one is written. A stripe the
+  *         request covers only partly has its old data read first, through the rebuilding read, so a
+  *         stripe that lost a block can still be updated. Flags go with every piece.
+  */
+static SD_Error_t SD_Rs_Write(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                              SD_BlockDevCallback_t Callback, void *Context)
+{
+    volatile SD_Error_t Status[2] = { SD_OK, SD_OK };
+    SD_Error_t          ErrorState = SD_OK;
+    uint64_t            Next = Lba, End = Lba + NumberOfBlocks, First, Begin, To;
+    uint32_t            Slot = 0, Stripes;
+    uint32_t           *pStripe;
+
+    while ((Next < End) && (ErrorState == SD_OK)) {
+        while (Status[Slot] == SD_BUSY) {
+            SD_BlockDev_Process(pDev->pLower);
+        }
+        if ((ErrorState = Status[Slot]) != SD_OK) {
+            break;
+        }
+
+        First = Next / SD_RS_DATA;
+        for (Stripes = 0; (Stripes < SD_RS_STAGE_STRIPES) && (Next < End); Stripes++) {
+            pStripe = &SD_RsStage[Slot][Stripes * SD_RS_STRIPE_WORDS];
+            Begin   = (First + Stripes) * SD_RS_DATA;
+            To      = (End < (Begin + SD_RS_DATA)) ? End : (Begin + SD_RS_DATA);
+            if ((Next != Begin) || (To != (Begin + SD_RS_DATA))) {
+                while (Status[Slot ^ 1] == SD_BUSY) {
+                    SD_BlockDev_Process(pDev->pLower);
+                }
+                if (((ErrorState = Status[Slot ^ 1]) != SD_OK) || ((ErrorState = SD_Rs_ReadStripe(First + Stripes, pStripe)) != SD_OK)) {
+                    break;
+                }
+                SD_RsStats.PartialStripes++;
+            }
+            memcpy(&((uint8_t*)pStripe)[(Next - Begin) * SD_BLOCKDEV_BLOCK_SIZE], &pBuffer[(Next - Lba) * SD_BLOCKDEV_BLOCK_SIZE],
+                   (To - Next) * SD_BLOCKDEV_BLOCK_SIZE);
+            SD_Rs_Code(pStripe, SD_RS_DATA_MASK, SD_RS_PARITY_MASK);
+            Next = To;
+        }
+        if (ErrorState != SD_OK) {
+            break;
+        }
+
+        Status[Slot] = SD_BUSY;
+        if ((ErrorState = SD_BlockDev_Write(pDev->pLower, First * SD_RS_STRIPE_BLOCKS, (uint8_t*)SD_RsStage[Slot], Stripes * SD_RS_STRIPE_BLOCKS,
+                                            Flags, SD_Rs_TransferDone, (void*)&Status[Slot])) != SD_OK) {
+            Status[Slot] = SD_OK;
+            break;
+        }
+        Slot ^= 1;
+    }
+
+    for (Slot = 0; Slot < 2; Slot++) {
+        while (Status[Slot] == SD_BUSY) {
+            SD_BlockDev_Process(pDev->pLower);
+        }
+        if (ErrorState == SD_OK) {
+            ErrorState = Status[Slot];
+        }
+    }
+
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Rs_Transfer(bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags)
+{
+    volatile SD_Error_t Status = SD_BUSY;
+    SD_Error_t          ErrorState;
+
+    if (Write == true) {
+        ErrorState = SD_BlockDev_Write(SD_RsDevice.pLower, Lba, pBuffer, NumberOfBlocks, Flags, SD_Rs_TransferDone, (void*)&Status);
+    } else {
+        ErrorState = SD_BlockDev_Read(SD_RsDevice.pLower, Lba, pBuffer, NumberOfBlocks, SD_Rs_TransferDone, (void*)&Status);
+    }
+    if (ErrorState != SD_OK) {
+        return ErrorState;
+    }
+    while (Status == SD_BUSY) {
+        SD_BlockDev_Process(SD_RsDevice.pLower);
+    }
+    return Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Rs_TransferDone(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context)
+{
+    (void)pDev;
+    *(volatile SD_Error_t*)Context = Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads the data blocks of a stripe, rebuilding them when the card cannot.
+  */
+static SD_Error_t SD_Rs_ReadStripe(uint64_t Stripe, uint32_t *pStripe)
+{
+    SD_Error_t ErrorState = SD_Rs_Transfer(false, Stripe * SD_RS_STRIPE_BLOCKS, (uint8_t*)pStripe, SD_RS_DATA, 0);
+
+    if (SD_RS_MEDIA_ERROR(ErrorState)) {
+        ErrorState = SD_Rs_Recover(Stripe, pStripe);
+    }
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads a stripe block by block to find the ones that fail, and only as many parity blocks as
+  *         there are data blocks to rebuild. A multi-block read can fail on the bus without any single
+  *         block being bad, then nothing needs rebuilding.
+  * @retval SD Card error state, the card's own error when more blocks are lost than parity can cover
+  */
+static SD_Error_t SD_Rs_Recover(uint64_t Stripe, uint32_t *pStripe)
+{
+    SD_Error_t ErrorState, Failure = SD_OK;
+    uint32_t   Valid = 0, Lost = 0;
+
+    for (uint32_t Block = 0; Block < SD_RS_STRIPE_BLOCKS; Block++) {
+        if ((Block >= SD_RS_DATA) &&
+            (__builtin_popcount(Valid & SD_RS_PARITY_MASK) >= __builtin_popcount(Lost & SD_RS_DATA_MASK))) {
+            break;
+        }
+        ErrorState = SD_Rs_Transfer(false, Stripe * SD_RS_STRIPE_BLOCKS + Block, (uint8_t*)&pStripe[Block * SD_RS_WORDS], 1, 0);
+        if (ErrorState == SD_OK) {
+            Valid |= 1UL << Block;
+        } else if (SD_RS_MEDIA_ERROR(ErrorState)) {
+            Lost   |= 1UL << Block;
+            Failure = ErrorState;
+            SD_RsStats.ReadErrors++;
+        } else {
+            return ErrorState;
+        }
+    }
+
+    if ((Lost & SD_RS_DATA_MASK) == 0) {
+        return SD_OK;
+    }
+    if (__builtin_popcount(Valid) < SD_RS_DATA) {
+        SD_RsStats.Unrecoverable++;
+        return Failure;
+    }
+    if ((ErrorState = SD_Rs_Code(pStripe, Valid, Lost)) != SD_OK) {
+        return ErrorState;
+    }
+    SD_RsStats.Reconstructed += __builtin_popcount(Lost);
+
+#if SD_RS_REPAIR
+    for (uint32_t Block = 0; Block < SD_RS_STRIPE_BLOCKS; Block++) {
+        if (((Lost & (1UL << Block)) != 0) &&
+            (SD_Rs_Transfer(true, Stripe * SD_RS_STRIPE_BLOCKS + Block, (uint8_t*)&pStripe[Block * SD_RS_WORDS], 1, 0) == SD_OK)) {
+            SD_RsStats.Repaired++;
+        }
+    }
+#endif
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  SD_Rs_Rebuild with the cycles accounted, computing parity from intact data counts as encoding.
+  */
+static SD_Error_t SD_Rs_Code(uint32_t *pStripe, uint32_t Valid, uint32_t Wanted)
+{
+    uint32_t   Start = DWT->CYCCNT;
+    SD_Error_t ErrorState = SD_Rs_Rebuild(pStripe, Valid, Wanted);
+
+    if ((Wanted & SD_RS_DATA_MASK) == 0) {
+        SD_RsStats.EncodeCycles += DWT->CYCCNT - Start;
+        SD_RsStats.EncodedBytes += SD_RS_DATA * SD_BLOCKDEV_BLOCK_SIZE;
+    } else {
+        SD_RsStats.DecodeCycles += DWT->CYCCNT - Start;
+        SD_RsStats.DecodedBytes += __builtin_popcount(Wanted) * SD_BLOCKDEV_BLOCK_SIZE;
+    }
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Rebuilds the Wanted blocks of a stripe from SD_RS_DATA of its Valid ones. Lost data blocks are
+  *         solved for by inverting the rows of the blocks used, intact data rows preferred as those are
+  *         unit rows, lost parity is then encoded again from the complete data.
+  * @retval SD Card error state, SD_ERROR when fewer than SD_RS_DATA blocks are valid
+  */
+static SD_Error_t SD_Rs_Rebuild(uint32_t *pStripe, uint32_t Valid, uint32_t Wanted)
+{
+    uint8_t Rows[SD_RS_DATA];
+    uint8_t Factor;
+    uint32_t Count = 0, Pivot;
+
+    Wanted &= ~Valid;
+    for (uint32_t Block = 0; (Block < SD_RS_STRIPE_BLOCKS) && (Count < SD_RS_DATA); Block++) {
+        if ((Valid & (1UL << Block)) != 0) {
+            Rows[Count++] = Block;
+        }
+    }
+    if (Count < SD_RS_DATA) {
+        return SD_ERROR;
+    }
+
+    if ((Wanted & SD_RS_DATA_MASK) != 0) {
+        for (uint32_t Row = 0; Row < SD_RS_DATA; Row++) {
+            for (uint32_t Col = 0; Col < SD_RS_DATA; Col++) {
+                SD_RsMatrix[Row][Col] = (Rows[Row] < SD_RS_DATA) ? (Rows[Row] == Col) : SD_RsCoef[Rows[Row] - SD_RS_DATA][Col];
+                SD_RsMatrix[Row][SD_RS_DATA + Col] = (Row == Col);
+            }
+        }
+
+        // Gauss-Jordan, every square block of a Cauchy generator is invertible so a pivot always exists
+        for (uint32_t Col = 0; Col < SD_RS_DATA; Col++) {
+            for (Pivot = Col; (Pivot < SD_RS_DATA) && (SD_RsMatrix[Pivot][Col] == 0); Pivot++) {
+            }
+            if (Pivot == SD_RS_DATA) {
+                return SD_ERROR;
+            }
+            for (uint32_t Index = 0; Index < 2 * SD_RS_DATA; Index++) {
+                uint8_t Swap = SD_RsMatrix[Col][Index];
+
+                SD_RsMatrix[Col][Index]   = SD_RsMatrix[Pivot][Index];
+                SD_RsMatrix[Pivot][Index] = Swap;
+            }
+            Factor = SD_Rs_Inv(SD_RsMatrix[Col][Col]);
+            for (uint32_t Index = 0; Index < 2 * SD_RS_DATA; Index++) {
+                SD_RsMatrix[Col][Index] = SD_Rs_Mul(SD_RsMatrix[Col][Index], Factor);
+            }
+            for (uint32_t Row = 0; Row < SD_RS_DATA; Row++) {
+                if ((Row != Col) && ((Factor = SD_RsMatrix[Row][Col]) != 0)) {
+                    for (uint32_t Index = 0; Index < 2 * SD_RS_DATA; Index++) {
+                        SD_RsMatrix[Row][Index] ^= SD_Rs_Mul(SD_RsMatrix[Col][Index], Factor);
+                    }
+                }
+            }
+        }
+
+        for (uint32_t Block = 0; Block < SD_RS_DATA; Block++) {
+            if ((Wanted & (1UL << Block)) != 0) {
+                memset(&pStripe[Block * SD_RS_WORDS], 0, SD_BLOCKDEV_BLOCK_SIZE);
+                for (uint32_t Row = 0; Row < SD_RS_DATA; Row++) {
+                    SD_Rs_MulAdd(&pStripe[Block * SD_RS_WORDS], &pStripe[Rows[Row] * SD_RS_WORDS], SD_RsMatrix[Block][SD_RS_DATA + Row]);
+                }
+            }
+        }
+    }
+
+    for (uint32_t Parity = 0; Parity < SD_RS_PARITY; Parity++) {
+        uint32_t *pParity = &pStripe[(SD_RS_DATA + Parity) * SD_RS_WORDS];
+
+        if ((Wanted & (1UL << (SD_RS_DATA + Parity))) != 0) {
+            memcpy(pParity, pStripe, SD_BLOCKDEV_BLOCK_SIZE);
+            for (uint32_t Block = 1; Block < SD_RS_DATA; Block++) {
+                SD_Rs_MulAdd(pParity, &pStripe[Block * SD_RS_WORDS], SD_RsCoef[Parity][Block]);
+            }
+        }
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Doubles four field elements: UADD8 shifts each byte without carrying into the next and flags
+  *         the bytes that overflowed, SEL puts the polynomial into just those.
+  */
+static inline uint32_t SD_Rs_Double(uint32_t x)
+{
+    x = __UADD8(x, x);
+    return x ^ __SEL(SD_RS_POLY4, 0);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Adds Coef times one block to another, a word at a time. Coef is constant over the block, so
+  *         the branches on its bits are predicted and the cost is one doubling per bit below its top one.
+  */
+SD_RS_ITCM static void SD_Rs_MulAdd(uint32_t *pDst, const uint32_t *pSrc, uint8_t Coef)
+{
+    uint32_t Top, x, Sum;
+
+    if (Coef == 0) {
+        return;
+    }
+    if (Coef == 1) {
+        for (uint32_t Word = 0; Word < SD_RS_WORDS; Word += 4) {
+            pDst[Word]     ^= pSrc[Word];
+            pDst[Word + 1] ^= pSrc[Word + 1];
+            pDst[Word + 2] ^= pSrc[Word + 2];
+            pDst[Word + 3] ^= pSrc[Word + 3];
+        }
+        return;
+    }
+
+    Top = 31 - __CLZ(Coef);
+    for (uint32_t Word = 0; Word < SD_RS_WORDS; Word++) {
+        x   = pSrc[Word];
+        Sum = ((Coef & 1) != 0) ? x : 0;
+        for (uint32_t Bit = 1; Bit <= Top; Bit++) {
+            x = SD_Rs_Double(x);
+            if ((Coef & (1U << Bit)) != 0) {
+                Sum ^= x;
+            }
+        }
+        pDst[Word] ^= Sum;
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Log and exponent tables for the scalar arithmetic of the decode matrix, and the coefficients:
+  *         Cauchy entries 1 / (x_j + y_i) with x_j = SD_RS_DATA + j and y_i = i, then scaled per column
+  *         and per row, which keeps every square block invertible, to make row 0 and column 0 ones.
+  */
+static void SD_Rs_InitTables(void)
+{
+    uint32_t x = 1;
+    uint8_t  Scale;
+
+    for (uint32_t Index = 0; Index < 255; Index++) {
+        SD_RsExp[Index]       = (uint8_t)x;
+        SD_RsExp[Index + 255] = (uint8_t)x;
+        SD_RsLog[x]           = (uint8_t)Index;
+        x <<= 1;
+        if ((x & 0x100) != 0) {
+            x ^= SD_RS_POLY;
+        }
+    }
+    SD_RsExp[510] = SD_RsExp[0];
+    SD_RsExp[511] = SD_RsExp[1];
+    SD_RsLog[0]   = 0;
+
+    for (uint32_t Parity = 0; Parity < SD_RS_PARITY; Parity++) {
+        for (uint32_t Block = 0; Block < SD_RS_DATA; Block++) {
+            SD_RsCoef[Parity][Block] = SD_Rs_Inv((uint8_t)((SD_RS_DATA + Parity) ^ Block));
+        }
+    }
+    for (uint32_t Block = 0; Block < SD_RS_DATA; Block++) {
+        Scale = SD_Rs_Inv(SD_RsCoef[0][Block]);
+        for (uint32_t Parity = 0; Parity < SD_RS_PARITY; Parity++) {
+            SD_RsCoef[Parity][Block] = SD_Rs_Mul(SD_RsCoef[Parity][Block], Scale);
+        }
+    }
+    for (uint32_t Parity = 1; Parity < SD_RS_PARITY; Parity++) {
+        Scale = SD_Rs_Inv(SD_RsCoef[Parity][0]);
+        for (uint32_t Block = 0; Block < SD_RS_DATA; Block++) {
+            SD_RsCoef[Parity][Block] = SD_Rs_Mul(SD_RsCoef[Parity][Block], Scale);
+        }
+    }
+    SD_RsTables = true;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint8_t SD_Rs_Mul(uint8_t a, uint8_t b)
+{
+    if ((a == 0) || (b == 0)) {
+        return 0;
+    }
+    return SD_RsExp[SD_RsLog[a] + SD_RsLog[b]];
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint8_t SD_Rs_Inv(uint8_t a)
+{
+    return SD_RsExp[255 - SD_RsLog[a]];
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#else
+
+SD_Error_t SD_Rs_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    (void)pLower;
+    (void)ppDev;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Rs_EncodeStripe(uint8_t *pStripe)
+{
+    (void)pStripe;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Rs_DecodeStripe(uint8_t *pStripe, uint32_t Erased)
+{
+    (void)pStripe;
+    (void)Erased;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Rs_Benchmark(uint8_t *pBuffer, SD_RsBench_t *pResult)
+{
+    (void)pBuffer;
+    (void)pResult;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+void SD_Rs_GetStats(SD_RsStats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
@@ -0,0 +1,1098 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_sched.h"
+
+#ifdef SDMMC_SCHED
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_SCHED_WORDS                  (SD_BLOCKDEV_BLOCK_SIZE / 4)
+// Token buckets count in 1/1000 block so a per-millisecond refill of a blocks-per-second rate is exact
+#define SD_SCHED_TOKEN                  1000
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_SCHED_FREE           = 0,
+    SD_SCHED_PENDING        = 1,
+    SD_SCHED_DISPATCHED     = 2,        // Part of the command in flight
+    SD_SCHED_DONE           = 3,        // Finished, callback not run yet
+    SD_SCHED_FLUSHING       = 4,        // Data on the card, waits for the card cache flush
+} SD_SchedState_t;
+
+typedef enum
+{
+    SD_SCHED_DIR_READ       = 0,
+    SD_SCHED_DIR_WRITE      = 1,
+    SD_SCHED_DIR_BARRIER    = 2,        // No data, ordering point
+} SD_SchedDir_t;
+
+typedef struct
+{
+    uint64_t           Lba;             // Next block to transfer, advances chunk by chunk
+    uint8_t           *pBuffer;         // Caller data of that block
+    uint32_t           Remaining;
+    uint32_t           Blocks;          // As submitted
+    uint32_t           Sequence;        // Arrival order, overlapping requests never overtake each other
+    uint32_t           Deadline;        // HAL tick
+    uint32_t           Start;           // DWT cycles at submit
+    SD_SchedCallback_t Callback;
+    void              *Context;
+    SD_Error_t         Status;
+    volatile uint8_t   State;
+    uint8_t            Dir;
+    uint8_t            Client;
+    uint8_t            Flags;
+} SD_SchedRequest_t;
+
+typedef struct
+{
+    bool               Open;
+    SD_SchedClass_t    Class;
+    uint32_t           Rate;            // Blocks per second, 0 = unlimited
+    int32_t            Burst;           // Bucket size in tokens
+    int32_t            Tokens;          // May go negative, a command is charged in full when dispatched
+    uint32_t           Refill;          // HAL tick of the last refill
+    uint32_t           Since;           // HAL tick the statistics started
+    uint64_t           LatencySum;      // Cycles
+    uint32_t           LatencyMax;
+    SD_SchedClientStats_t Stats;
+} SD_SchedClient_t;
+
+typedef struct
+{
+    uint8_t            Id;
+    uint32_t           Count;           // Blocks of the request in this command
+} SD_SchedPart_t;
+
+typedef struct
+{
+    bool               Issuing;         // Our own driver call, not foreground activity
+    bool               Active;          // Command in flight
+    bool               Flushing;        // Card cache flush in flight, collected like a command
+    bool               FlushDue;        // Requests wait in SD_SCHED_FLUSHING
+    uint8_t            Dir;
+    uint8_t            Parts;
+    uint32_t           Count;
+    uint64_t           Lba;
+    uint64_t           Head;            // End of the last command, the C-SCAN sweep continues from here
+    uint32_t           Sequence;
+    SD_SchedPart_t     Part[SD_SCHED_DEPTH];
+    SD_SchedRequest_t  Request[SD_SCHED_DEPTH];
+    SD_SchedClient_t   Client[SD_SCHED_CLIENTS];
+    SD_SchedStats_t    Stats;
+} SD_Sched_t;
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_Sched_t                  SD_Sched = { .Client[SD_SCHED_DEFAULT_CLIENT] = { .Open = true, .Class = SD_SCHED_CLASS_NORMAL } };
+static uint32_t                    SD_SchedStage[SD_SCHED_CHUNK_BLOCKS * SD_SCHED_WORDS] __attribute__((section(".ram_d1"), aligned(32)));
+
+// [class][direction]
+static const uint32_t              SD_SchedDeadline[SD_SCHED_CLASSES][2] =
+{
+    { SD_SCHED_READ_DEADLINE_MS / 4, SD_SCHED_WRITE_DEADLINE_MS / 4 },
+    { SD_SCHED_READ_DEADLINE_MS,     SD_SCHED_WRITE_DEADLINE_MS     },
+    { SD_SCHED_READ_DEADLINE_MS * 8, SD_SCHED_WRITE_DEADLINE_MS * 8 },
+};
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_Sched_Submit             (uint8_t Client, SD_SchedDir_t Dir, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                                                     uint32_t Flags, SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId);
+static void             SD_Sched_TransferDone       (uint8_t RequestId, SD_Error_t Status, void *Context);
+static void             SD_Sched_Refill             (void);
+static bool             SD_Sched_IsEligible         (uint8_t Id);
+static bool             SD_Sched_IsBlocked          (uint8_t Id);
+static uint8_t          SD_Sched_Select             (void);
+static bool             SD_Sched_RunBarrier         (void);
+static void             SD_Sched_Flush              (void);
+static void             SD_Sched_FinishFlush        (SD_Error_t Status);
+static uint8_t          SD_Sched_Find               (SD_SchedDir_t Dir, uint64_t Lba, bool EndsAt, uint32_t MaxBlocks);
+static void             SD_Sched_Merge              (uint8_t Id);
+static void             SD_Sched_Dispatch           (void);
+static bool             SD_Sched_Complete           (bool Wait);
+static void             SD_Sched_Finish             (uint8_t Id, SD_Error_t Status);
+static void             SD_Sched_RunCallbacks       (void);
+static uint32_t         SD_Sched_Lock               (void);
+static void             SD_Sched_Unlock             (uint32_t BasePri);
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Drops everything pending and closes all clients but the default one.
+  */
+void SD_Sched_Init(void)
+{
+    SD_Sched_Complete(true);
+    memset(&SD_Sched, 0, sizeof(SD_Sched));
+    SD_Sched_SetClient(SD_SCHED_DEFAULT_CLIENT, SD_SCHED_CLASS_NORMAL, 0, 0);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Opens an I/O context for one user of the card.
+  * @param  Class: Priority class
+  * @param  RateKBs: Bandwidth limit, 0 for none
+  * @param  BurstKB: Token bucket size, at least one chunk is always allowed
+  * @param  pClient: Receives the client ID
+  * @retval SD Card error state, SD_BUSY when all clients are open
+  */
+SD_Error_t SD_Sched_OpenClient(SD_SchedClass_t Class, uint32_t RateKBs, uint32_t BurstKB, uint8_t *pClient)
+{
+    for (uint8_t i = 0; i < SD_SCHED_CLIENTS; i++) {
+        if (!SD_Sched.Client[i].Open) {
+            *pClient = i;
+            return SD_Sched_SetClient(i, Class, RateKBs, BurstKB);
+        }
+    }
+    return SD_BUSY;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  (Re)configures a client and restarts its statistics. The bucket starts full.
+  */
+SD_Error_t SD_Sched_SetClient(uint8_t Client, SD_SchedClass_t Class, uint32_t RateKBs, uint32_t BurstKB)
+{
+    SD_SchedClient_t *pClient;
+    uint32_t          Burst = BurstKB * 2;
+
+    if ((Client >= SD_SCHED_CLIENTS) || (Class >= SD_SCHED_CLASSES)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (Burst < SD_SCHED_CHUNK_BLOCKS) {
+        Burst = SD_SCHED_CHUNK_BLOCKS;
+    }
+
+    pClient = &SD_Sched.Client[Client];
+    memset(pClient, 0, sizeof(*pClient));
+    pClient->Class  = Class;
+    pClient->Rate   = RateKBs * 2;
+    pClient->Burst  = (int32_t)(Burst * SD_SCHED_TOKEN);
+    pClient->Tokens = pClient->Burst;
+    pClient->Refill = HAL_GetTick();
+    pClient->Since  = pClient->Refill;
+    pClient->Open   = true;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Sched_GetClientStats(uint8_t Client, SD_SchedClientStats_t *pStats)
+{
+    SD_SchedClient_t *pClient;
+    uint32_t          Elapsed, BasePri;
+
+    memset(pStats, 0, sizeof(*pStats));
+    if (Client >= SD_SCHED_CLIENTS) {
+        return;
+    }
+    pClient = &SD_Sched.Client[Client];
+
+    BasePri = SD_Sched_Lock();
+    *pStats = pClient->Stats;
+    if (pStats->Completed) {
+        pStats->LatencyAvgUs = (uint32_t)(pClient->LatencySum / pStats->Completed / (SystemCoreClock / 1000000));
+    }
+    pStats->LatencyMaxUs = pClient->LatencyMax / (SystemCoreClock / 1000000);
+    Elapsed = HAL_GetTick() - pClient->Since;
+    SD_Sched_Unlock(BasePri);
+
+    if (Elapsed) {
+        pStats->ThroughputKBs = (uint32_t)((pStats->Blocks * SD_BLOCKDEV_BLOCK_SIZE) / Elapsed * 1000 / 1024);
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Queues a read for the default client. Completion is reported through Callback from SD_Sched_Process().
+  * @param  Lba: First block
+  * @param  pBuffer: Destination, any memory, must stay valid until the callback
+  * @param  NumberOfBlocks: 512 byte blocks to read, longer requests are split
+  * @param  pRequestId: Optional, receives the request ID
+  * @retval SD Card error state, SD_BUSY when all request slots are used
+  */
+SD_Error_t SD_Sched_Read(uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                         SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    return SD_Sched_Submit(SD_SCHED_DEFAULT_CLIENT, SD_SCHED_DIR_READ, Lba, pBuffer, NumberOfBlocks, 0, Callback, Context, pRequestId);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Queues a write for the default client. Completion is reported through Callback from SD_Sched_Process().
+  * @note   Same rules as SD_Sched_Read()
+  */
+SD_Error_t SD_Sched_Write(uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                          SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    return SD_Sched_Submit(SD_SCHED_DEFAULT_CLIENT, SD_SCHED_DIR_WRITE, Lba, (uint8_t*)pBuffer, NumberOfBlocks, 0, Callback, Context, pRequestId);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Sched_ClientRead(uint8_t Client, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                               SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    return SD_Sched_Submit(Client, SD_SCHED_DIR_READ, Lba, pBuffer, NumberOfBlocks, 0, Callback, Context, pRequestId);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Queues a write for a client.
+  * @param  Flags: SD_SCHED_FUA for a write that must be durable when its callback runs
+  */
+SD_Error_t SD_Sched_ClientWrite(uint8_t Client, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                                SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    return SD_Sched_Submit(Client, SD_SCHED_DIR_WRITE, Lba, (uint8_t*)pBuffer, NumberOfBlocks, Flags, Callback, Context, pRequestId);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Queues an ordering point. It runs once every older request of every client has completed, then
+  *         flushes the card cache when it is enabled. Requests submitted after it are not dispatched
+  *         before it completed, so writes on either side can still be batched and merged.
+  * @retval SD Card error state, SD_BUSY when all request slots are used
+  */
+SD_Error_t SD_Sched_Barrier(uint8_t Client, SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    return SD_Sched_Submit(Client, SD_SCHED_DIR_BARRIER, 0, NULL, 0, 0, Callback, Context, pRequestId);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Synchronous request for callers that cannot continue without the data (USB MSC). Requests
+  *         of other clients keep being dispatched by class while it waits, a throttled client waits
+  *         for its tokens here.
+  * @param  Client: Client ID
+  * @param  Write: Direction
+  * @param  Lba: First block
+  * @param  pBuffer: Data, any memory
+  * @param  NumberOfBlocks: Number of blocks
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Sched_Transfer(uint8_t Client, bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    volatile SD_Error_t Status = SD_BUSY;
+    SD_Error_t          ErrorState;
+
+    ErrorState = SD_Sched_Submit(Client, Write ? SD_SCHED_DIR_WRITE : SD_SCHED_DIR_READ, Lba, pBuffer, NumberOfBlocks, 0,
+                                 SD_Sched_TransferDone, (void*)&Status, NULL);
+    if (ErrorState != SD_OK) {
+        return ErrorState;
+    }
+    while (Status == SD_BUSY) {
+        SD_Sched_Process();
+    }
+    return Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Scheduler step, call it from the main loop. Collects the command in flight once the card is
+  *         back in transfer state and dispatches the next one. The step holds off only the interrupts
+  *         that call into the scheduler, an SD_Sched_Transfer from one of them would otherwise wait for
+  *         the step it interrupted. SysTick keeps the deadlines and token buckets going, the SDMMC and
+  *         PVD interrupts keep being served. Callbacks run afterwards with nothing masked.
+  */
+void SD_Sched_Process(void)
+{
+    uint32_t BasePri = SD_Sched_Lock();
+
+    if (SD_Sched_Complete(false)) {
+        while (SD_Sched_RunBarrier());
+        SD_Sched_Flush();
+        // Nothing else goes to the card while it writes its cache back
+        if (!SD_Sched.FlushDue && !SD_Sched.Flushing) {
+            SD_Sched_Dispatch();
+        }
+    }
+    SD_Sched_Unlock(BasePri);
+
+    SD_Sched_RunCallbacks();
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Sched_Drain(void)
+{
+    while (!SD_Sched_IsIdle()) {
+        SD_Sched_Process();
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+bool SD_Sched_IsIdle(void)
+{
+    return (SD_Sched.Stats.Depth == 0) && !SD_Sched.Active && !SD_Sched.Flushing;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Sched_GetStats(SD_SchedStats_t *pStats)
+{
+    uint32_t BasePri = SD_Sched_Lock();
+
+    *pStats = SD_Sched.Stats;
+    SD_Sched_Unlock(BasePri);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Called by the driver on entry of every foreground request. The command or card cache flush
+  *         in flight is finished first, its callbacks run on the next SD_Sched_Process. The caller may
+  *         be a client interrupt, the lock keeps a step of the scheduler from running in between.
+  */
+void SD_Sched_Preempt(void)
+{
+    uint32_t BasePri = SD_Sched_Lock();
+
+    if (!SD_Sched.Issuing) {
+        SD_Sched_Complete(true);
+    }
+    SD_Sched_Unlock(BasePri);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Sched_Submit(uint8_t Client, SD_SchedDir_t Dir, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                                  uint32_t Flags, SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    SD_SchedRequest_t *pRequest;
+    SD_SchedClass_t    Class;
+    uint32_t           BasePri;
+    uint8_t            Id;
+
+    if ((Client >= SD_SCHED_CLIENTS) || !SD_Sched.Client[Client].Open) {
+        return SD_INVALID_PARAMETER;
+    }
+    if ((Dir != SD_SCHED_DIR_BARRIER) && ((NumberOfBlocks == 0) || (pBuffer == NULL))) {
+        return SD_INVALID_PARAMETER;
+    }
+    if ((Lba + NumberOfBlocks) > SD_GetBlockCount()) {
+        return SD_ADDR_OUT_OF_RANGE;
+    }
+    Class = SD_Sched.Client[Client].Class;
+
+    // Submits may come from interrupt context (USB), the slot is claimed atomically
+    BasePri = SD_Sched_Lock();
+    for (Id = 0; Id < SD_SCHED_DEPTH; Id++) {
+        if (SD_Sched.Request[Id].State == SD_SCHED_FREE) break;
+    }
+    if (Id >= SD_SCHED_DEPTH) {
+        SD_Sched_Unlock(BasePri);
+        return SD_BUSY;
+    }
+
+    pRequest            = &SD_Sched.Request[Id];
+    pRequest->Lba       = Lba;
+    pRequest->pBuffer   = pBuffer;
+    pRequest->Remaining = NumberOfBlocks;
+    pRequest->Blocks    = NumberOfBlocks;
+    pRequest->Sequence  = SD_Sched.Sequence++;
+    pRequest->Deadline  = HAL_GetTick() + SD_SchedDeadline[Class][(Dir == SD_SCHED_DIR_READ) ? 0 : 1];
+    pRequest->Start     = DWT->CYCCNT;
+    pRequest->Callback  = Callback;
+    pRequest->Context   = Context;
+    pRequest->Dir       = Dir;
+    pRequest->Client    = Client;
+    pRequest->Flags     = (uint8_t)Flags;
+    pRequest->State     = SD_SCHED_PENDING;
+
+    SD_Sched.Client[Client].Stats.Pending++;
+    SD_Sched.Stats.Submitted++;
+    SD_Sched.Stats.Depth++;
+    SD_Sched.Stats.DepthSum += SD_Sched.Stats.Depth;
+    if (SD_Sched.Stats.Depth > SD_Sched.Stats.MaxDepth) {
+        SD_Sched.Stats.MaxDepth = SD_Sched.Stats.Depth;
+    }
+    SD_Sched_Unlock(BasePri);
+
+    if (pRequestId) {
+        *pRequestId = Id;
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Sched_TransferDone(uint8_t RequestId, SD_Error_t Status, void *Context)
+{
+    (void)RequestId;
+    *(volatile SD_Error_t*)Context = Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Sched_Refill(void)
+{
+    SD_SchedClient_t *pClient;
+    uint32_t          Now = HAL_GetTick();
+    uint32_t          Elapsed;
+
+    for (uint8_t i = 0; i < SD_SCHED_CLIENTS; i++) {
+        pClient = &SD_Sched.Client[i];
+        if (!pClient->Open || (pClient->Rate == 0)) {
+            continue;
+        }
+        Elapsed         = Now - pClient->Refill;
+        pClient->Refill = Now;
+        // Rate is blocks per second, a millisecond adds Rate thousandths of a block
+        if ((pClient->Tokens + (int64_t)Elapsed * pClient->Rate) >= pClient->Burst) {
+            pClient->Tokens = pClient->Burst;
+        } else {
+            pClient->Tokens += (int32_t)(Elapsed * pClient->Rate);
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  A pending request can go when no older request conflicts with it and its client has tokens.
+  */
+static bool SD_Sched_IsEligible(uint8_t Id)
+{
+    SD_SchedRequest_t *pRequest = &SD_Sched.Request[Id];
+    SD_SchedClient_t  *pClient  = &SD_Sched.Client[pRequest->Client];
+
+    return (pRequest->State == SD_SCHED_PENDING) && ((pClient->Rate == 0) || (pClient->Tokens > 0)) && !SD_Sched_IsBlocked(Id);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  A request must wait while an older one overlaps it and either of them writes. Barriers wait
+  *         for everything older and hold back everything newer.
+  */
+static bool SD_Sched_IsBlocked(uint8_t Id)
+{
+    SD_SchedRequest_t *pRequest = &SD_Sched.Request[Id];
+    SD_SchedRequest_t *pOther;
+
+    for (uint8_t i = 0; i < SD_SCHED_DEPTH; i++) {
+        pOther = &SD_Sched.Request[i];
+        if ((i == Id) || (pOther->State == SD_SCHED_FREE) || (pOther->State == SD_SCHED_DONE) ||
+            ((int32_t)(pOther->Sequence - pRequest->Sequence) >= 0)) {
+            continue;
+        }
+        if ((pOther->Dir == SD_SCHED_DIR_BARRIER) || (pRequest->Dir == SD_SCHED_DIR_BARRIER)) {
+            return true;
+        }
+        if ((pOther->Dir == SD_SCHED_DIR_READ) && (pRequest->Dir == SD_SCHED_DIR_READ)) {
+            continue;
+        }
+        if ((pOther->Lba < (pRequest->Lba + pRequest->Remaining)) && (pRequest->Lba < (pOther->Lba + pOther->Remaining))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Picks the request that starts the next command. Clients out of tokens are skipped.
+  *         1. Any request past its deadline, earliest deadline first, lower classes cannot starve.
+  *         2. The highest class with work, within it reads before writes, a write burst cannot hold
+  *            reads back for longer than one chunk.
+  *         3. Within the SD_SCHED_SORT_WINDOW oldest requests of that class and direction, the lowest
+  *            LBA at or after the end of the previous command (C-SCAN), wrapping to the lowest LBA.
+  * @retval Request ID, SD_SCHED_NO_REQUEST when nothing can be dispatched
+  */
+static uint8_t SD_Sched_Select(void)
+{
+    SD_SchedRequest_t *pRequest;
+    uint32_t           Now  = HAL_GetTick();
+    uint8_t            Best = SD_SCHED_NO_REQUEST;
+    uint8_t            Oldest, Ahead, Lowest, Throttled = 0;
+    SD_SchedDir_t      Dir;
+    SD_SchedClass_t    Class;
+
+    SD_Sched_Refill();
+
+    for (uint8_t i = 0; i < SD_SCHED_DEPTH; i++) {
+        pRequest = &SD_Sched.Request[i];
+        if ((pRequest->State != SD_SCHED_PENDING) || (pRequest->Dir == SD_SCHED_DIR_BARRIER)) {
+            continue;
+        }
+        if (!SD_Sched_IsEligible(i)) {
+            if ((SD_Sched.Client[pRequest->Client].Rate != 0) && (SD_Sched.Client[pRequest->Client].Tokens <= 0)) {
+                Throttled |= (1U << pRequest->Client);
+            }
+            continue;
+        }
+        if ((int32_t)(Now - pRequest->Deadline) < 0) {
+            continue;
+        }
+        if ((Best == SD_SCHED_NO_REQUEST) || ((int32_t)(pRequest->Deadline - SD_Sched.Request[Best].Deadline) < 0)) {
+            Best = i;
+        }
+    }
+    for (uint8_t i = 0; i < SD_SCHED_CLIENTS; i++) {
+        if (Throttled & (1U << i)) {
+            SD_Sched.Client[i].Stats.Throttled++;
+        }
+    }
+    if (Best != SD_SCHED_NO_REQUEST) {
+        SD_Sched.Stats.Expired++;
+        return Best;
+    }
+
+    for (uint32_t Pass = 0; Pass < (SD_SCHED_CLASSES * 2); Pass++) {
+        Class  = (SD_SchedClass_t)(Pass / 2);
+        Dir    = (Pass & 1) ? SD_SCHED_DIR_WRITE : SD_SCHED_DIR_READ;
+        Oldest = Ahead = Lowest = SD_SCHED_NO_REQUEST;
+
+        for (uint8_t i = 0; i < SD_SCHED_DEPTH; i++) {
+            pRequest = &SD_Sched.Request[i];
+            if ((pRequest->State == SD_SCHED_PENDING) && (pRequest->Dir == Dir) && (SD_Sched.Client[pRequest->Client].Class == Class) &&
+                ((Oldest == SD_SCHED_NO_REQUEST) || ((int32_t)(pRequest->Sequence - SD_Sched.Request[Oldest].Sequence) < 0))) {
+                Oldest = i;
+            }
+        }
+        if (Oldest == SD_SCHED_NO_REQUEST) {
+            continue;
+        }
+
+        for (uint8_t i = 0; i < SD_SCHED_DEPTH; i++) {
+            pRequest = &SD_Sched.Request[i];
+            if ((pRequest->Dir != Dir) || (SD_Sched.Client[pRequest->Client].Class != Class) ||
+                ((pRequest->Sequence - SD_Sched.Request[Oldest].Sequence) >= SD_SCHED_SORT_WINDOW) || !SD_Sched_IsEligible(i)) {
+                continue;
+            }
+            if ((pRequest->Lba >= SD_Sched.Head) && ((Ahead == SD_SCHED_NO_REQUEST) || (pRequest->Lba < SD_Sched.Request[Ahead].Lba))) {
+                Ahead = i;
+            }
+            if ((Lowest == SD_SCHED_NO_REQUEST) || (pRequest->Lba < SD_Sched.Request[Lowest].Lba)) {
+                Lowest = i;
+            }
+        }
+        Best = (Ahead != SD_SCHED_NO_REQUEST) ? Ahead : Lowest;
+        if (Best != SD_SCHED_NO_REQUEST) {
+            if (Best != Oldest) {
+                SD_Sched.Stats.Sorted++;
+            }
+            return Best;
+        }
+    }
+    return SD_SCHED_NO_REQUEST;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Completes a barrier whose older requests have all finished. Their data reached the card when
+  *         they completed, only the card cache may still hold it, the barrier then waits for the flush.
+  * @retval true when a barrier completed or went on to wait for the flush
+  */
+static bool SD_Sched_RunBarrier(void)
+{
+    for (uint8_t i = 0; i < SD_SCHED_DEPTH; i++) {
+        if ((SD_Sched.Request[i].State != SD_SCHED_PENDING) || (SD_Sched.Request[i].Dir != SD_SCHED_DIR_BARRIER) ||
+            SD_Sched_IsBlocked(i)) {
+            continue;
+        }
+        SD_Sched.Stats.Barriers++;
+        if (SD_CardCacheIsEnabled()) {
+            SD_Sched.Request[i].State = SD_SCHED_FLUSHING;
+            SD_Sched.FlushDue         = true;
+        } else {
+            SD_Sched_Finish(i, SD_OK);
+        }
+        return true;
+    }
+    return false;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Starts one card cache flush for all barriers and FUA writes waiting on it. The card may take
+  *         up to a second, SD_Sched_Complete collects the flush like a command so the step never waits.
+  */
+static void SD_Sched_Flush(void)
+{
+    SD_Error_t ErrorState;
+
+    if (!SD_Sched.FlushDue) {
+        return;
+    }
+
+    SD_Sched.Issuing = true;
+    ErrorState       = SD_CardCacheFlushStart();
+    SD_Sched.Issuing = false;
+
+    if (ErrorState == SD_BUSY) {
+        // A flush of someone else still runs, it may not cover our data, tried again on the next step
+        return;
+    }
+    SD_Sched.FlushDue = false;
+    SD_Sched.Stats.CacheFlushes++;
+    if (ErrorState == SD_OK) {
+        SD_Sched.Flushing = true;
+        return;
+    }
+    SD_Sched_FinishFlush(ErrorState);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Sched_FinishFlush(SD_Error_t Status)
+{
+    for (uint8_t i = 0; i < SD_SCHED_DEPTH; i++) {
+        if (SD_Sched.Request[i].State == SD_SCHED_FLUSHING) {
+            SD_Sched_Finish(i, Status);
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Finds an eligible request of a direction that starts, or with EndsAt ends, exactly at an LBA.
+  *         With EndsAt the whole request has to fit into MaxBlocks.
+  */
+static uint8_t SD_Sched_Find(SD_SchedDir_t Dir, uint64_t Lba, bool EndsAt, uint32_t MaxBlocks)
+{
+    SD_SchedRequest_t *pRequest;
+
+    for (uint8_t i = 0; i < SD_SCHED_DEPTH; i++) {
+        pRequest = &SD_Sched.Request[i];
+        if ((pRequest->State != SD_SCHED_PENDING) || (pRequest->Dir != Dir)) {
+            continue;
+        }
+        if (EndsAt ? (((pRequest->Lba + pRequest->Remaining) != Lba) || (pRequest->Remaining > MaxBlocks)) : (pRequest->Lba != Lba)) {
+            continue;
+        }
+        if (SD_Sched_IsEligible(i)) {
+            return i;
+        }
+    }
+    return SD_SCHED_NO_REQUEST;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Builds the next command around a request. Pending requests of the same direction that end
+  *         where the command starts are put in front, ones that start where it ends are appended,
+  *         until SD_SCHED_CHUNK_BLOCKS are collected. The last one may be taken only partly.
+  */
+static void SD_Sched_Merge(uint8_t Id)
+{
+    SD_SchedRequest_t *pRequest = &SD_Sched.Request[Id];
+    uint32_t           Take;
+    uint8_t            Other;
+
+    SD_Sched.Dir     = pRequest->Dir;
+    SD_Sched.Lba     = pRequest->Lba;
+    SD_Sched.Count   = (pRequest->Remaining < SD_SCHED_CHUNK_BLOCKS) ? pRequest->Remaining : SD_SCHED_CHUNK_BLOCKS;
+    SD_Sched.Parts   = 1;
+    SD_Sched.Part[0] = (SD_SchedPart_t){ Id, SD_Sched.Count };
+    pRequest->State  = SD_SCHED_DISPATCHED;
+
+    while ((SD_Sched.Count < SD_SCHED_CHUNK_BLOCKS) &&
+           ((Other = SD_Sched_Find(SD_Sched.Dir, SD_Sched.Lba, true, SD_SCHED_CHUNK_BLOCKS - SD_Sched.Count)) != SD_SCHED_NO_REQUEST)) {
+        memmove(&SD_Sched.Part[1], &SD_Sched.Part[0], SD_Sched.Parts * sizeof(SD_SchedPart_t));
+        SD_Sched.Part[0]                = (SD_SchedPart_t){ Other, SD_Sched.Request[Other].Remaining };
+        SD_Sched.Lba                   -= SD_Sched.Request[Other].Remaining;
+        SD_Sched.Count                 += SD_Sched.Request[Other].Remaining;
+        SD_Sched.Request[Other].State   = SD_SCHED_DISPATCHED;
+        SD_Sched.Parts++;
+    }
+
+    // Only a request taken whole can be followed by the next one
+    while ((SD_Sched.Count < SD_SCHED_CHUNK_BLOCKS) &&
+           (SD_Sched.Part[SD_Sched.Parts - 1].Count == SD_Sched.Request[SD_Sched.Part[SD_Sched.Parts - 1].Id].Remaining) &&
+           ((Other = SD_Sched_Find(SD_Sched.Dir, SD_Sched.Lba + SD_Sched.Count, false, 0)) != SD_SCHED_NO_REQUEST)) {
+        Take = SD_SCHED_CHUNK_BLOCKS - SD_Sched.Count;
+        if (SD_Sched.Request[Other].Remaining < Take) {
+            Take = SD_Sched.Request[Other].Remaining;
+        }
+        SD_Sched.Part[SD_Sched.Parts++] = (SD_SchedPart_t){ Other, Take };
+        SD_Sched.Count                 += Take;
+        SD_Sched.Request[Other].State   = SD_SCHED_DISPATCHED;
+    }
+
+    SD_Sched.Stats.Merged += SD_Sched.Parts - 1;
+    for (uint8_t i = 0; i < SD_Sched.Parts; i++) {
+        if (SD_Sched.Part[i].Count < SD_Sched.Request[SD_Sched.Part[i].Id].Remaining) {
+            SD_Sched.Stats.Chunks++;
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Sched_Dispatch(void)
+{
+    SD_SchedRequest_t *pRequest;
+    SD_Error_t         ErrorState;
+    uint32_t           Offset = 0;
+    uint8_t            Id;
+
+    if ((Id = SD_Sched_Select()) == SD_SCHED_NO_REQUEST) {
+        return;
+    }
+    SD_Sched_Merge(Id);
+
+    if (SD_Sched.Dir == SD_SCHED_DIR_WRITE) {
+        for (uint8_t i = 0; i < SD_Sched.Parts; i++) {
+            pRequest = &SD_Sched.Request[SD_Sched.Part[i].Id];
+            memcpy(&SD_SchedStage[Offset * SD_SCHED_WORDS], pRequest->pBuffer, SD_Sched.Part[i].Count * SD_BLOCKDEV_BLOCK_SIZE);
+            Offset += SD_Sched.Part[i].Count;
+        }
+    }
+
+    SD_Sched.Issuing = true;
+    if (SD_Sched.Dir == SD_SCHED_DIR_READ) {
+        ErrorState = SD_ReadBlocks_DMA(SD_Sched.Lba, SD_SchedStage, SD_BLOCKDEV_BLOCK_SIZE, SD_Sched.Count);
+    } else {
+        ErrorState = SD_WriteBlocks_DMA(SD_Sched.Lba, SD_SchedStage, SD_BLOCKDEV_BLOCK_SIZE, SD_Sched.Count);
+    }
+    SD_Sched.Issuing = false;
+
+    if (ErrorState == SD_OK) {
+        SD_Sched.Active = true;
+        SD_Sched.Stats.Dispatches++;
+        // Each part is charged to its own client, merging does not make anyone's data free
+        for (uint8_t i = 0; i < SD_Sched.Parts; i++) {
+            SD_Sched.Client[SD_Sched.Request[SD_Sched.Part[i].Id].Client].Tokens -= (int32_t)(SD_Sched.Part[i].Count * SD_SCHED_TOKEN);
+        }
+        return;
+    }
+
+    for (uint8_t i = 0; i < SD_Sched.Parts; i++) {
+        if (ErrorState == SD_BUSY) {
+            // Card held by the command queue, try again on the next step
+            SD_Sched.Request[SD_Sched.Part[i].Id].State = SD_SCHED_PENDING;
+        } else {
+            SD_Sched_Finish(SD_Sched.Part[i].Id, ErrorState);
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Collects the command in flight, scatters read data and advances or completes its requests.
+  *         A card cache flush in flight completes the requests waiting on it.
+  * @param  Wait: Block until the card is back in transfer state
+  * @retval true when no command is in flight anymore
+  */
+static bool SD_Sched_Complete(bool Wait)
+{
+    SD_SchedRequest_t *pRequest;
+    SD_Error_t         ErrorState;
+    uint32_t           Offset = 0;
+
+    if (SD_Sched.Flushing) {
+        SD_Sched.Issuing = true;
+        do {
+            ErrorState = SD_CardCacheFlushPoll();
+        } while (Wait && (ErrorState == SD_BUSY));
+        SD_Sched.Issuing = false;
+
+        if (ErrorState == SD_BUSY) {
+            return false;
+        }
+        SD_Sched.Flushing = false;
+        SD_Sched_FinishFlush(ErrorState);
+        return true;
+    }
+    if (!SD_Sched.Active) {
+        return true;
+    }
+    if (SD_Sched.Dir == SD_SCHED_DIR_READ) {
+        if (!Wait && (SD_CheckRead() == SD_BUSY)) {
+            return false;
+        }
+        while (SD_CheckRead());
+    } else {
+        if (!Wait && (SD_CheckWrite() == SD_BUSY)) {
+            return false;
+        }
+        while (SD_CheckWrite());
+    }
+    // Programming of a write may keep the card busy long after the data phase
+    if (!Wait && !SD_GetState()) {
+        return false;
+    }
+    while (SD_GetState() == false);
+
+    ErrorState      = SD_GetTransferError();
+    SD_Sched.Active = false;
+    SD_Sched.Head   = SD_Sched.Lba + SD_Sched.Count;
+
+    for (uint8_t i = 0; i < SD_Sched.Parts; i++) {
+        pRequest = &SD_Sched.Request[SD_Sched.Part[i].Id];
+        if ((ErrorState == SD_OK) && (SD_Sched.Dir == SD_SCHED_DIR_READ)) {
+            memcpy(pRequest->pBuffer, &SD_SchedStage[Offset * SD_SCHED_WORDS], SD_Sched.Part[i].Count * SD_BLOCKDEV_BLOCK_SIZE);
+        }
+        Offset              += SD_Sched.Part[i].Count;
+        pRequest->Lba       += SD_Sched.Part[i].Count;
+        pRequest->pBuffer   += SD_Sched.Part[i].Count * SD_BLOCKDEV_BLOCK_SIZE;
+        pRequest->Remaining -= SD_Sched.Part[i].Count;
+        if ((ErrorState == SD_OK) && (pRequest->Remaining == 0) && (pRequest->Flags & SD_SCHED_FUA) && SD_CardCacheIsEnabled()) {
+            // A FUA write completes only once the card cache is flushed
+            pRequest->State   = SD_SCHED_FLUSHING;
+            SD_Sched.FlushDue = true;
+        } else if ((ErrorState != SD_OK) || (pRequest->Remaining == 0)) {
+            SD_Sched_Finish(SD_Sched.Part[i].Id, ErrorState);
+        } else {
+            pRequest->State = SD_SCHED_PENDING;
+        }
+    }
+    return true;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Accounts a finished request to its client, the callback follows from SD_Sched_RunCallbacks.
+  */
+static void SD_Sched_Finish(uint8_t Id, SD_Error_t Status)
+{
+    SD_SchedRequest_t *pRequest = &SD_Sched.Request[Id];
+    SD_SchedClient_t  *pClient  = &SD_Sched.Client[pRequest->Client];
+    uint32_t           Latency  = DWT->CYCCNT - pRequest->Start;
+
+    if ((int32_t)(HAL_GetTick() - pRequest->Deadline) > 0) {
+        SD_Sched.Stats.Late++;
+    }
+    pClient->Stats.Pending--;
+    pClient->Stats.Completed++;
+    pClient->Stats.Blocks += pRequest->Blocks - pRequest->Remaining;
+    if (Status != SD_OK) {
+        pClient->Stats.Errors++;
+    }
+    pClient->LatencySum += Latency;
+    if (Latency > pClient->LatencyMax) {
+        pClient->LatencyMax = Latency;
+    }
+
+    pRequest->Status = Status;
+    pRequest->State  = SD_SCHED_DONE;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Frees finished requests one at a time and calls their callbacks with interrupts enabled.
+  *         Safe against SD_Sched_Transfer running the same loop from an interrupt.
+  */
+static void SD_Sched_RunCallbacks(void)
+{
+    SD_SchedCallback_t Callback;
+    SD_Error_t         Status;
+    void              *Context;
+    uint32_t           BasePri;
+    uint8_t            Id;
+
+    do {
+        BasePri = SD_Sched_Lock();
+        // Oldest first, a barrier's callback always follows those of the requests before it
+        Id = SD_SCHED_DEPTH;
+        for (uint8_t i = 0; i < SD_SCHED_DEPTH; i++) {
+            if ((SD_Sched.Request[i].State == SD_SCHED_DONE) &&
+                ((Id == SD_SCHED_DEPTH) || ((int32_t)(SD_Sched.Request[i].Sequence - SD_Sched.Request[Id].Sequence) < 0))) {
+                Id = i;
+            }
+        }
+        if (Id < SD_SCHED_DEPTH) {
+            Callback                    = SD_Sched.Request[Id].Callback;
+            Context                     = SD_Sched.Request[Id].Context;
+            Status                      = SD_Sched.Request[Id].Status;
+            SD_Sched.Request[Id].State  = SD_SCHED_FREE;
+            SD_Sched.Stats.Depth--;
+            SD_Sched.Stats.Completed++;
+        }
+        SD_Sched_Unlock(BasePri);
+
+        if ((Id < SD_SCHED_DEPTH) && Callback) {
+            Callback(Id, Status, Context);
+        }
+    } while (Id < SD_SCHED_DEPTH);
+}
+
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Holds off the interrupts that call into the scheduler, BASEPRI only ever goes up so nested
+  *         sections and the driver's own PVD mask are fine.
+  * @retval Previous BASEPRI for SD_Sched_Unlock
+  */
+static uint32_t SD_Sched_Lock(void)
+{
+    uint32_t BasePri = __get_BASEPRI();
+
+    __set_BASEPRI_MAX(SD_SCHED_IRQ_PRIORITY << (8U - __NVIC_PRIO_BITS));
+    return BasePri;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Sched_Unlock(uint32_t BasePri)
+{
+    __set_BASEPRI(BasePri);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#else
+
+void SD_Sched_Init(void)
+{
+}
+
+SD_Error_t SD_Sched_Read(uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                         SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    (void)Lba;
+    (void)pBuffer;
+    (void)NumberOfBlocks;
+    (void)Callback;
+    (void)Context;
+    (void)pRequestId;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Sched_Write(uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                          SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    (void)Lba;
+    (void)pBuffer;
+    (void)NumberOfBlocks;
+    (void)Callback;
+    (void)Context;
+    (void)pRequestId;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Sched_OpenClient(SD_SchedClass_t Class, uint32_t RateKBs, uint32_t BurstKB, uint8_t *pClient)
+{
+    (void)Class;
+    (void)RateKBs;
+    (void)BurstKB;
+    (void)pClient;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Sched_SetClient(uint8_t Client, SD_SchedClass_t Class, uint32_t RateKBs, uint32_t BurstKB)
+{
+    (void)Client;
+    (void)Class;
+    (void)RateKBs;
+    (void)BurstKB;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+void SD_Sched_GetClientStats(uint8_t Client, SD_SchedClientStats_t *pStats)
+{
+    (void)Client;
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+SD_Error_t SD_Sched_ClientRead(uint8_t Client, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                               SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    (void)Client;
+    return SD_Sched_Read(Lba, pBuffer, NumberOfBlocks, Callback, Context, pRequestId);
+}
+
+SD_Error_t SD_Sched_ClientWrite(uint8_t Client, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                                SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    (void)Client;
+    (void)Flags;
+    return SD_Sched_Write(Lba, pBuffer, NumberOfBlocks, Callback, Context, pRequestId);
+}
+
+SD_Error_t SD_Sched_Barrier(uint8_t Client, SD_SchedCallback_t Callback, void *Context, uint8_t *pRequestId)
+{
+    (void)Client;
+    (void)Callback;
+    (void)Context;
+    (void)pRequestId;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Sched_Transfer(uint8_t Client, bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    (void)Client;
+    (void)Write;
+    (void)Lba;
+    (void)pBuffer;
+    (void)NumberOfBlocks;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+void SD_Sched_Process(void)
+{
+}
+
+SD_Error_t SD_Sched_Drain(void)
+{
+    return SD_OK;
+}
+
+bool SD_Sched_IsIdle(void)
+{
+    return true;
+}
+
+void SD_Sched_GetStats(SD_SchedStats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+void SD_Sched_Preempt(void)
+{
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
@@ -0,0 +1,523 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_share.h"
+
+#ifdef SDMMC_SHARE
+
+/*
+ * The MSC callbacks run in the USB interrupt and finish every request before they return, so to the
+ * firmware each host request is atomic. The firmware in turn masks the USB interrupts while it uses
+ * the volume, one slice of at most SD_SHARE_SLICE_BLOCKS at a time: a host command arriving meanwhile
+ * is NAKed for at most one slice, and a logger waits for at most one MSC_MEDIA_PACKET of host data.
+ * Both go through the same stack, so the cache and read-ahead layers see one coherent stream.
+ *
+ * The reserved region belongs to the firmware. Host writes touching it fail (the host sees a write
+ * fault), host reads see whatever was appended so far, unless the host answers them from its own
+ * cache. When the firmware changes what the host's cached view describes, e.g. it wrote a directory
+ * entry or closed a file it appended to, the next host command fails with UNIT ATTENTION, MEDIUM MAY
+ * HAVE CHANGED through SCSI_MediaChanged, and the host drops its cache and reads the volume again.
+ * Reserving or appending does not raise it, the layout the host knows stays valid.
+ */
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_SHARE_IRQ_COUNT              (sizeof(SD_ShareIrq) / sizeof(SD_ShareIrq[0]))
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    SD_BlockDev_t     *pLower;
+    bool               Reserved;
+    uint64_t           Start;           // Region on pLower
+    uint64_t           Blocks;
+    uint64_t           Head;            // Next block to append, relative to Start
+    volatile bool      Changed;         // Not reported to the host yet
+    uint32_t           Enabled;         // Host interrupts that were enabled when the lock was taken, one bit each
+    uint32_t           Since;           // DWT cycles when the lock was taken
+    uint32_t           MaxHold;
+} SD_Share_t;
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_Share_t                  SD_Share;
+static SD_ShareStats_t             SD_ShareStats;
+static SD_BlockDev_t               SD_ShareDevice;
+static const IRQn_Type             SD_ShareIrq[] = SD_SHARE_HOST_IRQS;
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_Share_HostRead           (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Share_HostWrite          (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Share_HostDiscard        (SD_BlockDev_t *pDev, uint64_t Lba, uint64_t NumberOfBlocks);
+static bool             SD_Share_Overlaps           (uint64_t Lba, uint64_t NumberOfBlocks);
+static bool             SD_Share_Lock               (void);
+static void             SD_Share_Unlock             (void);
+static SD_Error_t       SD_Share_Run                (bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t *pDone);
+static SD_Error_t       SD_Share_Transfer           (bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks);
+static void             SD_Share_TransferDone       (SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+
+static const SD_BlockDevOps_t      SD_ShareOps =
+{
+    .Read       = SD_Share_HostRead,
+    .Write      = SD_Share_HostWrite,
+    .Discard    = SD_Share_HostDiscard,
+};
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Sets up the host's device over pLower. A different pLower drops the reserved region.
+  */
+SD_Error_t SD_Share_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppHost)
+{
+    if ((pLower == NULL) || (ppHost == NULL)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (pLower != SD_Share.pLower) {
+        memset(&SD_Share, 0, sizeof(SD_Share));
+        SD_Share.pLower = pLower;
+    }
+    if (SD_Share.Reserved && ((SD_Share.Start + SD_Share.Blocks) > pLower->Blocks)) {
+        SD_Share.Reserved = false;
+    }
+
+    SD_ShareDevice.pOps        = &SD_ShareOps;
+    SD_ShareDevice.pLower      = pLower;
+    SD_ShareDevice.pName       = "share";
+    SD_ShareDevice.pPrivate    = NULL;
+    SD_ShareDevice.Blocks      = pLower->Blocks;
+    SD_ShareDevice.Offset      = 0;
+    SD_ShareDevice.EraseBlocks = pLower->EraseBlocks;
+    SD_ShareDevice.Caps        = pLower->Caps;
+    *ppHost = &SD_ShareDevice;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @retval SD Card error state, SD_BUSY when called from an interrupt that preempted the host
+  */
+SD_Error_t SD_Share_Reserve(uint64_t Lba, uint64_t NumberOfBlocks, uint64_t Head)
+{
+    if (SD_Share.pLower == NULL) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    if ((NumberOfBlocks == 0) || (Head > NumberOfBlocks)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if ((Lba >= SD_Share.pLower->Blocks) || (NumberOfBlocks > (SD_Share.pLower->Blocks - Lba))) {
+        return SD_ADDR_OUT_OF_RANGE;
+    }
+    if (!SD_Share_Lock()) {
+        return SD_BUSY;
+    }
+    SD_Share.Start    = Lba;
+    SD_Share.Blocks   = NumberOfBlocks;
+    SD_Share.Head     = Head;
+    SD_Share.Reserved = true;
+    SD_Share_Unlock();
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Share_Release(void)
+{
+    if (!SD_Share.Reserved) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    if (!SD_Share_Lock()) {
+        return SD_BUSY;
+    }
+    SD_Share.Reserved = false;
+    SD_Share_Unlock();
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  The head advances by every slice that was written, also when a later one failed.
+  */
+SD_Error_t SD_Share_Append(const uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    SD_Error_t ErrorState;
+    uint32_t   Done;
+
+    if ((pBuffer == NULL) || (NumberOfBlocks == 0)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (!SD_Share.Reserved) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    if (NumberOfBlocks > (SD_Share.Blocks - SD_Share.Head)) {
+        return SD_ADDR_OUT_OF_RANGE;
+    }
+
+    ErrorState = SD_Share_Run(true, SD_Share.Start + SD_Share.Head, (uint8_t*)pBuffer, NumberOfBlocks, &Done);
+    SD_Share.Head          += Done;
+    SD_ShareStats.Appended += Done;
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Share_Read(uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    uint32_t Done;
+
+    if ((pBuffer == NULL) || (NumberOfBlocks == 0)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (SD_Share.pLower == NULL) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    return SD_Share_Run(false, Lba, pBuffer, NumberOfBlocks, &Done);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Anything written outside of the region may be metadata the host has cached, the change is
+  *         raised as soon as a slice of it was written.
+  */
+SD_Error_t SD_Share_Write(uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    SD_Error_t ErrorState;
+    uint32_t   Done;
+    bool       Inside;
+
+    if ((pBuffer == NULL) || (NumberOfBlocks == 0)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (SD_Share.pLower == NULL) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    Inside = SD_Share.Reserved && (Lba >= SD_Share.Start) &&
+             ((Lba + NumberOfBlocks) <= (SD_Share.Start + SD_Share.Blocks));
+
+    ErrorState = SD_Share_Run(true, Lba, (uint8_t*)pBuffer, NumberOfBlocks, &Done);
+    SD_ShareStats.Written += Done;
+    if ((Done > 0) && !Inside) {
+        SD_Share_NotifyChange();
+    }
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Holds the host off for as long as the layers take to write back, not one slice, call it
+  *         when the data has to be durable rather than after every append.
+  */
+SD_Error_t SD_Share_Flush(void)
+{
+    SD_Error_t ErrorState;
+
+    if (SD_Share.pLower == NULL) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    if (!SD_Share_Lock()) {
+        return SD_BUSY;
+    }
+    ErrorState = SD_BlockDev_Flush(SD_Share.pLower);
+    SD_Share_Unlock();
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Share_Process(void)
+{
+    if ((SD_Share.pLower == NULL) || !SD_Share_Lock()) {
+        return;
+    }
+    SD_BlockDev_Process(SD_Share.pLower);
+    SD_Share_Unlock();
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Share_NotifyChange(void)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    if (!SD_Share.Changed) {
+        SD_Share.Changed = true;
+        SD_ShareStats.MediaChanges++;
+    }
+    __set_PRIMASK(primask);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Called by the MSC class on every new host command, clears the change it reports.
+  */
+bool SD_Share_MediaChanged(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    bool     Changed;
+
+    __disable_irq();
+    Changed          = SD_Share.Changed;
+    SD_Share.Changed = false;
+    __set_PRIMASK(primask);
+    return Changed;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Share_GetStats(SD_ShareStats_t *pStats)
+{
+    *pStats           = SD_ShareStats;
+    pStats->MaxHoldUs = SD_Share.MaxHold / (SystemCoreClock / 1000000);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Share_HostRead(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                                    SD_BlockDevCallback_t Callback, void *Context)
+{
+    return SD_BlockDev_Forward(pDev, false, Lba, pBuffer, NumberOfBlocks, 0, Callback, Context);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @retval SD Card error state, SD_WRITE_PROT_VIOLATION when the request touches the reserved region
+  */
+static SD_Error_t SD_Share_HostWrite(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                                     SD_BlockDevCallback_t Callback, void *Context)
+{
+    if (SD_Share_Overlaps(Lba, NumberOfBlocks)) {
+        SD_ShareStats.HostRejected++;
+        return SD_WRITE_PROT_VIOLATION;
+    }
+    return SD_BlockDev_Forward(pDev, true, Lba, (uint8_t*)pBuffer, NumberOfBlocks, Flags, Callback, Context);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Share_HostDiscard(SD_BlockDev_t *pDev, uint64_t Lba, uint64_t NumberOfBlocks)
+{
+    if (SD_Share_Overlaps(Lba, NumberOfBlocks)) {
+        SD_ShareStats.HostRejected++;
+        return SD_WRITE_PROT_VIOLATION;
+    }
+    return SD_BlockDev_Discard(pDev->pLower, Lba, NumberOfBlocks);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static bool SD_Share_Overlaps(uint64_t Lba, uint64_t NumberOfBlocks)
+{
+    return SD_Share.Reserved && (Lba < (SD_Share.Start + SD_Share.Blocks)) && ((Lba + NumberOfBlocks) > SD_Share.Start);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Masks the host interrupts that are enabled. An interrupt that preempted the host cannot wait
+  *         for it to finish, the caller is refused instead.
+  * @retval true when the host is held off
+  */
+static bool SD_Share_Lock(void)
+{
+    for (uint32_t i = 0; i < SD_SHARE_IRQ_COUNT; i++) {
+        if (NVIC_GetActive(SD_ShareIrq[i])) {
+            SD_ShareStats.Refused++;
+            return false;
+        }
+    }
+
+    SD_Share.Enabled = 0;
+    for (uint32_t i = 0; i < SD_SHARE_IRQ_COUNT; i++) {
+        if (NVIC_GetEnableIRQ(SD_ShareIrq[i])) {
+            SD_Share.Enabled |= (1U << i);
+            NVIC_DisableIRQ(SD_ShareIrq[i]);
+        }
+    }
+    SD_Share.Since = DWT->CYCCNT;
+    SD_ShareStats.Slices++;
+    return true;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Share_Unlock(void)
+{
+    uint32_t Hold = DWT->CYCCNT - SD_Share.Since;
+
+    if (Hold > SD_Share.MaxHold) {
+        SD_Share.MaxHold = Hold;
+    }
+    for (uint32_t i = 0; i < SD_SHARE_IRQ_COUNT; i++) {
+        if (SD_Share.Enabled & (1U << i)) {
+            NVIC_EnableIRQ(SD_ShareIrq[i]);
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Transfers slice by slice, the host is let in between them.
+  * @param  pDone: Blocks transferred before the first failure
+  * @retval SD Card error state, SD_BUSY when called from an interrupt that preempted the host
+  */
+static SD_Error_t SD_Share_Run(bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t *pDone)
+{
+    SD_Error_t ErrorState = SD_OK;
+    uint32_t   Count;
+
+    *pDone = 0;
+    while ((*pDone < NumberOfBlocks) && (ErrorState == SD_OK)) {
+        Count = NumberOfBlocks - *pDone;
+        if (Count > SD_SHARE_SLICE_BLOCKS) {
+            Count = SD_SHARE_SLICE_BLOCKS;
+        }
+        if (!SD_Share_Lock()) {
+            return SD_BUSY;
+        }
+        ErrorState = SD_Share_Transfer(Write, Lba + *pDone, &pBuffer[*pDone * SD_BLOCKDEV_BLOCK_SIZE], Count);
+        SD_Share_Unlock();
+        if (ErrorState == SD_OK) {
+            *pDone += Count;
+        }
+    }
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static SD_Error_t SD_Share_Transfer(bool Write, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    volatile SD_Error_t Status = SD_BUSY;
+    SD_Error_t          ErrorState;
+
+    if (Write == true) {
+        ErrorState = SD_BlockDev_Write(SD_Share.pLower, Lba, pBuffer, NumberOfBlocks, 0, SD_Share_TransferDone, (void*)&Status);
+    } else {
+        ErrorState = SD_BlockDev_Read(SD_Share.pLower, Lba, pBuffer, NumberOfBlocks, SD_Share_TransferDone, (void*)&Status);
+    }
+    if (ErrorState != SD_OK) {
+        return ErrorState;
+    }
+    while (Status == SD_BUSY) {
+        SD_BlockDev_Process(SD_Share.pLower);
+    }
+    return Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Share_TransferDone(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context)
+{
+    (void)pDev;
+    *(volatile SD_Error_t*)Context = Status;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#else
+
+SD_Error_t SD_Share_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppHost)
+{
+    (void)pLower;
+    (void)ppHost;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Share_Reserve(uint64_t Lba, uint64_t NumberOfBlocks, uint64_t Head)
+{
+    (void)Lba;
+    (void)NumberOfBlocks;
+    (void)Head;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Share_Release(void)
+{
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Share_Append(const uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    (void)pBuffer;
+    (void)NumberOfBlocks;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Share_Read(uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    (void)Lba;
+    (void)pBuffer;
+    (void)NumberOfBlocks;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Share_Write(uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    (void)Lba;
+    (void)pBuffer;
+    (void)NumberOfBlocks;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Share_Flush(void)
+{
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+void SD_Share_Process(void)
+{
+}
+
+void SD_Share_NotifyChange(void)
+{
+}
+
+bool SD_Share_MediaChanged(void)
+{
+    return false;
+}
+
+void SD_Share_GetStats(SD_ShareStats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
@@ -0,0 +1,275 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_stats.h"
+
+#ifdef SDMMC_STATS
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_Stats_t                  SD_Stats;
+
+static const char * const          SD_StatsOpName[SD_STATS_OP_COUNT]       = { "read", "write", "qread", "qwrite" };
+static const char * const          SD_StatsPhaseName[SD_STATS_PHASE_COUNT] = { "cmd", "data", "busy", "cplt", "total" };
+static const char * const          SD_StatsSizeName[SD_STATS_SIZE_COUNT]   = { "1", "2-8", "9-64", "65-256", ">256" };
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Maps cycle count to log-linear bucket, values below 4 get their own bucket.
+  */
+static inline uint32_t SD_Stats_Bucket(uint32_t Cycles)
+{
+    uint32_t Exponent;
+
+    if (Cycles < SD_STATS_SUB_BUCKETS) {
+        return Cycles;
+    }
+
+    Exponent = 31 - __CLZ(Cycles);
+    return (Exponent - 1) * SD_STATS_SUB_BUCKETS + ((Cycles >> (Exponent - 2)) & (SD_STATS_SUB_BUCKETS - 1));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Largest cycle count that still falls into the bucket.
+  */
+static uint32_t SD_Stats_BucketUpper(uint32_t Bucket)
+{
+    uint32_t Exponent, Sub;
+
+    if (Bucket < SD_STATS_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    Exponent = Bucket / SD_STATS_SUB_BUCKETS + 1;
+    Sub      = Bucket % SD_STATS_SUB_BUCKETS;
+    return (((SD_STATS_SUB_BUCKETS + Sub + 1) << (Exponent - 2)) - 1);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static inline void SD_Stats_Record(SD_Histogram_t *pHistogram, uint32_t Cycles)
+{
+    if (pHistogram->Count == 0 || Cycles < pHistogram->Min) pHistogram->Min = Cycles;
+    if (Cycles > pHistogram->Max)                           pHistogram->Max = Cycles;
+    pHistogram->Count++;
+    pHistogram->Sum += Cycles;
+    pHistogram->Bucket[SD_Stats_Bucket(Cycles)]++;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static inline uint8_t SD_Stats_SizeClass(uint32_t NumberOfBlocks)
+{
+    if (NumberOfBlocks <= 1)   return SD_STATS_SIZE_1;
+    if (NumberOfBlocks <= 8)   return SD_STATS_SIZE_8;
+    if (NumberOfBlocks <= 64)  return SD_STATS_SIZE_64;
+    if (NumberOfBlocks <= 256) return SD_STATS_SIZE_256;
+    return SD_STATS_SIZE_LARGE;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Starts timing of a data request, stamps the issue time.
+  */
+void SD_Stats_Begin(SD_StatsRequest_t *pRequest, SD_StatsOp_t Op, uint32_t NumberOfBlocks)
+{
+    pRequest->Issue      = DWT->CYCCNT;
+    pRequest->Response   = pRequest->Issue;
+    pRequest->DataEnd    = pRequest->Issue;
+    pRequest->Completion = 0;
+    pRequest->Op         = Op;
+    pRequest->SizeClass  = SD_Stats_SizeClass(NumberOfBlocks);
+    pRequest->Active     = 1;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Records all phases of a finished request.
+  * @param  BusyEnd: Cycle count when card left programming state, DataEnd for reads
+  */
+void SD_Stats_Finish(SD_StatsRequest_t *pRequest, uint32_t BusyEnd)
+{
+    SD_Histogram_t *pPhase = SD_Stats.Phase[pRequest->Op];
+    uint32_t        End;
+    uint32_t        primask;
+
+    if (pRequest->Completion == 0) {
+        pRequest->Completion = DWT->CYCCNT;
+    }
+    // Unsigned difference is wrap safe, whichever came last closes the request
+    End = ((int32_t)(BusyEnd - pRequest->Completion) > 0) ? BusyEnd : pRequest->Completion;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    SD_Stats_Record(&pPhase[SD_STATS_PHASE_COMMAND],    pRequest->Response   - pRequest->Issue);
+    SD_Stats_Record(&pPhase[SD_STATS_PHASE_DATA],       pRequest->DataEnd    - pRequest->Response);
+    if (pRequest->Op == SD_STATS_OP_WRITE) {
+        SD_Stats_Record(&pPhase[SD_STATS_PHASE_BUSY],   BusyEnd              - pRequest->DataEnd);
+    }
+    SD_Stats_Record(&pPhase[SD_STATS_PHASE_COMPLETION], pRequest->Completion - pRequest->DataEnd);
+    SD_Stats_Record(&pPhase[SD_STATS_PHASE_TOTAL],      End                  - pRequest->Issue);
+    SD_Stats_Record(&SD_Stats.Total[pRequest->Op][pRequest->SizeClass], End  - pRequest->Issue);
+    __set_PRIMASK(primask);
+
+    pRequest->Active = 0;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Records one command round trip, called from thread and interrupt context.
+  */
+void SD_Stats_Command(uint8_t CmdIndex, uint32_t Start, SD_Error_t ErrorState)
+{
+    uint32_t           Cycles = DWT->CYCCNT - Start;
+    SD_CommandStats_t *pCmd   = &SD_Stats.PerCommand[CmdIndex & (SD_STATS_COMMANDS - 1)];
+    uint32_t           primask;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    SD_Stats_Record(&SD_Stats.Command, Cycles);
+    pCmd->Count++;
+    pCmd->Sum += Cycles;
+    if (Cycles > pCmd->Max)    pCmd->Max = Cycles;
+    if (ErrorState != SD_OK)   pCmd->Errors++;
+    __set_PRIMASK(primask);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Stats_Reset(void)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    memset(&SD_Stats, 0, sizeof(SD_Stats));
+    __set_PRIMASK(primask);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Stats_Snapshot(SD_Stats_t *pSnapshot)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    memcpy(pSnapshot, &SD_Stats, sizeof(SD_Stats));
+    __set_PRIMASK(primask);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Finds the value below which the given share of samples falls.
+  * @param  PartsPer10k: 5000 for p50, 9900 for p99, 9990 for p999
+  * @retval Upper bound of the bucket in cycles, never above the recorded maximum
+  */
+uint32_t SD_Stats_Percentile(const SD_Histogram_t *pHistogram, uint32_t PartsPer10k)
+{
+    uint64_t Target;
+    uint32_t Seen = 0;
+    uint32_t Upper;
+
+    if (pHistogram->Count == 0) {
+        return 0;
+    }
+
+    // Rank of the sample, rounded up
+    Target = ((uint64_t)pHistogram->Count * PartsPer10k + 9999) / 10000;
+    if (Target == 0) Target = 1;
+
+    for (uint32_t i = 0; i < SD_STATS_BUCKETS; i++) {
+        Seen += pHistogram->Bucket[i];
+        if (Seen >= Target) {
+            Upper = SD_Stats_BucketUpper(i);
+            return (Upper > pHistogram->Max) ? pHistogram->Max : Upper;
+        }
+    }
+
+    return pHistogram->Max;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+uint32_t SD_Stats_CyclesToUs(uint32_t Cycles)
+{
+    return Cycles / (SystemCoreClock / 1000000);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Stats_PrintHistogram(const char *pName, const char *pDetail, const SD_Histogram_t *pHistogram)
+{
+    if (pHistogram->Count == 0) {
+        return;
+    }
+
+    printf(" %-7s %-6s n=%-8lu min=%-7lu p50=%-7lu p99=%-7lu p999=%-7lu max=%lu us\n",
+           pName, pDetail, pHistogram->Count,
+           SD_Stats_CyclesToUs(pHistogram->Min),
+           SD_Stats_CyclesToUs(SD_Stats_Percentile(pHistogram, 5000)),
+           SD_Stats_CyclesToUs(SD_Stats_Percentile(pHistogram, 9900)),
+           SD_Stats_CyclesToUs(SD_Stats_Percentile(pHistogram, 9990)),
+           SD_Stats_CyclesToUs(pHistogram->Max));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Prints non empty histograms, pass a snapshot to keep the numbers consistent.
+  */
+void SD_Stats_Print(const SD_Stats_t *pStats)
+{
+    for (uint32_t Op = 0; Op < SD_STATS_OP_COUNT; Op++) {
+        for (uint32_t Phase = 0; Phase < SD_STATS_PHASE_COUNT; Phase++) {
+            SD_Stats_PrintHistogram(SD_StatsOpName[Op], SD_StatsPhaseName[Phase], &pStats->Phase[Op][Phase]);
+        }
+        for (uint32_t Size = 0; Size < SD_STATS_SIZE_COUNT; Size++) {
+            SD_Stats_PrintHistogram(SD_StatsOpName[Op], SD_StatsSizeName[Size], &pStats->Total[Op][Size]);
+        }
+    }
+
+    SD_Stats_PrintHistogram("command", "all", &pStats->Command);
+    for (uint32_t Cmd = 0; Cmd < SD_STATS_COMMANDS; Cmd++) {
+        const SD_CommandStats_t *pCmd = &pStats->PerCommand[Cmd];
+        if (pCmd->Count != 0) {
+            printf(" CMD%-2lu n=%-8lu err=%-5lu avg=%-7lu max=%lu us\n", Cmd, pCmd->Count, pCmd->Errors,
+                   SD_Stats_CyclesToUs((uint32_t)(pCmd->Sum / pCmd->Count)), SD_Stats_CyclesToUs(pCmd->Max));
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
@@ -0,0 +1,125 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sdmmc_sdio.h"
+#include "sd_trace.h"
+
+#ifdef SDMMC_TRACE
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+// Kept in DTCM, recording is a single cycle store per word
+SD_TraceRing_t                     SD_TraceRing = { .Magic = SD_TRACE_MAGIC, .Entries = SD_TRACE_ENTRIES };
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Trace_Reset(void)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    SD_TraceRing.Head = 0;
+    memset(SD_TraceRing.Entry, 0, sizeof(SD_TraceRing.Entry));
+    __set_PRIMASK(primask);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Copies the newest events out of the ring, oldest first.
+  * @param  pEntries: Destination
+  * @param  MaxEntries: Size of destination in entries
+  * @retval Number of entries copied
+  */
+uint32_t SD_Trace_Snapshot(SD_TraceEntry_t *pEntries, uint32_t MaxEntries)
+{
+    uint32_t primask = __get_PRIMASK();
+    uint32_t Head, Count, First;
+
+    __disable_irq();
+    Head  = SD_TraceRing.Head;
+    Count = (Head < SD_TRACE_ENTRIES) ? Head : SD_TRACE_ENTRIES;
+    if (Count > MaxEntries) Count = MaxEntries;
+    First = Head - Count;
+    for (uint32_t i = 0; i < Count; i++) {
+        pEntries[i] = SD_TraceRing.Entry[(First + i) & (SD_TRACE_ENTRIES - 1)];
+    }
+    __set_PRIMASK(primask);
+
+    return Count;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Prints the ring, oldest event first. Recording carries on while the UART is busy,
+  *         an entry is only printed if the writer has not lapped it in the meantime.
+  */
+void SD_Trace_Dump(void)
+{
+    SD_TraceEntry_t Entry;
+    uint32_t        Head, Count, First, Lost = 0;
+
+    Head  = SD_TraceRing.Head;
+    Count = (Head < SD_TRACE_ENTRIES) ? Head : SD_TRACE_ENTRIES;
+    First = Head - Count;
+
+    printf("SDTRACE BEGIN %lu %lu %lu\n", SystemCoreClock, Count, Head);
+    for (uint32_t i = 0; i < Count; i++) {
+        Entry = SD_TraceRing.Entry[(First + i) & (SD_TRACE_ENTRIES - 1)];
+        // Head counts claimed slots, anything older than one lap may have been overwritten
+        if ((SD_TraceRing.Head - (First + i)) >= SD_TRACE_ENTRIES) {
+            Lost++;
+            continue;
+        }
+        printf("%08lx %08lx %08lx\n", Entry.Cycles, Entry.Header, Entry.Data);
+    }
+    printf("SDTRACE END %lu\n", Lost);
+}
+
+#else
+
+void SD_Trace_Reset(void)
+{
+}
+
+uint32_t SD_Trace_Snapshot(SD_TraceEntry_t *pEntries, uint32_t MaxEntries)
+{
+    (void)pEntries;
+    (void)MaxEntries;
+    return 0;
+}
+
+void SD_Trace_Dump(void)
+{
+    printf("SDTRACE disabled\n");
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
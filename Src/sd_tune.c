@@ -0,0 +1,344 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_tune.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_TUNE_RANDOM_BLOCKS           8           // 4KB random requests
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_TuneProfile_t            SD_TuneProfile;
+static const uint8_t               SD_TuneDividers[] = SD_TUNE_DIVIDERS;
+static const uint16_t              SD_TuneChunks[]   = SD_TUNE_CHUNKS;
+static uint32_t                    SD_TuneSeed;
+static uint32_t                    SD_TuneTransfers;
+static uint32_t                    SD_TuneErrors;
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static uint32_t         SD_Tune_Next                (void);
+static SD_Error_t       SD_Tune_Transfer            (bool Write, uint64_t Lba, uint32_t *pBuffer, uint32_t Blocks);
+static bool             SD_Tune_IsStable            (uint64_t Lba, uint32_t *pBuffer, uint32_t Blocks);
+static uint32_t         SD_Tune_Sequential          (bool Write, uint64_t Lba, uint32_t *pBuffer, uint32_t Chunk);
+static uint32_t         SD_Tune_Random              (bool Write, uint64_t Lba, uint32_t ScratchBlocks, uint32_t *pBuffer);
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint32_t SD_Tune_Next(void)
+{
+    // xorshift32, the probes only need addresses and patterns that differ between runs
+    SD_TuneSeed ^= SD_TuneSeed << 13;
+    SD_TuneSeed ^= SD_TuneSeed >> 17;
+    SD_TuneSeed ^= SD_TuneSeed << 5;
+    return SD_TuneSeed;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  One blocking transfer. Waits are bounded, a marginal clock must fail the probe instead of
+  *         hanging calibration.
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_Tune_Transfer(bool Write, uint64_t Lba, uint32_t *pBuffer, uint32_t Blocks)
+{
+    SD_Error_t ErrorState;
+    uint32_t   Start;
+
+    SD_TuneTransfers++;
+    ErrorState = Write ? SD_WriteBlocks_DMA(Lba, pBuffer, SD_BLOCKDEV_BLOCK_SIZE, Blocks)
+                       : SD_ReadBlocks_DMA(Lba, pBuffer, SD_BLOCKDEV_BLOCK_SIZE, Blocks);
+    if (ErrorState != SD_OK) {
+        SD_AbortTransfer();
+        SD_TuneErrors++;
+        return ErrorState;
+    }
+
+    Start = HAL_GetTick();
+    while ((Write ? SD_CheckWrite() : SD_CheckRead()) == SD_BUSY) {
+        if ((HAL_GetTick() - Start) > SD_TUNE_TIMEOUT_MS) {
+            SD_AbortTransfer();
+            SD_TuneErrors++;
+            return SD_DATA_TIMEOUT;
+        }
+    }
+    if ((ErrorState = SD_GetTransferError()) != SD_OK) {
+        SD_TuneErrors++;
+        return ErrorState;
+    }
+    while (SD_GetState() == false) {
+        if ((HAL_GetTick() - Start) > SD_TUNE_TIMEOUT_MS) {
+            SD_TuneErrors++;
+            return SD_DATA_TIMEOUT;
+        }
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Writes a pattern, reads it back over an inverted copy and compares. CRC errors alone miss
+  *         a clock that is just too fast for one data line, the compare does not.
+  * @retval true when the data made the round trip intact
+  */
+static bool SD_Tune_IsStable(uint64_t Lba, uint32_t *pBuffer, uint32_t Blocks)
+{
+    uint32_t Words = Blocks * (SD_BLOCKDEV_BLOCK_SIZE / 4);
+    uint32_t Seed  = SD_Tune_Next();
+
+    SD_TuneSeed = Seed;
+    for (uint32_t i = 0; i < Words; i++) {
+        pBuffer[i] = SD_Tune_Next();
+    }
+    if (SD_Tune_Transfer(true, Lba, pBuffer, Blocks) != SD_OK) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < Words; i++) {
+        pBuffer[i] = ~pBuffer[i];
+    }
+    // Dirty lines must not land on top of the DMA data later
+    if (SCB->CCR & SCB_CCR_DC_Msk) {
+        SCB_CleanDCache_by_Addr(pBuffer, Words * 4);
+    }
+    if (SD_Tune_Transfer(false, Lba, pBuffer, Blocks) != SD_OK) {
+        return false;
+    }
+    if (SCB->CCR & SCB_CCR_DC_Msk) {
+        SCB_InvalidateDCache_by_Addr(pBuffer, Words * 4);
+    }
+
+    SD_TuneSeed = Seed;
+    for (uint32_t i = 0; i < Words; i++) {
+        if (pBuffer[i] != SD_Tune_Next()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Moves SD_TUNE_PROBE_BLOCKS through the scratch area in Chunk sized requests.
+  * @retval KB/s, 0 when a request failed
+  */
+static uint32_t SD_Tune_Sequential(bool Write, uint64_t Lba, uint32_t *pBuffer, uint32_t Chunk)
+{
+    uint32_t Start = DWT->CYCCNT;
+    uint32_t Cycles;
+
+    for (uint32_t Done = 0; Done < SD_TUNE_PROBE_BLOCKS; Done += Chunk) {
+        if (SD_Tune_Transfer(Write, Lba + Done, pBuffer, Chunk) != SD_OK) {
+            return 0;
+        }
+    }
+    Cycles = DWT->CYCCNT - Start;
+
+    return (uint32_t)(((uint64_t)(SD_TUNE_PROBE_BLOCKS / 2) * SystemCoreClock) / (Cycles ? Cycles : 1));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  4KB requests at random 4KB aligned offsets of the scratch area.
+  * @retval Requests per second, 0 when a request failed
+  */
+static uint32_t SD_Tune_Random(bool Write, uint64_t Lba, uint32_t ScratchBlocks, uint32_t *pBuffer)
+{
+    uint32_t Slots = ScratchBlocks / SD_TUNE_RANDOM_BLOCKS;
+    uint32_t Start = DWT->CYCCNT;
+    uint32_t Cycles;
+
+    for (uint32_t i = 0; i < SD_TUNE_RANDOM_REQUESTS; i++) {
+        uint64_t Offset = (uint64_t)(SD_Tune_Next() % Slots) * SD_TUNE_RANDOM_BLOCKS;
+        if (SD_Tune_Transfer(Write, Lba + Offset, pBuffer, SD_TUNE_RANDOM_BLOCKS) != SD_OK) {
+            return 0;
+        }
+    }
+    Cycles = DWT->CYCCNT - Start;
+
+    return (uint32_t)(((uint64_t)SD_TUNE_RANDOM_REQUESTS * SystemCoreClock) / (Cycles ? Cycles : 1));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Calibration pass. Every divider up to SD_TUNE_MAX_CLOCK has to survive a pattern round trip
+  *         and a sequential read and write probe, the error free one with the best combined throughput
+  *         wins. Chunk sizes and write strategies are then compared at that clock, the winners are
+  *         applied to the driver and kept as the profile.
+  * @param  ScratchLba: First block of an area the application does not use, its content is destroyed
+  * @param  ScratchBlocks: Size of the area, at least SD_TUNE_PROBE_BLOCKS
+  * @param  pBuffer: Buffer in AXI SRAM
+  * @param  BufferBlocks: Size of the buffer in blocks, chunks larger than this are not tried
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Tune_Run(uint64_t ScratchLba, uint32_t ScratchBlocks, uint32_t *pBuffer, uint32_t BufferBlocks)
+{
+    SD_TuneProfile_t Profile = { 0 };
+    uint32_t         MaxChunk = 0, BestScore = 0, Kbs;
+    uint8_t          Original = SD_GetClockDivider();
+
+    if ((ScratchBlocks < SD_TUNE_PROBE_BLOCKS) || (pBuffer == NULL) ||
+        ((ScratchLba + ScratchBlocks) > SD_GetBlockCount())) {
+        return SD_INVALID_PARAMETER;
+    }
+    for (uint32_t i = 0; i < (sizeof(SD_TuneChunks) / sizeof(SD_TuneChunks[0])); i++) {
+        if ((SD_TuneChunks[i] <= BufferBlocks) && (SD_TuneChunks[i] > MaxChunk)) {
+            MaxChunk = SD_TuneChunks[i];
+        }
+    }
+    if (MaxChunk == 0) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (!SD_IsIdle()) {
+        return SD_BUSY;
+    }
+
+    SD_TuneSeed      = DWT->CYCCNT | 1;
+    SD_TuneTransfers = 0;
+    SD_TuneErrors    = 0;
+
+    // Clock: stability first, throughput decides between stable dividers
+    for (uint32_t i = 0; i < sizeof(SD_TuneDividers); i++) {
+        uint32_t Score;
+
+        if (SD_GetBusClock(SD_TuneDividers[i]) > SD_TUNE_MAX_CLOCK) {
+            continue;
+        }
+        if (SD_SetClockDivider(SD_TuneDividers[i]) != SD_OK) {
+            continue;
+        }
+        if (!SD_Tune_IsStable(ScratchLba, pBuffer, MaxChunk)) {
+            Profile.RejectedDividers++;
+            continue;
+        }
+        Score = SD_Tune_Sequential(false, ScratchLba, pBuffer, MaxChunk);
+        Kbs   = SD_Tune_Sequential(true, ScratchLba, pBuffer, MaxChunk);
+        if ((Score == 0) || (Kbs == 0) || !SD_Tune_IsStable(ScratchLba, pBuffer, MaxChunk)) {
+            Profile.RejectedDividers++;
+            continue;
+        }
+        Score += Kbs;
+        if (Score > BestScore) {
+            BestScore            = Score;
+            Profile.ClockDivider = SD_TuneDividers[i];
+        }
+    }
+
+    if (BestScore == 0) {
+        SD_SetClockDivider(Original);
+        return SD_DATA_CRC_FAIL;
+    }
+    SD_SetClockDivider(Profile.ClockDivider);
+    Profile.BusClock = SD_GetBusClock(Profile.ClockDivider);
+
+    // Request size and write strategy at the chosen clock
+    for (uint32_t i = 0; i < (sizeof(SD_TuneChunks) / sizeof(SD_TuneChunks[0])); i++) {
+        uint32_t Chunk = SD_TuneChunks[i];
+
+        if (Chunk > BufferBlocks) {
+            continue;
+        }
+        Kbs = SD_Tune_Sequential(false, ScratchLba, pBuffer, Chunk);
+        if (Kbs > Profile.SeqReadKBs) {
+            Profile.SeqReadKBs = Kbs;
+            Profile.ReadChunk  = (uint16_t)Chunk;
+        }
+        for (uint32_t Strategy = SD_WRITE_OPEN_ENDED; Strategy <= SD_WRITE_PRE_ERASE; Strategy++) {
+            SD_SetWriteStrategy((SD_WriteStrategy_t)Strategy);
+            Kbs = SD_Tune_Sequential(true, ScratchLba, pBuffer, Chunk);
+            if (Kbs > Profile.SeqWriteKBs) {
+                Profile.SeqWriteKBs   = Kbs;
+                Profile.WriteChunk    = (uint16_t)Chunk;
+                Profile.WriteStrategy = (SD_WriteStrategy_t)Strategy;
+            }
+        }
+    }
+    SD_SetWriteStrategy(Profile.WriteStrategy);
+
+    if (BufferBlocks >= SD_TUNE_RANDOM_BLOCKS) {
+        Profile.RandReadIops  = SD_Tune_Random(false, ScratchLba, ScratchBlocks, pBuffer);
+        Profile.RandWriteIops = SD_Tune_Random(true, ScratchLba, ScratchBlocks, pBuffer);
+    }
+
+    Profile.SpeedMode      = SD_TUNE_SPEED_DEFAULT;
+    Profile.ProbeTransfers = SD_TuneTransfers;
+    Profile.ProbeErrors    = SD_TuneErrors;
+    Profile.Valid          = (Profile.ReadChunk != 0) && (Profile.WriteChunk != 0);
+    SD_TuneProfile = Profile;
+
+    return Profile.Valid ? SD_OK : SD_ERROR;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Tune_Apply(const SD_TuneProfile_t *pProfile)
+{
+    SD_Error_t ErrorState;
+
+    if ((pProfile == NULL) || !pProfile->Valid) {
+        return SD_INVALID_PARAMETER;
+    }
+    if ((ErrorState = SD_SetClockDivider(pProfile->ClockDivider)) != SD_OK) {
+        return ErrorState;
+    }
+    SD_SetWriteStrategy(pProfile->WriteStrategy);
+    SD_TuneProfile = *pProfile;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+const SD_TuneProfile_t *SD_Tune_GetProfile(void)
+{
+    return &SD_TuneProfile;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Tune_Print(const SD_TuneProfile_t *pProfile)
+{
+    if (!pProfile->Valid) {
+        printf("SD tune: no profile\n");
+        return;
+    }
+    printf("SD tune: clkdiv %u (%lu kHz), %u rejected, %lu/%lu probe errors\n", pProfile->ClockDivider, pProfile->BusClock / 1000,
+           pProfile->RejectedDividers, pProfile->ProbeErrors, pProfile->ProbeTransfers);
+    printf("  read  chunk %u blocks %lu KB/s, random 4KB %lu IOPS\n", pProfile->ReadChunk, pProfile->SeqReadKBs, pProfile->RandReadIops);
+    printf("  write chunk %u blocks %lu KB/s %s, random 4KB %lu IOPS\n", pProfile->WriteChunk, pProfile->SeqWriteKBs,
+           (pProfile->WriteStrategy == SD_WRITE_PRE_ERASE) ? "pre-erase" : "open-ended", pProfile->RandWriteIops);
+}
@@ -0,0 +1,332 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_tune.h"
+#include "sd_tunedb.h"
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_TUNEDB_RECORDS               (SD_TUNEDB_SIZE / sizeof(SD_TuneDBRecord_t))
+#define SD_TUNEDB_FLASH_WORD            32
+#define SD_TUNEDB_ERASED                ((uint32_t)0xFFFFFFFF)
+#define SD_TUNEDB_CRC_LEN               offsetof(SD_TuneDBRecord_t, Crc)
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+// Survivors of a compaction, programmed back after the sector erase
+static SD_TuneDBRecord_t           SD_TuneDBCompact[SD_TUNEDB_MAX_CARDS];
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static inline const SD_TuneDBRecord_t *SD_TuneDB_Slot(uint32_t Index)
+{
+    return (const SD_TuneDBRecord_t *)(SD_TUNEDB_ADDRESS + (Index * sizeof(SD_TuneDBRecord_t)));
+}
+
+static uint32_t         SD_TuneDB_Crc32             (const uint8_t *pData, uint32_t Length);
+static bool             SD_TuneDB_IsValid           (const SD_TuneDBRecord_t *pRecord);
+static bool             SD_TuneDB_SameCard          (const SD_TuneDBRecord_t *pA, const SD_TuneDBRecord_t *pB);
+static const SD_TuneDBRecord_t *SD_TuneDB_Find      (const SD_TuneDBRecord_t *pKey, uint32_t *pFree, uint32_t *pSequence);
+static void             SD_TuneDB_Pack              (SD_TuneDBRecord_t *pRecord, const SD_CID_t *pCID, const SD_TuneProfile_t *pProfile);
+static SD_Error_t       SD_TuneDB_Program           (uint32_t Index, SD_TuneDBRecord_t *pRecord);
+static SD_Error_t       SD_TuneDB_Compact           (uint32_t *pFree);
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint32_t SD_TuneDB_Crc32(const uint8_t *pData, uint32_t Length)
+{
+    uint32_t Crc = 0xFFFFFFFF;
+
+    while (Length--) {
+        Crc ^= *pData++;
+        for (uint8_t i = 0; i < 8; i++) {
+            Crc = (Crc >> 1) ^ (0xEDB88320 & (0 - (Crc & 1)));
+        }
+    }
+    return ~Crc;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static bool SD_TuneDB_IsValid(const SD_TuneDBRecord_t *pRecord)
+{
+    return (pRecord->Magic == SD_TUNEDB_MAGIC) &&
+           (pRecord->Crc == SD_TuneDB_Crc32((const uint8_t *)pRecord, SD_TUNEDB_CRC_LEN));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static bool SD_TuneDB_SameCard(const SD_TuneDBRecord_t *pA, const SD_TuneDBRecord_t *pB)
+{
+    return (pA->ManufacturerID == pB->ManufacturerID) && (pA->OEM_AppliID == pB->OEM_AppliID) &&
+           (pA->ProdName1 == pB->ProdName1) && (pA->ProdName2 == pB->ProdName2) &&
+           (pA->ProdSN == pB->ProdSN);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Scans the sector once. Records are appended in order, so the first erased slot ends the scan.
+  *         Torn records (power lost while programming) fail the CRC and are skipped.
+  * @param  pKey: Card to look for, NULL to only find the free slot
+  * @param  pFree: Receives the first free slot, SD_TUNEDB_RECORDS when the sector is full
+  * @param  pSequence: Receives the highest sequence number in use
+  * @retval Newest record of the card or NULL
+  */
+static const SD_TuneDBRecord_t *SD_TuneDB_Find(const SD_TuneDBRecord_t *pKey, uint32_t *pFree, uint32_t *pSequence)
+{
+    const SD_TuneDBRecord_t *pNewest = NULL;
+    const SD_TuneDBRecord_t *pRecord;
+    uint32_t                 Index;
+
+    *pSequence = 0;
+    for (Index = 0; Index < SD_TUNEDB_RECORDS; Index++) {
+        pRecord = SD_TuneDB_Slot(Index);
+        if (pRecord->Magic == SD_TUNEDB_ERASED) {
+            break;
+        }
+        if (!SD_TuneDB_IsValid(pRecord)) {
+            continue;
+        }
+        if (pRecord->Sequence > *pSequence) {
+            *pSequence = pRecord->Sequence;
+        }
+        if ((pKey != NULL) && SD_TuneDB_SameCard(pRecord, pKey) &&
+            ((pNewest == NULL) || (pRecord->Sequence > pNewest->Sequence))) {
+            pNewest = pRecord;
+        }
+    }
+    *pFree = Index;
+    return pNewest;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_TuneDB_Pack(SD_TuneDBRecord_t *pRecord, const SD_CID_t *pCID, const SD_TuneProfile_t *pProfile)
+{
+    memset(pRecord, 0, sizeof(*pRecord));
+    pRecord->Magic            = SD_TUNEDB_MAGIC;
+    pRecord->ManufacturerID   = pCID->ManufacturerID;
+    pRecord->ProdName2        = pCID->ProdName2;
+    pRecord->OEM_AppliID      = pCID->OEM_AppliID;
+    pRecord->ProdName1        = pCID->ProdName1;
+    pRecord->ProdSN           = pCID->ProdSN;
+    if (pProfile == NULL) {
+        return;
+    }
+    pRecord->SpeedMode        = (uint8_t)pProfile->SpeedMode;
+    pRecord->ClockDivider     = pProfile->ClockDivider;
+    pRecord->WriteStrategy    = (uint8_t)pProfile->WriteStrategy;
+    pRecord->RejectedDividers = pProfile->RejectedDividers;
+    pRecord->ReadChunk        = pProfile->ReadChunk;
+    pRecord->WriteChunk       = pProfile->WriteChunk;
+    pRecord->BusClock         = pProfile->BusClock;
+    pRecord->SeqReadKBs       = pProfile->SeqReadKBs;
+    pRecord->SeqWriteKBs      = pProfile->SeqWriteKBs;
+    pRecord->RandReadIops     = pProfile->RandReadIops;
+    pRecord->RandWriteIops    = pProfile->RandWriteIops;
+    pRecord->ProbeTransfers   = pProfile->ProbeTransfers;
+    pRecord->ProbeErrors      = pProfile->ProbeErrors;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Seals the record with its CRC and programs it as two flash words.
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_TuneDB_Program(uint32_t Index, SD_TuneDBRecord_t *pRecord)
+{
+    uint32_t          Address = (uint32_t)SD_TuneDB_Slot(Index);
+    HAL_StatusTypeDef Status  = HAL_OK;
+
+    pRecord->Crc = SD_TuneDB_Crc32((const uint8_t *)pRecord, SD_TUNEDB_CRC_LEN);
+
+    HAL_FLASH_Unlock();
+    for (uint32_t Offset = 0; (Offset < sizeof(*pRecord)) && (Status == HAL_OK); Offset += SD_TUNEDB_FLASH_WORD) {
+        Status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, Address + Offset, (uint32_t)pRecord + Offset);
+    }
+    HAL_FLASH_Lock();
+    SCB_InvalidateDCache_by_Addr((uint32_t *)Address, sizeof(*pRecord));
+
+    return (Status == HAL_OK) ? SD_OK : SD_ERROR;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_TuneDB_Erase(void)
+{
+    FLASH_EraseInitTypeDef Erase;
+    uint32_t               SectorError;
+    HAL_StatusTypeDef      Status;
+
+    Erase.TypeErase    = FLASH_TYPEERASE_SECTORS;
+    Erase.Banks        = FLASH_BANK_2;
+    Erase.Sector       = FLASH_SECTOR_7;
+    Erase.NbSectors    = 1;
+    Erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+
+    HAL_FLASH_Unlock();
+    Status = HAL_FLASHEx_Erase(&Erase, &SectorError);
+    HAL_FLASH_Lock();
+    SCB_InvalidateDCache_by_Addr((uint32_t *)SD_TUNEDB_ADDRESS, SD_TUNEDB_SIZE);
+
+    return (Status == HAL_OK) ? SD_OK : SD_ERROR;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Keeps the newest record of up to SD_TUNEDB_MAX_CARDS cards, erases the sector and programs
+  *         them back. Losing power in between only costs a recalibration.
+  * @param  pFree: Receives the first free slot afterwards
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_TuneDB_Compact(uint32_t *pFree)
+{
+    const SD_TuneDBRecord_t *pRecord;
+    SD_Error_t               ErrorState;
+    uint32_t                 Count = 0, Oldest, Slot;
+
+    for (uint32_t Index = 0; Index < SD_TUNEDB_RECORDS; Index++) {
+        pRecord = SD_TuneDB_Slot(Index);
+        if (!SD_TuneDB_IsValid(pRecord)) {
+            continue;
+        }
+        // Same card replaces its older record, otherwise take a free entry or evict the oldest card
+        for (Slot = 0, Oldest = 0; Slot < Count; Slot++) {
+            if (SD_TuneDB_SameCard(&SD_TuneDBCompact[Slot], pRecord)) break;
+            if (SD_TuneDBCompact[Slot].Sequence < SD_TuneDBCompact[Oldest].Sequence) Oldest = Slot;
+        }
+        if ((Slot == Count) && (Count < SD_TUNEDB_MAX_CARDS)) {
+            SD_TuneDBCompact[Count++] = *pRecord;
+            continue;
+        }
+        if (Slot == Count) {
+            Slot = Oldest;
+        }
+        if (pRecord->Sequence > SD_TuneDBCompact[Slot].Sequence) {
+            SD_TuneDBCompact[Slot] = *pRecord;
+        }
+    }
+
+    if ((ErrorState = SD_TuneDB_Erase()) != SD_OK) {
+        return ErrorState;
+    }
+    for (Slot = 0; Slot < Count; Slot++) {
+        if ((ErrorState = SD_TuneDB_Program(Slot, &SD_TuneDBCompact[Slot])) != SD_OK) {
+            return ErrorState;
+        }
+    }
+    *pFree = Count;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_TuneDB_Lookup(const SD_CID_t *pCID, SD_TuneProfile_t *pProfile)
+{
+    const SD_TuneDBRecord_t *pRecord;
+    SD_TuneDBRecord_t        Key;
+    uint32_t                 Free, Sequence;
+
+    SD_TuneDB_Pack(&Key, pCID, NULL);
+    if ((pRecord = SD_TuneDB_Find(&Key, &Free, &Sequence)) == NULL) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+
+    memset(pProfile, 0, sizeof(*pProfile));
+    pProfile->Valid            = true;
+    pProfile->SpeedMode        = (SD_TuneSpeed_t)pRecord->SpeedMode;
+    pProfile->ClockDivider     = pRecord->ClockDivider;
+    pProfile->WriteStrategy    = (SD_WriteStrategy_t)pRecord->WriteStrategy;
+    pProfile->RejectedDividers = pRecord->RejectedDividers;
+    pProfile->ReadChunk        = pRecord->ReadChunk;
+    pProfile->WriteChunk       = pRecord->WriteChunk;
+    pProfile->BusClock         = pRecord->BusClock;
+    pProfile->SeqReadKBs       = pRecord->SeqReadKBs;
+    pProfile->SeqWriteKBs      = pRecord->SeqWriteKBs;
+    pProfile->RandReadIops     = pRecord->RandReadIops;
+    pProfile->RandWriteIops    = pRecord->RandWriteIops;
+    pProfile->ProbeTransfers   = pRecord->ProbeTransfers;
+    pProfile->ProbeErrors      = pRecord->ProbeErrors;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_TuneDB_Store(const SD_CID_t *pCID, const SD_TuneProfile_t *pProfile)
+{
+    const SD_TuneDBRecord_t *pNewest;
+    SD_TuneDBRecord_t        Record;
+    SD_Error_t               ErrorState;
+    uint32_t                 Free, Sequence;
+
+    if ((pProfile == NULL) || !pProfile->Valid) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    SD_TuneDB_Pack(&Record, pCID, pProfile);
+    pNewest = SD_TuneDB_Find(&Record, &Free, &Sequence);
+
+    // Flash wear: nothing to do when the card is already stored with this profile
+    if ((pNewest != NULL) &&
+        (memcmp(&pNewest->SpeedMode, &Record.SpeedMode, offsetof(SD_TuneDBRecord_t, Crc) - offsetof(SD_TuneDBRecord_t, SpeedMode)) == 0)) {
+        return SD_OK;
+    }
+
+    if (Free >= SD_TUNEDB_RECORDS) {
+        if ((ErrorState = SD_TuneDB_Compact(&Free)) != SD_OK) {
+            return ErrorState;
+        }
+    }
+
+    Record.Sequence = Sequence + 1;
+    return SD_TuneDB_Program(Free, &Record);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Boot path for known cards: the stored clock and write strategy are applied right after
+  *         initialization and become the profile upper layers see through SD_Tune_GetProfile.
+  * @retval SD Card error state, SD_REQUEST_NOT_APPLICABLE for an unknown card
+  */
+SD_Error_t SD_TuneDB_ApplyCard(void)
+{
+    SD_TuneProfile_t Profile;
+    SD_Error_t       ErrorState;
+
+    if ((ErrorState = SD_TuneDB_Lookup((const SD_CID_t *)&SD_CardInfo.SD_cid, &Profile)) != SD_OK) {
+        return ErrorState;
+    }
+    return SD_Tune_Apply(&Profile);
+}
@@ -0,0 +1,379 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_verify.h"
+
+#ifdef SDMMC_VERIFY
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_VERIFY_WORDS                 (SD_BLOCKDEV_BLOCK_SIZE / 4)
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef enum
+{
+    SD_VERIFY_STATE_IDLE    = 0,
+    SD_VERIFY_STATE_READING = 1,        // Batch read in flight, foreground I/O aborts it
+} SD_VerifyState_t;
+
+typedef struct
+{
+    SD_VerifyCallback_t Callback;
+    void               *Context;
+    bool                Enabled;
+    bool                Issuing;        // Our own SD_ReadBlocks_DMA call, not foreground activity
+    volatile uint8_t    State;
+    uint32_t            BatchCount;     // Blocks in flight, taken from the ring tail
+    volatile uint32_t   Head;           // Total entries recorded, slot = Head % SD_VERIFY_ENTRIES
+    volatile uint32_t   Tail;           // Total entries taken for verification
+    volatile uint32_t   LastActivity;   // HAL tick of the last foreground request
+    SD_VerifyEntry_t    Batch[SD_VERIFY_BATCH];
+    SD_VerifyEntry_t    Entry[SD_VERIFY_ENTRIES];
+    SD_VerifyStats_t    Stats;
+} SD_Verify_t;
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_Verify_t                 SD_Verify;
+static uint32_t                    SD_VerifyBuffer[SD_VERIFY_BATCH * SD_VERIFY_WORDS] __attribute__((section(".ram_d1"), aligned(32)));
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static void             SD_Verify_Complete          (void);
+static bool             SD_Verify_IsSuperseded      (uint64_t Lba);
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Fletcher style sum over 32 bit words, two adds per word. Catches dropped, shifted and
+  *         stuck words, it is not meant to be cryptographically strong.
+  * @param  pBlock: 512 byte block
+  * @retval Checksum
+  */
+uint32_t SD_Verify_Checksum(const uint32_t *pBlock)
+{
+    uint32_t a = 0, b = 0;
+
+    for (uint32_t i = 0; i < SD_VERIFY_WORDS; i++) {
+        a += pBlock[i];
+        b += a;
+    }
+    return a ^ ((b << 13) | (b >> 19));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Verify_Enable(SD_VerifyCallback_t Callback, void *Context)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    SD_Verify.Callback     = Callback;
+    SD_Verify.Context      = Context;
+    SD_Verify.Head         = 0;
+    SD_Verify.Tail         = 0;
+    SD_Verify.LastActivity = HAL_GetTick();
+    memset(&SD_Verify.Stats, 0, sizeof(SD_Verify.Stats));
+    SD_Verify.Enabled      = true;
+    __set_PRIMASK(primask);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Verify_Disable(void)
+{
+    SD_Verify_Preempt();
+    SD_Verify.Enabled = false;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+uint32_t SD_Verify_Pending(void)
+{
+    return SD_Verify.Head - SD_Verify.Tail + SD_Verify.BatchCount;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Verify_GetStats(SD_VerifyStats_t *pStats)
+{
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    *pStats = SD_Verify.Stats;
+    __set_PRIMASK(primask);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Remembers checksums of blocks just handed to the card. Called by the driver once the write
+  *         command is accepted, so the sums are calculated while IDMA streams the same buffer out.
+  *         When the ring is full the oldest entry is dropped, a newer write of an LBA is therefore
+  *         always pending when an older one is.
+  * @param  Lba: First block
+  * @param  pBuffer: Data as written
+  * @param  NumberOfBlocks: Number of blocks
+  */
+void SD_Verify_Record(uint64_t Lba, const uint32_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    SD_VerifyEntry_t *pEntry;
+
+    if (!SD_Verify.Enabled) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < NumberOfBlocks; i++) {
+        if ((SD_Verify.Head - SD_Verify.Tail) >= SD_VERIFY_ENTRIES) {
+            SD_Verify.Tail++;
+            SD_Verify.Stats.Dropped++;
+        }
+        pEntry           = &SD_Verify.Entry[SD_Verify.Head & (SD_VERIFY_ENTRIES - 1)];
+        pEntry->Lba      = Lba + i;
+        pEntry->Checksum = SD_Verify_Checksum(&pBuffer[i * SD_VERIFY_WORDS]);
+        SD_Verify.Head++;
+    }
+    SD_Verify.Stats.Recorded += NumberOfBlocks;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Called by the driver on entry of every foreground request. Aborts a verification read still
+  *         in flight and gives its blocks back to the ring, so foreground latency never includes a
+  *         background transfer, only the abort itself.
+  */
+void SD_Verify_Preempt(void)
+{
+    uint32_t primask;
+
+    if (SD_Verify.Issuing) {
+        return;
+    }
+    SD_Verify.LastActivity = HAL_GetTick();
+
+    if (SD_Verify.State != SD_VERIFY_STATE_READING) {
+        return;
+    }
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    SD_AbortTransfer();
+    // Entries stay in ring memory until a lap overwrites them
+    if ((SD_Verify.Head - SD_Verify.Tail + SD_Verify.BatchCount) <= SD_VERIFY_ENTRIES) {
+        SD_Verify.Tail -= SD_Verify.BatchCount;
+    } else {
+        SD_Verify.Stats.Dropped += SD_Verify.BatchCount;
+    }
+    SD_Verify.BatchCount = 0;
+    SD_Verify.State      = SD_VERIFY_STATE_IDLE;
+    SD_Verify.Stats.Preempted++;
+    __set_PRIMASK(primask);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Background step, call it from the idle loop. Starts a batch read once the card has seen no
+  *         foreground request for SD_VERIFY_IDLE_MS and collects it on a later call. Interrupts are
+  *         masked only while the batch is issued, so foreground requests coming from interrupt
+  *         context (USB MSC) cannot interleave with our commands.
+  */
+void SD_Verify_Process(void)
+{
+    SD_VerifyEntry_t *pEntry;
+    SD_Error_t        ErrorState;
+    uint32_t          primask, Count;
+
+    if (!SD_Verify.Enabled) {
+        return;
+    }
+
+    if (SD_Verify.State == SD_VERIFY_STATE_READING) {
+        SD_Verify_Complete();
+        return;
+    }
+
+    if ((SD_Verify.Head == SD_Verify.Tail) || ((HAL_GetTick() - SD_Verify.LastActivity) < SD_VERIFY_IDLE_MS)) {
+        return;
+    }
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+
+    // Foreground transfer still being polled by its owner, or card still programming
+    if (!SD_IsIdle() || !SD_GetState()) {
+        __set_PRIMASK(primask);
+        return;
+    }
+
+    // Take consecutive LBAs from the tail, one multi block read per batch
+    Count = 0;
+    while ((Count < SD_VERIFY_BATCH) && (SD_Verify.Tail != SD_Verify.Head)) {
+        pEntry = &SD_Verify.Entry[SD_Verify.Tail & (SD_VERIFY_ENTRIES - 1)];
+        if ((Count != 0) && (pEntry->Lba != (SD_Verify.Batch[0].Lba + Count))) {
+            break;
+        }
+        SD_Verify.Batch[Count++] = *pEntry;
+        SD_Verify.Tail++;
+    }
+    SD_Verify.BatchCount = Count;
+
+    SD_Verify.Issuing = true;
+    ErrorState = SD_ReadBlocks_DMA(SD_Verify.Batch[0].Lba, SD_VerifyBuffer, SD_BLOCKDEV_BLOCK_SIZE, Count);
+    SD_Verify.Issuing = false;
+
+    if (ErrorState == SD_OK) {
+        SD_Verify.State = SD_VERIFY_STATE_READING;
+        __set_PRIMASK(primask);
+        return;
+    }
+
+    // Nothing read, report the whole batch
+    SD_Verify.BatchCount = 0;
+    SD_Verify.Stats.ReadErrors += Count;
+    __set_PRIMASK(primask);
+
+    for (uint32_t i = 0; i < Count; i++) {
+        if (SD_Verify.Callback) {
+            SD_Verify.Callback(SD_Verify.Batch[i].Lba, ErrorState, SD_Verify.Context);
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Verify_Complete(void)
+{
+    SD_VerifyEntry_t Batch[SD_VERIFY_BATCH];
+    SD_Error_t       ErrorState;
+    uint32_t         primask, Count;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    // Preempt may have run since the state was checked
+    if ((SD_Verify.State != SD_VERIFY_STATE_READING) || (SD_CheckRead() == SD_BUSY)) {
+        __set_PRIMASK(primask);
+        return;
+    }
+    ErrorState = SD_GetTransferError();
+    Count      = SD_Verify.BatchCount;
+    memcpy(Batch, SD_Verify.Batch, Count * sizeof(SD_VerifyEntry_t));
+    SD_Verify.BatchCount = 0;
+    SD_Verify.State      = SD_VERIFY_STATE_IDLE;
+    __set_PRIMASK(primask);
+
+#ifdef SDMMC_CACHE_MAINTANANCE
+    if (SCB->CCR & SCB_CCR_DC_Msk) {
+        SCB_InvalidateDCache_by_Addr(SD_VerifyBuffer, Count * SD_BLOCKDEV_BLOCK_SIZE);
+    }
+#endif
+
+    for (uint32_t i = 0; i < Count; i++) {
+        if (ErrorState != SD_OK) {
+            SD_Verify.Stats.ReadErrors++;
+        } else if (SD_Verify_Checksum(&SD_VerifyBuffer[i * SD_VERIFY_WORDS]) == Batch[i].Checksum) {
+            SD_Verify.Stats.Verified++;
+            continue;
+        } else if (SD_Verify_IsSuperseded(Batch[i].Lba)) {
+            SD_Verify.Stats.Superseded++;
+            continue;
+        } else {
+            SD_Verify.Stats.Mismatches++;
+        }
+        if (SD_Verify.Callback) {
+            SD_Verify.Callback(Batch[i].Lba, (ErrorState != SD_OK) ? ErrorState : SD_ERROR, SD_Verify.Context);
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Only called on a mismatch. The LBA was written again after it was recorded, the newer
+  *         entry still waits in the ring and will be checked on its own.
+  */
+static bool SD_Verify_IsSuperseded(uint64_t Lba)
+{
+    for (uint32_t i = SD_Verify.Tail; i != SD_Verify.Head; i++) {
+        if (SD_Verify.Entry[i & (SD_VERIFY_ENTRIES - 1)].Lba == Lba) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#else
+
+void SD_Verify_Enable(SD_VerifyCallback_t Callback, void *Context)
+{
+    (void)Callback;
+    (void)Context;
+}
+
+void SD_Verify_Disable(void)
+{
+}
+
+void SD_Verify_Process(void)
+{
+}
+
+uint32_t SD_Verify_Pending(void)
+{
+    return 0;
+}
+
+void SD_Verify_GetStats(SD_VerifyStats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+uint32_t SD_Verify_Checksum(const uint32_t *pBlock)
+{
+    (void)pBlock;
+    return 0;
+}
+
+void SD_Verify_Record(uint64_t Lba, const uint32_t *pBuffer, uint32_t NumberOfBlocks)
+{
+    (void)Lba;
+    (void)pBuffer;
+    (void)NumberOfBlocks;
+}
+
+void SD_Verify_Preempt(void)
+{
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
@@ -0,0 +1,915 @@
+/*
+    Copyright (c) 2019 Chris Hockuba (https://github.com/conkerkh)
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE.
+ */
+
+/* Include(s) -------------------------------------------------------------------------------------------------------*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stm32h7xx_hal.h"
+#include "sdmmc_sdio.h"
+#include "sd_blockdev.h"
+#include "sd_xts.h"
+
+#ifdef SDMMC_XTS
+
+/*
+ * XTS-AES (IEEE 1619) with a 512 byte data unit and the block number as the tweak, 32 AES blocks per
+ * sector so ciphertext stealing is never needed. State and keys are handled as little endian words,
+ * row 0 of a column in the low byte, which lets both the table and the bitsliced AES load data with
+ * plain (unaligned) word loads.
+ *
+ * The T-table AES uses one encryption and one decryption table, the other three of the classic four
+ * are rotations, which the M7 gets for free in the second operand of EOR. Tables are built at the
+ * first SD_Xts_SetKey into .bss, which is DTCM: zero wait state, and no data cache whose timing could
+ * leak table indices. The bitsliced AES follows the 32 bit constant-time design of BearSSL (aes_ct),
+ * two blocks at a time, which XTS provides naturally.
+ */
+
+/* Define(s) --------------------------------------------------------------------------------------------------------*/
+
+#define SD_XTS_WORDS                    (SD_BLOCKDEV_BLOCK_SIZE / sizeof(uint32_t))
+#define SD_XTS_AES_BLOCKS               (SD_BLOCKDEV_BLOCK_SIZE / 16)
+#define SD_XTS_MAX_ROUNDS               14
+#define SD_XTS_AXI_START                0x24000000
+#define SD_XTS_AXI_END                  0x24080000
+
+#define SD_XTS_ROR(x, n)                (((x) >> (n)) | ((x) << (32 - (n))))
+#define SD_XTS_LOAD(p)                  __UNALIGNED_UINT32(p)
+
+/* Structure(s) -----------------------------------------------------------------------------------------------------*/
+
+typedef struct
+{
+    uint32_t Rounds;
+#if SD_XTS_BITSLICED
+    uint32_t Slice[(SD_XTS_MAX_ROUNDS + 1) * 8];    // Round keys in bitsliced form, used both ways
+#else
+    uint32_t Encrypt[(SD_XTS_MAX_ROUNDS + 1) * 4];
+    uint32_t Decrypt[(SD_XTS_MAX_ROUNDS + 1) * 4];  // Equivalent inverse cipher, reversed with InvMixColumns applied
+#endif
+} SD_XtsKey_t;
+
+typedef struct
+{
+    uint8_t            *pData;
+    uint32_t            Block;          // First block of the piece inside the request
+    uint32_t            Count;          // 0 when the slot is free
+    volatile SD_Error_t Status;
+} SD_XtsPiece_t;
+
+/* Variable(s) ------------------------------------------------------------------------------------------------------*/
+
+static SD_XtsKey_t                 SD_XtsData;
+static SD_XtsKey_t                 SD_XtsTweak;
+static bool                        SD_XtsKeyValid;
+static SD_XtsStats_t               SD_XtsStats;
+static SD_BlockDev_t               SD_XtsDevice;
+#if SD_XTS_BITSLICED == 0
+static uint32_t                    SD_XtsTe[256];
+static uint32_t                    SD_XtsTd[256];
+static uint8_t                     SD_XtsInvSbox[256];
+#endif
+static uint8_t                     SD_XtsSbox[256];
+static bool                        SD_XtsTables;
+// Ciphertext on its way to and from the card, never plaintext
+static uint32_t                    SD_XtsStage[2][SD_XTS_STAGE_BLOCKS * SD_XTS_WORDS] __attribute__((section(".ram_d1"), aligned(32)));
+
+/* Private function(s) ----------------------------------------------------------------------------------------------*/
+
+static SD_Error_t       SD_Xts_Read                 (SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks, SD_BlockDevCallback_t Callback, void *Context);
+static SD_Error_t       SD_Xts_Write                (SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags, SD_BlockDevCallback_t Callback, void *Context);
+static void             SD_Xts_TransferDone         (SD_BlockDev_t *pDev, SD_Error_t Status, void *Context);
+static void             SD_Xts_Crypt                (const uint8_t *pIn, uint8_t *pOut, uint64_t Sector, uint32_t Sectors, bool Encrypt);
+static void             SD_Xts_Sectors              (const uint8_t *pIn, uint8_t *pOut, uint64_t Sector, uint32_t Sectors, bool Encrypt);
+static void             SD_Xts_InitTables           (void);
+static void             SD_Xts_ExpandKey            (SD_XtsKey_t *pKey, const uint8_t *pBytes, uint32_t Length);
+static uint8_t          SD_Xts_Mul                  (uint8_t a, uint8_t b);
+#if SD_XTS_BITSLICED
+static void             SD_Xts_Ortho                (uint32_t *q);
+static void             SD_Xts_Sbox                 (uint32_t *q);
+static void             SD_Xts_InvSbox              (uint32_t *q);
+static void             SD_Xts_EncryptBlocks        (const SD_XtsKey_t *pKey, uint32_t *q);
+static void             SD_Xts_DecryptBlocks        (const SD_XtsKey_t *pKey, uint32_t *q);
+#else
+static void             SD_Xts_EncryptBlock         (const SD_XtsKey_t *pKey, uint32_t *s);
+static void             SD_Xts_DecryptBlock         (const SD_XtsKey_t *pKey, uint32_t *s);
+#endif
+
+static const SD_BlockDevOps_t      SD_XtsOps =
+{
+    .Read       = SD_Xts_Read,
+    .Write      = SD_Xts_Write,
+};
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Expands the data and tweak keys. IEEE 1619 requires the two halves to differ.
+  * @param  pKey: Data key followed by tweak key
+  * @param  KeyLength: SD_XTS_KEY_128 or SD_XTS_KEY_256
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Xts_SetKey(const uint8_t *pKey, uint32_t KeyLength)
+{
+    uint32_t Half = KeyLength / 2;
+    uint8_t  Same = 0;
+
+    if ((pKey == NULL) || ((KeyLength != SD_XTS_KEY_128) && (KeyLength != SD_XTS_KEY_256))) {
+        return SD_INVALID_PARAMETER;
+    }
+    for (uint32_t Index = 0; Index < Half; Index++) {
+        Same |= pKey[Index] ^ pKey[Half + Index];
+    }
+    if (Same == 0) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    if (SD_XtsTables == false) {
+        SD_Xts_InitTables();
+        SD_XtsTables = true;
+    }
+    SD_Xts_ExpandKey(&SD_XtsData, pKey, Half);
+    SD_Xts_ExpandKey(&SD_XtsTweak, &pKey[Half], Half);
+    SD_XtsKeyValid = true;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Xts_ClearKey(void)
+{
+    volatile uint8_t *pWipe = (volatile uint8_t*)&SD_XtsData;
+
+    for (uint32_t Index = 0; Index < sizeof(SD_XtsData); Index++) {
+        pWipe[Index] = 0;
+    }
+    pWipe = (volatile uint8_t*)&SD_XtsTweak;
+    for (uint32_t Index = 0; Index < sizeof(SD_XtsTweak); Index++) {
+        pWipe[Index] = 0;
+    }
+    SD_XtsKeyValid = false;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Stacks the encryption layer on pLower, same geometry. Reads go straight into the caller's
+  *         buffer and are decrypted there when the buffer is DMA reachable, writes are encrypted into the
+  *         staging buffers, which are what the card transfers from.
+  * @param  pLower: Device to encrypt, usually the card or a partition
+  * @param  ppDev: Receives the plaintext device
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Xts_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    if ((pLower == NULL) || (ppDev == NULL)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (SD_XtsKeyValid == false) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+
+    SD_XtsDevice.pOps        = &SD_XtsOps;
+    SD_XtsDevice.pLower      = pLower;
+    SD_XtsDevice.pName       = "xts";
+    SD_XtsDevice.pPrivate    = NULL;
+    SD_XtsDevice.Blocks      = pLower->Blocks;
+    SD_XtsDevice.Offset      = 0;
+    SD_XtsDevice.EraseBlocks = pLower->EraseBlocks;
+    SD_XtsDevice.Caps        = SD_BLOCKDEV_CAP_ANY_BUFFER |
+                               (pLower->Caps & (SD_BLOCKDEV_CAP_VOLATILE | SD_BLOCKDEV_CAP_PERSISTENT | SD_BLOCKDEV_CAP_READ_ONLY));
+    *ppDev = &SD_XtsDevice;
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Xts_EncryptSector(const uint8_t *pIn, uint8_t *pOut, uint64_t Sector)
+{
+    if (SD_XtsKeyValid == false) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    SD_Xts_Crypt(pIn, pOut, Sector, 1, true);
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_Xts_DecryptSector(const uint8_t *pIn, uint8_t *pOut, uint64_t Sector)
+{
+    if (SD_XtsKeyValid == false) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    SD_Xts_Crypt(pIn, pOut, Sector, 1, false);
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Cipher throughput without the card. KB/s per MHz is bytes per cycle, so at 400 MHz a result of 50
+  *         means 20 MB/s, compare it with the card write rate to see whether encryption is the bottleneck.
+  * @param  pBuffer: Blocks sectors of scratch, encrypted then decrypted in place
+  * @retval SD Card error state
+  */
+SD_Error_t SD_Xts_Benchmark(uint8_t *pBuffer, uint32_t Blocks, SD_XtsBench_t *pResult)
+{
+    uint64_t Bytes = (uint64_t)Blocks * SD_BLOCKDEV_BLOCK_SIZE;
+    uint32_t Start, Encrypt, Decrypt;
+
+    if ((pBuffer == NULL) || (Blocks == 0) || (pResult == NULL)) {
+        return SD_INVALID_PARAMETER;
+    }
+    if (SD_XtsKeyValid == false) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+
+    Start   = DWT->CYCCNT;
+    SD_Xts_Sectors(pBuffer, pBuffer, 0, Blocks, true);
+    Encrypt = DWT->CYCCNT - Start;
+    Start   = DWT->CYCCNT;
+    SD_Xts_Sectors(pBuffer, pBuffer, 0, Blocks, false);
+    Decrypt = DWT->CYCCNT - Start;
+    Encrypt = (Encrypt != 0) ? Encrypt : 1;
+    Decrypt = (Decrypt != 0) ? Decrypt : 1;
+
+    pResult->EncryptCyclesPerByte = (uint32_t)(((uint64_t)Encrypt * 100) / Bytes);
+    pResult->DecryptCyclesPerByte = (uint32_t)(((uint64_t)Decrypt * 100) / Bytes);
+    pResult->EncryptKBsPerMHz     = (uint32_t)((Bytes * 1000) / Encrypt);
+    pResult->DecryptKBsPerMHz     = (uint32_t)((Bytes * 1000) / Decrypt);
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_Xts_GetStats(SD_XtsStats_t *pStats)
+{
+    *pStats = SD_XtsStats;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Keeps two reads of up to SD_XTS_STAGE_BLOCKS in flight on an asynchronous lower device and
+  *         decrypts each piece while the next one transfers.
+  */
+static SD_Error_t SD_Xts_Read(SD_BlockDev_t *pDev, uint64_t Lba, uint8_t *pBuffer, uint32_t NumberOfBlocks,
+                              SD_BlockDevCallback_t Callback, void *Context)
+{
+    SD_XtsPiece_t Piece[2] = { 0 };
+    SD_XtsPiece_t *pPiece;
+    SD_Error_t    ErrorState = SD_OK;
+    uint32_t      Next = 0, Done = 0, Head = 0;
+    bool          InPlace;
+
+    InPlace = ((pDev->pLower->Caps & SD_BLOCKDEV_CAP_ANY_BUFFER) != 0) ||
+              ((((uint32_t)pBuffer & 31) == 0) && ((uint32_t)pBuffer >= SD_XTS_AXI_START) && ((uint32_t)pBuffer < SD_XTS_AXI_END));
+    if (InPlace == true) {
+        SD_XtsStats.InPlaceReads++;
+    } else {
+        SD_XtsStats.StagedReads++;
+    }
+
+    while ((Done < Next) || ((Next < NumberOfBlocks) && (ErrorState == SD_OK))) {
+        for (uint32_t Index = 0; (Index < 2) && (Next < NumberOfBlocks) && (ErrorState == SD_OK); Index++) {
+            uint32_t Slot = (Head + Index) & 1;
+
+            pPiece = &Piece[Slot];
+            if (pPiece->Count != 0) {
+                continue;
+            }
+            pPiece->Count  = ((NumberOfBlocks - Next) > SD_XTS_STAGE_BLOCKS) ? SD_XTS_STAGE_BLOCKS : (NumberOfBlocks - Next);
+            pPiece->Block  = Next;
+            pPiece->pData  = (InPlace == true) ? &pBuffer[Next * SD_BLOCKDEV_BLOCK_SIZE] : (uint8_t*)SD_XtsStage[Slot];
+            pPiece->Status = SD_BUSY;
+            if ((ErrorState = SD_BlockDev_Read(pDev->pLower, Lba + Next, pPiece->pData, pPiece->Count, SD_Xts_TransferDone, (void*)&pPiece->Status)) != SD_OK) {
+                pPiece->Count = 0;
+                break;
+            }
+            Next += pPiece->Count;
+        }
+
+        pPiece = &Piece[Head];
+        if (pPiece->Count == 0) {
+            break;
+        }
+        while (pPiece->Status == SD_BUSY) {
+            SD_BlockDev_Process(pDev->pLower);
+        }
+        if ((ErrorState == SD_OK) && ((ErrorState = pPiece->Status) == SD_OK)) {
+            SD_Xts_Crypt(pPiece->pData, &pBuffer[pPiece->Block * SD_BLOCKDEV_BLOCK_SIZE], Lba + pPiece->Block, pPiece->Count, false);
+        }
+        Done         += pPiece->Count;
+        pPiece->Count = 0;
+        Head         ^= 1;
+    }
+
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Encrypts into one staging buffer while the other one is being written. Flags go with every
+  *         piece, so FUA covers the whole request.
+  */
+static SD_Error_t SD_Xts_Write(SD_BlockDev_t *pDev, uint64_t Lba, const uint8_t *pBuffer, uint32_t NumberOfBlocks, uint32_t Flags,
+                               SD_BlockDevCallback_t Callback, void *Context)
+{
+    volatile SD_Error_t Status[2] = { SD_OK, SD_OK };
+    SD_Error_t          ErrorState = SD_OK;
+    uint32_t            Next = 0, Slot = 0, Count;
+
+    while ((Next < NumberOfBlocks) && (ErrorState == SD_OK)) {
+        while (Status[Slot] == SD_BUSY) {
+            SD_BlockDev_Process(pDev->pLower);
+        }
+        if ((ErrorState = Status[Slot]) != SD_OK) {
+            break;
+        }
+
+        Count = ((NumberOfBlocks - Next) > SD_XTS_STAGE_BLOCKS) ? SD_XTS_STAGE_BLOCKS : (NumberOfBlocks - Next);
+        SD_Xts_Crypt(&pBuffer[Next * SD_BLOCKDEV_BLOCK_SIZE], (uint8_t*)SD_XtsStage[Slot], Lba + Next, Count, true);
+        Status[Slot] = SD_BUSY;
+        if ((ErrorState = SD_BlockDev_Write(pDev->pLower, Lba + Next, (uint8_t*)SD_XtsStage[Slot], Count, Flags,
+                                            SD_Xts_TransferDone, (void*)&Status[Slot])) != SD_OK) {
+            Status[Slot] = SD_OK;
+            break;
+        }
+        Next += Count;
+        Slot ^= 1;
+    }
+
+    for (Slot = 0; Slot < 2; Slot++) {
+        while (Status[Slot] == SD_BUSY) {
+            SD_BlockDev_Process(pDev->pLower);
+        }
+        if (ErrorState == SD_OK) {
+            ErrorState = Status[Slot];
+        }
+    }
+
+    if (Callback != NULL) {
+        Callback(pDev, ErrorState, Context);
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Xts_TransferDone(SD_BlockDev_t *pDev, SD_Error_t Status, void *Context)
+{
+    (void)pDev;
+    *(volatile SD_Error_t*)Context = Status;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static void SD_Xts_Crypt(const uint8_t *pIn, uint8_t *pOut, uint64_t Sector, uint32_t Sectors, bool Encrypt)
+{
+    uint32_t Start = DWT->CYCCNT;
+
+    SD_Xts_Sectors(pIn, pOut, Sector, Sectors, Encrypt);
+    if (Encrypt == true) {
+        SD_XtsStats.EncryptCycles  += DWT->CYCCNT - Start;
+        SD_XtsStats.EncryptedBytes += Sectors * SD_BLOCKDEV_BLOCK_SIZE;
+    } else {
+        SD_XtsStats.DecryptCycles  += DWT->CYCCNT - Start;
+        SD_XtsStats.DecryptedBytes += Sectors * SD_BLOCKDEV_BLOCK_SIZE;
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  XTS over whole sectors: the tweak is the sector number encrypted with the tweak key, and is
+  *         multiplied by x in GF(2^128) from one AES block to the next. In and out may overlap exactly.
+  */
+SD_XTS_ITCM static void SD_Xts_Sectors(const uint8_t *pIn, uint8_t *pOut, uint64_t Sector, uint32_t Sectors, bool Encrypt)
+{
+    uint32_t Tweak[4];
+
+    for (; Sectors != 0; Sectors--, Sector++) {
+        Tweak[0] = (uint32_t)Sector;
+        Tweak[1] = (uint32_t)(Sector >> 32);
+        Tweak[2] = 0;
+        Tweak[3] = 0;
+#if SD_XTS_BITSLICED
+        {
+            uint32_t q[8] = { Tweak[0], 0, Tweak[1], 0, Tweak[2], 0, Tweak[3], 0 };
+
+            SD_Xts_Ortho(q);
+            SD_Xts_EncryptBlocks(&SD_XtsTweak, q);
+            SD_Xts_Ortho(q);
+            Tweak[0] = q[0];
+            Tweak[1] = q[2];
+            Tweak[2] = q[4];
+            Tweak[3] = q[6];
+        }
+
+        for (uint32_t Block = 0; Block < SD_XTS_AES_BLOCKS; Block += 2) {
+            uint32_t q[8], Next[4];
+
+            // Second block's tweak is the first one times x
+            Next[0] = (Tweak[0] << 1) ^ (0x87 & (0 - (Tweak[3] >> 31)));
+            Next[1] = (Tweak[1] << 1) | (Tweak[0] >> 31);
+            Next[2] = (Tweak[2] << 1) | (Tweak[1] >> 31);
+            Next[3] = (Tweak[3] << 1) | (Tweak[2] >> 31);
+            for (uint32_t Word = 0; Word < 4; Word++) {
+                q[Word * 2]     = SD_XTS_LOAD(&pIn[Word * 4]) ^ Tweak[Word];
+                q[Word * 2 + 1] = SD_XTS_LOAD(&pIn[16 + Word * 4]) ^ Next[Word];
+            }
+            SD_Xts_Ortho(q);
+            if (Encrypt == true) {
+                SD_Xts_EncryptBlocks(&SD_XtsData, q);
+            } else {
+                SD_Xts_DecryptBlocks(&SD_XtsData, q);
+            }
+            SD_Xts_Ortho(q);
+            for (uint32_t Word = 0; Word < 4; Word++) {
+                SD_XTS_LOAD(&pOut[Word * 4])      = q[Word * 2] ^ Tweak[Word];
+                SD_XTS_LOAD(&pOut[16 + Word * 4]) = q[Word * 2 + 1] ^ Next[Word];
+            }
+            Tweak[0] = (Next[0] << 1) ^ (0x87 & (0 - (Next[3] >> 31)));
+            Tweak[1] = (Next[1] << 1) | (Next[0] >> 31);
+            Tweak[2] = (Next[2] << 1) | (Next[1] >> 31);
+            Tweak[3] = (Next[3] << 1) | (Next[2] >> 31);
+            pIn  += 32;
+            pOut += 32;
+        }
+#else
+        SD_Xts_EncryptBlock(&SD_XtsTweak, Tweak);
+
+        for (uint32_t Block = 0; Block < SD_XTS_AES_BLOCKS; Block++) {
+            uint32_t s[4], Carry;
+
+            s[0] = SD_XTS_LOAD(&pIn[0]) ^ Tweak[0];
+            s[1] = SD_XTS_LOAD(&pIn[4]) ^ Tweak[1];
+            s[2] = SD_XTS_LOAD(&pIn[8]) ^ Tweak[2];
+            s[3] = SD_XTS_LOAD(&pIn[12]) ^ Tweak[3];
+            if (Encrypt == true) {
+                SD_Xts_EncryptBlock(&SD_XtsData, s);
+            } else {
+                SD_Xts_DecryptBlock(&SD_XtsData, s);
+            }
+            SD_XTS_LOAD(&pOut[0])  = s[0] ^ Tweak[0];
+            SD_XTS_LOAD(&pOut[4])  = s[1] ^ Tweak[1];
+            SD_XTS_LOAD(&pOut[8])  = s[2] ^ Tweak[2];
+            SD_XTS_LOAD(&pOut[12]) = s[3] ^ Tweak[3];
+
+            Carry    = 0x87 & (0 - (Tweak[3] >> 31));
+            Tweak[3] = (Tweak[3] << 1) | (Tweak[2] >> 31);
+            Tweak[2] = (Tweak[2] << 1) | (Tweak[1] >> 31);
+            Tweak[1] = (Tweak[1] << 1) | (Tweak[0] >> 31);
+            Tweak[0] = (Tweak[0] << 1) ^ Carry;
+            pIn  += 16;
+            pOut += 16;
+        }
+#endif
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  S-box from the multiplicative inverse (walked with generator 3) and the affine transform, then
+  *         the tables: Te holds S * (2, 1, 1, 3), Td holds InvS * (14, 9, 13, 11), row 0 in the low byte.
+  */
+static void SD_Xts_InitTables(void)
+{
+    uint8_t p = 1, q = 1;
+
+    do {
+        p = p ^ (uint8_t)(p << 1) ^ ((p & 0x80) ? 0x1B : 0);
+        q ^= q << 1;
+        q ^= q << 2;
+        q ^= q << 4;
+        q ^= (q & 0x80) ? 0x09 : 0;
+        SD_XtsSbox[p] = q ^ (uint8_t)((q << 1) | (q >> 7)) ^ (uint8_t)((q << 2) | (q >> 6)) ^
+                        (uint8_t)((q << 3) | (q >> 5)) ^ (uint8_t)((q << 4) | (q >> 4)) ^ 0x63;
+    } while (p != 1);
+    SD_XtsSbox[0] = 0x63;
+
+#if SD_XTS_BITSLICED == 0
+    for (uint32_t Index = 0; Index < 256; Index++) {
+        uint8_t s = SD_XtsSbox[Index];
+
+        SD_XtsInvSbox[s] = (uint8_t)Index;
+        SD_XtsTe[Index]  = SD_Xts_Mul(s, 2) | ((uint32_t)s << 8) | ((uint32_t)s << 16) | ((uint32_t)SD_Xts_Mul(s, 3) << 24);
+    }
+    for (uint32_t Index = 0; Index < 256; Index++) {
+        uint8_t v = SD_XtsInvSbox[Index];
+
+        SD_XtsTd[Index] = SD_Xts_Mul(v, 14) | ((uint32_t)SD_Xts_Mul(v, 9) << 8) | ((uint32_t)SD_Xts_Mul(v, 13) << 16) |
+                          ((uint32_t)SD_Xts_Mul(v, 11) << 24);
+    }
+#endif
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  FIPS-197 key expansion on little endian words, so RotWord is a right rotation by 8.
+  */
+static void SD_Xts_ExpandKey(SD_XtsKey_t *pKey, const uint8_t *pBytes, uint32_t Length)
+{
+    uint32_t w[(SD_XTS_MAX_ROUNDS + 1) * 4];
+    uint32_t Nk = Length / 4, Total, Rcon = 1, Temp;
+
+    pKey->Rounds = Nk + 6;
+    Total = (pKey->Rounds + 1) * 4;
+    for (uint32_t Index = 0; Index < Nk; Index++) {
+        w[Index] = SD_XTS_LOAD(&pBytes[Index * 4]);
+    }
+    for (uint32_t Index = Nk; Index < Total; Index++) {
+        Temp = w[Index - 1];
+        if ((Index % Nk) == 0) {
+            Temp  = SD_XTS_ROR(Temp, 8);
+            Temp  = SD_XtsSbox[Temp & 0xFF] | ((uint32_t)SD_XtsSbox[(Temp >> 8) & 0xFF] << 8) |
+                    ((uint32_t)SD_XtsSbox[(Temp >> 16) & 0xFF] << 16) | ((uint32_t)SD_XtsSbox[Temp >> 24] << 24);
+            Temp ^= Rcon;
+            Rcon  = SD_Xts_Mul((uint8_t)Rcon, 2);
+        } else if ((Nk > 6) && ((Index % Nk) == 4)) {
+            Temp  = SD_XtsSbox[Temp & 0xFF] | ((uint32_t)SD_XtsSbox[(Temp >> 8) & 0xFF] << 8) |
+                    ((uint32_t)SD_XtsSbox[(Temp >> 16) & 0xFF] << 16) | ((uint32_t)SD_XtsSbox[Temp >> 24] << 24);
+        }
+        w[Index] = w[Index - Nk] ^ Temp;
+    }
+
+#if SD_XTS_BITSLICED
+    for (uint32_t Round = 0; Round <= pKey->Rounds; Round++) {
+        uint32_t *q = &pKey->Slice[Round * 8];
+
+        for (uint32_t Word = 0; Word < 4; Word++) {
+            q[Word * 2]     = w[Round * 4 + Word];
+            q[Word * 2 + 1] = w[Round * 4 + Word];
+        }
+        SD_Xts_Ortho(q);
+    }
+#else
+    memcpy(pKey->Encrypt, w, Total * sizeof(uint32_t));
+    for (uint32_t Round = 0; Round <= pKey->Rounds; Round++) {
+        for (uint32_t Word = 0; Word < 4; Word++) {
+            uint32_t k = w[(pKey->Rounds - Round) * 4 + Word];
+
+            if ((Round != 0) && (Round != pKey->Rounds)) {
+                k = SD_XtsTd[SD_XtsSbox[k & 0xFF]] ^ SD_XTS_ROR(SD_XtsTd[SD_XtsSbox[(k >> 8) & 0xFF]], 24) ^
+                    SD_XTS_ROR(SD_XtsTd[SD_XtsSbox[(k >> 16) & 0xFF]], 16) ^ SD_XTS_ROR(SD_XtsTd[SD_XtsSbox[k >> 24]], 8);
+            }
+            pKey->Decrypt[Round * 4 + Word] = k;
+        }
+    }
+#endif
+
+    for (uint32_t Index = 0; Index < Total; Index++) {
+        ((volatile uint32_t*)w)[Index] = 0;
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static uint8_t SD_Xts_Mul(uint8_t a, uint8_t b)
+{
+    uint8_t Product = 0;
+
+    while (b != 0) {
+        if (b & 1) {
+            Product ^= a;
+        }
+        a = (uint8_t)(a << 1) ^ ((a & 0x80) ? 0x1B : 0);
+        b >>= 1;
+    }
+    return Product;
+}
+
+#if SD_XTS_BITSLICED
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Converts two blocks, words interleaved, to and from bitsliced form, its own inverse.
+  */
+SD_XTS_ITCM static void SD_Xts_Ortho(uint32_t *q)
+{
+#define SD_XTS_SWAP(cl, ch, s, x, y)    do { uint32_t a = (x), b = (y); \
+                                             (x) = (a & (cl)) | ((b & (cl)) << (s)); \
+                                             (y) = ((a & (ch)) >> (s)) | (b & (ch)); } while (0)
+
+    SD_XTS_SWAP(0x55555555, 0xAAAAAAAA, 1, q[0], q[1]);
+    SD_XTS_SWAP(0x55555555, 0xAAAAAAAA, 1, q[2], q[3]);
+    SD_XTS_SWAP(0x55555555, 0xAAAAAAAA, 1, q[4], q[5]);
+    SD_XTS_SWAP(0x55555555, 0xAAAAAAAA, 1, q[6], q[7]);
+
+    SD_XTS_SWAP(0x33333333, 0xCCCCCCCC, 2, q[0], q[2]);
+    SD_XTS_SWAP(0x33333333, 0xCCCCCCCC, 2, q[1], q[3]);
+    SD_XTS_SWAP(0x33333333, 0xCCCCCCCC, 2, q[4], q[6]);
+    SD_XTS_SWAP(0x33333333, 0xCCCCCCCC, 2, q[5], q[7]);
+
+    SD_XTS_SWAP(0x0F0F0F0F, 0xF0F0F0F0, 4, q[0], q[4]);
+    SD_XTS_SWAP(0x0F0F0F0F, 0xF0F0F0F0, 4, q[1], q[5]);
+    SD_XTS_SWAP(0x0F0F0F0F, 0xF0F0F0F0, 4, q[2], q[6]);
+    SD_XTS_SWAP(0x0F0F0F0F, 0xF0F0F0F0, 4, q[3], q[7]);
+
+#undef SD_XTS_SWAP
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  S-box as the Boyar-Peralta circuit, 32 bytes at once, q[0] holds bit 0 of every byte.
+  */
+SD_XTS_ITCM static void SD_Xts_Sbox(uint32_t *q)
+{
+    uint32_t x0, x1, x2, x3, x4, x5, x6, x7;
+    uint32_t y1, y2, y3, y4, y5, y6, y7, y8, y9, y10, y11, y12, y13, y14, y15, y16, y17, y18, y19, y20, y21;
+    uint32_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9, z10, z11, z12, z13, z14, z15, z16, z17;
+    uint32_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    uint32_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29, t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    uint32_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49, t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    uint32_t t60, t61, t62, t63, t64, t65, t66, t67;
+    uint32_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = q[7]; x1 = q[6]; x2 = q[5]; x3 = q[4];
+    x4 = q[3]; x5 = q[2]; x6 = q[1]; x7 = q[0];
+
+    // Top linear transformation
+    y14 = x3 ^ x5;   y13 = x0 ^ x6;   y9  = x0 ^ x3;   y8  = x0 ^ x5;
+    t0  = x1 ^ x2;   y1  = t0 ^ x7;   y4  = y1 ^ x3;   y12 = y13 ^ y14;
+    y2  = y1 ^ x0;   y5  = y1 ^ x6;   y3  = y5 ^ y8;   t1  = x4 ^ y12;
+    y15 = t1 ^ x5;   y20 = t1 ^ x1;   y6  = y15 ^ x7;  y10 = y15 ^ t0;
+    y11 = y20 ^ y9;  y7  = x7 ^ y11;  y17 = y10 ^ y11; y19 = y10 ^ y8;
+    y16 = t0 ^ y11;  y21 = y13 ^ y16; y18 = x0 ^ y16;
+
+    // Non-linear section
+    t2  = y12 & y15; t3  = y3 & y6;   t4  = t3 ^ t2;   t5  = y4 & x7;
+    t6  = t5 ^ t2;   t7  = y13 & y16; t8  = y5 & y1;   t9  = t8 ^ t7;
+    t10 = y2 & y7;   t11 = t10 ^ t7;  t12 = y9 & y11;  t13 = y14 & y17;
+    t14 = t13 ^ t12; t15 = y8 & y10;  t16 = t15 ^ t12; t17 = t4 ^ t14;
+    t18 = t6 ^ t16;  t19 = t9 ^ t14;  t20 = t11 ^ t16; t21 = t17 ^ y20;
+    t22 = t18 ^ y19; t23 = t19 ^ y21; t24 = t20 ^ y18;
+    t25 = t21 ^ t22; t26 = t21 & t23; t27 = t24 ^ t26; t28 = t25 & t27;
+    t29 = t28 ^ t22; t30 = t23 ^ t24; t31 = t22 ^ t26; t32 = t31 & t30;
+    t33 = t32 ^ t24; t34 = t23 ^ t33; t35 = t27 ^ t33; t36 = t24 & t35;
+    t37 = t36 ^ t34; t38 = t27 ^ t36; t39 = t29 & t38; t40 = t25 ^ t39;
+    t41 = t40 ^ t37; t42 = t29 ^ t33; t43 = t29 ^ t40; t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0  = t44 & y15; z1  = t37 & y6;  z2  = t33 & x7;  z3  = t43 & y16;
+    z4  = t40 & y1;  z5  = t29 & y7;  z6  = t42 & y11; z7  = t45 & y17;
+    z8  = t41 & y10; z9  = t44 & y12; z10 = t37 & y3;  z11 = t33 & y4;
+    z12 = t43 & y13; z13 = t40 & y5;  z14 = t29 & y2;  z15 = t42 & y9;
+    z16 = t45 & y14; z17 = t41 & y8;
+
+    // Bottom linear transformation
+    t46 = z15 ^ z16; t47 = z10 ^ z11; t48 = z5 ^ z13;  t49 = z9 ^ z10;
+    t50 = z2 ^ z12;  t51 = z2 ^ z5;   t52 = z7 ^ z8;   t53 = z0 ^ z3;
+    t54 = z6 ^ z7;   t55 = z16 ^ z17; t56 = z12 ^ t48; t57 = t50 ^ t53;
+    t58 = z4 ^ t46;  t59 = z3 ^ t54;  t60 = t46 ^ t57; t61 = z14 ^ t57;
+    t62 = t52 ^ t58; t63 = t49 ^ t58; t64 = z4 ^ t59;  t65 = t61 ^ t62;
+    t66 = z1 ^ t63;  s0  = t59 ^ t63; s6  = t56 ^ ~t62; s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65; s3  = t53 ^ t66; s4  = t51 ^ t66; s5  = t47 ^ t65;
+    s1  = t64 ^ ~s3; s2  = t55 ^ ~t67;
+
+    q[7] = s0; q[6] = s1; q[5] = s2; q[4] = s3;
+    q[3] = s4; q[2] = s5; q[1] = s6; q[0] = s7;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Inverse S-box through the forward circuit: with A' the inverse affine map including its constant,
+  *         inv(x) = A'(S(x)) and InvS(y) = inv(A'(y)), so InvS = A' S A'.
+  */
+SD_XTS_ITCM static void SD_Xts_InvSbox(uint32_t *q)
+{
+    uint32_t b[8];
+
+    for (uint32_t Pass = 0; Pass < 2; Pass++) {
+        for (uint32_t Bit = 0; Bit < 8; Bit++) {
+            b[Bit] = q[(Bit + 2) & 7] ^ q[(Bit + 5) & 7] ^ q[(Bit + 7) & 7];
+        }
+        q[0] = ~b[0]; q[1] = b[1]; q[2] = ~b[2]; q[3] = b[3];
+        q[4] = b[4];  q[5] = b[5]; q[6] = b[6];  q[7] = b[7];
+        if (Pass == 0) {
+            SD_Xts_Sbox(q);
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+static inline uint32_t SD_Xts_Rotr16(uint32_t x)
+{
+    return (x << 16) | (x >> 16);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_XTS_ITCM static void SD_Xts_EncryptBlocks(const SD_XtsKey_t *pKey, uint32_t *q)
+{
+    const uint32_t *pRound = pKey->Slice;
+
+    for (uint32_t Round = 0; ; Round++, pRound += 8) {
+        for (uint32_t Bit = 0; Bit < 8; Bit++) {
+            q[Bit] ^= pRound[Bit];
+        }
+        if (Round == pKey->Rounds) {
+            break;
+        }
+        SD_Xts_Sbox(q);
+
+        // ShiftRows
+        for (uint32_t Bit = 0; Bit < 8; Bit++) {
+            uint32_t x = q[Bit];
+
+            q[Bit] = (x & 0x000000FF) | ((x & 0x0000FC00) >> 2) | ((x & 0x00000300) << 6) |
+                     ((x & 0x00F00000) >> 4) | ((x & 0x000F0000) << 4) | ((x & 0xC0000000) >> 6) | ((x & 0x3F000000) << 2);
+        }
+
+        // MixColumns, skipped in the last round
+        if (Round != (pKey->Rounds - 1)) {
+            uint32_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3], q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+            uint32_t r0 = SD_XTS_ROR(q0, 8), r1 = SD_XTS_ROR(q1, 8), r2 = SD_XTS_ROR(q2, 8), r3 = SD_XTS_ROR(q3, 8);
+            uint32_t r4 = SD_XTS_ROR(q4, 8), r5 = SD_XTS_ROR(q5, 8), r6 = SD_XTS_ROR(q6, 8), r7 = SD_XTS_ROR(q7, 8);
+
+            q[0] = q7 ^ r7 ^ r0 ^ SD_Xts_Rotr16(q0 ^ r0);
+            q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ SD_Xts_Rotr16(q1 ^ r1);
+            q[2] = q1 ^ r1 ^ r2 ^ SD_Xts_Rotr16(q2 ^ r2);
+            q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ SD_Xts_Rotr16(q3 ^ r3);
+            q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ SD_Xts_Rotr16(q4 ^ r4);
+            q[5] = q4 ^ r4 ^ r5 ^ SD_Xts_Rotr16(q5 ^ r5);
+            q[6] = q5 ^ r5 ^ r6 ^ SD_Xts_Rotr16(q6 ^ r6);
+            q[7] = q6 ^ r6 ^ r7 ^ SD_Xts_Rotr16(q7 ^ r7);
+        }
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_XTS_ITCM static void SD_Xts_DecryptBlocks(const SD_XtsKey_t *pKey, uint32_t *q)
+{
+    const uint32_t *pRound = &pKey->Slice[pKey->Rounds * 8];
+
+    for (uint32_t Round = pKey->Rounds; ; Round--, pRound -= 8) {
+        for (uint32_t Bit = 0; Bit < 8; Bit++) {
+            q[Bit] ^= pRound[Bit];
+        }
+        if (Round == 0) {
+            break;
+        }
+
+        // InvMixColumns, not after the first round key
+        if (Round != pKey->Rounds) {
+            uint32_t q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3], q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+            uint32_t r0 = SD_XTS_ROR(q0, 8), r1 = SD_XTS_ROR(q1, 8), r2 = SD_XTS_ROR(q2, 8), r3 = SD_XTS_ROR(q3, 8);
+            uint32_t r4 = SD_XTS_ROR(q4, 8), r5 = SD_XTS_ROR(q5, 8), r6 = SD_XTS_ROR(q6, 8), r7 = SD_XTS_ROR(q7, 8);
+
+            q[0] = q5 ^ q6 ^ q7 ^ r0 ^ r5 ^ r7 ^ SD_Xts_Rotr16(q0 ^ q5 ^ q6 ^ r0 ^ r5);
+            q[1] = q0 ^ q5 ^ r0 ^ r1 ^ r5 ^ r6 ^ r7 ^ SD_Xts_Rotr16(q1 ^ q5 ^ q7 ^ r1 ^ r5 ^ r6);
+            q[2] = q0 ^ q1 ^ q6 ^ r1 ^ r2 ^ r6 ^ r7 ^ SD_Xts_Rotr16(q0 ^ q2 ^ q6 ^ r2 ^ r6 ^ r7);
+            q[3] = q0 ^ q1 ^ q2 ^ q5 ^ q6 ^ r0 ^ r2 ^ r3 ^ r5 ^ SD_Xts_Rotr16(q0 ^ q1 ^ q3 ^ q5 ^ q6 ^ q7 ^ r0 ^ r3 ^ r5 ^ r7);
+            q[4] = q1 ^ q2 ^ q3 ^ q5 ^ r1 ^ r3 ^ r4 ^ r5 ^ r6 ^ r7 ^ SD_Xts_Rotr16(q1 ^ q2 ^ q4 ^ q5 ^ q7 ^ r1 ^ r4 ^ r5 ^ r6);
+            q[5] = q2 ^ q3 ^ q4 ^ q6 ^ r2 ^ r4 ^ r5 ^ r6 ^ r7 ^ SD_Xts_Rotr16(q2 ^ q3 ^ q5 ^ q6 ^ r2 ^ r5 ^ r6 ^ r7);
+            q[6] = q3 ^ q4 ^ q5 ^ q7 ^ r3 ^ r5 ^ r6 ^ r7 ^ SD_Xts_Rotr16(q3 ^ q4 ^ q6 ^ q7 ^ r3 ^ r6 ^ r7);
+            q[7] = q4 ^ q5 ^ q6 ^ r4 ^ r6 ^ r7 ^ SD_Xts_Rotr16(q4 ^ q5 ^ q7 ^ r4 ^ r7);
+        }
+
+        // InvShiftRows
+        for (uint32_t Bit = 0; Bit < 8; Bit++) {
+            uint32_t x = q[Bit];
+
+            q[Bit] = (x & 0x000000FF) | ((x & 0x00003F00) << 2) | ((x & 0x0000C000) >> 6) |
+                     ((x & 0x000F0000) << 4) | ((x & 0x00F00000) >> 4) | ((x & 0x03000000) << 6) | ((x & 0xFC000000) >> 2);
+        }
+        SD_Xts_InvSbox(q);
+    }
+}
+
+#else
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  One table lookup and a rotation per byte and round, the last round through the S-box.
+  */
+SD_XTS_ITCM static void SD_Xts_EncryptBlock(const SD_XtsKey_t *pKey, uint32_t *s)
+{
+    const uint32_t *rk = pKey->Encrypt;
+    uint32_t        s0 = s[0] ^ rk[0], s1 = s[1] ^ rk[1], s2 = s[2] ^ rk[2], s3 = s[3] ^ rk[3];
+    uint32_t        t0, t1, t2, t3;
+
+    for (uint32_t Round = 1; Round < pKey->Rounds; Round++) {
+        rk += 4;
+        t0 = SD_XtsTe[s0 & 0xFF] ^ SD_XTS_ROR(SD_XtsTe[(s1 >> 8) & 0xFF], 24) ^ SD_XTS_ROR(SD_XtsTe[(s2 >> 16) & 0xFF], 16) ^ SD_XTS_ROR(SD_XtsTe[s3 >> 24], 8) ^ rk[0];
+        t1 = SD_XtsTe[s1 & 0xFF] ^ SD_XTS_ROR(SD_XtsTe[(s2 >> 8) & 0xFF], 24) ^ SD_XTS_ROR(SD_XtsTe[(s3 >> 16) & 0xFF], 16) ^ SD_XTS_ROR(SD_XtsTe[s0 >> 24], 8) ^ rk[1];
+        t2 = SD_XtsTe[s2 & 0xFF] ^ SD_XTS_ROR(SD_XtsTe[(s3 >> 8) & 0xFF], 24) ^ SD_XTS_ROR(SD_XtsTe[(s0 >> 16) & 0xFF], 16) ^ SD_XTS_ROR(SD_XtsTe[s1 >> 24], 8) ^ rk[2];
+        t3 = SD_XtsTe[s3 & 0xFF] ^ SD_XTS_ROR(SD_XtsTe[(s0 >> 8) & 0xFF], 24) ^ SD_XTS_ROR(SD_XtsTe[(s1 >> 16) & 0xFF], 16) ^ SD_XTS_ROR(SD_XtsTe[s2 >> 24], 8) ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    rk += 4;
+    s[0] = (SD_XtsSbox[s0 & 0xFF] | ((uint32_t)SD_XtsSbox[(s1 >> 8) & 0xFF] << 8) | ((uint32_t)SD_XtsSbox[(s2 >> 16) & 0xFF] << 16) | ((uint32_t)SD_XtsSbox[s3 >> 24] << 24)) ^ rk[0];
+    s[1] = (SD_XtsSbox[s1 & 0xFF] | ((uint32_t)SD_XtsSbox[(s2 >> 8) & 0xFF] << 8) | ((uint32_t)SD_XtsSbox[(s3 >> 16) & 0xFF] << 16) | ((uint32_t)SD_XtsSbox[s0 >> 24] << 24)) ^ rk[1];
+    s[2] = (SD_XtsSbox[s2 & 0xFF] | ((uint32_t)SD_XtsSbox[(s3 >> 8) & 0xFF] << 8) | ((uint32_t)SD_XtsSbox[(s0 >> 16) & 0xFF] << 16) | ((uint32_t)SD_XtsSbox[s1 >> 24] << 24)) ^ rk[2];
+    s[3] = (SD_XtsSbox[s3 & 0xFF] | ((uint32_t)SD_XtsSbox[(s0 >> 8) & 0xFF] << 8) | ((uint32_t)SD_XtsSbox[(s1 >> 16) & 0xFF] << 16) | ((uint32_t)SD_XtsSbox[s2 >> 24] << 24)) ^ rk[3];
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_XTS_ITCM static void SD_Xts_DecryptBlock(const SD_XtsKey_t *pKey, uint32_t *s)
+{
+    const uint32_t *rk = pKey->Decrypt;
+    uint32_t        s0 = s[0] ^ rk[0], s1 = s[1] ^ rk[1], s2 = s[2] ^ rk[2], s3 = s[3] ^ rk[3];
+    uint32_t        t0, t1, t2, t3;
+
+    for (uint32_t Round = 1; Round < pKey->Rounds; Round++) {
+        rk += 4;
+        t0 = SD_XtsTd[s0 & 0xFF] ^ SD_XTS_ROR(SD_XtsTd[(s3 >> 8) & 0xFF], 24) ^ SD_XTS_ROR(SD_XtsTd[(s2 >> 16) & 0xFF], 16) ^ SD_XTS_ROR(SD_XtsTd[s1 >> 24], 8) ^ rk[0];
+        t1 = SD_XtsTd[s1 & 0xFF] ^ SD_XTS_ROR(SD_XtsTd[(s0 >> 8) & 0xFF], 24) ^ SD_XTS_ROR(SD_XtsTd[(s3 >> 16) & 0xFF], 16) ^ SD_XTS_ROR(SD_XtsTd[s2 >> 24], 8) ^ rk[1];
+        t2 = SD_XtsTd[s2 & 0xFF] ^ SD_XTS_ROR(SD_XtsTd[(s1 >> 8) & 0xFF], 24) ^ SD_XTS_ROR(SD_XtsTd[(s0 >> 16) & 0xFF], 16) ^ SD_XTS_ROR(SD_XtsTd[s3 >> 24], 8) ^ rk[2];
+        t3 = SD_XtsTd[s3 & 0xFF] ^ SD_XTS_ROR(SD_XtsTd[(s2 >> 8) & 0xFF], 24) ^ SD_XTS_ROR(SD_XtsTd[(s1 >> 16) & 0xFF], 16) ^ SD_XTS_ROR(SD_XtsTd[s0 >> 24], 8) ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    rk += 4;
+    s[0] = (SD_XtsInvSbox[s0 & 0xFF] | ((uint32_t)SD_XtsInvSbox[(s3 >> 8) & 0xFF] << 8) | ((uint32_t)SD_XtsInvSbox[(s2 >> 16) & 0xFF] << 16) | ((uint32_t)SD_XtsInvSbox[s1 >> 24] << 24)) ^ rk[0];
+    s[1] = (SD_XtsInvSbox[s1 & 0xFF] | ((uint32_t)SD_XtsInvSbox[(s0 >> 8) & 0xFF] << 8) | ((uint32_t)SD_XtsInvSbox[(s3 >> 16) & 0xFF] << 16) | ((uint32_t)SD_XtsInvSbox[s2 >> 24] << 24)) ^ rk[1];
+    s[2] = (SD_XtsInvSbox[s2 & 0xFF] | ((uint32_t)SD_XtsInvSbox[(s1 >> 8) & 0xFF] << 8) | ((uint32_t)SD_XtsInvSbox[(s0 >> 16) & 0xFF] << 16) | ((uint32_t)SD_XtsInvSbox[s3 >> 24] << 24)) ^ rk[2];
+    s[3] = (SD_XtsInvSbox[s3 & 0xFF] | ((uint32_t)SD_XtsInvSbox[(s2 >> 8) & 0xFF] << 8) | ((uint32_t)SD_XtsInvSbox[(s1 >> 16) & 0xFF] << 16) | ((uint32_t)SD_XtsInvSbox[s0 >> 24] << 24)) ^ rk[3];
+}
+
+#endif
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#else
+
+SD_Error_t SD_Xts_SetKey(const uint8_t *pKey, uint32_t KeyLength)
+{
+    (void)pKey;
+    (void)KeyLength;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+void SD_Xts_ClearKey(void)
+{
+}
+
+SD_Error_t SD_Xts_Mount(SD_BlockDev_t *pLower, SD_BlockDev_t **ppDev)
+{
+    (void)pLower;
+    (void)ppDev;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Xts_EncryptSector(const uint8_t *pIn, uint8_t *pOut, uint64_t Sector)
+{
+    (void)pIn;
+    (void)pOut;
+    (void)Sector;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Xts_DecryptSector(const uint8_t *pIn, uint8_t *pOut, uint64_t Sector)
+{
+    (void)pIn;
+    (void)pOut;
+    (void)Sector;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+SD_Error_t SD_Xts_Benchmark(uint8_t *pBuffer, uint32_t Blocks, SD_XtsBench_t *pResult)
+{
+    (void)pBuffer;
+    (void)Blocks;
+    (void)pResult;
+    return SD_REQUEST_NOT_APPLICABLE;
+}
+
+void SD_Xts_GetStats(SD_XtsStats_t *pStats)
+{
+    memset(pStats, 0, sizeof(*pStats));
+}
+
+/* ------------------------------------------------------------------------------------------------------------------*/
+#endif
@@ -31,6 +31,13 @@
 #ifdef USE_SDCARD_SDIO
 
 #include "sdmmc_sdio.h"
+#include "sd_stats.h"
+#include "sd_trace.h"
+#include "sd_verify.h"
+#include "sd_tunedb.h"
+#include "sd_powerfail.h"
+#include "sd_readahead.h"
+#include "sd_sched.h"
 #include "io.h"
 
 
@@ -74,6 +81,7 @@
 
 #define SD_VOLTAGE_WINDOW_SD            ((uint32_t)0x80100000)
 #define SD_RESP_HIGH_CAPACITY           ((uint32_t)0x40000000)
+#define SD_RESP_ULTRA_CAPACITY          ((uint32_t)0x08000000)  // ACMD41 HO2T in the argument, CO2T in the OCR
 #define SD_RESP_STD_CAPACITY            ((uint32_t)0x00000000)
 #define SD_CHECK_PATTERN                ((uint32_t)0x000001AA)
 
@@ -98,6 +106,7 @@
 #define SD_BUS_WIDE_4B                  SDMMC_CLKCR_WIDBUS_0
 #define SD_BUS_WIDE_8B                  SDMMC_CLKCR_WIDBUS_1
 
+#define SD_CMD_RESPONSE_NONE            ((uint32_t)0)
 #define SD_CMD_RESPONSE_SHORT           SDMMC_CMD_WAITRESP_0
 #define SD_CMD_RESPONSE_LONG            SDMMC_CMD_WAITRESP
 
@@ -139,6 +148,8 @@
                                                        // fixed 512 bytes in case of SDHC and SDXC.
 #define SD_CMD_READ_MULT_BLOCK          ((uint8_t)18)  // Continuously transfers data blocks from card to host until interrupted by
                                                        // STOP_TRANSMISSION command.
+#define SD_CMD_ADDRESS_EXTENSION        ((uint8_t)22)  // Upper 6 bits of the block address for the next memory access command (SDUC).
+#define SD_CMD_SET_BLOCK_COUNT          ((uint8_t)23)  // Number of blocks for the following CMD18/CMD25, no CMD12 needed at the end.
 #define SD_CMD_WRITE_SINGLE_BLOCK       ((uint8_t)24)  // Writes single block of size selected by SET_BLOCKLEN in case of SDSC, and a block of
                                                        // fixed 512 bytes in case of SDHC and SDXC.
 #define SD_CMD_WRITE_MULT_BLOCK         ((uint8_t)25)  // Continuously writes blocks of data until a STOP_TRANSMISSION follows.
@@ -147,6 +158,13 @@
                                                        // system set by switch function command (CMD6).
 #define SD_CMD_ERASE                    ((uint8_t)38)  // Reserved for SD security applications.
 #define SD_CMD_FAST_IO                  ((uint8_t)39)  // SD card doesn't support it (Reserved).
+#define SD_CMD_Q_MANAGEMENT             ((uint8_t)43)  // Queue management, aborts a single queued task or the whole queue.
+#define SD_CMD_Q_TASK_INFO_A            ((uint8_t)44)  // Queues a task: direction, priority, task ID and number of blocks.
+#define SD_CMD_Q_TASK_INFO_B            ((uint8_t)45)  // Start block address of the task queued by the preceding CMD44.
+#define SD_CMD_Q_RD_TASK                ((uint8_t)46)  // Executes a read task the card has marked ready in the QSR.
+#define SD_CMD_Q_WR_TASK                ((uint8_t)47)  // Executes a write task the card has marked ready in the QSR.
+#define SD_CMD_READ_EXTR_SINGLE         ((uint8_t)48)  // Reads up to 512 bytes of an extension register page.
+#define SD_CMD_WRITE_EXTR_SINGLE        ((uint8_t)49)  // Writes bytes of an extension register page.
 #define SD_CMD_APP_CMD                  ((uint8_t)55)  // Indicates to the card that the next command is an application specific command rather
                                                        // than a standard command.
 
@@ -157,11 +175,79 @@
 #define SD_CMD_SD_APP_STATUS            ((uint8_t)13)  // (ACMD13) Sends the SD status.
 #define SD_CMD_SD_APP_OP_COND           ((uint8_t)41)  // (ACMD41) Sends host capacity support information (HCS) and asks the accessed card to
                                                        // send its operating condition register (OCR) content in the response on the CMD line.
+#define SD_CMD_SD_APP_SET_WR_ERASE      ((uint8_t)23)  // (ACMD23) Number of blocks to pre-erase for the following CMD25.
 #define SD_CMD_SD_APP_SEND_SCR          ((uint8_t)51)  // Reads the SD Configuration Register (SCR).
 
 #define SDMMC_DIR_TX 1
 #define SDMMC_DIR_RX 0
 
+#define SD_OPERATION_QUEUED             ((uint32_t)0x04)    // Operation is a CMD46/CMD47 task, no CMD12 at DATAEND
+
+#define SD_SCR_CMD48_SUPPORT            ((uint32_t)0x00000004)  // SCR[34] in upper SCR word
+
+#define SD_STATUS_SEND_QSR              ((uint32_t)0x00008000)  // CMD13 argument bit 15, return Queue Status Register
+
+#define SD_EXT_GENERAL_INFO_HDR_LEN     16
+#define SD_EXT_DESCRIPTOR_LEN           48
+#define SD_EXT_SFC_PERFORMANCE          ((uint16_t)0x0002)  // Standard function code of performance enhancement
+#define SD_EXT_PERF_REVISION            0                   // Byte offsets inside the performance enhancement register
+#define SD_EXT_PERF_FX_EVENT            1
+#define SD_EXT_PERF_MAINTENANCE         2
+#define SD_EXT_PERF_CACHE               4
+#define SD_EXT_PERF_QUEUE_DEPTH         6
+#define SD_EXT_PERF_CACHE_ENABLE        260
+#define SD_EXT_PERF_CACHE_FLUSH         261
+#define SD_EXT_PERF_CQ_ENABLE           262
+#define SD_EXT_PERF_LENGTH              (SD_EXT_PERF_CQ_ENABLE + 1)   // Bytes of the register the driver uses
+
+#define SD_CQ_DIR_READ                  ((uint32_t)0x40000000)  // CMD44 argument bit 30
+#define SD_CQ_TASK_ID_POS               16
+#define SD_CQ_NO_TASK                   ((int8_t)-1)
+
+#define SD_CACHE_FLUSH_TIMEOUT_MS       1000                // Longest a card may take to write its cache back
+
+#define SD_CACHE_FLUSH_IDLE             0                   // Steps of SD_CardCacheFlushStart/SD_CardCacheFlushPoll
+#define SD_CACHE_FLUSH_DRAIN            1                   // Queued tasks run first
+#define SD_CACHE_FLUSH_BUSY             2                   // Flush bit written, card holds DAT0 low
+#define SD_CACHE_FLUSH_CHECK            3                   // Waiting for the card to clear the flush bit
+
+#define SD_CSD_STRUCT_V3                ((uint8_t)2)            // SDUC, 28 bit C_SIZE
+#define SD_ADDRESS_EXTENSION_POS        32                      // CMD22 carries block address bits 37:32
+#define SD_ADDRESS_EXTENSION_MASK       ((uint32_t)0x0000003F)
+#define SD_ULTRA_MAX_BLOCKS             ((uint64_t)1 << 38)
+
+// SDHC, SDXC and SDUC take block numbers, SDSC byte addresses
+#define SD_BLOCK_ADDRESSED()            ((SD_CardType == SD_HIGH_CAPACITY) || (SD_CardType == SD_ULTRA_CAPACITY))
+
+#define SD_CMDF_APP                     ((uint8_t)0x01)     // Application command, CMD55 with the RCA is sent first
+#define SD_CMDF_BUSY                    ((uint8_t)0x02)     // R1b, card holds DAT0 busy after the response
+#define SD_CMDF_RX                      ((uint8_t)0x04)     // Data phase card to host
+#define SD_CMDF_TX                      ((uint8_t)0x08)     // Data phase host to card
+#define SD_CMDF_IDMA                    ((uint8_t)0x10)     // Data phase started by CMDTRANS, DPSM and IDMA set up by the caller
+#define SD_CMDF_STOP                    ((uint8_t)0x20)     // Stop/abort command, DPSM returns to idle
+
+// STA flags that end the command phase
+#define SD_CMD_WAIT_SENT                SDMMC_STA_CMDSENT
+#define SD_CMD_WAIT_RESP                (SDMMC_STA_CCRCFAIL | SDMMC_STA_CMDREND | SDMMC_STA_CTIMEOUT)
+#define SD_CMD_WAIT_BUSY                (SD_CMD_WAIT_RESP | SDMMC_STA_BUSYD0END)
+
+#define SD_DBLOCKSIZE(Bytes)            ((((Bytes) == 512) ? 9 : ((Bytes) == 64) ? 6 : 3) << SDMMC_DCTRL_DBLOCKSIZE_Pos)
+
+// Everything the engine needs is worked out here at compile time, issuing a command is
+// a table load and three register writes
+#define SD_CMD_DESC(Idx, Rsp, Chk, Flg, Len)                                                                            \
+{                                                                                                                       \
+    .CmdReg    = (Idx) | (Rsp) | SDMMC_CMD_CPSMEN |                                                                     \
+                 (((Flg) & SD_CMDF_IDMA) ? SDMMC_CMD_CMDTRANS : 0) | (((Flg) & SD_CMDF_STOP) ? SDMMC_CMD_CMDSTOP : 0),  \
+    .WaitFlags = ((Rsp) == SD_CMD_RESPONSE_NONE) ? SD_CMD_WAIT_SENT :                                                            \
+                 (((Flg) & SD_CMDF_BUSY) ? SD_CMD_WAIT_BUSY : SD_CMD_WAIT_RESP),                                        \
+    .DataCtrl  = (((Flg) & (SD_CMDF_RX | SD_CMDF_TX)) && !((Flg) & SD_CMDF_IDMA)) ?                                     \
+                 (SDMMC_DCTRL_DTEN | (((Flg) & SD_CMDF_RX) ? SDMMC_DCTRL_DTDIR : 0) | SD_DBLOCKSIZE(Len)) : 0,          \
+    .BlockLen  = (Len),                                                                                                 \
+    .Check     = (Chk),                                                                                                 \
+    .Flags     = (Flg),                                                                                                 \
+}
+
 
 /* Typedef(s) -------------------------------------------------------------------------------------------------------*/
 
@@ -172,6 +258,66 @@ typedef enum
 } SD_Operation_t;
 
 
+// Response checks, each level includes the ones above it
+typedef enum
+{
+    SD_CHECK_SENT       = 0,            // No response, command is done once it left the CPSM
+    SD_CHECK_TIMEOUT    = 1,            // R3, CRC of the OCR response is not valid
+    SD_CHECK_CRC        = 2,            // R2 and the CMD13 queue status register
+    SD_CHECK_INDEX      = 3,            // R7, response must echo the command index
+    SD_CHECK_R1         = 4,            // Card status error bits
+    SD_CHECK_R6         = 5,            // Published RCA
+} SD_CmdCheck_t;
+
+typedef enum
+{
+    SD_CMDID_GO_IDLE_STATE = 0,
+    SD_CMDID_ALL_SEND_CID,
+    SD_CMDID_SET_REL_ADDR,
+    SD_CMDID_SWITCH_FUNC,
+    SD_CMDID_SEL_DESEL_CARD,
+    SD_CMDID_SEND_IF_COND,
+    SD_CMDID_SEND_CSD,
+    SD_CMDID_SEND_CID,
+    SD_CMDID_STOP_TRANSMISSION,
+    SD_CMDID_SEND_STATUS,
+    SD_CMDID_SEND_QSR,
+    SD_CMDID_SET_BLOCKLEN,
+    SD_CMDID_READ_SINGLE_BLOCK,
+    SD_CMDID_READ_MULT_BLOCK,
+    SD_CMDID_ADDRESS_EXTENSION,
+    SD_CMDID_SET_BLOCK_COUNT,
+    SD_CMDID_WRITE_SINGLE_BLOCK,
+    SD_CMDID_WRITE_MULT_BLOCK,
+    SD_CMDID_ERASE_GRP_START,
+    SD_CMDID_ERASE_GRP_END,
+    SD_CMDID_ERASE,
+    SD_CMDID_Q_MANAGEMENT,
+    SD_CMDID_Q_TASK_INFO_A,
+    SD_CMDID_Q_TASK_INFO_B,
+    SD_CMDID_Q_RD_TASK,
+    SD_CMDID_Q_WR_TASK,
+    SD_CMDID_READ_EXTR_SINGLE,
+    SD_CMDID_WRITE_EXTR_SINGLE,
+    SD_CMDID_APP_CMD,
+    SD_CMDID_APP_SET_BUSWIDTH,
+    SD_CMDID_APP_SD_STATUS,
+    SD_CMDID_APP_OP_COND,
+    SD_CMDID_APP_SEND_SCR,
+    SD_CMDID_APP_PRE_ERASE,
+    SD_CMDID_COUNT
+} SD_CmdId_t;
+
+typedef struct
+{
+    uint32_t CmdReg;                    // CMD register word: index, response length, CMDTRANS/CMDSTOP, CPSMEN
+    uint32_t WaitFlags;                 // STA flags that end the command phase
+    uint32_t DataCtrl;                  // DCTRL word for FIFO data phases the engine starts, 0 otherwise
+    uint16_t BlockLen;                  // Block length the command relies on (CMD16 is sent when it changes), 0 for none
+    uint8_t  Check;                     // SD_CmdCheck_t
+    uint8_t  Flags;                     // SD_CMDF_xxx
+} SD_CmdDesc_t;
+
 typedef struct
 {
     uint32_t          CSD[4];            // SD card specific data table
@@ -182,8 +328,50 @@ typedef struct
     volatile uint32_t TXCplt;		     // SD TX Complete is equal 0 when no transfer
     volatile uint32_t Operation;         // SD transfer operation (read/write)
     volatile uint32_t last_transfer_end; // Holds no of cycles when last trasfer ended
+    uint32_t          SCR[2];            // SD configuration register, SCR[1] holds bits 63:32
+#ifdef SDMMC_STATS
+    SD_StatsRequest_t Stats;             // Phase timestamps of the transfer in flight
+#endif
 } SD_Handle_t;
 
+typedef enum
+{
+    SD_CQ_TASK_FREE      = 0,           // Slot can be used for a new task
+    SD_CQ_TASK_QUEUED    = 1,           // CMD44/CMD45 accepted, waiting for ready bit in QSR
+    SD_CQ_TASK_EXECUTING = 2,           // CMD46/CMD47 issued, data phase in progress
+    SD_CQ_TASK_DONE      = 3,           // Data phase finished, callback not delivered yet
+} SD_CQ_TaskState_t;
+
+typedef struct
+{
+    uint32_t                   *Buffer;
+    uint64_t                   Address;
+    uint16_t                   NumberOfBlocks;
+    uint8_t                    Direction;
+    volatile SD_CQ_TaskState_t State;
+    volatile SD_Error_t        Status;
+    SD_CQ_Callback_t           Callback;
+    void                       *Context;
+#ifdef SDMMC_STATS
+    SD_StatsRequest_t          Stats;
+#endif
+} SD_CQ_Task_t;
+
+typedef struct
+{
+    bool                 Supported;      // Card reports a queue depth in performance enhancement register
+    bool                 Enabled;        // Queue mode switched on through CMD49
+    uint8_t              Depth;          // Number of tasks card accepts (1..32)
+    volatile bool        FlushPending;   // Cache flush is draining the queue, refuse new tasks
+    uint8_t              FlushStep;      // SD_CACHE_FLUSH_ step of the flush in progress
+    uint32_t             FlushStart;     // HAL tick the flush started
+    uint32_t             QueuedMask;     // Tasks handed to the card and not executed yet
+    uint32_t             ReadyMask;      // Last QSR snapshot, limited to queued tasks
+    volatile int8_t      Executing;      // Task in data phase or SD_CQ_NO_TASK
+    uint8_t              NextScan;       // Round robin start for ready bitmap scan
+    SD_CQ_Task_t         Tasks[SD_CQ_MAX_TASKS];
+} SD_CQ_t;
+
 typedef enum
 {
     SD_CARD_READY                  = ((uint32_t)0x00000001),  // Card state is ready
@@ -206,13 +394,62 @@ static uint32_t                    SD_CardRCA;
 SD_CardType_t                      SD_CardType;
 SDMMC_TypeDef                      *sdmmc_instance;
 static uint32_t                    sdmmc8_clk_cycles;
+static SD_CQ_t                     SD_CQ = { .Executing = SD_CQ_NO_TASK };
+static SD_ExtInfo_t                SD_ExtInfo;
+static uint32_t                    SD_BlockLen;        // Last length set through CMD16, 0 after CMD0
+static SD_WriteStrategy_t          SD_WriteStrategy;   // How multi block writes are announced to the card
+
+static const SD_CmdDesc_t          SD_CmdTable[SD_CMDID_COUNT] =
+{
+    [SD_CMDID_GO_IDLE_STATE]      = SD_CMD_DESC(SD_CMD_GO_IDLE_STATE,       SD_CMD_RESPONSE_NONE,  SD_CHECK_SENT,    0,                           0),
+    [SD_CMDID_ALL_SEND_CID]       = SD_CMD_DESC(SD_CMD_ALL_SEND_CID,        SD_CMD_RESPONSE_LONG,  SD_CHECK_CRC,     0,                           0),
+    [SD_CMDID_SET_REL_ADDR]       = SD_CMD_DESC(SD_CMD_SET_REL_ADDR,        SD_CMD_RESPONSE_SHORT, SD_CHECK_R6,      0,                           0),
+    [SD_CMDID_SWITCH_FUNC]        = SD_CMD_DESC(SD_CMD_HS_SWITCH,           SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_RX,                  64),
+    [SD_CMDID_SEL_DESEL_CARD]     = SD_CMD_DESC(SD_CMD_SEL_DESEL_CARD,      SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_BUSY,                0),
+    [SD_CMDID_SEND_IF_COND]       = SD_CMD_DESC(SD_CMD_HS_SEND_EXT_CSD,     SD_CMD_RESPONSE_SHORT, SD_CHECK_INDEX,   0,                           0),
+    [SD_CMDID_SEND_CSD]           = SD_CMD_DESC(SD_CMD_SEND_CSD,            SD_CMD_RESPONSE_LONG,  SD_CHECK_CRC,     0,                           0),
+    [SD_CMDID_SEND_CID]           = SD_CMD_DESC(SD_CMD_SEND_CID,            SD_CMD_RESPONSE_LONG,  SD_CHECK_CRC,     0,                           0),
+    [SD_CMDID_STOP_TRANSMISSION]  = SD_CMD_DESC(SD_CMD_STOP_TRANSMISSION,   SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_BUSY | SD_CMDF_STOP, 0),
+    [SD_CMDID_SEND_STATUS]        = SD_CMD_DESC(SD_CMD_SEND_STATUS,         SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      0,                           0),
+    [SD_CMDID_SEND_QSR]           = SD_CMD_DESC(SD_CMD_SEND_STATUS,         SD_CMD_RESPONSE_SHORT, SD_CHECK_CRC,     0,                           0),
+    [SD_CMDID_SET_BLOCKLEN]       = SD_CMD_DESC(SD_CMD_SET_BLOCKLEN,        SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      0,                           0),
+    [SD_CMDID_READ_SINGLE_BLOCK]  = SD_CMD_DESC(SD_CMD_READ_SINGLE_BLOCK,   SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_RX | SD_CMDF_IDMA,   BLOCK_SIZE),
+    [SD_CMDID_READ_MULT_BLOCK]    = SD_CMD_DESC(SD_CMD_READ_MULT_BLOCK,     SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_RX | SD_CMDF_IDMA,   BLOCK_SIZE),
+    [SD_CMDID_ADDRESS_EXTENSION]  = SD_CMD_DESC(SD_CMD_ADDRESS_EXTENSION,   SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      0,                           0),
+    [SD_CMDID_SET_BLOCK_COUNT]    = SD_CMD_DESC(SD_CMD_SET_BLOCK_COUNT,     SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      0,                           0),
+    [SD_CMDID_WRITE_SINGLE_BLOCK] = SD_CMD_DESC(SD_CMD_WRITE_SINGLE_BLOCK,  SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_TX | SD_CMDF_IDMA,   BLOCK_SIZE),
+    [SD_CMDID_WRITE_MULT_BLOCK]   = SD_CMD_DESC(SD_CMD_WRITE_MULT_BLOCK,    SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_TX | SD_CMDF_IDMA,   BLOCK_SIZE),
+    [SD_CMDID_ERASE_GRP_START]    = SD_CMD_DESC(SD_CMD_SD_ERASE_GRP_START,  SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      0,                           0),
+    [SD_CMDID_ERASE_GRP_END]      = SD_CMD_DESC(SD_CMD_SD_ERASE_GRP_END,    SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      0,                           0),
+    [SD_CMDID_ERASE]              = SD_CMD_DESC(SD_CMD_ERASE,               SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_BUSY,                0),
+    [SD_CMDID_Q_MANAGEMENT]       = SD_CMD_DESC(SD_CMD_Q_MANAGEMENT,        SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_BUSY,                0),
+    // Task block length is fixed when it is queued, CMD16 is not allowed between CMD44 and CMD46/CMD47
+    [SD_CMDID_Q_TASK_INFO_A]      = SD_CMD_DESC(SD_CMD_Q_TASK_INFO_A,       SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      0,                           BLOCK_SIZE),
+    [SD_CMDID_Q_TASK_INFO_B]      = SD_CMD_DESC(SD_CMD_Q_TASK_INFO_B,       SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      0,                           0),
+    [SD_CMDID_Q_RD_TASK]          = SD_CMD_DESC(SD_CMD_Q_RD_TASK,           SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_RX | SD_CMDF_IDMA,   0),
+    [SD_CMDID_Q_WR_TASK]          = SD_CMD_DESC(SD_CMD_Q_WR_TASK,           SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_TX | SD_CMDF_IDMA,   0),
+    [SD_CMDID_READ_EXTR_SINGLE]   = SD_CMD_DESC(SD_CMD_READ_EXTR_SINGLE,    SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_RX | SD_CMDF_IDMA,   BLOCK_SIZE),
+    [SD_CMDID_WRITE_EXTR_SINGLE]  = SD_CMD_DESC(SD_CMD_WRITE_EXTR_SINGLE,   SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_TX | SD_CMDF_IDMA,   BLOCK_SIZE),
+    [SD_CMDID_APP_CMD]            = SD_CMD_DESC(SD_CMD_APP_CMD,             SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      0,                           0),
+    [SD_CMDID_APP_SET_BUSWIDTH]   = SD_CMD_DESC(SD_CMD_APP_SD_SET_BUSWIDTH, SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_APP,                 0),
+    [SD_CMDID_APP_SD_STATUS]      = SD_CMD_DESC(SD_CMD_SD_APP_STATUS,       SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_APP | SD_CMDF_RX,    64),
+    [SD_CMDID_APP_OP_COND]        = SD_CMD_DESC(SD_CMD_SD_APP_OP_COND,      SD_CMD_RESPONSE_SHORT, SD_CHECK_TIMEOUT, SD_CMDF_APP,                 0),
+    [SD_CMDID_APP_SEND_SCR]       = SD_CMD_DESC(SD_CMD_SD_APP_SEND_SCR,     SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_APP | SD_CMDF_RX,    8),
+    [SD_CMDID_APP_PRE_ERASE]      = SD_CMD_DESC(SD_CMD_SD_APP_SET_WR_ERASE, SD_CMD_RESPONSE_SHORT, SD_CHECK_R1,      SD_CMDF_APP,                 0),
+};
+
+// Extension register pages are always moved as one 512 byte block, IDMA needs it in AXI SRAM
+static uint8_t                     SD_ExtRegBuffer[512] __attribute__((section(".ram_d1"), aligned(32)));
 
 
 /* Private function(s) ----------------------------------------------------------------------------------------------*/
 
-static void             SD_DataTransferInit         (uint32_t Size, uint32_t DataBlockSize, bool IsItReadFromCard, bool enableDPSM);
-static SD_Error_t       SD_TransmitCommand          (uint32_t Command, uint32_t Argument, int8_t ResponseType);
-static SD_Error_t       SD_CmdResponse              (uint8_t SD_CMD, int8_t ResponseType);
+static SD_Error_t       SD_TransmitCommand          (SD_CmdId_t CmdId, uint32_t Argument);
+static SD_Error_t       SD_TransmitSequence         (SD_CmdId_t CmdId, uint32_t Argument);
+static SD_Error_t       SD_SetBlockLen              (const SD_CmdDesc_t *pCmd);
+static SD_Error_t       SD_ExecuteCommand           (const SD_CmdDesc_t *pCmd, uint32_t Argument);
+static SD_Error_t       SD_TransmitAddressCommand   (SD_CmdId_t CmdId, uint64_t Address);
+static SD_Error_t       SD_CmdResponse              (const SD_CmdDesc_t *pCmd);
 static void             SD_GetResponse              (uint32_t* pResponse);
 static SD_Error_t       CheckOCR_Response           (uint32_t Response_R1);
 static SD_Error_t       SD_InitializeCard           (void);
@@ -222,6 +459,11 @@ static SD_Error_t       SD_WideBusOperationConfig   (uint32_t WideMode);
 static SD_Error_t       SD_FindSCR                  (uint32_t *pSCR);
 static void             SD_EnableIDMA               (uint32_t *pBuffer);
 static void             SD_StartBlockTransfer       (uint32_t BlockSize, uint32_t NumberOfBlocks, uint8_t dir);
+static SD_Error_t       SD_ExtRegisterTransfer      (SD_CmdId_t CmdId, uint32_t Argument, uint8_t dir);
+static SD_Error_t       SD_ExtRead                  (uint8_t FNO, uint8_t Page, uint16_t Offset, uint16_t Length);
+static SD_Error_t       SD_ExtWrite                 (uint8_t FNO, uint8_t Page, uint16_t Offset, uint16_t LengthOrMask, bool MaskWrite);
+static SD_Error_t       SD_ExtWriteStart            (uint8_t FNO, uint8_t Page, uint16_t Offset, uint16_t LengthOrMask, bool MaskWrite);
+static SD_Error_t       SD_ReadExtInfo              (void);
 
 //static void             SD_PowerOFF                 (void);
 
@@ -249,47 +491,173 @@ bool SD_IsDetected(void)
 /** -----------------------------------------------------------------------------------------------------------------*/
 /**		SD_TransmitCommand
   *
-  * @brief  Send the commande to sdmmc_instance
-  * @param  uint32_t Command
-  * @param  uint32_t Argument              Must provide the response size
-  * @param  uint8_t ResponseType
+  * @brief  Sends a command from SD_CmdTable. CMD16 goes out first when the command needs another
+  *         block length, CMD55 for application commands. FIFO data phases are armed here, IDMA
+  *         data phases must be set up by the caller before.
+  * @param  SD_CmdId_t CmdId
+  * @param  uint32_t Argument
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_TransmitCommand(SD_CmdId_t CmdId, uint32_t Argument)
+{
+#ifdef SDMMC_POWER_FAIL
+    // The power-fail service sends commands as well, it must not land between CMD55 and its ACMD
+    uint32_t   Mask       = SD_PowerFail_Mask();
+    SD_Error_t ErrorState = SD_TransmitSequence(CmdId, Argument);
+
+    SD_PowerFail_Unmask(Mask);
+    return ErrorState;
+#else
+    return SD_TransmitSequence(CmdId, Argument);
+#endif
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  CMD16 and CMD55 prefixes as required by the descriptor, data path setup, then the command.
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_TransmitSequence(SD_CmdId_t CmdId, uint32_t Argument)
+{
+    const SD_CmdDesc_t *pCmd = &SD_CmdTable[CmdId];
+    SD_Error_t         ErrorState;
+
+    if((ErrorState = SD_SetBlockLen(pCmd)) != SD_OK)
+    {
+        return ErrorState;
+    }
+
+    if((pCmd->Flags & SD_CMDF_APP) != 0)
+    {
+        if((ErrorState = SD_ExecuteCommand(&SD_CmdTable[SD_CMDID_APP_CMD], SD_CardRCA)) != SD_OK)
+        {
+            return ErrorState;
+        }
+    }
+
+    if(pCmd->DataCtrl != 0)
+    {
+        sdmmc_instance->DTIMER = SD_DATATIMEOUT;
+        sdmmc_instance->DLEN   = pCmd->BlockLen;
+        sdmmc_instance->DCTRL  = pCmd->DataCtrl;
+    }
+
+    return SD_ExecuteCommand(pCmd, Argument);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Sends CMD16 when the command relies on another block length than the card has set.
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_SetBlockLen(const SD_CmdDesc_t *pCmd)
+{
+    SD_Error_t ErrorState;
+
+    if((pCmd->BlockLen != 0) && (pCmd->BlockLen != SD_BlockLen))
+    {
+        if((ErrorState = SD_ExecuteCommand(&SD_CmdTable[SD_CMDID_SET_BLOCKLEN], pCmd->BlockLen)) != SD_OK)
+        {
+            return ErrorState;
+        }
+        SD_BlockLen = pCmd->BlockLen;
+    }
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Sends a memory access command with a card address. SDUC cards take the upper
+  *         address bits through CMD22, which has to come right before the command. A CMD16
+  *         the command needs goes out ahead of CMD22, and the power-fail service is held
+  *         off across the pair.
+  * @param  CmdId: Memory access command
+  * @param  Address: Block number (byte address for SDSC)
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_TransmitAddressCommand(SD_CmdId_t CmdId, uint64_t Address)
+{
+    SD_Error_t ErrorState;
+#ifdef SDMMC_POWER_FAIL
+    uint32_t   Mask;
+#endif
+
+    if(SD_CardType != SD_ULTRA_CAPACITY)
+    {
+        return (Address > 0xFFFFFFFF) ? SD_ADDR_OUT_OF_RANGE : SD_TransmitCommand(CmdId, (uint32_t)Address);
+    }
+    if(Address >= SD_ULTRA_MAX_BLOCKS)
+    {
+        return SD_ADDR_OUT_OF_RANGE;
+    }
+
+#ifdef SDMMC_POWER_FAIL
+    Mask = SD_PowerFail_Mask();
+#endif
+    if((ErrorState = SD_SetBlockLen(&SD_CmdTable[CmdId])) == SD_OK)
+    {
+        ErrorState = SD_TransmitSequence(SD_CMDID_ADDRESS_EXTENSION, (uint32_t)(Address >> SD_ADDRESS_EXTENSION_POS) & SD_ADDRESS_EXTENSION_MASK);
+    }
+    if(ErrorState == SD_OK)
+    {
+        ErrorState = SD_TransmitSequence(CmdId, (uint32_t)Address);
+    }
+#ifdef SDMMC_POWER_FAIL
+    SD_PowerFail_Unmask(Mask);
+#endif
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Issues exactly one command and checks its response.
+  * @param  pCmd: Command descriptor
+  * @param  Argument: Command argument
   * @retval SD Card error state
   */
-static SD_Error_t SD_TransmitCommand(uint32_t Command, uint32_t Argument, int8_t ResponseType)
+static SD_Error_t SD_ExecuteCommand(const SD_CmdDesc_t *pCmd, uint32_t Argument)
 {
     SD_Error_t ErrorState;
+#if defined(SDMMC_TRACE) || defined(SDMMC_STATS)
+    uint8_t    CmdIndex = pCmd->CmdReg & SDMMC_CMD_CMDINDEX;
+#endif
+#ifdef SDMMC_STATS
+    uint32_t   Start = DWT->CYCCNT;
+#endif
 
-    uint32_t cmd_clear_mask = ((uint32_t)(SDMMC_CMD_CMDINDEX | SDMMC_CMD_WAITRESP |\
-            SDMMC_CMD_WAITINT  | SDMMC_CMD_WAITPEND |\
-            SDMMC_CMD_CPSMEN   | SDMMC_CMD_CMDSUSPEND));
+    SD_TRACE(SD_TRACE_CMD, CmdIndex, 0, Argument);
 
     WRITE_REG(sdmmc_instance->ICR, SDMMC_ICR_STATIC_FLAGS);                               // Clear the Command Flags
-    WRITE_REG(sdmmc_instance->ARG, (uint32_t) Argument);                                  // Set the sdmmc_instance Argument value
-    MODIFY_REG(sdmmc_instance->CMD, cmd_clear_mask,(uint32_t) (Command | SDMMC_CMD_CPSMEN));              // Set sdmmc_instance command parameters
-    if((Argument == 0) && (ResponseType == 0)) ResponseType = -1;                         // Go idle command
-    ErrorState  = SD_CmdResponse(Command & SDMMC_CMD_CMDINDEX, ResponseType);
+    WRITE_REG(sdmmc_instance->ARG, Argument);                                             // Set the sdmmc_instance Argument value
+    WRITE_REG(sdmmc_instance->CMD, pCmd->CmdReg);                                         // Precomputed command word, starts the CPSM
+    ErrorState  = SD_CmdResponse(pCmd);
+    SD_TRACE(SD_TRACE_RESP, CmdIndex, ErrorState, sdmmc_instance->RESP1);
+    if (ErrorState != SD_OK) {
+        SD_TRACE(SD_TRACE_STA, SD_TRACE_SITE_COMMAND, CmdIndex, SD_Status);
+    }
     WRITE_REG(sdmmc_instance->ICR, SDMMC_ICR_STATIC_FLAGS);                               // Clear the Command Flags
+#ifdef SDMMC_STATS
+    SD_Stats_Command(CmdIndex, Start, ErrorState);
+#endif
     return ErrorState;
 }
 
 
 /** -----------------------------------------------------------------------------------------------------------------*/
 /**
-  * @brief  Checks for error conditions for any response.
-  *                                     - R2 (CID or CSD) response.
-  *                                     - R3 (OCR) response.
-  *
-  * @param  SD_CMD: The sent command Index
+  * @brief  Waits for the end of the command phase and checks the response as far as the
+  *         descriptor asks for.
+  * @param  pCmd: The sent command descriptor
   * @retval SD Card error state
   */
-static SD_Error_t SD_CmdResponse(uint8_t SD_CMD, int8_t ResponseType)
+static SD_Error_t SD_CmdResponse(const SD_CmdDesc_t *pCmd)
 {
     uint32_t Response_R1;
     uint32_t TimeOut;
-    uint32_t Flag;
-
-    if(ResponseType == -1) Flag = SDMMC_STA_CMDSENT;
-    else                   Flag = SDMMC_STA_CCRCFAIL | SDMMC_STA_CMDREND | SDMMC_STA_CTIMEOUT | SDMMC_STA_BUSYD0END;
 
     TimeOut = SD_SOFTWARE_COMMAND_TIMEOUT;
     do
@@ -297,41 +665,32 @@ static SD_Error_t SD_CmdResponse(uint8_t SD_CMD, int8_t ResponseType)
         SD_Status = sdmmc_instance->STA;
         TimeOut--;
     }
-    while(((SD_Status & Flag) == 0) && (TimeOut > 0));
-
-    if(ResponseType <= 0)
-    {
-        if(TimeOut == 0)                            return SD_CMD_RSP_TIMEOUT;
-        else                                        return SD_OK;
-    }
+    while(((SD_Status & pCmd->WaitFlags) == 0) && (TimeOut > 0));
 
-    if((sdmmc_instance->STA & SDMMC_STA_CTIMEOUT) != 0)     return SD_CMD_RSP_TIMEOUT;
-    if(ResponseType == 3)
-    {
-        if(TimeOut == 0)                            return SD_CMD_RSP_TIMEOUT;  // Card is not V2.0 compliant or card does not support the set voltage range
-        else                                        return SD_OK;               // Card is SD V2.0 compliant
-    }
+    if(TimeOut == 0)                                return SD_CMD_RSP_TIMEOUT;
+    if(pCmd->Check == SD_CHECK_SENT)                return SD_OK;
+    if((SD_Status & SDMMC_STA_CTIMEOUT) != 0)       return SD_CMD_RSP_TIMEOUT;  // R3: card is not V2.0 compliant or does not support the set voltage range
+    if(pCmd->Check == SD_CHECK_TIMEOUT)             return SD_OK;
+    if((SD_Status & SDMMC_STA_CCRCFAIL) != 0)       return SD_CMD_CRC_FAIL;
+    if(pCmd->Check == SD_CHECK_CRC)                 return SD_OK;
+    if(sdmmc_instance->RESPCMD != (pCmd->CmdReg & SDMMC_CMD_CMDINDEX))  return SD_ILLEGAL_CMD;  // Check if response is of desired command
+    if(pCmd->Check == SD_CHECK_INDEX)               return SD_OK;
 
-    if((sdmmc_instance->STA & SDMMC_STA_CCRCFAIL) != 0)     return SD_CMD_CRC_FAIL;
-    if(ResponseType == 2)                           return SD_OK;
-    if((uint8_t)sdmmc_instance->RESPCMD != SD_CMD)          return SD_ILLEGAL_CMD;      // Check if response is of desired command
+    Response_R1 = sdmmc_instance->RESP1;            // We have received response, retrieve it for analysis
 
-    Response_R1 = sdmmc_instance->RESP1;                    // We have received response, retrieve it for analysis
-
-    if(ResponseType == 1)
+    if(pCmd->Check == SD_CHECK_R1)
     {
         return CheckOCR_Response(Response_R1);
     }
-    else if(ResponseType == 6)
+
+    // SD_CHECK_R6
+    if((Response_R1 & (SD_R6_GENERAL_UNKNOWN_ERROR | SD_R6_ILLEGAL_CMD | SD_R6_COM_CRC_FAILED)) == SD_ALLZERO)
     {
-        if((Response_R1 & (SD_R6_GENERAL_UNKNOWN_ERROR | SD_R6_ILLEGAL_CMD | SD_R6_COM_CRC_FAILED)) == SD_ALLZERO)
-        {
-            SD_CardRCA = Response_R1;
-        }
-        if((Response_R1 & SD_R6_GENERAL_UNKNOWN_ERROR) == SD_R6_GENERAL_UNKNOWN_ERROR)      return SD_GENERAL_UNKNOWN_ERROR;
-        if((Response_R1 & SD_R6_ILLEGAL_CMD)           == SD_R6_ILLEGAL_CMD)                return SD_ILLEGAL_CMD;
-        if((Response_R1 & SD_R6_COM_CRC_FAILED)        == SD_R6_COM_CRC_FAILED)             return SD_COM_CRC_FAILED;
+        SD_CardRCA = Response_R1;
     }
+    if((Response_R1 & SD_R6_GENERAL_UNKNOWN_ERROR) == SD_R6_GENERAL_UNKNOWN_ERROR)      return SD_GENERAL_UNKNOWN_ERROR;
+    if((Response_R1 & SD_R6_ILLEGAL_CMD)           == SD_R6_ILLEGAL_CMD)                return SD_ILLEGAL_CMD;
+    if((Response_R1 & SD_R6_COM_CRC_FAILED)        == SD_R6_COM_CRC_FAILED)             return SD_COM_CRC_FAILED;
 
     return SD_OK;
 }
@@ -400,7 +759,7 @@ static SD_Error_t SD_InitializeCard(void)
         if(SD_CardType != SD_SECURE_DIGITAL_IO)
         {
             // Send CMD2 ALL_SEND_CID
-            if((ErrorState = SD_TransmitCommand((SD_CMD_ALL_SEND_CID | SD_CMD_RESPONSE_LONG), 0, 2)) != SD_OK)
+            if((ErrorState = SD_TransmitCommand(SD_CMDID_ALL_SEND_CID, 0)) != SD_OK)
             {
                 return ErrorState;
             }
@@ -410,11 +769,11 @@ static SD_Error_t SD_InitializeCard(void)
         }
 
         if((SD_CardType == SD_STD_CAPACITY_V1_1)    || (SD_CardType == SD_STD_CAPACITY_V2_0) ||
-           (SD_CardType == SD_SECURE_DIGITAL_IO_COMBO) || (SD_CardType == SD_HIGH_CAPACITY))
+           (SD_CardType == SD_SECURE_DIGITAL_IO_COMBO) || SD_BLOCK_ADDRESSED())
         {
             // Send CMD3 SET_REL_ADDR with argument 0
             // SD Card publishes its RCA.
-            if((ErrorState = SD_TransmitCommand((SD_CMD_SET_REL_ADDR | SD_CMD_RESPONSE_SHORT), 0, 6)) != SD_OK)
+            if((ErrorState = SD_TransmitCommand(SD_CMDID_SET_REL_ADDR, 0)) != SD_OK)
             {
                 return ErrorState;
             }
@@ -423,7 +782,7 @@ static SD_Error_t SD_InitializeCard(void)
         if(SD_CardType != SD_SECURE_DIGITAL_IO)
         {
             // Send CMD9 SEND_CSD with argument as card's RCA
-            if((ErrorState = SD_TransmitCommand((SD_CMD_SEND_CSD | SD_CMD_RESPONSE_LONG), SD_CardRCA, 2)) == SD_OK)
+            if((ErrorState = SD_TransmitCommand(SD_CMDID_SEND_CSD, SD_CardRCA)) == SD_OK)
             {
                 // Get Card Specific Data
                 SD_GetResponse(SD_Handle.CSD);
@@ -484,29 +843,11 @@ static void SD_StartBlockTransfer(uint32_t BlockSize, uint32_t NumberOfBlocks, u
 
 static void SD_EnableIDMA(uint32_t *pBuffer)
 {
+    SD_TRACE(SD_TRACE_IDMA, (SD_Handle.Operation >> 1) & 0x01, sdmmc_instance->DLEN / BLOCK_SIZE, pBuffer);
     sdmmc_instance->IDMACTRL  |= SDMMC_IDMA_IDMAEN;                                                 // Enable sdmmc_instance DMA transfer
     sdmmc_instance->IDMABASE0  = (uint32_t) pBuffer;                                                // Configure DMA Stream memory address
 }
 
-/** -----------------------------------------------------------------------------------------------------------------*/
-/**     DataTransferInit
-  *
-  * @brief  Prepare the state machine for transfer
-  * @param  SD_TransferType_e   TransfertDir
-  * @param  SD_CARD_BlockSize_e Size
-  */
-static void SD_DataTransferInit(uint32_t Size, uint32_t DataBlockSize, bool IsItReadFromCard, bool enableDPSM)
-{
-    uint32_t Direction;
-
-    sdmmc_instance->DTIMER = SD_DATATIMEOUT;        // Set the sdmmc_instance Data TimeOut value
-    sdmmc_instance->DLEN   = Size;                  // Set the sdmmc_instance DataLength value
-    Direction      = (IsItReadFromCard == true) ? SDMMC_DCTRL_DTDIR : 0;
-    sdmmc_instance->DCTRL |= DataBlockSize;
-    sdmmc_instance->DCTRL |=  (uint32_t)(Direction | enableDPSM);
-    return;
-}
-
 void SD_MDMA_ReadConfig(uint32_t addr, uint32_t dest, uint32_t len) {
     MDMA_Channel0->CCR = MDMA_PRIORITY_VERY_HIGH | MDMA_LITTLE_ENDIANNESS_PRESERVE;
 
@@ -536,38 +877,61 @@ void SD_MDMA_ReadConfig(uint32_t addr, uint32_t dest, uint32_t len) {
 SD_Error_t SD_ReadBlocks_DMA(uint64_t ReadAddress, uint32_t *buffer, uint32_t BlockSize, uint32_t NumberOfBlocks)
 {
     SD_Error_t ErrorState;
-    uint32_t   CmdIndex;
+    SD_CmdId_t CmdId;
+#ifdef SDMMC_POWER_FAIL
+    uint32_t   Mask;
+#endif
+
+    // Legacy data commands are not allowed while the card holds queued tasks
+    if ((SD_CQ.QueuedMask != 0) || (SD_CQ.Executing != SD_CQ_NO_TASK)) {
+        return SD_BUSY;
+    }
+
+#ifdef SDMMC_SCHED
+    SD_Sched_Preempt();
+#endif
+#ifdef SDMMC_READAHEAD
+    SD_ReadAhead_Preempt();
+#endif
+#ifdef SDMMC_VERIFY
+    SD_Verify_Preempt();
+#endif
+
+#ifdef SDMMC_POWER_FAIL
+    Mask = SD_PowerFail_Mask();
+#endif
+
     SD_Handle.RXCplt = 1;
 
+#ifdef SDMMC_STATS
+    SD_Stats_Begin(&SD_Handle.Stats, SD_STATS_OP_READ, NumberOfBlocks);
+#endif
+    SD_TRACE(SD_TRACE_XFER, SD_TRACE_XFER_READ, NumberOfBlocks, ReadAddress);
+
     assert_param((buffer >= 0x24000000) && (buffer <= (0x24080000)));
 
     //printf("Reading at %ld into %p %ld blocks\n", (uint32_t)ReadAddress, (void*)buffer, NumberOfBlocks);
 
-    if(SD_CardType != SD_HIGH_CAPACITY)
+    if(!SD_BLOCK_ADDRESSED())
     {
         ReadAddress *= 512;
     }
 
-    // Set Block Size for Card
-    ErrorState = SD_TransmitCommand((SD_CMD_SET_BLOCKLEN | SD_CMD_RESPONSE_SHORT), BlockSize, 1);
-
     // Configure the SD DPSM (Data Path State Machine)
     SD_StartBlockTransfer(BlockSize, NumberOfBlocks, SDMMC_DIR_RX);
 
-    // Enable transfer
-    sdmmc_instance->CMD |= SDMMC_CMD_CMDTRANS;
-
     // Enable IDMA
     SD_EnableIDMA(buffer);
 
     // Send CMD18 READ_MULT_BLOCK with argument data address
     // or send CMD17 READ_SINGLE_BLOCK depending on number of block
+    // CMDTRANS in the command word starts the DPSM, CMD16 goes out first only if the block length changed
     uint8_t retries = 10;
-    CmdIndex   = (NumberOfBlocks > 1) ? SD_CMD_READ_MULT_BLOCK : SD_CMD_READ_SINGLE_BLOCK;
+    CmdId      = (NumberOfBlocks > 1) ? SD_CMDID_READ_MULT_BLOCK : SD_CMDID_READ_SINGLE_BLOCK;
     do {
-            ErrorState = SD_TransmitCommand((CmdIndex | SD_CMD_RESPONSE_SHORT), (uint32_t)ReadAddress, 1);
+            ErrorState = SD_TransmitAddressCommand(CmdId, ReadAddress);
             if (ErrorState != SD_OK && retries--) {
-                ErrorState = SD_TransmitCommand((SD_CMD_APP_CMD | SD_CMD_RESPONSE_SHORT), 0, 1);
+                ErrorState = SD_TransmitCommand(SD_CMDID_APP_CMD, 0);
             }
     } while (ErrorState != SD_OK && retries);
 
@@ -575,9 +939,18 @@ SD_Error_t SD_ReadBlocks_DMA(uint64_t ReadAddress, uint32_t *buffer, uint32_t Bl
             SD_Handle.RXCplt = 0;
     }
 
+#ifdef SDMMC_STATS
+    SD_Handle.Stats.Response = DWT->CYCCNT;
+    SD_Handle.Stats.Active   = (ErrorState == SD_OK);
+#endif
+
     // Update the SD transfer error in SD handle
     SD_Handle.TransferError = ErrorState;
 
+#ifdef SDMMC_POWER_FAIL
+    SD_PowerFail_Unmask(Mask);
+#endif
+
     return ErrorState;
 }
 
@@ -598,18 +971,53 @@ SD_Error_t SD_ReadBlocks_DMA(uint64_t ReadAddress, uint32_t *buffer, uint32_t Bl
 SD_Error_t SD_WriteBlocks_DMA(uint64_t WriteAddress, uint32_t *buffer, uint32_t BlockSize, uint32_t NumberOfBlocks)
 {
     SD_Error_t ErrorState;
-    uint32_t   CmdIndex;
+    SD_CmdId_t CmdId;
+#ifdef SDMMC_POWER_FAIL
+    uint32_t   Mask;
+
+    if (!SD_PowerFail_WriteAllowed()) {
+        return SD_POWER_FAIL;
+    }
+#endif
+
+    // Legacy data commands are not allowed while the card holds queued tasks
+    if ((SD_CQ.QueuedMask != 0) || (SD_CQ.Executing != SD_CQ_NO_TASK)) {
+        return SD_BUSY;
+    }
+
+#ifdef SDMMC_SCHED
+    SD_Sched_Preempt();
+#endif
+#ifdef SDMMC_READAHEAD
+    SD_ReadAhead_Preempt();
+    SD_ReadAhead_Invalidate(WriteAddress, NumberOfBlocks);
+#endif
+#ifdef SDMMC_VERIFY
+    SD_Verify_Preempt();
+#endif
+
+#ifdef SDMMC_POWER_FAIL
+    Mask = SD_PowerFail_Mask();
+#endif
+
     SD_Handle.TXCplt = 1;
 
+#ifdef SDMMC_STATS
+    SD_Stats_Begin(&SD_Handle.Stats, SD_STATS_OP_WRITE, NumberOfBlocks);
+#endif
+    SD_TRACE(SD_TRACE_XFER, SD_TRACE_XFER_WRITE, NumberOfBlocks, WriteAddress);
+
     assert_param((buffer >= 0x24000000) && (buffer <= (0x24080000)));
 
-    if(SD_CardType != SD_HIGH_CAPACITY)
+    if(!SD_BLOCK_ADDRESSED())
     {
         WriteAddress *= 512;
     }
 
-    // Set Block Size for Card
-    ErrorState = SD_TransmitCommand((SD_CMD_SET_BLOCKLEN | SD_CMD_RESPONSE_SHORT), BlockSize, 1);
+    // Pre-erase hint, only a performance hint so a card rejecting it still gets the write
+    if ((SD_WriteStrategy == SD_WRITE_PRE_ERASE) && (NumberOfBlocks > 1)) {
+        SD_TransmitCommand(SD_CMDID_APP_PRE_ERASE, NumberOfBlocks & 0x7FFFFF);
+    }
 
     // Set transfer
     SD_StartBlockTransfer(BlockSize, NumberOfBlocks, SDMMC_DIR_TX);
@@ -617,10 +1025,7 @@ SD_Error_t SD_WriteBlocks_DMA(uint64_t WriteAddress, uint32_t *buffer, uint32_t
     // Check number of blocks command
     // Send CMD24 WRITE_SINGLE_BLOCK
     // Send CMD25 WRITE_MULT_BLOCK with argument data address
-    CmdIndex = (NumberOfBlocks > 1) ? SD_CMD_WRITE_MULT_BLOCK : SD_CMD_WRITE_SINGLE_BLOCK;
-
-    // Enable transfer
-    sdmmc_instance->CMD |= SDMMC_CMD_CMDTRANS;
+    CmdId = (NumberOfBlocks > 1) ? SD_CMDID_WRITE_MULT_BLOCK : SD_CMDID_WRITE_SINGLE_BLOCK;
 
     // Enable IDMA
     SD_EnableIDMA(buffer);
@@ -633,15 +1038,24 @@ SD_Error_t SD_WriteBlocks_DMA(uint64_t WriteAddress, uint32_t *buffer, uint32_t
     }
 #endif
 
-    // Set Block Size for Card
+    // CMDTRANS in the command word starts the DPSM, CMD16 goes out first only if the block length changed
     uint8_t retries = 10;
     do {
-            ErrorState = SD_TransmitCommand((CmdIndex | SD_CMD_RESPONSE_SHORT), (uint32_t)WriteAddress, 1);
+            ErrorState = SD_TransmitAddressCommand(CmdId, WriteAddress);
             if (ErrorState != SD_OK && retries--) {
-                ErrorState = SD_TransmitCommand((SD_CMD_APP_CMD | SD_CMD_RESPONSE_SHORT), 0, 1);
+                ErrorState = SD_TransmitCommand(SD_CMDID_APP_CMD, 0);
             }
     } while(ErrorState != SD_OK && retries);
 
+#ifdef SDMMC_STATS
+    SD_Handle.Stats.Response = DWT->CYCCNT;
+    SD_Handle.Stats.Active   = (ErrorState == SD_OK);
+#endif
+
+#ifdef SDMMC_POWER_FAIL
+    SD_PowerFail_Unmask(Mask);
+#endif
+
     if (ErrorState != SD_OK) {
             SD_Handle.TXCplt = 0;
             return ErrorState;
@@ -649,6 +1063,11 @@ SD_Error_t SD_WriteBlocks_DMA(uint64_t WriteAddress, uint32_t *buffer, uint32_t
 
     SD_Handle.TransferError = ErrorState;
 
+#ifdef SDMMC_VERIFY
+    // Checksums are calculated while IDMA is streaming the buffer out
+    SD_Verify_Record(SD_BLOCK_ADDRESSED() ? WriteAddress : (WriteAddress / 512), buffer, NumberOfBlocks);
+#endif
+
     return ErrorState;
 }
 
@@ -657,8 +1076,20 @@ SD_Error_t SD_CheckWrite(void) {
     if (SD_Handle.TXCplt != 0) {
         error = SD_BUSY;
     }
+#ifdef SDMMC_STATS
+    else if (SD_Handle.Stats.Active && (SD_Handle.Stats.Op == SD_STATS_OP_WRITE) && (SD_Handle.Stats.Completion == 0)) {
+        SD_Handle.Stats.Completion = DWT->CYCCNT;   // Finished on busy end in SD_GetStatus
+    }
+#endif
     if (SD_Handle.TransferError) {
+#ifdef SDMMC_STATS
+        SD_Handle.Stats.Active = 0;
+#endif
+#ifdef SDMMC_TRACE
+        SD_TRACE(SD_TRACE_ERROR, SD_TRACE_SITE_CHECKWRITE, SD_Handle.TransferError, sdmmc_instance->STA);
+#else
         printf("SD Card TXError %lu will abort...\n", SD_Handle.TransferError);
+#endif
         if (SD_Abort() == SD_OK) {
             SD_Handle.TXCplt = 0;
         }
@@ -671,8 +1102,20 @@ SD_Error_t SD_CheckRead(void) {
     if (SD_Handle.RXCplt != 0) {
         error = SD_BUSY;
     }
+#ifdef SDMMC_STATS
+    else if (SD_Handle.Stats.Active && (SD_Handle.Stats.Op == SD_STATS_OP_READ) && (SD_Handle.TransferError == SD_OK)) {
+        SD_Stats_Finish(&SD_Handle.Stats, SD_Handle.Stats.DataEnd);
+    }
+#endif
     if (SD_Handle.TransferError) {
+#ifdef SDMMC_STATS
+        SD_Handle.Stats.Active = 0;
+#endif
+#ifdef SDMMC_TRACE
+        SD_TRACE(SD_TRACE_ERROR, SD_TRACE_SITE_CHECKREAD, SD_Handle.TransferError, sdmmc_instance->STA);
+#else
         printf("SD Card RXError %lu will abort...\n", SD_Handle.TransferError);
+#endif
         if (SD_Abort() == SD_OK) {
             SD_Handle.RXCplt = 0;
         }
@@ -680,6 +1123,45 @@ SD_Error_t SD_CheckRead(void) {
     return error;
 }
 
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Tells background users whether the data path is free.
+  * @retval true when no transfer started with SD_ReadBlocks_DMA/SD_WriteBlocks_DMA and no queued task is in flight
+  */
+bool SD_IsIdle(void)
+{
+    return (SD_Handle.RXCplt == 0) && (SD_Handle.TXCplt == 0) &&
+           (SD_CQ.QueuedMask == 0) && (SD_CQ.Executing == SD_CQ_NO_TASK) && (SD_CQ.FlushStep == SD_CACHE_FLUSH_IDLE);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Aborts the transfer started with SD_ReadBlocks_DMA/SD_WriteBlocks_DMA, CMD12 is sent
+  *         if the card is still in a data state.
+  * @retval SD Card error state
+  */
+SD_Error_t SD_AbortTransfer(void)
+{
+    SD_Error_t ErrorState;
+
+    ErrorState = SD_Abort();
+    SD_Handle.RXCplt = 0;
+    SD_Handle.TXCplt = 0;
+#ifdef SDMMC_STATS
+    SD_Handle.Stats.Active = 0;
+#endif
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_Error_t SD_GetTransferError(void)
+{
+    return (SD_Error_t)SD_Handle.TransferError;
+}
+
 /** -----------------------------------------------------------------------------------------------------------------*/
 /**
   * @brief  Erases the specified memory area of the given SD card.
@@ -710,7 +1192,7 @@ SD_Error_t SD_Erase(uint64_t StartAddress, uint64_t EndAddress)
     }
 
     // Get start and end block for high capacity cards
-    if(SD_CardType == SD_HIGH_CAPACITY)
+    if(SD_BLOCK_ADDRESSED())
     {
         StartAddress /= 512;
         EndAddress   /= 512;
@@ -718,23 +1200,23 @@ SD_Error_t SD_Erase(uint64_t StartAddress, uint64_t EndAddress)
 
     // According to sd-card spec 1.0 ERASE_GROUP_START (CMD32) and erase_group_end(CMD33)
     if ((SD_CardType == SD_STD_CAPACITY_V1_1) || (SD_CardType == SD_STD_CAPACITY_V2_0) ||
-        (SD_CardType == SD_HIGH_CAPACITY))
+        SD_BLOCK_ADDRESSED())
     {
         // Send CMD32 SD_ERASE_GRP_START with argument as addr
-        if((ErrorState = SD_TransmitCommand((SD_CMD_SD_ERASE_GRP_START | SDMMC_CMD_RESPONSE_SHORT), (uint32_t)StartAddress, 1)) != SD_OK)
+        if((ErrorState = SD_TransmitAddressCommand(SD_CMDID_ERASE_GRP_START, StartAddress)) != SD_OK)
         {
             return ErrorState;
         }
 
         // Send CMD33 SD_ERASE_GRP_END with argument as addr
-        if((ErrorState = SD_TransmitCommand((SD_CMD_SD_ERASE_GRP_END | SDMMC_CMD_RESPONSE_SHORT), (uint32_t)EndAddress, 1)) != SD_OK)
+        if((ErrorState = SD_TransmitAddressCommand(SD_CMDID_ERASE_GRP_END, EndAddress)) != SD_OK)
         {
             return ErrorState;
         }
     }
 
     // Send CMD38 ERASE
-    if((ErrorState = SD_TransmitCommand((SD_CMD_ERASE | SDMMC_CMD_RESPONSE_SHORT), 0, 1)) != SD_OK)
+    if((ErrorState = SD_TransmitCommand(SD_CMDID_ERASE, 0)) != SD_OK)
     {
         return ErrorState;
     }
@@ -832,11 +1314,19 @@ SD_Error_t SD_GetCardInfo(void)
         SD_CardInfo.CardBlockSize = 1 << (SD_CardInfo.SD_csd.RdBlockLen);
         SD_CardInfo.CardCapacity *= SD_CardInfo.CardBlockSize;
     }
-    else if(SD_CardType == SD_HIGH_CAPACITY)
+    else if(SD_BLOCK_ADDRESSED())
     {
-        // Byte 7
+        // Byte 7, C_SIZE is 22 bits for CSD 2.0 and 28 bits for CSD 3.0 (SDUC)
         Temp = (uint8_t)(SD_Handle.CSD[1] & 0x000000FF);
-        SD_CardInfo.SD_csd.DeviceSize = (Temp & 0x3F) << 16;
+        if(SD_CardInfo.SD_csd.CSDStruct == SD_CSD_STRUCT_V3)
+        {
+            SD_CardInfo.SD_csd.DeviceSize = (((SD_Handle.CSD[1] & 0x0000FF00) >> 8) & 0x0F) << 24;
+            SD_CardInfo.SD_csd.DeviceSize |= Temp << 16;
+        }
+        else
+        {
+            SD_CardInfo.SD_csd.DeviceSize = (Temp & 0x3F) << 16;
+        }
 
         // Byte 8
         Temp = (uint8_t)((SD_Handle.CSD[2] & 0xFF000000) >> 24);
@@ -966,6 +1456,22 @@ SD_Error_t SD_GetCardInfo(void)
 }
 
 
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Card size in 512 byte blocks, whatever addressing the card uses.
+  * @retval Number of blocks
+  */
+uint64_t SD_GetBlockCount(void)
+{
+    if(SD_BLOCK_ADDRESSED())
+    {
+        return SD_CardInfo.CardCapacity;
+    }
+
+    return SD_CardInfo.CardCapacity / BLOCK_SIZE;
+}
+
+
 /** -----------------------------------------------------------------------------------------------------------------*/
 /**
   * @brief  Enables wide bus operation for the requested card if supported by
@@ -984,7 +1490,7 @@ static SD_Error_t SD_WideBusOperationConfig(uint32_t WideMode)
     uint32_t   SCR[2] = {0, 0};
 
     if((SD_CardType == SD_STD_CAPACITY_V1_1) || (SD_CardType == SD_STD_CAPACITY_V2_0) ||\
-            (SD_CardType == SD_HIGH_CAPACITY))
+            SD_BLOCK_ADDRESSED())
     {
         if(WideMode == SD_BUS_WIDE_8B)
         {
@@ -1004,15 +1510,10 @@ static SD_Error_t SD_WideBusOperationConfig(uint32_t WideMode)
                     // If requested card supports wide bus operation
                     if((SCR[1] & Temp) != SD_ALLZERO)
                     {
-                        // Send CMD55 APP_CMD with argument as card's RCA.
-                            ErrorState = SD_TransmitCommand((SD_CMD_APP_CMD | SD_CMD_RESPONSE_SHORT), SD_CardRCA, 1);
-                        if(ErrorState == SD_OK)
-                        {
-                            Temp = (WideMode == SD_BUS_WIDE_4B) ? 2 : 0;
-
-                            // Send ACMD6 APP_CMD with argument as 2 for wide bus mode
-                            ErrorState =  SD_TransmitCommand((SD_CMD_APP_SD_SET_BUSWIDTH | SD_CMD_RESPONSE_SHORT), Temp, 1);
-                        }
+                        Temp = (WideMode == SD_BUS_WIDE_4B) ? 2 : 0;
+
+                        // Send ACMD6 APP_CMD with argument as 2 for wide bus mode, CMD55 goes out first
+                        ErrorState =  SD_TransmitCommand(SD_CMDID_APP_SET_BUSWIDTH, Temp);
                     }
                     else
                     {
@@ -1077,17 +1578,8 @@ SD_Error_t HAL_SD_HighSpeed(void)
 
     if(SD_SPEC != SD_ALLZERO)
     {
-        // Set Block Size for Card
-        if((ErrorState = SD_TransmitCommand((SD_CMD_SET_BLOCKLEN | SDMMC_CMD_RESPONSE_SHORT), 64, 1)) != SD_OK)
-        {
-            return ErrorState;
-        }
-
-        // Configure the SD DPSM (Data Path State Machine)
-        SD_DataTransferInit(64, SDMMC_DATABLOCK_SIZE_64B, true);
-
-        // Send CMD6 switch mode
-        if((ErrorState =SD_TransmitCommand((SD_CMD_HS_SWITCH | SDMMC_CMD_RESPONSE_SHORT), 0x80FFFF01, 1)) != SD_OK)
+        // Send CMD6 switch mode, 64 byte status block read through the FIFO
+        if((ErrorState = SD_TransmitCommand(SD_CMDID_SWITCH_FUNC, 0x80FFFF01)) != SD_OK)
         {
             return ErrorState;
         }
@@ -1144,11 +1636,19 @@ SD_Error_t SD_GetStatus(void)
 
 
     // Send Status command
-    if((ErrorState = SD_TransmitCommand((SD_CMD_SEND_STATUS | SD_CMD_RESPONSE_SHORT), SD_CardRCA, 1)) == SD_OK)
+    if((ErrorState = SD_TransmitCommand(SD_CMDID_SEND_STATUS, SD_CardRCA)) == SD_OK)
     {
         Response1 = sdmmc_instance->RESP1;
         CardState = (SD_CardState_t)((Response1 >> 9) & 0x0F);
 
+#ifdef SDMMC_STATS
+        // Write is over once card leaves programming and caller has seen DATAEND
+        if ((CardState == SD_CARD_TRANSFER) && SD_Handle.Stats.Active &&
+            (SD_Handle.Stats.Op == SD_STATS_OP_WRITE) && (SD_Handle.Stats.Completion != 0)) {
+            SD_Stats_Finish(&SD_Handle.Stats, DWT->CYCCNT);
+        }
+#endif
+
         // Find SD status according to card state
         if     (CardState == SD_CARD_TRANSFER)  ErrorState = SD_OK;
         else if(CardState == SD_CARD_ERROR)     ErrorState = SD_ERROR;
@@ -1165,6 +1665,8 @@ SD_Error_t SD_GetStatus(void)
 static SD_Error_t SD_Abort(void) {
     SD_Error_t error = SD_OK;
 
+    SD_TRACE(SD_TRACE_STA, SD_TRACE_SITE_ABORT, 0, sdmmc_instance->STA);
+
     // Disable all sdmmc_instance peripheral interrupt sources
     sdmmc_instance->MASK &= ~(SDMMC_MASK_DCRCFAILIE | SDMMC_MASK_DTIMEOUTIE
             | SDMMC_MASK_DATAENDIE |
@@ -1178,7 +1680,7 @@ static SD_Error_t SD_Abort(void) {
     sdmmc_instance->IDMACTRL &= ~SDMMC_IDMA_IDMAEN;
 
     if (SD_GetStatus() == SD_BUSY) {
-        error = SD_TransmitCommand((SDMMC_CMD_STOP_TRANSMISSION | SDMMC_RESPONSE_SHORT), 0, 1);
+        error = SD_TransmitCommand(SD_CMDID_STOP_TRANSMISSION, 0);
     }
     return error;
 }
@@ -1202,23 +1704,8 @@ SD_Error_t SD_GetCardStatus(SD_CardStatus_t* pCardStatus)
         return SD_LOCK_UNLOCK_FAILED;
     }
 
-    // Set block size for card if it is not equal to current block size for card
-    if((ErrorState = SD_TransmitCommand((SD_CMD_SET_BLOCKLEN | SD_CMD_RESPONSE_SHORT), 64, 1)) != SD_OK)
-    {
-        return ErrorState;
-    }
-
-    // Send CMD55
-    if((ErrorState = SD_TransmitCommand((SD_CMD_APP_CMD | SD_CMD_RESPONSE_SHORT), SD_CardRCA, 1)) != SD_OK)
-    {
-        return ErrorState;
-    }
-
-    // Configure the SD DPSM (Data Path State Machine)
-    SD_DataTransferInit(64, SD_DATABLOCK_SIZE_64B, true, true);
-
-    // Send ACMD13 (SD_APP_STAUS)  with argument as card's RCA
-    if((ErrorState = SD_TransmitCommand((SD_CMD_SD_APP_STATUS | SD_CMD_RESPONSE_SHORT), 0, 1)) != SD_OK)
+    // Send ACMD13 (SD_APP_STAUS), the engine sets 64 byte blocks, sends CMD55 and arms the DPSM
+    if((ErrorState = SD_TransmitCommand(SD_CMDID_APP_SD_STATUS, 0)) != SD_OK)
     {
         return ErrorState;
     }
@@ -1345,8 +1832,10 @@ static SD_Error_t SD_PowerON(void)
     HAL_Delay(2);
 
     // CMD0: GO_IDLE_STATE -----------------------------------------------------
-    // No CMD response required
-    if((ErrorState = SD_TransmitCommand(SD_CMD_GO_IDLE_STATE, 0, 0)) != SD_OK)
+    // No CMD response required, card forgets its RCA and block length
+    SD_CardRCA  = 0;
+    SD_BlockLen = 0;
+    if((ErrorState = SD_TransmitCommand(SD_CMDID_GO_IDLE_STATE, 0)) != SD_OK)
     {
         // CMD Response Timeout (wait for CMDSENT flag)
         return ErrorState;
@@ -1358,30 +1847,24 @@ static SD_Error_t SD_PowerON(void)
     //- [11:8]: Supply Voltage (VHS) 0x1 (Range: 2.7-3.6 V)
     //- [7:0]: Check Pattern (recommended 0xAA)
     // CMD Response: R7 */
-    if((ErrorState = SD_TransmitCommand((SD_CMD_HS_SEND_EXT_CSD | SD_CMD_RESPONSE_SHORT), SD_CHECK_PATTERN, 7)) == SD_OK)
+    if((ErrorState = SD_TransmitCommand(SD_CMDID_SEND_IF_COND, SD_CHECK_PATTERN)) == SD_OK)
     {
-        // SD Card 2.0
+        // SD Card 2.0, host supports SDHC/SDXC and SDUC
         SD_CardType = SD_STD_CAPACITY_V2_0;
-        SD_Type     = SD_RESP_HIGH_CAPACITY;
+        SD_Type     = SD_RESP_HIGH_CAPACITY | SD_RESP_ULTRA_CAPACITY;
     }
 
     // Send CMD55
     // If ErrorState is Command Timeout, it is a MMC card
     // If ErrorState is SD_OK it is a SD card: SD card 2.0 (voltage range mismatch) or SD card 1.x
-    if((ErrorState = SD_TransmitCommand((SD_CMD_APP_CMD | SD_CMD_RESPONSE_SHORT), 0, 1)) == SD_OK)
+    if((ErrorState = SD_TransmitCommand(SD_CMDID_APP_CMD, 0)) == SD_OK)
     {
         // SD CARD
         // Send ACMD41 SD_APP_OP_COND with Argument 0x80100000
         while((ValidVoltage == 0) && (Count < SD_MAX_VOLT_TRIAL))
         {
-            // SEND CMD55 APP_CMD with RCA as 0
-            if((ErrorState = SD_TransmitCommand((SD_CMD_APP_CMD | SD_CMD_RESPONSE_SHORT), 0, 1)) != SD_OK)
-            {
-                return ErrorState;
-            }
-
-            // Send CMD41
-            if((ErrorState = SD_TransmitCommand((SD_CMD_SD_APP_OP_COND | SD_CMD_RESPONSE_SHORT), SD_VOLTAGE_WINDOW_SD | SD_Type, 3)) != SD_OK)
+            // Send ACMD41, preceded by CMD55 with RCA still 0
+            if((ErrorState = SD_TransmitCommand(SD_CMDID_APP_OP_COND, SD_VOLTAGE_WINDOW_SD | SD_Type)) != SD_OK)
             {
                 return ErrorState;
             }
@@ -1396,7 +1879,11 @@ static SD_Error_t SD_PowerON(void)
             return SD_INVALID_VOLTRANGE;
         }
 
-        if((Response & SD_RESP_HIGH_CAPACITY) == SD_RESP_HIGH_CAPACITY)
+        if((Response & SD_RESP_ULTRA_CAPACITY) == SD_RESP_ULTRA_CAPACITY)
+        {
+            SD_CardType = SD_ULTRA_CAPACITY;
+        }
+        else if((Response & SD_RESP_HIGH_CAPACITY) == SD_RESP_HIGH_CAPACITY)
         {
             SD_CardType = SD_HIGH_CAPACITY;
         }
@@ -1432,40 +1919,29 @@ static SD_Error_t SD_FindSCR(uint32_t *pSCR)
     uint32_t Index = 0;
     uint32_t tempscr[2] = {0, 0};
 
-    // Set Block Size To 8 Bytes
-    // Send CMD55 APP_CMD with argument as card's RCA
-    if((ErrorState = SD_TransmitCommand((SD_CMD_SET_BLOCKLEN | SD_CMD_RESPONSE_SHORT), 8, 1)) == SD_OK)
+    // Send ACMD51 SD_APP_SEND_SCR with argument as 0
+    // Block size goes to 8 bytes and CMD55 APP_CMD with the card's RCA is sent first
+    if((ErrorState = SD_TransmitCommand(SD_CMDID_APP_SEND_SCR, 0)) == SD_OK)
     {
-        // Send CMD55 APP_CMD with argument as card's RCA
-        if((ErrorState = SD_TransmitCommand((SD_CMD_APP_CMD | SD_CMD_RESPONSE_SHORT), SD_CardRCA, 1)) == SD_OK)
+        while((sdmmc_instance->STA & (SDMMC_STA_RXOVERR | SDMMC_STA_DCRCFAIL | SDMMC_STA_DTIMEOUT | SDMMC_STA_DBCKEND | SDMMC_STA_DATAEND)) == 0)
         {
-            SD_DataTransferInit(8, SD_DATABLOCK_SIZE_8B, true, true);
-
-            // Send ACMD51 SD_APP_SEND_SCR with argument as 0
-            if((ErrorState = SD_TransmitCommand((SD_CMD_SD_APP_SEND_SCR | SD_CMD_RESPONSE_SHORT), 0, 1)) == SD_OK)
+            if((sdmmc_instance->STA & SDMMC_STA_RXFIFOE) == 0)
             {
-                while((sdmmc_instance->STA & (SDMMC_STA_RXOVERR | SDMMC_STA_DCRCFAIL | SDMMC_STA_DTIMEOUT | SDMMC_STA_DBCKEND | SDMMC_STA_DATAEND)) == 0)
-                {
-                    if((sdmmc_instance->STA & SDMMC_STA_RXFIFOE) == 0)
-                    {
-                        *(tempscr + Index) = sdmmc_instance->FIFO;
-                        Index++;
-                    }
-                }
-
-                if     ((sdmmc_instance->STA & SDMMC_STA_DTIMEOUT) != 0) ErrorState = SD_DATA_TIMEOUT;
-                else if((sdmmc_instance->STA & SDMMC_STA_DCRCFAIL) != 0) ErrorState = SD_DATA_CRC_FAIL;
-                else if((sdmmc_instance->STA & SDMMC_STA_RXOVERR)  != 0) ErrorState = SD_RX_OVERRUN;
-                else
-                {
-                    *(pSCR + 1) = ((tempscr[0] & SD_0TO7BITS) << 24)  | ((tempscr[0] & SD_8TO15BITS) << 8) |
-                                  ((tempscr[0] & SD_16TO23BITS) >> 8) | ((tempscr[0] & SD_24TO31BITS) >> 24);
+                *(tempscr + Index) = sdmmc_instance->FIFO;
+                Index++;
+            }
+        }
 
-                    *(pSCR) = ((tempscr[1] & SD_0TO7BITS) << 24)  | ((tempscr[1] & SD_8TO15BITS) << 8) |
-                              ((tempscr[1] & SD_16TO23BITS) >> 8) | ((tempscr[1] & SD_24TO31BITS) >> 24);
-                }
+        if     ((sdmmc_instance->STA & SDMMC_STA_DTIMEOUT) != 0) ErrorState = SD_DATA_TIMEOUT;
+        else if((sdmmc_instance->STA & SDMMC_STA_DCRCFAIL) != 0) ErrorState = SD_DATA_CRC_FAIL;
+        else if((sdmmc_instance->STA & SDMMC_STA_RXOVERR)  != 0) ErrorState = SD_RX_OVERRUN;
+        else
+        {
+            *(pSCR + 1) = ((tempscr[0] & SD_0TO7BITS) << 24)  | ((tempscr[0] & SD_8TO15BITS) << 8) |
+                          ((tempscr[0] & SD_16TO23BITS) >> 8) | ((tempscr[0] & SD_24TO31BITS) >> 24);
 
-            }
+            *(pSCR) = ((tempscr[1] & SD_0TO7BITS) << 24)  | ((tempscr[1] & SD_8TO15BITS) << 8) |
+                      ((tempscr[1] & SD_16TO23BITS) >> 8) | ((tempscr[1] & SD_24TO31BITS) >> 24);
         }
     }
 
@@ -1484,7 +1960,7 @@ static SD_Error_t SD_IsCardProgramming(uint8_t *pStatus)
 {
     uint32_t Response_R1;
 
-    SD_TransmitCommand((SD_CMD_SEND_STATUS | SDMMC_CMD_RESPONSE_SHORT), SD_CardRCA, 0);
+    SD_TransmitCommand(SD_CMDID_SEND_STATUS, SD_CardRCA);
     if((sdmmc_instance->STA & SDMMC_STA_CTIMEOUT) != 0)         return SD_CMD_RSP_TIMEOUT;
     else if((sdmmc_instance->STA & SDMMC_STA_CCRCFAIL) != 0)    return SD_CMD_CRC_FAIL;
     if((uint32_t)sdmmc_instance->RESPCMD != SD_CMD_SEND_STATUS) return SD_ILLEGAL_CMD;  // Check if is of desired command
@@ -1497,13 +1973,766 @@ static SD_Error_t SD_IsCardProgramming(uint8_t *pStatus)
 
 /** -----------------------------------------------------------------------------------------------------------------*/
 /**
-  * @brief  Initialize the sdmmc_instance module, DMA, and IO
+  * @brief  Moves one 512 byte extension register block between the card and SD_ExtRegBuffer
+  *         through IDMA and waits for it to finish.
+  * @param  CmdId: SD_CMDID_READ_EXTR_SINGLE or SD_CMDID_WRITE_EXTR_SINGLE
+  * @param  Argument: CMD48/CMD49 argument
+  * @param  dir: SDMMC_DIR_RX or SDMMC_DIR_TX
+  * @retval SD Card error state
   */
-void SD_Initialize_LL(SDMMC_TypeDef *sdmmc)
+static SD_Error_t SD_ExtRegisterTransfer(SD_CmdId_t CmdId, uint32_t Argument, uint8_t dir)
 {
-    sdmmc_instance = sdmmc;
+    SD_Error_t        ErrorState;
+    volatile uint32_t *pCplt = (dir == SDMMC_DIR_RX) ? &SD_Handle.RXCplt : &SD_Handle.TXCplt;
+    uint32_t          TimeOut = SD_SOFTWARE_COMMAND_TIMEOUT;
 
-     // Reset sdmmc_instance Module
+    if ((SD_CQ.QueuedMask != 0) || (SD_CQ.Executing != SD_CQ_NO_TASK)) {
+        return SD_BUSY;
+    }
+
+    *pCplt = 1;
+    SD_StartBlockTransfer(BLOCK_SIZE, 1, dir);
+    SD_EnableIDMA((uint32_t*)SD_ExtRegBuffer);
+
+#ifdef SDMMC_CACHE_MAINTANANCE
+    if ((dir == SDMMC_DIR_TX) && (SCB->CCR & SCB_CCR_DC_Msk)) {
+        SCB_CleanDCache_by_Addr((uint32_t*)SD_ExtRegBuffer, sizeof(SD_ExtRegBuffer));
+    }
+#endif
+
+    if ((ErrorState = SD_TransmitCommand(CmdId, Argument)) != SD_OK) {
+        *pCplt = 0;
+        SD_Abort();
+        return ErrorState;
+    }
+
+    while ((*pCplt != 0) && (SD_Handle.TransferError == SD_OK) && (--TimeOut > 0));
+
+    if (SD_Handle.TransferError != SD_OK) {
+        ErrorState = (SD_Error_t)SD_Handle.TransferError;
+        SD_Abort();
+        *pCplt = 0;
+        return ErrorState;
+    }
+    if (TimeOut == 0) {
+        SD_Abort();
+        *pCplt = 0;
+        return SD_DATA_TIMEOUT;
+    }
+
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads extension register bytes into SD_ExtRegBuffer (CMD48).
+  * @param  FNO: Function number
+  * @param  Page: Page number inside the function
+  * @param  Offset: Byte offset inside the page
+  * @param  Length: Number of bytes to read (1..512)
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_ExtRead(uint8_t FNO, uint8_t Page, uint16_t Offset, uint16_t Length)
+{
+    uint32_t Argument;
+
+    if ((Length == 0) || ((Offset + Length) > BLOCK_SIZE)) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    // [31] MIO = 0 (memory), [30:27] FNO, [25:18] page, [17:9] offset, [8:0] length - 1
+    Argument = ((uint32_t)(FNO & 0x0F) << 27) | ((uint32_t)Page << 18) | ((uint32_t)Offset << 9) | (Length - 1);
+
+    return SD_ExtRegisterTransfer(SD_CMDID_READ_EXTR_SINGLE, Argument, SDMMC_DIR_RX);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Writes the first bytes of SD_ExtRegBuffer to an extension register (CMD49) and waits until
+  *         the card applied the value.
+  * @param  FNO: Function number
+  * @param  Page: Page number inside the function
+  * @param  Offset: Byte offset inside the page
+  * @param  LengthOrMask: Number of bytes (1..512), or bit mask when MaskWrite is set
+  * @param  MaskWrite: Only bits set in LengthOrMask of the byte at Offset are written
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_ExtWrite(uint8_t FNO, uint8_t Page, uint16_t Offset, uint16_t LengthOrMask, bool MaskWrite)
+{
+    SD_Error_t ErrorState;
+    uint32_t   TimeOut = SD_SOFTWARE_COMMAND_TIMEOUT;
+
+    if ((ErrorState = SD_ExtWriteStart(FNO, Page, Offset, LengthOrMask, MaskWrite)) != SD_OK) {
+        return ErrorState;
+    }
+
+    // Register writes keep DAT0 busy until the card has applied the value
+    while (((ErrorState = SD_GetStatus()) == SD_BUSY) && (--TimeOut > 0));
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Transfers a register write like SD_ExtWrite(), without waiting for the card to apply it.
+  */
+static SD_Error_t SD_ExtWriteStart(uint8_t FNO, uint8_t Page, uint16_t Offset, uint16_t LengthOrMask, bool MaskWrite)
+{
+    uint32_t Argument;
+
+    if (MaskWrite) {
+        if ((Offset >= BLOCK_SIZE) || (LengthOrMask > 0xFF)) {
+            return SD_INVALID_PARAMETER;
+        }
+        LengthOrMask &= 0xFF;
+    } else {
+        if ((LengthOrMask == 0) || ((Offset + LengthOrMask) > BLOCK_SIZE)) {
+            return SD_INVALID_PARAMETER;
+        }
+        LengthOrMask -= 1;
+    }
+
+    // [31] MIO = 0 (memory), [30:27] FNO, [26] MW, [25:18] page, [17:9] offset, [8:0] length - 1 or mask
+    Argument = ((uint32_t)(FNO & 0x0F) << 27) | ((MaskWrite ? 1UL : 0UL) << 26) |
+               ((uint32_t)Page << 18) | ((uint32_t)Offset << 9) | LengthOrMask;
+
+    return SD_ExtRegisterTransfer(SD_CMDID_WRITE_EXTR_SINGLE, Argument, SDMMC_DIR_TX);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Writes a single byte of the performance enhancement register.
+  */
+static SD_Error_t SD_PerfWriteByte(uint16_t Offset, uint8_t Value)
+{
+    memset(SD_ExtRegBuffer, 0, sizeof(SD_ExtRegBuffer));
+    SD_ExtRegBuffer[0] = Value;
+
+    return SD_ExtWrite(SD_ExtInfo.Perf.FNO, SD_ExtInfo.Perf.Page, SD_ExtInfo.Perf.Offset + Offset, 1, false);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads the used part of the performance enhancement register into SD_ExtRegBuffer, the fields
+  *         are then found at their SD_EXT_PERF_ offsets.
+  */
+static SD_Error_t SD_PerfRead(void)
+{
+    return SD_ExtRead(SD_ExtInfo.Perf.FNO, SD_ExtInfo.Perf.Page, SD_ExtInfo.Perf.Offset, SD_EXT_PERF_LENGTH);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Reads extension register bytes (CMD48).
+  * @param  FNO: Function number
+  * @param  Page: Page number inside the function
+  * @param  Offset: Byte offset inside the page
+  * @param  Length: Number of bytes to read, Offset + Length must stay inside the 512 byte page
+  * @param  pData: Destination, any memory
+  * @retval SD Card error state
+  */
+SD_Error_t SD_ReadExtRegister(uint8_t FNO, uint8_t Page, uint16_t Offset, uint16_t Length, uint8_t *pData)
+{
+    SD_Error_t ErrorState;
+
+    if ((ErrorState = SD_ExtRead(FNO, Page, Offset, Length)) == SD_OK) {
+        memcpy(pData, SD_ExtRegBuffer, Length);
+    }
+
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Writes extension register bytes (CMD49) and waits until card is back in transfer state.
+  * @param  FNO: Function number
+  * @param  Page: Page number inside the function
+  * @param  Offset: Byte offset inside the page
+  * @param  pData: Source, any memory
+  * @param  Length: Number of bytes to write, Offset + Length must stay inside the 512 byte page
+  * @retval SD Card error state
+  */
+SD_Error_t SD_WriteExtRegister(uint8_t FNO, uint8_t Page, uint16_t Offset, const uint8_t *pData, uint16_t Length)
+{
+    if ((Length == 0) || (Length > BLOCK_SIZE)) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    memset(SD_ExtRegBuffer, 0, sizeof(SD_ExtRegBuffer));
+    memcpy(SD_ExtRegBuffer, pData, Length);
+
+    return SD_ExtWrite(FNO, Page, Offset, Length, false);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Read-modify-write of one extension register byte done by the card (CMD49 mask write).
+  * @param  Mask: Bits of the register byte to change
+  * @param  Value: New value of the masked bits
+  * @retval SD Card error state
+  */
+SD_Error_t SD_WriteExtRegisterMasked(uint8_t FNO, uint8_t Page, uint16_t Offset, uint8_t Mask, uint8_t Value)
+{
+    memset(SD_ExtRegBuffer, 0, sizeof(SD_ExtRegBuffer));
+    SD_ExtRegBuffer[0] = Value;
+
+    return SD_ExtWrite(FNO, Page, Offset, Mask, true);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Parses the general information page (FNO 0, page 0) into SD_ExtInfo and reads
+  *         the capabilities of the performance enhancement function when present.
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_ReadExtInfo(void)
+{
+    SD_Error_t ErrorState;
+    uint32_t   Next;
+    uint32_t   RegAddress;
+
+    memset(&SD_ExtInfo, 0, sizeof(SD_ExtInfo));
+    memset(&SD_CQ, 0, sizeof(SD_CQ));
+    SD_CQ.Executing = SD_CQ_NO_TASK;
+
+    if ((SD_Handle.SCR[1] & SD_SCR_CMD48_SUPPORT) == 0) {
+        return SD_UNSUPPORTED_FEATURE;
+    }
+
+    if ((ErrorState = SD_ExtRead(0, 0, 0, BLOCK_SIZE)) != SD_OK) {
+        return ErrorState;
+    }
+
+    SD_ExtInfo.Revision           = SD_ExtRegBuffer[0] | (SD_ExtRegBuffer[1] << 8);
+    SD_ExtInfo.Length             = SD_ExtRegBuffer[2] | (SD_ExtRegBuffer[3] << 8);
+    SD_ExtInfo.NumberOfExtensions = SD_ExtRegBuffer[4];
+    if ((SD_ExtInfo.Revision != 0) || (SD_ExtInfo.Length > BLOCK_SIZE)) {
+        return SD_UNSUPPORTED_FEATURE;
+    }
+
+    // First descriptor follows the 16 byte header, the rest are linked through their next pointer
+    Next = SD_EXT_GENERAL_INFO_HDR_LEN;
+    for (uint8_t i = 0; (i < SD_ExtInfo.NumberOfExtensions) && (Next != 0) &&
+                        ((Next + SD_EXT_DESCRIPTOR_LEN) <= BLOCK_SIZE); i++) {
+        uint8_t          *pExt = &SD_ExtRegBuffer[Next];
+        SD_ExtFunction_t *pFunction;
+
+        Next = pExt[40] | (pExt[41] << 8);
+
+        // Only single register set extensions are defined by standard functions
+        if ((pExt[42] != 1) || (SD_ExtInfo.NumberOfFunctions >= SD_EXT_MAX_FUNCTIONS)) {
+            continue;
+        }
+
+        RegAddress        = pExt[44] | (pExt[45] << 8) | (pExt[46] << 16) | ((uint32_t)pExt[47] << 24);
+        pFunction         = &SD_ExtInfo.Functions[SD_ExtInfo.NumberOfFunctions++];
+        pFunction->SFC    = pExt[0] | (pExt[1] << 8);
+        pFunction->Offset = RegAddress & 0x1FF;
+        pFunction->Page   = (RegAddress >> 9) & 0xFF;
+        pFunction->FNO    = (RegAddress >> 18) & 0x0F;
+
+        // A register running past the end of its page cannot be read in one go, leave it alone
+        if ((pFunction->SFC == SD_EXT_SFC_PERFORMANCE) && ((pFunction->Offset + SD_EXT_PERF_LENGTH) <= BLOCK_SIZE)) {
+            SD_ExtInfo.Perf.FNO    = pFunction->FNO;
+            SD_ExtInfo.Perf.Page   = pFunction->Page;
+            SD_ExtInfo.Perf.Offset = pFunction->Offset;
+            SD_ExtInfo.Perf.Present = true;
+        }
+    }
+
+    if (!SD_ExtInfo.Perf.Present) {
+        return SD_OK;
+    }
+
+    if ((ErrorState = SD_PerfRead()) != SD_OK) {
+        return ErrorState;
+    }
+
+    SD_ExtInfo.Perf.Revision        = SD_ExtRegBuffer[SD_EXT_PERF_REVISION];
+    SD_ExtInfo.Perf.FxEvent         = (SD_ExtRegBuffer[SD_EXT_PERF_FX_EVENT]    & 0x01) != 0;
+    SD_ExtInfo.Perf.CardMaintenance = (SD_ExtRegBuffer[SD_EXT_PERF_MAINTENANCE] & 0x01) != 0;
+    SD_ExtInfo.Perf.HostMaintenance = (SD_ExtRegBuffer[SD_EXT_PERF_MAINTENANCE] & 0x02) != 0;
+    SD_ExtInfo.Perf.Cache           = (SD_ExtRegBuffer[SD_EXT_PERF_CACHE]       & 0x01) != 0;
+    SD_ExtInfo.Perf.CacheEnabled    = (SD_ExtRegBuffer[SD_EXT_PERF_CACHE_ENABLE] & 0x01) != 0;
+
+    // Queue depth N - 1 in bits 4:0, zero means no command queue
+    if ((SD_ExtRegBuffer[SD_EXT_PERF_QUEUE_DEPTH] & 0x1F) != 0) {
+        SD_ExtInfo.Perf.QueueDepth = (SD_ExtRegBuffer[SD_EXT_PERF_QUEUE_DEPTH] & 0x1F) + 1;
+        SD_CQ.Depth     = SD_ExtInfo.Perf.QueueDepth;
+        SD_CQ.Supported = true;
+        SD_CQ.Enabled   = (SD_ExtRegBuffer[SD_EXT_PERF_CQ_ENABLE] & 0x01) != 0;
+    }
+
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+const SD_ExtInfo_t *SD_GetExtInfo(void)
+{
+    return &SD_ExtInfo;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Enables or disables the card volatile write cache.
+  * @note   Cache content is lost on power loss, use SD_CardCacheFlush() before cutting power.
+  *         Card clears the enable bit on every power cycle and CMD0.
+  * @retval SD Card error state
+  */
+SD_Error_t SD_CardCacheEnable(bool Enable)
+{
+    SD_Error_t ErrorState;
+
+    if (!SD_ExtInfo.Perf.Cache) {
+        return SD_UNSUPPORTED_FEATURE;
+    }
+    if ((SD_CQ.QueuedMask != 0) || (SD_CQ.Executing != SD_CQ_NO_TASK)) {
+        return SD_BUSY;
+    }
+
+    // Dirty data has to reach the flash before the cache goes away
+    if (!Enable && SD_ExtInfo.Perf.CacheEnabled) {
+        if ((ErrorState = SD_CardCacheFlush()) != SD_OK) {
+            return ErrorState;
+        }
+    }
+
+    if ((ErrorState = SD_PerfWriteByte(SD_EXT_PERF_CACHE_ENABLE, Enable ? 0x01 : 0x00)) != SD_OK) {
+        return ErrorState;
+    }
+
+    if ((ErrorState = SD_PerfRead()) != SD_OK) {
+        return ErrorState;
+    }
+    SD_ExtInfo.Perf.CacheEnabled = (SD_ExtRegBuffer[SD_EXT_PERF_CACHE_ENABLE] & 0x01) != 0;
+
+    return (SD_ExtInfo.Perf.CacheEnabled == Enable) ? SD_OK : SD_SDMMC_FUNCTION_FAILED;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+bool SD_CardCacheIsEnabled(void)
+{
+    return SD_ExtInfo.Perf.CacheEnabled;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Writes the card volatile cache back to flash and waits for it, see SD_CardCacheFlushStart().
+  *         A flush already in progress is finished first, it may not cover everything written since.
+  * @retval SD Card error state
+  */
+SD_Error_t SD_CardCacheFlush(void)
+{
+    SD_Error_t ErrorState;
+
+    while (SD_CardCacheFlushPoll() == SD_BUSY);
+
+    if ((ErrorState = SD_CardCacheFlushStart()) != SD_OK) {
+        return ErrorState;
+    }
+    while ((ErrorState = SD_CardCacheFlushPoll()) == SD_BUSY);
+
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Starts writing the card volatile cache back to flash, SD_CardCacheFlushPoll() then advances
+  *         it. Tasks queued before the call are executed first and new tasks are refused with SD_BUSY
+  *         until the flush finished, so the flush is an ordering point for queued writes.
+  * @retval SD Card error state, SD_BUSY while another flush is in progress
+  */
+SD_Error_t SD_CardCacheFlushStart(void)
+{
+    if (SD_CQ.FlushStep != SD_CACHE_FLUSH_IDLE) {
+        return SD_BUSY;
+    }
+    if (!SD_ExtInfo.Perf.CacheEnabled) {
+        return SD_OK;
+    }
+
+    SD_CQ.FlushPending = true;
+    SD_CQ.FlushStep    = SD_CACHE_FLUSH_DRAIN;
+    SD_CQ.FlushStart   = HAL_GetTick();
+
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Advances the flush started by SD_CardCacheFlushStart() by at most one short command. The card
+  *         writing its cache back is only checked on, never waited for.
+  * @retval SD_BUSY while the flush is in progress, then its result once, SD_OK without a flush
+  */
+SD_Error_t SD_CardCacheFlushPoll(void)
+{
+    SD_Error_t ErrorState = SD_BUSY;
+
+    switch (SD_CQ.FlushStep) {
+        case SD_CACHE_FLUSH_IDLE:
+            return SD_OK;
+
+        case SD_CACHE_FLUSH_DRAIN:
+            if ((ErrorState = SD_CQ_Process()) == SD_OK) {
+                memset(SD_ExtRegBuffer, 0, sizeof(SD_ExtRegBuffer));
+                SD_ExtRegBuffer[0] = 0x01;
+                if ((ErrorState = SD_ExtWriteStart(SD_ExtInfo.Perf.FNO, SD_ExtInfo.Perf.Page,
+                                                   SD_ExtInfo.Perf.Offset + SD_EXT_PERF_CACHE_FLUSH, 1, false)) == SD_OK) {
+                    SD_CQ.FlushStep = SD_CACHE_FLUSH_BUSY;
+                    ErrorState      = SD_BUSY;
+                }
+            }
+            break;
+
+        case SD_CACHE_FLUSH_BUSY:
+            // DAT0 busy covers most of the write back
+            if ((ErrorState = SD_GetStatus()) == SD_OK) {
+                SD_CQ.FlushStep = SD_CACHE_FLUSH_CHECK;
+                ErrorState      = SD_BUSY;
+            }
+            break;
+
+        case SD_CACHE_FLUSH_CHECK:
+            // Card clears the flush bit once the cache is written back
+            ErrorState = SD_ExtRead(SD_ExtInfo.Perf.FNO, SD_ExtInfo.Perf.Page, SD_ExtInfo.Perf.Offset + SD_EXT_PERF_CACHE_FLUSH, 1);
+            if ((ErrorState == SD_OK) && ((SD_ExtRegBuffer[0] & 0x01) != 0)) {
+                ErrorState = SD_BUSY;
+            }
+            break;
+    }
+
+    if ((ErrorState == SD_BUSY) && ((HAL_GetTick() - SD_CQ.FlushStart) > SD_CACHE_FLUSH_TIMEOUT_MS)) {
+        ErrorState = SD_DATA_TIMEOUT;
+    }
+    if (ErrorState != SD_BUSY) {
+        SD_CQ.FlushStep    = SD_CACHE_FLUSH_IDLE;
+        SD_CQ.FlushPending = false;
+    }
+    return ErrorState;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+bool SD_CQ_IsSupported(void)
+{
+    return SD_CQ.Supported;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+uint8_t SD_CQ_GetDepth(void)
+{
+    return SD_CQ.Depth;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Switches card command queue mode on or off (performance enhancement register byte 262).
+  * @note   Queue must be empty.
+  * @param  Enable: true to enable queueing
+  * @retval SD Card error state
+  */
+SD_Error_t SD_CQ_Enable(bool Enable)
+{
+    SD_Error_t ErrorState;
+
+    if (!SD_CQ.Supported) {
+        return SD_UNSUPPORTED_FEATURE;
+    }
+    if ((SD_CQ.QueuedMask != 0) || (SD_CQ.Executing != SD_CQ_NO_TASK)) {
+        return SD_BUSY;
+    }
+
+    if ((ErrorState = SD_PerfWriteByte(SD_EXT_PERF_CQ_ENABLE, Enable ? 0x01 : 0x00)) != SD_OK) {
+        return ErrorState;
+    }
+
+    // Read back, card may refuse the mode
+    if ((ErrorState = SD_PerfRead()) != SD_OK) {
+        return ErrorState;
+    }
+    SD_CQ.Enabled = (SD_ExtRegBuffer[SD_EXT_PERF_CQ_ENABLE] & 0x01) != 0;
+
+    return (SD_CQ.Enabled == Enable) ? SD_OK : SD_SDMMC_FUNCTION_FAILED;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Hands a task to the card with CMD44/CMD45.
+  * @param  dir: SDMMC_DIR_RX or SDMMC_DIR_TX
+  * @retval SD Card error state
+  */
+static SD_Error_t SD_CQ_Queue(uint8_t dir, uint64_t Address, uint32_t *buffer, uint32_t NumberOfBlocks,
+                              SD_CQ_Callback_t Callback, void *Context, uint8_t *pTaskId)
+{
+    SD_Error_t ErrorState;
+    uint8_t    TaskId;
+    uint32_t   Argument;
+#ifdef SDMMC_STATS
+    uint32_t   IssueStart = DWT->CYCCNT;
+#endif
+
+    assert_param(((uint32_t)buffer >= 0x24000000) && ((uint32_t)buffer <= (0x24080000)));
+
+    if (!SD_CQ.Enabled) {
+        return SD_REQUEST_NOT_APPLICABLE;
+    }
+    if (SD_CQ.FlushPending) {
+        return SD_BUSY;
+    }
+#ifdef SDMMC_POWER_FAIL
+    if ((dir == SDMMC_DIR_TX) && !SD_PowerFail_WriteAllowed()) {
+        return SD_POWER_FAIL;
+    }
+#endif
+    if ((NumberOfBlocks == 0) || (NumberOfBlocks > 0xFFFF) ||
+        ((Address > 0xFFFFFFFF) && (SD_CardType != SD_ULTRA_CAPACITY))) {
+        return SD_INVALID_PARAMETER;
+    }
+
+    for (TaskId = 0; TaskId < SD_CQ.Depth; TaskId++) {
+        if (SD_CQ.Tasks[TaskId].State == SD_CQ_TASK_FREE) break;
+    }
+    if (TaskId >= SD_CQ.Depth) {
+        return SD_BUSY;
+    }
+
+#ifdef SDMMC_SCHED
+    SD_Sched_Preempt();
+#endif
+#ifdef SDMMC_READAHEAD
+    SD_ReadAhead_Preempt();
+    if (dir == SDMMC_DIR_TX) {
+        SD_ReadAhead_Invalidate(Address, NumberOfBlocks);
+    }
+#endif
+#ifdef SDMMC_VERIFY
+    SD_Verify_Preempt();
+#endif
+
+    // [30] direction (1 = read), [20:16] task ID, [15:0] number of blocks
+    Argument = ((dir == SDMMC_DIR_RX) ? SD_CQ_DIR_READ : 0) | ((uint32_t)TaskId << SD_CQ_TASK_ID_POS) | NumberOfBlocks;
+    if ((ErrorState = SD_TransmitCommand(SD_CMDID_Q_TASK_INFO_A, Argument)) != SD_OK) {
+        return ErrorState;
+    }
+    if ((ErrorState = SD_TransmitAddressCommand(SD_CMDID_Q_TASK_INFO_B, Address)) != SD_OK) {
+        return ErrorState;
+    }
+
+    SD_CQ.Tasks[TaskId].Buffer         = buffer;
+    SD_CQ.Tasks[TaskId].Address        = Address;
+    SD_CQ.Tasks[TaskId].NumberOfBlocks = (uint16_t)NumberOfBlocks;
+    SD_CQ.Tasks[TaskId].Direction      = dir;
+    SD_CQ.Tasks[TaskId].Status         = SD_REQUEST_PENDING;
+    SD_CQ.Tasks[TaskId].Callback       = Callback;
+    SD_CQ.Tasks[TaskId].Context        = Context;
+    SD_CQ.Tasks[TaskId].State          = SD_CQ_TASK_QUEUED;
+#ifdef SDMMC_STATS
+    SD_Stats_Begin(&SD_CQ.Tasks[TaskId].Stats, (dir == SDMMC_DIR_RX) ? SD_STATS_OP_QREAD : SD_STATS_OP_QWRITE, NumberOfBlocks);
+    SD_CQ.Tasks[TaskId].Stats.Issue    = IssueStart;
+#endif
+    SD_CQ.QueuedMask                  |= (1UL << TaskId);
+    SD_TRACE(SD_TRACE_CQ, TaskId, SD_CQ_TASK_QUEUED, Address);
+#ifdef SDMMC_VERIFY
+    if (dir == SDMMC_DIR_TX) {
+        SD_Verify_Record(Address, buffer, NumberOfBlocks);
+    }
+#endif
+
+    if (pTaskId != NULL) {
+        *pTaskId = TaskId;
+    }
+
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Queues a read task. Completion is reported through Callback from SD_CQ_Process().
+  * @param  Address: Block address (card must be high capacity)
+  * @param  buffer: Destination in AXI SRAM, must stay valid until the callback
+  * @param  NumberOfBlocks: 512 byte blocks to read (1..65535)
+  * @param  pTaskId: Optional, receives the task ID
+  * @retval SD Card error state, SD_BUSY when all task slots are used
+  */
+SD_Error_t SD_CQ_QueueRead(uint64_t Address, uint32_t *buffer, uint32_t NumberOfBlocks,
+                           SD_CQ_Callback_t Callback, void *Context, uint8_t *pTaskId)
+{
+    return SD_CQ_Queue(SDMMC_DIR_RX, Address, buffer, NumberOfBlocks, Callback, Context, pTaskId);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Queues a write task. Completion is reported through Callback from SD_CQ_Process().
+  * @note   Same rules as SD_CQ_QueueRead()
+  * @retval SD Card error state, SD_BUSY when all task slots are used
+  */
+SD_Error_t SD_CQ_QueueWrite(uint64_t Address, uint32_t *buffer, uint32_t NumberOfBlocks,
+                            SD_CQ_Callback_t Callback, void *Context, uint8_t *pTaskId)
+{
+    return SD_CQ_Queue(SDMMC_DIR_TX, Address, buffer, NumberOfBlocks, Callback, Context, pTaskId);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Completes the executing task and hands it back to its owner.
+  */
+static void SD_CQ_Complete(int8_t TaskId, SD_Error_t Status)
+{
+    SD_CQ_Task_t *pTask = &SD_CQ.Tasks[TaskId];
+
+    SD_CQ.QueuedMask &= ~(1UL << TaskId);
+    SD_CQ.ReadyMask  &= ~(1UL << TaskId);
+    SD_CQ.Executing   = SD_CQ_NO_TASK;
+    pTask->State      = SD_CQ_TASK_FREE;
+    SD_TRACE(SD_TRACE_CQ, TaskId, SD_CQ_TASK_DONE, Status);
+
+#ifdef SDMMC_STATS
+    if (pTask->Stats.Active) {
+        if (Status == SD_OK) {
+            SD_Stats_Finish(&pTask->Stats, pTask->Stats.DataEnd);
+        }
+        pTask->Stats.Active = 0;
+    }
+#endif
+
+    if (pTask->Callback != NULL) {
+        pTask->Callback((uint8_t)TaskId, Status, pTask->Context);
+    }
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Drives the command queue, call it from the main loop.
+  *         Delivers the finished task, reads the QSR (CMD13 with SQS bit) when no ready
+  *         task is known and starts the next ready task with CMD46/CMD47. Tasks finish in
+  *         the order the card makes them ready, not the order they were queued.
+  * @retval SD_OK when queue is empty, SD_BUSY while tasks are outstanding, error otherwise
+  */
+SD_Error_t SD_CQ_Process(void)
+{
+    SD_Error_t    ErrorState;
+    SD_CQ_Task_t *pTask;
+    int8_t        TaskId = SD_CQ.Executing;
+    SD_CmdId_t    CmdId;
+
+    if (TaskId != SD_CQ_NO_TASK) {
+        pTask = &SD_CQ.Tasks[TaskId];
+        if (pTask->State == SD_CQ_TASK_DONE) {
+            SD_CQ_Complete(TaskId, pTask->Status);
+        } else if (SD_Handle.TransferError != SD_OK) {
+            ErrorState = (SD_Error_t)SD_Handle.TransferError;
+            SD_Abort();
+            SD_CQ_Complete(TaskId, ErrorState);
+        } else {
+            return SD_BUSY;
+        }
+    }
+
+    if (SD_CQ.QueuedMask == 0) {
+        return SD_OK;
+    }
+
+    // Card is still programming the previous write
+    if ((ErrorState = SD_GetStatus()) != SD_OK) {
+        return (ErrorState == SD_BUSY) ? SD_BUSY : ErrorState;
+    }
+
+    if (SD_CQ.ReadyMask == 0) {
+        // R1 of CMD13 with SQS carries the ready bitmap, not the card status
+        if ((ErrorState = SD_TransmitCommand(SD_CMDID_SEND_QSR, SD_CardRCA | SD_STATUS_SEND_QSR)) != SD_OK) {
+            return ErrorState;
+        }
+        SD_CQ.ReadyMask = sdmmc_instance->RESP1 & SD_CQ.QueuedMask;
+        SD_TRACE(SD_TRACE_CQ, 0xFF, 0, sdmmc_instance->RESP1);
+        if (SD_CQ.ReadyMask == 0) {
+            return SD_BUSY;
+        }
+    }
+
+    // Round robin over ready tasks so one busy LBA range can not starve the rest
+    for (uint8_t i = 0; i < SD_CQ_MAX_TASKS; i++) {
+        TaskId = (SD_CQ.NextScan + i) % SD_CQ_MAX_TASKS;
+        if ((SD_CQ.ReadyMask & (1UL << TaskId)) != 0) break;
+    }
+    SD_CQ.NextScan = (TaskId + 1) % SD_CQ_MAX_TASKS;
+    pTask          = &SD_CQ.Tasks[TaskId];
+
+#ifdef SDMMC_POWER_FAIL
+    uint32_t Mask = SD_PowerFail_Mask();
+#endif
+
+    if (pTask->Direction == SDMMC_DIR_RX) {
+        SD_Handle.RXCplt = 1;
+        CmdId = SD_CMDID_Q_RD_TASK;
+    } else {
+        SD_Handle.TXCplt = 1;
+        CmdId = SD_CMDID_Q_WR_TASK;
+    }
+
+    SD_StartBlockTransfer(BLOCK_SIZE, pTask->NumberOfBlocks, pTask->Direction);
+    SD_Handle.Operation |= SD_OPERATION_QUEUED;
+    pTask->State    = SD_CQ_TASK_EXECUTING;
+    SD_CQ.Executing = TaskId;
+    SD_TRACE(SD_TRACE_CQ, TaskId, SD_CQ_TASK_EXECUTING, pTask->Address);
+    SD_EnableIDMA(pTask->Buffer);
+
+#ifdef SDMMC_CACHE_MAINTANANCE
+    if ((pTask->Direction == SDMMC_DIR_TX) && (SCB->CCR & SCB_CCR_DC_Msk)) {
+        uint32_t alignedAddr = (uint32_t)pTask->Buffer & ~0x1F;
+        SCB_CleanDCache_by_Addr((uint32_t*)alignedAddr, pTask->NumberOfBlocks * BLOCK_SIZE + ((uint32_t)pTask->Buffer - alignedAddr));
+    }
+#endif
+
+    if ((ErrorState = SD_TransmitCommand(CmdId, (uint32_t)TaskId << SD_CQ_TASK_ID_POS)) != SD_OK) {
+        SD_Handle.RXCplt = 0;
+        SD_Handle.TXCplt = 0;
+        SD_Abort();
+        SD_CQ_Complete(TaskId, ErrorState);
+    }
+#ifdef SDMMC_STATS
+    else {
+        pTask->Stats.Response = DWT->CYCCNT;
+    }
+#endif
+
+#ifdef SDMMC_POWER_FAIL
+    SD_PowerFail_Unmask(Mask);
+#endif
+
+    return SD_BUSY;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Initialize the sdmmc_instance module, DMA, and IO
+  */
+void SD_Initialize_LL(SDMMC_TypeDef *sdmmc)
+{
+    sdmmc_instance = sdmmc;
+
+     // Reset sdmmc_instance Module
     if (sdmmc_instance == SDMMC1) {
         RCC->AHB2RSTR |=  RCC_AHB3RSTR_SDMMC1RST;
         HAL_Delay(1);
@@ -1562,6 +2791,58 @@ bool SD_GetState(void)
 }
 
 
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Changes the bus clock of an initialized card, bus width is kept.
+  * @param  clk_div: CLKDIV value, SDMMC_CK = SDMMC kernel clock / (2 * clk_div)
+  * @retval SD Card error state
+  */
+SD_Error_t SD_SetClockDivider(uint8_t clk_div)
+{
+    if ((clk_div == 0) || !SD_IsIdle()) {
+        return (clk_div == 0) ? SD_INVALID_PARAMETER : SD_BUSY;
+    }
+    MODIFY_REG(sdmmc_instance->CLKCR, SDMMC_CLKCR_CLKDIV, (uint32_t)clk_div);
+    sdmmc8_clk_cycles = SystemCoreClock / 50000000 * 8 * (clk_div * 2);
+    return SD_OK;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+uint8_t SD_GetClockDivider(void)
+{
+    return (uint8_t)(sdmmc_instance->CLKCR & SDMMC_CLKCR_CLKDIV);
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+/**
+  * @brief  Bus clock for a given divider.
+  * @param  clk_div: CLKDIV value
+  * @retval SDMMC_CK in Hz
+  */
+uint32_t SD_GetBusClock(uint8_t clk_div)
+{
+    uint32_t KernelClock = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SDMMC);
+
+    return (clk_div == 0) ? KernelClock : (KernelClock / (2 * (uint32_t)clk_div));
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+void SD_SetWriteStrategy(SD_WriteStrategy_t Strategy)
+{
+    SD_WriteStrategy = Strategy;
+}
+
+
+/** -----------------------------------------------------------------------------------------------------------------*/
+SD_WriteStrategy_t SD_GetWriteStrategy(void)
+{
+    return SD_WriteStrategy;
+}
+
+
 /** -----------------------------------------------------------------------------------------------------------------*/
 bool SD_Init(uint8_t clk_div)
 {
@@ -1584,7 +2865,7 @@ bool SD_Init(uint8_t clk_div)
             if((ErrorState = SD_GetCardInfo()) == SD_OK)        // Read CSD/CID MSD registers
             {
                 // Select the Card - Send CMD7 SDMMC_SEL_DESEL_CARD
-                ErrorState = SD_TransmitCommand((SD_CMD_SEL_DESEL_CARD | SD_CMD_RESPONSE_SHORT), SD_CardRCA, 1);
+                ErrorState = SD_TransmitCommand(SD_CMDID_SEL_DESEL_CARD, SD_CardRCA);
                 MODIFY_REG(sdmmc_instance->CLKCR, CLKCR_CLEAR_MASK, (uint32_t) clk_div); // Configure sdmmc_instance peripheral interface
             }
         }
@@ -1603,6 +2884,24 @@ bool SD_Init(uint8_t clk_div)
     }
 
     sdmmc8_clk_cycles = SystemCoreClock / 50000000 * 8 * (clk_div * 2);
+    SD_WriteStrategy  = SD_WRITE_OPEN_ENDED;
+
+    if(ErrorState == SD_OK)
+    {
+        // SCR is needed to find out which optional commands card has, extensions are optional so ignore errors
+        if(SD_FindSCR(SD_Handle.SCR) == SD_OK)
+        {
+            SD_ReadExtInfo();
+        }
+    }
+
+#ifdef SDMMC_TUNE_DB
+    if(ErrorState == SD_OK)
+    {
+        // Known card goes straight to its calibrated clock, unknown ones stay at clk_div until SD_Tune_Run
+        SD_TuneDB_ApplyCard();
+    }
+#endif
 
     // Configure the SDCARD device
     return ErrorState;
@@ -1617,6 +2916,7 @@ bool SD_Init(uint8_t clk_div)
 static inline void SDMMC_IRQHandler(void) {
     // Check for sdmmc_instance interrupt flags
     uint32_t status = sdmmc_instance->STA;
+    SD_TRACE(SD_TRACE_STA, SD_TRACE_SITE_IRQ, 0, status);
     // Disable all sdmmc_instance peripheral interrupt sources
     sdmmc_instance->MASK &= ~(SDMMC_MASK_DCRCFAILIE | SDMMC_MASK_DTIMEOUTIE
             | SDMMC_MASK_DATAENDIE |
@@ -1624,6 +2924,11 @@ static inline void SDMMC_IRQHandler(void) {
             SDMMC_MASK_RXOVERRIE | SDMMC_MASK_IDMABTCIE);
 
     if ((status & SDMMC_STA_DATAEND) != 0) {
+#ifdef SDMMC_STATS
+        uint32_t data_end = DWT->CYCCNT;    // Before CMD12 and cache maintenance
+#endif
+
+        SD_TRACE(SD_TRACE_DATAEND, SD_Handle.Operation, 0, sdmmc_instance->DLEN);
 
         // Disable CMDTRANS
         sdmmc_instance->CMD &= ~(SDMMC_CMD_CMDTRANS);
@@ -1632,9 +2937,9 @@ static inline void SDMMC_IRQHandler(void) {
         in the SD DCTRL register */
         sdmmc_instance->IDMACTRL &= ~(SDMMC_IDMA_IDMAEN);
 
-        if ((SD_Handle.Operation & 0x01) == SD_MULTIPLE_BLOCK) {
-            /* Send stop command in multiblock write */
-            SD_TransmitCommand((SD_CMD_STOP_TRANSMISSION | SD_CMD_RESPONSE_SHORT), 0, 1);
+        if ((SD_Handle.Operation & (SD_OPERATION_QUEUED | 0x01)) == SD_MULTIPLE_BLOCK) {
+            /* Send stop command in multiblock write, queued tasks end on their block count */
+            SD_TransmitCommand(SD_CMDID_STOP_TRANSMISSION, 0);
         }
 
         if ((SD_Handle.Operation & 0x02) == (SDMMC_DIR_TX << 1)) {
@@ -1655,6 +2960,19 @@ static inline void SDMMC_IRQHandler(void) {
             SD_Handle.RXCplt = 0;
         }
 
+        if ((SD_Handle.Operation & SD_OPERATION_QUEUED) != 0 && SD_CQ.Executing != SD_CQ_NO_TASK) {
+#ifdef SDMMC_STATS
+            SD_CQ.Tasks[SD_CQ.Executing].Stats.DataEnd = data_end;
+#endif
+            SD_CQ.Tasks[SD_CQ.Executing].Status = SD_OK;
+            SD_CQ.Tasks[SD_CQ.Executing].State  = SD_CQ_TASK_DONE;
+        }
+#ifdef SDMMC_STATS
+        else {
+            SD_Handle.Stats.DataEnd = data_end;
+        }
+#endif
+
         SD_Handle.TransferComplete = 1;
         SD_Handle.TransferError = SD_OK;       // No transfer error
         SD_Handle.last_transfer_end = DWT->CYCCNT;
@@ -1672,6 +2990,10 @@ static inline void SDMMC_IRQHandler(void) {
     else if ((status & SDMMC_STA_TXUNDERR) != 0)
         SD_Handle.TransferError = SD_TX_UNDERRUN;
 
+    if (((status & SDMMC_STA_DATAEND) == 0) && (SD_Handle.TransferError != SD_OK)) {
+        SD_TRACE(SD_TRACE_ERROR, SD_TRACE_SITE_IRQ, SD_Handle.TransferError, status);
+    }
+
     sdmmc_instance->ICR = SDMMC_ICR_STATIC_FLAGS;
 }
 
@@ -9,6 +9,25 @@
 
 #include "stm32h7xx_hal.h"
 #include "sdmmc_sdio.h"
+#include "sd_stats.h"
+#include "sd_trace.h"
+#include "sd_verify.h"
+#include "sd_tune.h"
+#include "sd_tunedb.h"
+#include "sd_powerfail.h"
+#include "sd_cache.h"
+#include "sd_readahead.h"
+#include "sd_sched.h"
+#include "sd_blockdev.h"
+#include "sd_part.h"
+#include "sd_journal.h"
+#include "sd_lz4.h"
+#include "sd_xts.h"
+#include "sd_rs.h"
+#include "sd_integrity.h"
+#include "sd_cow.h"
+#include "sd_ramdisk.h"
+#include "sd_share.h"
 #include "unity.h"
 #include "us_handler.h"
 
@@ -36,6 +55,9 @@ void _init_sdmmc(void) {
     SD_Initialize_LL(SDMMC2);
     TEST_ASSERT_TRUE(ret);
     SD_Init(0x03);
+#ifdef SDMMC_STATS
+    SD_Stats_Reset();
+#endif
     rng_init();
     TEST_ASSERT_TRUE(ret);
     TEST_ASSERT(SD_OK == SD_GetCardInfo());
@@ -45,9 +67,14 @@ void _init_sdmmc(void) {
     printf("Card OEM Appli ID %d\n", SD_CardInfo.SD_cid.OEM_AppliID);
     printf("Card Rev %d\n", SD_CardInfo.SD_cid.ProdRev);
     printf("Card SN %lu\n", SD_CardInfo.SD_cid.ProdSN);
-    printf("Card blocks %llu\n", SD_CardInfo.CardCapacity);
+    printf("Card type %d\n", SD_CardType);
+    printf("Card blocks %llu\n", SD_GetBlockCount());
     printf("Card block size %lu\n", SD_CardInfo.CardBlockSize);
-    printf("Card size %llub\n", SD_CardInfo.CardCapacity * SD_CardInfo.CardBlockSize);
+    printf("Card size %llub\n", SD_GetBlockCount() * SD_CardInfo.CardBlockSize);
+    TEST_ASSERT(SD_GetBlockCount() > 0);
+    if (SD_CardType == SD_ULTRA_CAPACITY) {
+        TEST_ASSERT(SD_GetBlockCount() > 0xFFFFFFFFULL);
+    }
 }
 
 // Sector is 512B
@@ -152,6 +179,932 @@ void _read_multi_test_sdmmc(void) {
     printf(" Read speed %fMB/s\n", data_written / time);
 }
 
+static volatile uint32_t cq_done_mask;
+static volatile uint32_t cq_errors;
+
+static void _cq_callback(uint8_t task_id, SD_Error_t status, void *context) {
+    (void)context;
+    if (status != SD_OK) {
+        cq_errors++;
+    }
+    cq_done_mask |= (1UL << task_id);
+}
+
+void _queued_read_sdmmc(void) {
+    SD_Error_t ret;
+    uint32_t queued_mask = 0;
+    uint32_t rd_time;
+    uint8_t task_id;
+    if (!SD_CQ_IsSupported()) {
+        TEST_IGNORE_MESSAGE("Card has no command queue");
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_CQ_Enable(true));
+    cq_done_mask = 0;
+    cq_errors = 0;
+    rd_time = HAL_GetTick();
+    // 4KB random reads, each into own 4KB slice of buffer_out
+    for (int i = 0; i < SD_CQ_GetDepth() && i < 8; i++) {
+        uint32_t address = rng_get() % (SD_GetBlockCount() - 8);
+        ret = SD_CQ_QueueRead(address, (uint32_t*)(buffer_out + i * 4096), 8, _cq_callback, NULL, &task_id);
+        TEST_ASSERT_EQUAL(SD_OK, ret);
+        queued_mask |= (1UL << task_id);
+    }
+    while ((ret = SD_CQ_Process()) == SD_BUSY);
+    rd_time = HAL_GetTick() - rd_time;
+    TEST_ASSERT_EQUAL(SD_OK, ret);
+    TEST_ASSERT_EQUAL_HEX32(queued_mask, cq_done_mask);
+    TEST_ASSERT_EQUAL(0, cq_errors);
+    TEST_ASSERT_EQUAL(SD_OK, SD_CQ_Enable(false));
+    printf(" Queued read time %lums\n", rd_time);
+}
+
+void _card_cache_sdmmc(void) {
+    SD_Error_t ret;
+    uint32_t *ptr = (uint32_t*) buffer_in;
+    if (!SD_GetExtInfo()->Perf.Cache) {
+        TEST_IGNORE_MESSAGE("Card has no volatile cache");
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_CardCacheEnable(true));
+    for (int i = 0; i < (512 / 4); i++) {
+        *ptr++ = rng_get();
+    }
+    uint32_t address = rng_get() % (SD_GetBlockCount() - 1);
+    ret = SD_WriteBlocks_DMA(address, (uint32_t*)buffer_in, 512, 1);
+    TEST_ASSERT_EQUAL(SD_OK, ret);
+    while (SD_CheckWrite());
+    while (SD_GetState() == false);
+    TEST_ASSERT_EQUAL(SD_OK, SD_CardCacheFlush());
+    ret = SD_ReadBlocks_DMA(address, (uint32_t*) buffer_out, 512, 1);
+    TEST_ASSERT_EQUAL(SD_OK, ret);
+    while (SD_CheckRead());
+    while (SD_GetState() == false);
+    TEST_ASSERT_EQUAL_MEMORY_ARRAY(buffer_in, buffer_out, 1, 512);
+    TEST_ASSERT_EQUAL(SD_OK, SD_CardCacheEnable(false));
+}
+
+#ifdef SDMMC_STATS
+static SD_Stats_t SD_BUFFER stats_snapshot;
+
+void _latency_stats_sdmmc(void) {
+    SD_Stats_Snapshot(&stats_snapshot);
+    TEST_ASSERT(stats_snapshot.Phase[SD_STATS_OP_READ][SD_STATS_PHASE_TOTAL].Count > 0);
+    TEST_ASSERT(stats_snapshot.Phase[SD_STATS_OP_WRITE][SD_STATS_PHASE_TOTAL].Count > 0);
+    TEST_ASSERT(stats_snapshot.Phase[SD_STATS_OP_WRITE][SD_STATS_PHASE_BUSY].Count > 0);
+    TEST_ASSERT(stats_snapshot.Command.Count > 0);
+    SD_Stats_Print(&stats_snapshot);
+}
+#endif
+
+#ifdef SDMMC_TRACE
+static SD_TraceEntry_t SD_BUFFER trace_snapshot[32];
+
+void _trace_ring_sdmmc(void) {
+    SD_Error_t ret;
+    uint32_t count;
+    bool cmd_seen = false, dataend_seen = false;
+    SD_Trace_Reset();
+    ret = SD_ReadBlocks_DMA(0, (uint32_t*) buffer_out, 512, 1);
+    TEST_ASSERT_EQUAL(SD_OK, ret);
+    while (SD_CheckRead());
+    while (SD_GetState() == false);
+    count = SD_Trace_Snapshot(trace_snapshot, 32);
+    TEST_ASSERT(count > 0);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t type = trace_snapshot[i].Header & 0xFF;
+        uint32_t aux  = (trace_snapshot[i].Header >> 8) & 0xFF;
+        if (type == SD_TRACE_CMD && aux == 17) cmd_seen = true;
+        if (type == SD_TRACE_DATAEND) dataend_seen = true;
+        if (i > 0) {
+            TEST_ASSERT((trace_snapshot[i].Cycles - trace_snapshot[i - 1].Cycles) < 0x80000000UL);
+        }
+    }
+    TEST_ASSERT(cmd_seen);
+    TEST_ASSERT(dataend_seen);
+    SD_Trace_Dump();
+}
+#endif
+
+#ifdef SDMMC_VERIFY
+static volatile uint32_t verify_failures;
+static volatile uint64_t verify_failed_lba;
+
+static void _verify_callback(uint64_t lba, SD_Error_t status, void *context) {
+    (void)status;
+    (void)context;
+    verify_failures++;
+    verify_failed_lba = lba;
+}
+
+static void _verify_drain(void) {
+    uint32_t start = HAL_GetTick();
+    while (SD_Verify_Pending() && ((HAL_GetTick() - start) < 1000)) {
+        SD_Verify_Process();
+    }
+    TEST_ASSERT_EQUAL(0, SD_Verify_Pending());
+}
+
+void _verify_sdmmc(void) {
+    SD_Error_t ret;
+    SD_VerifyStats_t stats;
+    uint32_t *ptr = (uint32_t*) buffer_in;
+    for (int i = 0; i < (512 * 16 / 4); i++) {
+        *ptr++ = rng_get();
+    }
+    uint32_t address = rng_get() % (SD_GetBlockCount() - 16);
+    verify_failures = 0;
+    SD_Verify_Enable(_verify_callback, NULL);
+    ret = SD_WriteBlocks_DMA(address, (uint32_t*)buffer_in, 512, 16);
+    TEST_ASSERT_EQUAL(SD_OK, ret);
+    while (SD_CheckWrite());
+    while (SD_GetState() == false);
+    TEST_ASSERT_EQUAL(16, SD_Verify_Pending());
+    _verify_drain();
+    TEST_ASSERT_EQUAL(0, verify_failures);
+    // Record a checksum the card does not hold, the read back has to flag it
+    SD_Verify_Record(address + 3, (uint32_t*)buffer_in, 1);
+    _verify_drain();
+    TEST_ASSERT_EQUAL(1, verify_failures);
+    TEST_ASSERT(verify_failed_lba == (address + 3));
+    SD_Verify_GetStats(&stats);
+    SD_Verify_Disable();
+    TEST_ASSERT_EQUAL(16, stats.Verified);
+    TEST_ASSERT_EQUAL(1, stats.Mismatches);
+    printf(" Verify preempted %lu dropped %lu\n", stats.Preempted, stats.Dropped);
+}
+#endif
+
+void _tune_sdmmc(void) {
+    const SD_TuneProfile_t *profile;
+    uint32_t scratch = 4 * SD_TUNE_PROBE_BLOCKS;
+    TEST_ASSERT_EQUAL(SD_OK, SD_Tune_Run(SD_GetBlockCount() - scratch, scratch, (uint32_t*)buffer_out, sizeof(buffer_out) / 512));
+    profile = SD_Tune_GetProfile();
+    TEST_ASSERT_TRUE(profile->Valid);
+    TEST_ASSERT_EQUAL(profile->ClockDivider, SD_GetClockDivider());
+    TEST_ASSERT(profile->SeqReadKBs > 0);
+    TEST_ASSERT(profile->SeqWriteKBs > 0);
+    SD_Tune_Print(profile);
+#ifdef SDMMC_TUNE_DB
+    SD_TuneProfile_t stored;
+    SD_Error_t found = SD_TuneDB_Lookup((const SD_CID_t*)&SD_CardInfo.SD_cid, &stored);
+    TEST_ASSERT((found == SD_OK) || (found == SD_REQUEST_NOT_APPLICABLE));
+#endif
+    // The tests run on every boot, storing appends a flash record each time, only on request
+#if defined(SDMMC_TUNE_DB) && defined(SDMMC_TEST_TUNE_DB_STORE)
+    TEST_ASSERT_EQUAL(SD_OK, SD_TuneDB_Store((const SD_CID_t*)&SD_CardInfo.SD_cid, profile));
+    TEST_ASSERT_EQUAL(SD_OK, SD_TuneDB_Lookup((const SD_CID_t*)&SD_CardInfo.SD_cid, &stored));
+    TEST_ASSERT_EQUAL(profile->ClockDivider, stored.ClockDivider);
+    TEST_ASSERT_EQUAL(profile->WriteChunk, stored.WriteChunk);
+    TEST_ASSERT_EQUAL(profile->WriteStrategy, stored.WriteStrategy);
+#endif
+}
+
+#ifdef SDMMC_POWER_FAIL
+static void _powerfail_hook(int32_t remaining_us, void *context) {
+    (void)remaining_us;
+    (*(uint32_t*)context)++;
+}
+
+void _powerfail_sdmmc(void) {
+    static uint32_t hook_calls;
+    SD_PowerFailStats_t stats;
+    uint64_t lba = SD_GetBlockCount() - 128;
+    SD_PowerFail_Init(SD_POWERFAIL_PVD_LEVEL, SD_POWERFAIL_HOLDUP_US);
+    TEST_ASSERT_EQUAL(SD_OK, SD_PowerFail_RegisterHook(_powerfail_hook, &hook_calls));
+    TEST_ASSERT_TRUE(SD_PowerFail_IsArmed());
+    TEST_ASSERT_TRUE(SD_PowerFail_WriteAllowed());
+    TEST_ASSERT_EQUAL(SD_POWERFAIL_HOLDUP_US, SD_PowerFail_RemainingUs());
+    // Supply is healthy, so a spurious service call must leave the service armed and run no hooks
+    SD_PowerFail_Service();
+    TEST_ASSERT_TRUE(SD_PowerFail_IsArmed());
+    TEST_ASSERT_EQUAL(0, hook_calls);
+    SD_PowerFail_GetStats(&stats);
+    TEST_ASSERT_EQUAL(0, stats.Events);
+    // Writes go on while armed, scratch block at the end of the card, away from the partition table
+    TEST_ASSERT_EQUAL(SD_OK, SD_WriteBlocks_DMA(lba, (uint32_t*)buffer_in, 512, 1));
+    while(SD_CheckWrite());
+    while(SD_GetState() == false);
+}
+#endif
+
+#ifdef SDMMC_BLOCK_CACHE
+void _block_cache_sdmmc(void) {
+    SD_CacheStats_t stats;
+    uint64_t lba = SD_GetBlockCount() - 256;
+    for (uint32_t i = 0; i < 8 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+
+    // Write-through LRU, second read comes from RAM
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cache_Init(SD_CACHE_LRU, SD_CACHE_WRITE_THROUGH));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cache_Write(lba, buffer_in, 8));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cache_Read(lba, buffer_out, 8));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 8 * 512);
+    SD_Cache_GetStats(&stats);
+    TEST_ASSERT_EQUAL(8, stats.ReadHits);
+    TEST_ASSERT_EQUAL(0, stats.Dirty);
+
+    // Write-back ARC, a scattered write pattern flushes as one run
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cache_Init(SD_CACHE_ARC, SD_CACHE_WRITE_BACK));
+    for (uint32_t i = 0; i < 8; i += 2) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_Cache_Write(lba + 16 + i, &buffer_in[i * 512], 1));
+    }
+    for (uint32_t i = 1; i < 8; i += 2) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_Cache_Write(lba + 16 + i, &buffer_in[i * 512], 1));
+    }
+    SD_Cache_GetStats(&stats);
+    if (SD_PowerFail_IsArmed()) {
+        TEST_ASSERT_EQUAL(8, stats.Dirty);
+        TEST_ASSERT_EQUAL(SD_OK, SD_Cache_Flush());
+        SD_Cache_GetStats(&stats);
+        TEST_ASSERT_EQUAL(1, stats.FlushRuns);
+        TEST_ASSERT_EQUAL(8, stats.FlushedBlocks);
+    }
+    TEST_ASSERT_EQUAL(0, stats.Dirty);
+
+    // Straight from the card again
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cache_Invalidate());
+    for (uint32_t i = 0; i < 8 * 512; i++) {
+        buffer_out[i] = 0;
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cache_Read(lba + 16, buffer_out, 8));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 8 * 512);
+    SD_Cache_GetStats(&stats);
+    TEST_ASSERT_EQUAL(8, stats.ReadMisses);
+    printf(" Cache resident %lu evictions %lu ghost hits %lu\n", stats.Resident, stats.Evictions, stats.GhostHits);
+}
+#endif
+
+#ifdef SDMMC_READAHEAD
+void _readahead_sdmmc(void) {
+    SD_ReadAheadStats_t stats;
+    uint64_t lba = SD_GetBlockCount() - 512;
+    for (uint32_t i = 0; i < 64 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_WriteBlocks_DMA(lba, (uint32_t*)buffer_in, 512, 64));
+    while(SD_CheckWrite());
+    while(SD_GetState() == false);
+
+    // One block at a time like USB MSC, all but the first few come from prefetch windows
+    SD_ReadAhead_Enable();
+    for (uint32_t i = 0; i < 64; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_ReadAhead_Read(lba + i, &buffer_out[i * 512], 1));
+    }
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 64 * 512);
+    SD_ReadAhead_GetStats(&stats);
+    TEST_ASSERT(stats.Prefetches > 0);
+    TEST_ASSERT(stats.HitBlocks > stats.MissBlocks);
+    printf(" Read-ahead hit %lu miss %lu prefetches %lu waits %lu\n", stats.HitBlocks, stats.MissBlocks, stats.Prefetches, stats.Waits);
+
+    // A write into a prefetched window must not be served stale
+    TEST_ASSERT_EQUAL(SD_OK, SD_ReadAhead_Read(lba, buffer_out, 1));
+    TEST_ASSERT_EQUAL(SD_OK, SD_ReadAhead_Read(lba + 1, buffer_out, 1));
+    TEST_ASSERT_EQUAL(SD_OK, SD_ReadAhead_Read(lba + 2, buffer_out, 1));
+    TEST_ASSERT_EQUAL(SD_OK, SD_WriteBlocks_DMA(lba + 4, (uint32_t*)&buffer_in[32 * 512], 512, 1));
+    while(SD_CheckWrite());
+    while(SD_GetState() == false);
+    TEST_ASSERT_EQUAL(SD_OK, SD_ReadAhead_Read(lba + 3, buffer_out, 2));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[3 * 512], buffer_out, 512);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[32 * 512], &buffer_out[512], 512);
+    SD_ReadAhead_Disable();
+}
+#endif
+
+#ifdef SDMMC_SCHED
+static volatile uint32_t sched_done;
+static volatile uint32_t sched_order[4];
+
+static void _sched_callback(uint8_t request_id, SD_Error_t status, void *context) {
+    (void)request_id;
+    TEST_ASSERT_EQUAL(SD_OK, status);
+    sched_order[sched_done++ & 3] = (uint32_t)context;
+}
+
+void _sched_sdmmc(void) {
+    SD_SchedStats_t stats;
+    uint64_t lba = SD_GetBlockCount() - 1024;
+    for (uint32_t i = 0; i < 64 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+    SD_Sched_Init();
+
+    // Sixteen single blocks submitted back to front go out as one command
+    sched_done = 0;
+    for (int32_t i = 15; i >= 0; i--) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Write(lba + i, &buffer_in[i * 512], 1, _sched_callback, NULL, NULL));
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Drain());
+    TEST_ASSERT_EQUAL(16, sched_done);
+    SD_Sched_GetStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.Dispatches);
+    TEST_ASSERT_EQUAL(15, stats.Merged);
+
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Read(lba, buffer_out, 16, _sched_callback, NULL, NULL));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Drain());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 16 * 512);
+
+    // A read submitted behind a long write gets in between its chunks
+    sched_done = 0;
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Write(lba + 64, buffer_in, 64, _sched_callback, (void*)1, NULL));
+    SD_Sched_Process();
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Read(lba, buffer_out, 1, _sched_callback, (void*)2, NULL));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Drain());
+    TEST_ASSERT_EQUAL(2, sched_done);
+    TEST_ASSERT_EQUAL(2, sched_order[0]);
+    TEST_ASSERT_EQUAL(1, sched_order[1]);
+    SD_Sched_GetStats(&stats);
+    printf(" Sched dispatches %lu merged %lu chunks %lu max depth %lu\n", stats.Dispatches, stats.Merged, stats.Chunks, stats.MaxDepth);
+}
+
+void _sched_qos_sdmmc(void) {
+    SD_SchedClientStats_t logger_stats, copy_stats;
+    uint64_t lba = SD_GetBlockCount() - 2048;
+    uint8_t logger, copy;
+    SD_Sched_Init();
+
+    // A host copy limited to 256 KB/s must not hold back a real-time logger
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_OpenClient(SD_SCHED_CLASS_RT, 0, 0, &logger));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_OpenClient(SD_SCHED_CLASS_BACKGROUND, 256, 16, &copy));
+    for (uint32_t i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_Sched_ClientWrite(copy, lba + i * 64, buffer_in, 64, 0, NULL, NULL, NULL));
+    }
+    for (uint32_t i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_Sched_ClientWrite(logger, lba + 512 + i, &buffer_in[i * 512], 1, 0, NULL, NULL, NULL));
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Drain());
+
+    SD_Sched_GetClientStats(logger, &logger_stats);
+    SD_Sched_GetClientStats(copy, &copy_stats);
+    TEST_ASSERT_EQUAL(8, logger_stats.Completed);
+    TEST_ASSERT_EQUAL(0, logger_stats.Errors);
+    TEST_ASSERT_EQUAL(4, copy_stats.Completed);
+    TEST_ASSERT_EQUAL(256, copy_stats.Blocks);
+    TEST_ASSERT_TRUE(copy_stats.Throttled > 0);
+    // 128K at 256 KB/s after a 16K burst, plus rounding of the millisecond tick
+    TEST_ASSERT_TRUE(copy_stats.ThroughputKBs <= 300);
+    TEST_ASSERT_TRUE(logger_stats.LatencyAvgUs < copy_stats.LatencyAvgUs);
+    printf(" Logger latency avg %lu max %lu us, copy %lu KB/s throttled %lu\n", logger_stats.LatencyAvgUs, logger_stats.LatencyMaxUs,
+           copy_stats.ThroughputKBs, copy_stats.Throttled);
+    SD_Sched_Init();
+}
+
+void _sched_cache_sdmmc(void) {
+    SD_SchedStats_t stats;
+    uint64_t lba = SD_GetBlockCount() - 1024;
+    uint32_t start, step, longest = 0;
+    if (!SD_GetExtInfo()->Perf.Cache) {
+        TEST_IGNORE_MESSAGE("Card has no volatile cache");
+    }
+    SD_Sched_Init();
+    TEST_ASSERT_EQUAL(SD_OK, SD_CardCacheEnable(true));
+
+    // Barrier and FUA write flush the card cache, the step only checks on it, the callbacks check for SD_OK
+    sched_done = 0;
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Write(lba, buffer_in, 8, _sched_callback, (void*)1, NULL));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Barrier(SD_SCHED_DEFAULT_CLIENT, _sched_callback, (void*)2, NULL));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_ClientWrite(SD_SCHED_DEFAULT_CLIENT, lba + 8, &buffer_in[8 * 512], 8, SD_SCHED_FUA,
+                                                  _sched_callback, (void*)3, NULL));
+    while (!SD_Sched_IsIdle()) {
+        start = DWT->CYCCNT;
+        SD_Sched_Process();
+        step = DWT->CYCCNT - start;
+        longest = (step > longest) ? step : longest;
+    }
+    printf(" Longest step %lu us\n", longest / (SystemCoreClock / 1000000));
+    TEST_ASSERT_LESS_THAN(SystemCoreClock / 100, longest);
+    TEST_ASSERT_EQUAL(3, sched_done);
+    TEST_ASSERT_EQUAL(1, sched_order[0]);
+    TEST_ASSERT_EQUAL(2, sched_order[1]);
+    TEST_ASSERT_EQUAL(3, sched_order[2]);
+    SD_Sched_GetStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.Barriers);
+    TEST_ASSERT_EQUAL(2, stats.CacheFlushes);
+
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Read(lba, buffer_out, 16, NULL, NULL, NULL));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Sched_Drain());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 16 * 512);
+    TEST_ASSERT_EQUAL(SD_OK, SD_CardCacheEnable(false));
+}
+#endif
+
+static float _blockdev_read_speed(SD_BlockDev_t *dev) {
+    SD_BlockDevStats_t stats;
+    SD_BlockDev_GetStats(dev, &stats);
+    return (stats.ReadBlocks * 512.0f / 1000000.0f) / ((float)stats.ReadCycles / SystemCoreClock);
+}
+
+void _blockdev_sdmmc(void) {
+    SD_BlockDev_t *card = SD_BlockDev_Card();
+    SD_BlockDev_t *top = SD_BlockDev_Default();
+    uint64_t lba = SD_GetBlockCount() - 4096;
+    for (uint32_t i = 0; i < 64 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+
+    TEST_ASSERT_EQUAL(SD_GetBlockCount(), card->Blocks);
+    TEST_ASSERT_EQUAL(card->Blocks, top->Blocks);
+    TEST_ASSERT_TRUE(card->EraseBlocks >= 32);
+    TEST_ASSERT_EQUAL(SD_ADDR_OUT_OF_RANGE, SD_BlockDev_ReadSync(card, card->Blocks - 1, buffer_out, 2));
+
+    // Written through the whole stack, read back from the card underneath it
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(top, lba, buffer_in, 64));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Flush(top));
+    SD_BlockDev_ResetStats(card);
+    SD_BlockDev_ResetStats(top);
+    for (uint32_t i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(card, lba, buffer_out, 64));
+    }
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 64 * 512);
+    for (uint32_t i = 0; i < 8 * 64; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(top, lba + (i & 63), &buffer_out[(i & 63) * 512], 1));
+    }
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 64 * 512);
+    printf(" Block device %s %fMB/s, %s single blocks %fMB/s\n", card->pName, _blockdev_read_speed(card),
+           top->pName, _blockdev_read_speed(top));
+}
+
+void _partition_sdmmc(void) {
+    SD_BlockDev_t *card = SD_BlockDev_Card();
+    SD_BlockDev_t *part;
+    const SD_PartInfo_t *info;
+
+    // Read only, the card keeps whatever layout it was formatted with
+    TEST_ASSERT_EQUAL(SD_OK, SD_Part_Mount(card));
+    SD_Part_Print();
+    for (uint8_t i = 0; i < SD_Part_GetTable()->Count; i++) {
+        part = SD_Part_GetDevice(i);
+        info = SD_Part_GetInfo(i);
+        TEST_ASSERT_EQUAL(info->Blocks, part->Blocks);
+        TEST_ASSERT_TRUE((info->Start + info->Blocks) <= card->Blocks);
+        TEST_ASSERT_EQUAL(SD_ADDR_OUT_OF_RANGE, SD_BlockDev_ReadSync(part, part->Blocks, buffer_out, 1));
+        TEST_ASSERT_EQUAL(SD_ADDR_OUT_OF_RANGE, SD_BlockDev_ReadSync(part, part->Blocks - 1, buffer_out, 2));
+        TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(part, 0, buffer_out, 1));
+        TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(card, info->Start, buffer_in, 1));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 512);
+    }
+    TEST_ASSERT_NULL(SD_Part_GetDevice(SD_Part_GetTable()->Count));
+}
+
+static volatile uint32_t barrier_done, barrier_seen;
+
+static void _barrier_write_callback(SD_BlockDev_t *dev, SD_Error_t status, void *context) {
+    (void)dev;
+    (void)context;
+    TEST_ASSERT_EQUAL(SD_OK, status);
+    barrier_done++;
+}
+
+static void _barrier_callback(SD_BlockDev_t *dev, SD_Error_t status, void *context) {
+    (void)dev;
+    (void)context;
+    TEST_ASSERT_EQUAL(SD_OK, status);
+    barrier_seen = barrier_done;
+}
+
+void _barrier_sdmmc(void) {
+    SD_BlockDev_t *card = SD_BlockDev_Card();
+    SD_BlockDevStats_t stats;
+    uint64_t lba = SD_GetBlockCount() - 4096;
+    for (uint32_t i = 0; i < 16 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+
+    // Eight writes, an ordering point, one more write, the barrier sees exactly the first eight
+    barrier_done = 0;
+    barrier_seen = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < 8; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Write(card, lba + i, &buffer_in[i * 512], 1, 0, _barrier_write_callback, NULL));
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Barrier(card, _barrier_callback, NULL));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Write(card, lba + 8, &buffer_in[8 * 512], 8, SD_BLOCKDEV_FUA, _barrier_write_callback, NULL));
+    while (barrier_done < 9) {
+        SD_BlockDev_Process(card);
+    }
+    TEST_ASSERT_EQUAL(8, barrier_seen);
+
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Flush(SD_BlockDev_Default()));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(card, lba, buffer_out, 16));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 16 * 512);
+    SD_BlockDev_GetStats(card, &stats);
+    printf(" Barrier flushes %lu FUA writes %lu, card cache %s\n", stats.Flushes, stats.Fua, SD_CardCacheIsEnabled() ? "on" : "off");
+}
+
+void _journal_sdmmc(void) {
+    SD_BlockDev_t *card = SD_BlockDev_Card();
+    SD_BlockDev_t *dev;
+    SD_JournalStats_t stats;
+    uint64_t lba = SD_GetBlockCount() - 16384;
+    uint32_t start, direct, logged;
+    for (uint32_t i = 0; i < 32 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Journal_Mount(card, &dev));
+    TEST_ASSERT_TRUE(dev->Blocks < card->Blocks);
+
+    // Sixteen scattered blocks, each durable on its own, against the same sixteen as one transaction
+    start = DWT->CYCCNT;
+    for (uint32_t i = 0; i < 16; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(card, lba + i * 37, &buffer_in[i * 512], 1));
+        TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Flush(card));
+    }
+    direct = DWT->CYCCNT - start;
+    start = DWT->CYCCNT;
+    TEST_ASSERT_EQUAL(SD_OK, SD_Journal_Begin());
+    for (uint32_t i = 0; i < 16; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_Journal_Add(lba + i * 37, &buffer_in[(16 + i) * 512]));
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Journal_Commit());
+    logged = DWT->CYCCNT - start;
+
+    // Served from the log before the checkpoint, from home after it
+    for (uint32_t i = 0; i < 16; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, lba + i * 37, &buffer_out[i * 512], 1));
+    }
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[16 * 512], buffer_out, 16 * 512);
+    TEST_ASSERT_EQUAL(SD_OK, SD_Journal_Checkpoint());
+    for (uint32_t i = 0; i < 16; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(card, lba + i * 37, &buffer_out[i * 512], 1));
+    }
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[16 * 512], buffer_out, 16 * 512);
+
+    // Committed but never checkpointed, as after a power loss, comes back at the next mount
+    TEST_ASSERT_EQUAL(SD_OK, SD_Journal_Begin());
+    for (uint32_t i = 0; i < 16; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_Journal_Add(lba + i * 37, &buffer_in[i * 512]));
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Journal_Commit());
+    TEST_ASSERT_EQUAL(SD_OK, SD_Journal_Mount(card, &dev));
+    SD_Journal_GetStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.Replayed);
+    TEST_ASSERT_EQUAL(16, stats.ReplayedBlocks);
+    for (uint32_t i = 0; i < 16; i++) {
+        TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(card, lba + i * 37, &buffer_out[i * 512], 1));
+    }
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 16 * 512);
+    printf(" 16 scattered blocks: one by one %luus, journaled %luus\n",
+           direct / (SystemCoreClock / 1000000), logged / (SystemCoreClock / 1000000));
+}
+
+static SD_Error_t _scratch_read(SD_BlockDev_t *dev, uint64_t lba, uint8_t *buffer, uint32_t count, SD_BlockDevCallback_t callback, void *context) {
+    return SD_BlockDev_Forward(dev, false, lba, buffer, count, 0, callback, context);
+}
+
+static SD_Error_t _scratch_write(SD_BlockDev_t *dev, uint64_t lba, const uint8_t *buffer, uint32_t count, uint32_t flags, SD_BlockDevCallback_t callback, void *context) {
+    return SD_BlockDev_Forward(dev, true, lba, (uint8_t*)buffer, count, flags, callback, context);
+}
+
+// Window on the end of the card for layers that format their lower device
+static const SD_BlockDevOps_t scratch_ops = { .Read = _scratch_read, .Write = _scratch_write };
+
+static SD_BlockDev_t _scratch_device(void) {
+    SD_BlockDev_t *card = SD_BlockDev_Card();
+    return (SD_BlockDev_t){ .pOps = &scratch_ops, .pLower = card, .pName = "scratch", .Blocks = 16384,
+                            .Offset = SD_GetBlockCount() - 32768, .EraseBlocks = card->EraseBlocks, .Caps = card->Caps };
+}
+
+#ifdef SDMMC_LZ4
+void _lz4_sdmmc(void) {
+    SD_BlockDev_t scratch = _scratch_device();
+    SD_BlockDev_t *dev;
+    SD_Lz4Stats_t stats;
+    uint32_t start, raw, packed, length = 0, sample = 0;
+
+    // Telemetry lines as a logger would write them, 32 KB
+    while (length < sizeof(buffer_in)) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%lu,%ld,%ld,%ld,%lu\n", sample++, (int32_t)(rng_get() % 64) - 32,
+                         (int32_t)(rng_get() % 16) - 8, 1000 + (int32_t)(rng_get() % 8), 2150 + (rng_get() % 4));
+        for (int i = 0; (i < n) && (length < sizeof(buffer_in)); i++) {
+            buffer_in[length++] = line[i];
+        }
+    }
+
+    TEST_ASSERT_EQUAL(SD_OK, SD_Lz4_Format(&scratch, &dev));
+    SD_Lz4_ResetStats();
+    start = DWT->CYCCNT;
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(&scratch, 8192, buffer_in, 64));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Flush(&scratch));
+    raw = DWT->CYCCNT - start;
+    start = DWT->CYCCNT;
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(dev, 0, buffer_in, 64));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Flush(dev));
+    packed = DWT->CYCCNT - start;
+
+    // Partial rewrite merges with the old chunk, then everything must survive a remount
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(dev, 3, &buffer_in[40 * 512], 2));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Flush(dev));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Lz4_Mount(&scratch, &dev));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 0, buffer_out, 64));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 3 * 512);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[40 * 512], &buffer_out[3 * 512], 2 * 512);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[5 * 512], &buffer_out[5 * 512], 59 * 512);
+
+    SD_Lz4_GetStats(&stats);
+    TEST_ASSERT_TRUE(stats.OutBytes < stats.InBytes);
+    SD_Lz4_Print();
+    printf(" 32 KB of telemetry: raw %luus, compressed %luus\n", raw / (SystemCoreClock / 1000000), packed / (SystemCoreClock / 1000000));
+}
+#endif
+
+#ifdef SDMMC_XTS
+void _xts_sdmmc(void) {
+    // IEEE 1619 vector 2, first two AES blocks of the data unit
+    static const uint8_t vector[32] = {
+        0xc4, 0x54, 0x18, 0x5e, 0x6a, 0x16, 0x93, 0x6e, 0x39, 0x33, 0x40, 0x38, 0xac, 0xef, 0x83, 0x8b,
+        0xfb, 0x18, 0x6f, 0xff, 0x74, 0x80, 0xad, 0xc4, 0x28, 0x93, 0x82, 0xec, 0xd6, 0xd3, 0x94, 0xf0 };
+    SD_BlockDev_t scratch = _scratch_device();
+    SD_BlockDev_t *dev;
+    SD_XtsBench_t bench;
+    uint8_t key[SD_XTS_KEY_256];
+
+    for (uint32_t i = 0; i < SD_XTS_KEY_128; i++) {
+        key[i] = (i < 16) ? 0x11 : 0x22;
+    }
+    for (uint32_t i = 0; i < 512; i++) {
+        buffer_in[i] = 0x44;
+    }
+    TEST_ASSERT_EQUAL(SD_INVALID_PARAMETER, SD_Xts_SetKey(buffer_in, SD_XTS_KEY_128));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Xts_SetKey(key, SD_XTS_KEY_128));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Xts_EncryptSector(buffer_in, buffer_out, 0x3333333333ULL));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(vector, buffer_out, 32);
+
+    for (uint32_t i = 0; i < SD_XTS_KEY_256; i += 4) {
+        *(uint32_t*)&key[i] = rng_get();
+    }
+    for (uint32_t i = 0; i < 64 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Xts_SetKey(key, SD_XTS_KEY_256));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Xts_Mount(&scratch, &dev));
+
+    // Only ciphertext on the card, each sector decrypts on its own with its number as the tweak
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(dev, 100, buffer_in, 64));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(&scratch, 100, buffer_out, 64));
+    TEST_ASSERT_FALSE(buffer_out[0] == buffer_in[0] && buffer_out[1] == buffer_in[1] && buffer_out[2] == buffer_in[2]);
+    TEST_ASSERT_EQUAL(SD_OK, SD_Xts_DecryptSector(&buffer_out[7 * 512], &buffer_out[7 * 512], 107));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[7 * 512], &buffer_out[7 * 512], 512);
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 100, buffer_out, 64));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 64 * 512);
+
+    TEST_ASSERT_EQUAL(SD_OK, SD_Xts_Benchmark(buffer_out, 64, &bench));
+    printf(" XTS-AES-256 %s: encrypt %lu.%02lu cycles/byte %lu KB/s per MHz, decrypt %lu.%02lu cycles/byte %lu KB/s per MHz, %lu MB/s at %lu MHz\n",
+           SD_XTS_BITSLICED ? "bitsliced" : "T-table", bench.EncryptCyclesPerByte / 100, bench.EncryptCyclesPerByte % 100, bench.EncryptKBsPerMHz,
+           bench.DecryptCyclesPerByte / 100, bench.DecryptCyclesPerByte % 100, bench.DecryptKBsPerMHz,
+           bench.EncryptKBsPerMHz * (SystemCoreClock / 1000000) / 1000, SystemCoreClock / 1000000);
+    SD_Xts_ClearKey();
+}
+#endif
+
+#ifdef SDMMC_RS
+static uint64_t faulty_lba[SD_RS_PARITY + 1];
+static uint32_t faulty_count;
+
+// Scratch window whose reads of chosen blocks fail the way a worn card fails them
+static SD_Error_t _faulty_read(SD_BlockDev_t *dev, uint64_t lba, uint8_t *buffer, uint32_t count, SD_BlockDevCallback_t callback, void *context) {
+    for (uint32_t i = 0; i < faulty_count; i++) {
+        if ((faulty_lba[i] >= lba) && (faulty_lba[i] < lba + count)) {
+            callback(dev, SD_CARD_ECC_FAILED, context);
+            return SD_OK;
+        }
+    }
+    return SD_BlockDev_Forward(dev, false, lba, buffer, count, 0, callback, context);
+}
+
+static const SD_BlockDevOps_t faulty_ops = { .Read = _faulty_read, .Write = _scratch_write };
+
+void _rs_sdmmc(void) {
+    SD_BlockDev_t faulty = _scratch_device();
+    SD_BlockDev_t *dev;
+    SD_RsStats_t stats;
+    SD_RsBench_t bench;
+
+    faulty.pOps  = &faulty_ops;
+    faulty_count = 0;
+    for (uint32_t i = 0; i < 64 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Rs_Mount(&faulty, &dev));
+    TEST_ASSERT_EQUAL(16384 / SD_RS_STRIPE_BLOCKS * SD_RS_DATA, dev->Blocks);
+
+    // Starts and ends inside a stripe, both ends are read-modify-write
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(dev, 3, buffer_in, 64));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 3, buffer_out, 64));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 64 * 512);
+
+    // Stripe 2 as stored, its first blocks lost and rebuilt from the rest
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(&faulty, 2 * SD_RS_STRIPE_BLOCKS, buffer_out, SD_RS_STRIPE_BLOCKS));
+    for (uint32_t i = 0; i < SD_RS_PARITY * 512; i++) {
+        buffer_out[i] = 0;
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Rs_DecodeStripe(buffer_out, (1UL << SD_RS_PARITY) - 1));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[(2 * SD_RS_DATA - 3) * 512], buffer_out, SD_RS_DATA * 512);
+    TEST_ASSERT_EQUAL(SD_ERROR, SD_Rs_DecodeStripe(buffer_out, (1UL << (SD_RS_PARITY + 1)) - 1));
+
+    // As many unreadable blocks as there is parity come back, one more fails like the card did
+    for (faulty_count = 0; faulty_count < SD_RS_PARITY; faulty_count++) {
+        faulty_lba[faulty_count] = 2 * SD_RS_STRIPE_BLOCKS + faulty_count;
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 3, buffer_out, 64));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 64 * 512);
+    SD_Rs_GetStats(&stats);
+    TEST_ASSERT_EQUAL(SD_RS_PARITY, stats.Reconstructed);
+    faulty_lba[faulty_count++] = 2 * SD_RS_STRIPE_BLOCKS + SD_RS_DATA;
+    TEST_ASSERT_EQUAL(SD_CARD_ECC_FAILED, SD_BlockDev_ReadSync(dev, 2 * SD_RS_DATA, buffer_out, 1));
+    faulty_count = 0;
+
+    TEST_ASSERT_EQUAL(SD_OK, SD_Rs_Benchmark(buffer_out, &bench));
+    printf(" RS(%d+%d): encode %lu.%02lu cycles/byte %lu KB/s per MHz, decode %lu.%02lu cycles/byte %lu KB/s per MHz, encode %lu MB/s at %lu MHz\n",
+           SD_RS_DATA, SD_RS_PARITY, bench.EncodeCyclesPerByte / 100, bench.EncodeCyclesPerByte % 100, bench.EncodeKBsPerMHz,
+           bench.DecodeCyclesPerByte / 100, bench.DecodeCyclesPerByte % 100, bench.DecodeKBsPerMHz,
+           bench.EncodeKBsPerMHz * (SystemCoreClock / 1000000) / 1000, SystemCoreClock / 1000000);
+}
+#endif
+
+#ifdef SDMMC_INTEGRITY
+void _integrity_sdmmc(void) {
+    SD_BlockDev_t scratch = _scratch_device();
+    SD_BlockDev_t *dev;
+    SD_IntegrityStats_t stats;
+    SD_IntegrityBench_t bench;
+
+    // zlib crc32() of 512 zero bytes and of bytes 0..255 twice
+    for (uint32_t i = 0; i < 512; i++) {
+        buffer_in[i] = 0;
+    }
+    TEST_ASSERT_EQUAL_HEX32(0xB2AA7578, SD_Integrity_Crc32(buffer_in));
+    for (uint32_t i = 0; i < 512; i++) {
+        buffer_in[i] = i;
+    }
+    TEST_ASSERT_EQUAL_HEX32(0x1C613576, SD_Integrity_Crc32(buffer_in));
+
+    for (uint32_t i = 0; i < 64 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Integrity_Format(&scratch, &dev));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 200, buffer_out, 64));
+    SD_Integrity_GetStats(&stats);
+    TEST_ASSERT_EQUAL(64, stats.UntaggedBlocks);
+
+    // Tags survive a remount, then a block changed underneath the layer or written to the wrong place fails
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(dev, 200, buffer_in, 64));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Flush(dev));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Integrity_Mount(&scratch, &dev));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 200, buffer_out, 64));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 64 * 512);
+    SD_Integrity_GetStats(&stats);
+    TEST_ASSERT_EQUAL(64, stats.VerifiedBlocks);
+
+    buffer_out[9 * 512 + 100] ^= 0x01;
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(&scratch, 209, &buffer_out[9 * 512], 1));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(&scratch, 210, &buffer_in[12 * 512], 1));
+    TEST_ASSERT_EQUAL(SD_CARD_ECC_FAILED, SD_BlockDev_ReadSync(dev, 200, buffer_out, 64));
+    SD_Integrity_GetStats(&stats);
+    TEST_ASSERT_EQUAL(2, stats.Mismatches);
+    TEST_ASSERT_EQUAL(210, stats.LastMismatch);
+
+    // Formatting drops every tag without touching them
+    TEST_ASSERT_EQUAL(SD_OK, SD_Integrity_Format(&scratch, &dev));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 200, buffer_out, 64));
+
+    TEST_ASSERT_EQUAL(SD_OK, SD_Integrity_Benchmark(buffer_in, SD_INTEGRITY_STAGE_BLOCKS, &bench));
+    printf(" CRC-32: software %lu.%02lu, CRC unit %lu.%02lu, CRC unit by MDMA %lu.%02lu cycles/byte\n",
+           bench.SoftwareCyclesPerByte / 100, bench.SoftwareCyclesPerByte % 100, bench.CpuCyclesPerByte / 100,
+           bench.CpuCyclesPerByte % 100, bench.MdmaCyclesPerByte / 100, bench.MdmaCyclesPerByte % 100);
+}
+#endif
+
+#ifdef SDMMC_COW
+void _cow_sdmmc(void) {
+    SD_BlockDev_t scratch = _scratch_device();
+    SD_BlockDev_t *dev, *snapshot;
+    SD_CowStats_t stats;
+    uint32_t start, taken;
+
+    for (uint32_t i = 0; i < 64 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cow_Format(&scratch, &dev));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(dev, 0, buffer_in, 64));
+    TEST_ASSERT_NULL(SD_Cow_GetSnapshot());
+
+    // Blocks 8..23 rewritten with blocks 40..55 after the snapshot, the snapshot keeps the old ones
+    start = DWT->CYCCNT;
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cow_Snapshot());
+    taken = DWT->CYCCNT - start;
+    TEST_ASSERT_EQUAL(SD_REQUEST_NOT_APPLICABLE, SD_Cow_Snapshot());
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(dev, 8, &buffer_in[40 * 512], 16));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Flush(dev));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cow_Mount(&scratch, &dev));
+    TEST_ASSERT_NOT_NULL(snapshot = SD_Cow_GetSnapshot());
+    TEST_ASSERT_EQUAL(SD_REQUEST_NOT_APPLICABLE, SD_BlockDev_WriteSync(snapshot, 0, buffer_in, 1));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(snapshot, 0, buffer_out, 64));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 64 * 512);
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 0, buffer_out, 64));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[40 * 512], &buffer_out[8 * 512], 16 * 512);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[24 * 512], &buffer_out[24 * 512], 40 * 512);
+    SD_Cow_GetStats(&stats);
+    TEST_ASSERT_EQUAL(16, stats.Remapped);
+
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cow_Rollback());
+    TEST_ASSERT_NULL(SD_Cow_GetSnapshot());
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 0, buffer_out, 64));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 64 * 512);
+
+    // Discard keeps the new contents, the background fold then empties the pool
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cow_Snapshot());
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(dev, 8, &buffer_in[40 * 512], 16));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Cow_Discard());
+    for (uint32_t i = 0; i < 16; i++) {
+        SD_BlockDev_Process(dev);
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 0, buffer_out, 64));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[40 * 512], &buffer_out[8 * 512], 16 * 512);
+    SD_Cow_GetStats(&stats);
+    TEST_ASSERT_EQUAL(0, stats.Remapped);
+    printf(" Snapshot of %lu MB taken in %luus\n", (uint32_t)(dev->Blocks / 2048), taken / (SystemCoreClock / 1000000));
+}
+#endif
+
+#ifdef SDMMC_RAMDISK
+void _ramdisk_sdmmc(void) {
+    SD_BlockDev_t *card = SD_BlockDev_Card();
+    SD_BlockDev_t *dev;
+    uint32_t start, ram, sd;
+
+    for (uint32_t i = 0; i < 64 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_RamDisk_Init(&dev));
+    TEST_ASSERT_EQUAL(SD_RAMDISK_BLOCKS, dev->Blocks);
+    TEST_ASSERT_NULL(SD_RamDisk_GetBlock(SD_RAMDISK_BLOCKS));
+    TEST_ASSERT_EQUAL(0, (uint32_t)SD_RamDisk_GetBlock(1) & 31);
+
+    // Across the end of D2 into D3
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(dev, SD_RAMDISK_D2_BLOCKS - 32, buffer_in, 64));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, SD_RAMDISK_D2_BLOCKS - 32, buffer_out, 64));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 64 * 512);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[40 * 512], SD_RamDisk_GetBlock(SD_RAMDISK_D2_BLOCKS + 8), 512);
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_Discard(dev, SD_RAMDISK_D2_BLOCKS - 1, 2));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, SD_RAMDISK_D2_BLOCKS - 1, buffer_out, 1));
+    for (uint32_t i = 0; i < 512; i++) {
+        TEST_ASSERT_EQUAL(0, buffer_out[i]);
+    }
+
+    // Same 32 KB read through the block layer from both, the difference is the card
+    start = DWT->CYCCNT;
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(dev, 0, buffer_out, 64));
+    ram = DWT->CYCCNT - start;
+    start = DWT->CYCCNT;
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(card, 0, buffer_out, 64));
+    sd = DWT->CYCCNT - start;
+    printf(" 32 KB read: RAM disk %luus, card %luus\n", ram / (SystemCoreClock / 1000000), sd / (SystemCoreClock / 1000000));
+}
+#endif
+
+#ifdef SDMMC_SHARE
+void _share_sdmmc(void) {
+    SD_BlockDev_t scratch = _scratch_device();
+    SD_BlockDev_t *host;
+    SD_ShareStats_t stats;
+
+    for (uint32_t i = 0; i < 64 * 512; i += 4) {
+        *(uint32_t*)&buffer_in[i] = rng_get();
+    }
+    TEST_ASSERT_EQUAL(SD_OK, SD_Share_Mount(&scratch, &host));
+    TEST_ASSERT_EQUAL(scratch.Blocks, host->Blocks);
+    TEST_ASSERT_EQUAL(SD_ADDR_OUT_OF_RANGE, SD_Share_Reserve(16380, 64, 0));
+    TEST_ASSERT_EQUAL(SD_OK, SD_Share_Reserve(1000, 64, 0));
+    SD_Share_MediaChanged();
+
+    // 40 blocks take three slices, the region has 24 left after them
+    TEST_ASSERT_EQUAL(SD_OK, SD_Share_Append(buffer_in, 40));
+    TEST_ASSERT_EQUAL(SD_ADDR_OUT_OF_RANGE, SD_Share_Append(buffer_in, 30));
+    TEST_ASSERT_FALSE(SD_Share_MediaChanged());
+
+    // The host reads the region but may not write it
+    TEST_ASSERT_EQUAL(SD_WRITE_PROT_VIOLATION, SD_BlockDev_WriteSync(host, 1060, buffer_in, 8));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(host, 900, &buffer_in[40 * 512], 8));
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_ReadSync(host, 1000, buffer_out, 40));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer_in, buffer_out, 40 * 512);
+    TEST_ASSERT_EQUAL(SD_OK, SD_Share_Read(900, buffer_out, 8));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(&buffer_in[40 * 512], buffer_out, 8 * 512);
+
+    // Only firmware writes outside of the region change what the host sees, reported once
+    TEST_ASSERT_EQUAL(SD_OK, SD_Share_Write(1050, buffer_in, 1));
+    TEST_ASSERT_FALSE(SD_Share_MediaChanged());
+    TEST_ASSERT_EQUAL(SD_OK, SD_Share_Write(2000, buffer_in, 1));
+    TEST_ASSERT_TRUE(SD_Share_MediaChanged());
+    TEST_ASSERT_FALSE(SD_Share_MediaChanged());
+
+    TEST_ASSERT_EQUAL(SD_OK, SD_Share_Release());
+    TEST_ASSERT_EQUAL(SD_OK, SD_BlockDev_WriteSync(host, 1060, buffer_in, 8));
+    SD_Share_GetStats(&stats);
+    TEST_ASSERT_EQUAL(40, stats.Appended);
+    TEST_ASSERT_EQUAL(1, stats.HostRejected);
+    printf(" Host held off for at most %luus per slice\n", stats.MaxHoldUs);
+}
+#endif
+
 void run_sdmmc_test(void) {
     UNITY_BEGIN();
     RUN_TEST(_init_sdmmc);
@@ -159,6 +1112,57 @@ void run_sdmmc_test(void) {
     RUN_TEST(_write_read_multi_sector_sdmmc);
     RUN_TEST(_write_multi_test_sdmmc);
     RUN_TEST(_read_multi_test_sdmmc);
+    RUN_TEST(_queued_read_sdmmc);
+    RUN_TEST(_card_cache_sdmmc);
+    RUN_TEST(_blockdev_sdmmc);
+    RUN_TEST(_partition_sdmmc);
+    RUN_TEST(_barrier_sdmmc);
+    RUN_TEST(_journal_sdmmc);
+#ifdef SDMMC_STATS
+    RUN_TEST(_latency_stats_sdmmc);
+#endif
+#ifdef SDMMC_TRACE
+    RUN_TEST(_trace_ring_sdmmc);
+#endif
+#ifdef SDMMC_VERIFY
+    RUN_TEST(_verify_sdmmc);
+#endif
+    RUN_TEST(_tune_sdmmc);
+#ifdef SDMMC_POWER_FAIL
+    RUN_TEST(_powerfail_sdmmc);
+#endif
+#ifdef SDMMC_BLOCK_CACHE
+    RUN_TEST(_block_cache_sdmmc);
+#endif
+#ifdef SDMMC_READAHEAD
+    RUN_TEST(_readahead_sdmmc);
+#endif
+#ifdef SDMMC_SCHED
+    RUN_TEST(_sched_sdmmc);
+    RUN_TEST(_sched_qos_sdmmc);
+    RUN_TEST(_sched_cache_sdmmc);
+#endif
+#ifdef SDMMC_LZ4
+    RUN_TEST(_lz4_sdmmc);
+#endif
+#ifdef SDMMC_XTS
+    RUN_TEST(_xts_sdmmc);
+#endif
+#ifdef SDMMC_RS
+    RUN_TEST(_rs_sdmmc);
+#endif
+#ifdef SDMMC_INTEGRITY
+    RUN_TEST(_integrity_sdmmc);
+#endif
+#ifdef SDMMC_COW
+    RUN_TEST(_cow_sdmmc);
+#endif
+#ifdef SDMMC_RAMDISK
+    RUN_TEST(_ramdisk_sdmmc);
+#endif
+#ifdef SDMMC_SHARE
+    RUN_TEST(_share_sdmmc);
+#endif
     UNITY_END();
 }
 
@@ -52,6 +52,13 @@
 
 /* USER CODE BEGIN INCLUDE */
 #include "sdmmc_sdio.h"
+#include "sd_cache.h"
+#include "sd_powerfail.h"
+#include "sd_readahead.h"
+#include "sd_sched.h"
+#include "sd_blockdev.h"
+#include "sd_ramdisk.h"
+#include "sd_share.h"
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -96,6 +103,18 @@
 #define STORAGE_BLK_SIZ                  0x200
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
+#ifdef SDMMC_RAMDISK
+// LUN 1 is the RAM disk, a scratch volume and a reference for the USB and SCSI overhead without the card
+#undef STORAGE_LUN_NBR
+#define STORAGE_LUN_NBR                  2
+#define STORAGE_RAMDISK_LUN              1
+#endif
+
+// A host expects a block to be on the card once the write completed. Write-back is for boards whose
+// PVD hold-up time covers a last-gasp flush, opt in by defining it to SD_CACHE_WRITE_BACK
+#ifndef STORAGE_CACHE_MODE
+#define STORAGE_CACHE_MODE               SD_CACHE_WRITE_THROUGH
+#endif
 
 /* USER CODE END PRIVATE_DEFINES */
 
@@ -137,11 +156,32 @@ const int8_t STORAGE_Inquirydata_FS[] = {/* 36 */
   'S', 'T', 'M', ' ', ' ', ' ', ' ', ' ', /* Manufacturer : 8 bytes */
   'P', 'r', 'o', 'd', 'u', 'c', 't', ' ', /* Product      : 16 Bytes */
   ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+  '0', '.', '0' ,'1',                     /* Version      : 4 Bytes */
+#ifdef SDMMC_RAMDISK
+
+  /* LUN 1 */
+  0x00,
+  0x80,
+  0x02,
+  0x02,
+  (STANDARD_INQUIRY_DATA_LEN - 5),
+  0x00,
+  0x00,
+  0x00,
+  'S', 'T', 'M', ' ', ' ', ' ', ' ', ' ', /* Manufacturer : 8 bytes */
+  'R', 'A', 'M', ' ', 'd', 'i', 's', 'k', /* Product      : 16 Bytes */
+  ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
   '0', '.', '0' ,'1'                      /* Version      : 4 Bytes */
+#endif
 };
 /* USER CODE END INQUIRY_DATA_FS */
 
 /* USER CODE BEGIN PRIVATE_VARIABLES */
+// Top of the block device stack the host sees
+static SD_BlockDev_t *StorageDev;
+#ifdef SDMMC_RAMDISK
+static SD_BlockDev_t *StorageRamDisk;
+#endif
 
 /* USER CODE END PRIVATE_VARIABLES */
 
@@ -170,14 +210,15 @@ extern USBD_HandleTypeDef hUsbDeviceFS;
   */
 
 static int8_t STORAGE_Init_FS(uint8_t lun);
-static int8_t STORAGE_GetCapacity_FS(uint8_t lun, uint32_t *block_num, uint16_t *block_size);
+static int8_t STORAGE_GetCapacity_FS(uint8_t lun, uint64_t *block_num, uint16_t *block_size);
 static int8_t STORAGE_IsReady_FS(uint8_t lun);
 static int8_t STORAGE_IsWriteProtected_FS(uint8_t lun);
-static int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
-static int8_t STORAGE_Write_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint64_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_Write_FS(uint8_t lun, uint8_t *buf, uint64_t blk_addr, uint16_t blk_len);
 static int8_t STORAGE_GetMaxLun_FS(void);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
+static SD_BlockDev_t *STORAGE_Device(uint8_t lun);
 
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
 
@@ -206,6 +247,32 @@ USBD_StorageTypeDef USBD_Storage_Interface_fops_FS =
 int8_t STORAGE_Init_FS(uint8_t lun)
 {
   /* USER CODE BEGIN 2 */
+#ifdef SDMMC_POWER_FAIL
+  SD_PowerFail_Init(SD_POWERFAIL_PVD_LEVEL, SD_POWERFAIL_HOLDUP_US);
+#endif
+#ifdef SDMMC_BLOCK_CACHE
+  // FAT and directory sectors are re-read by the host all the time
+  if (SD_Cache_Init(SD_CACHE_ARC, STORAGE_CACHE_MODE) != SD_OK) {
+      return (USBD_FAIL);
+  }
+#endif
+#ifdef SDMMC_READAHEAD
+  SD_ReadAhead_Enable();
+#endif
+#ifdef SDMMC_SCHED
+  // The host is the default client, on-device writers open their own with a higher class
+  SD_Sched_SetClient(SD_SCHED_DEFAULT_CLIENT, SD_SCHED_CLASS_NORMAL, 0, 0);
+#endif
+  StorageDev = SD_BlockDev_Default();
+#ifdef SDMMC_SHARE
+  // The host gets the volume through the arbitration layer, on-device writers use SD_Share_*
+  SD_Share_Mount(StorageDev, &StorageDev);
+#endif
+#ifdef SDMMC_RAMDISK
+  if (SD_RamDisk_Init(&StorageRamDisk) != SD_OK) {
+      return (USBD_FAIL);
+  }
+#endif
   return (USBD_OK);
   /* USER CODE END 2 */
 }
@@ -217,15 +284,25 @@ int8_t STORAGE_Init_FS(uint8_t lun)
   * @param  block_size: .
   * @retval USBD_OK if all operations are OK else USBD_FAIL
   */
-int8_t STORAGE_GetCapacity_FS(uint8_t lun, uint32_t *block_num, uint16_t *block_size)
+int8_t STORAGE_GetCapacity_FS(uint8_t lun, uint64_t *block_num, uint16_t *block_size)
 {
   /* USER CODE BEGIN 3 */
-  if (SD_GetCardInfo() == SD_OK) {
-      *block_num  = SD_CardInfo.CardCapacity;
-      *block_size = SD_CardInfo.CardBlockSize;
-      return (USBD_OK);
+  SD_BlockDev_t *dev;
+
+  // Geometry of the device the host actually reads and writes, not of the raw card
+  if (StorageDev == NULL) {
+      StorageDev = SD_BlockDev_Default();
+#ifdef SDMMC_SHARE
+      SD_Share_Mount(StorageDev, &StorageDev);
+#endif
   }
-  return 1;
+  dev = STORAGE_Device(lun);
+  if ((dev == NULL) || (dev->Blocks == 0)) {
+      return (USBD_FAIL);
+  }
+  *block_num  = dev->Blocks;
+  *block_size = SD_BLOCKDEV_BLOCK_SIZE;
+  return (USBD_OK);
   /* USER CODE END 3 */
 }
 
@@ -238,6 +315,13 @@ int8_t STORAGE_IsReady_FS(uint8_t lun)
 {
   /* USER CODE BEGIN 4 */
   int state = 1;
+#ifdef SDMMC_RAMDISK
+  if (lun == STORAGE_RAMDISK_LUN) {
+      return 0;
+  }
+#endif
+  // TEST UNIT READY is polled while the host is idle, a good moment to age dirty blocks and prefetch
+  SD_BlockDev_Process(StorageDev);
   if (SD_GetState()) {
       state = 0;
   }
@@ -262,14 +346,12 @@ int8_t STORAGE_IsWriteProtected_FS(uint8_t lun)
   * @param  lun: .
   * @retval USBD_OK if all operations are OK else USBD_FAIL
   */
-int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint64_t blk_addr, uint16_t blk_len)
 {
   /* USER CODE BEGIN 6 */
     int error = -1;
     HAL_GPIO_TogglePin(LD2_GPIO_Port, LD2_Pin);
-    if (SD_ReadBlocks_DMA(blk_addr, buf, 512, blk_len) == SD_OK) {
-        while (SD_CheckRead());
-        while(SD_GetState() == false);
+    if (SD_BlockDev_ReadSync(STORAGE_Device(lun), blk_addr, buf, blk_len) == SD_OK) {
         error = 0;
     }
     HAL_GPIO_TogglePin(LD2_GPIO_Port, LD2_Pin);
@@ -282,14 +364,12 @@ int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t bl
   * @param  lun: .
   * @retval USBD_OK if all operations are OK else USBD_FAIL
   */
-int8_t STORAGE_Write_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+int8_t STORAGE_Write_FS(uint8_t lun, uint8_t *buf, uint64_t blk_addr, uint16_t blk_len)
 {
   /* USER CODE BEGIN 7 */
     int error = -1;
     HAL_GPIO_TogglePin(LD3_GPIO_Port, LD3_Pin);
-    if (SD_WriteBlocks_DMA(blk_addr, buf, 512, blk_len) == SD_OK) {
-        while(SD_CheckWrite());
-        while(SD_GetState() == false);
+    if (SD_BlockDev_WriteSync(STORAGE_Device(lun), blk_addr, buf, blk_len) == SD_OK) {
         error = 0;
     }
     HAL_GPIO_TogglePin(LD3_GPIO_Port, LD3_Pin);
@@ -310,6 +390,52 @@ int8_t STORAGE_GetMaxLun_FS(void)
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
+/**
+  * @brief  Device behind a LUN.
+  * @param  lun: .
+  * @retval Block device, NULL before it is initialized
+  */
+static SD_BlockDev_t *STORAGE_Device(uint8_t lun)
+{
+#ifdef SDMMC_RAMDISK
+  if (lun == STORAGE_RAMDISK_LUN) {
+      return StorageRamDisk;
+  }
+#endif
+  return StorageDev;
+}
+
+/**
+  * @brief  Writes back what the layers hold for the LUN, on SYNCHRONIZE CACHE and eject.
+  * @param  lun: .
+  * @retval USBD_OK if all operations are OK else USBD_FAIL
+  */
+int8_t SCSI_FlushCache(uint8_t lun)
+{
+  SD_BlockDev_t *dev = STORAGE_Device(lun);
+
+  if ((dev != NULL) && (SD_BlockDev_Flush(dev) != SD_OK)) {
+      return (USBD_FAIL);
+  }
+  return (USBD_OK);
+}
+
+#ifdef SDMMC_SHARE
+/**
+  * @brief  Raises UNIT ATTENTION once the firmware changed the card under the host.
+  * @param  lun: .
+  * @retval 1 when changed, 0 otherwise
+  */
+int8_t SCSI_MediaChanged(uint8_t lun)
+{
+#ifdef SDMMC_RAMDISK
+  if (lun == STORAGE_RAMDISK_LUN) {
+      return 0;
+  }
+#endif
+  return SD_Share_MediaChanged() ? 1 : 0;
+}
+#endif
 
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
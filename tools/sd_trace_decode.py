@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+"""
+Decoder for the SDMMC driver trace ring (Inc/sd_trace.h).
+
+Accepts either the text produced by SD_Trace_Dump() (captured from the UART,
+other output around the SDTRACE BEGIN/END markers is ignored) or a raw binary
+memory dump of SD_TraceRing taken with a debugger, e.g.
+
+    JLinkExe: savebin trace.bin, <&SD_TraceRing>, <sizeof(SD_TraceRing)>
+
+Usage:
+    sd_trace_decode.py capture.log
+    sd_trace_decode.py --clock 400000000 trace.bin
+"""
+
+import argparse
+import struct
+import sys
+
+TRACE_MAGIC = 0x53445452
+
+EVENTS = {1: "CMD", 2: "RESP", 3: "STA", 4: "IDMA", 5: "DATAEND",
+          6: "ERROR", 7: "XFER", 8: "CQ", 9: "MARK", 10: "POWER"}
+
+SITES = {0: "irq", 1: "check_read", 2: "check_write", 3: "abort", 4: "cq", 5: "extreg", 6: "command"}
+
+XFERS = {0: "read", 1: "write", 2: "queued read", 3: "queued write"}
+
+CQ_STATES = {0: "free", 1: "queued", 2: "executing", 3: "done"}
+
+POWER_STAGES = {0: "detected", 1: "drained", 2: "idle", 3: "hooks done", 4: "done", 5: "recovered"}
+
+COMMANDS = {
+    0: "GO_IDLE_STATE", 2: "ALL_SEND_CID", 3: "SEND_RELATIVE_ADDR", 6: "SWITCH_FUNC",
+    7: "SELECT_CARD", 8: "SEND_IF_COND", 9: "SEND_CSD", 10: "SEND_CID",
+    11: "VOLTAGE_SWITCH", 12: "STOP_TRANSMISSION", 13: "SEND_STATUS", 16: "SET_BLOCKLEN",
+    17: "READ_SINGLE_BLOCK", 18: "READ_MULTIPLE_BLOCK", 19: "SEND_TUNING_BLOCK",
+    20: "SPEED_CLASS_CONTROL", 22: "ADDRESS_EXTENSION", 23: "SET_BLOCK_COUNT",
+    24: "WRITE_BLOCK", 25: "WRITE_MULTIPLE_BLOCK", 27: "PROGRAM_CSD",
+    32: "ERASE_WR_BLK_START", 33: "ERASE_WR_BLK_END", 38: "ERASE",
+    41: "SD_SEND_OP_COND", 42: "LOCK_UNLOCK", 43: "Q_MANAGEMENT",
+    44: "Q_TASK_INFO_A", 45: "Q_TASK_INFO_B", 46: "Q_RD_TASK", 47: "Q_WR_TASK",
+    48: "READ_EXTR_SINGLE", 49: "WRITE_EXTR_SINGLE", 51: "SEND_SCR", 55: "APP_CMD",
+}
+
+ERRORS = [
+    "SD_OK", "SD_CMD_CRC_FAIL", "SD_DATA_CRC_FAIL", "SD_CMD_RSP_TIMEOUT", "SD_DATA_TIMEOUT",
+    "SD_TX_UNDERRUN", "SD_RX_OVERRUN", "SD_START_BIT_ERR", "SD_CMD_OUT_OF_RANGE",
+    "SD_ADDR_MISALIGNED", "SD_BLOCK_LEN_ERR", "SD_ERASE_SEQ_ERR", "SD_BAD_ERASE_PARAM",
+    "SD_WRITE_PROT_VIOLATION", "SD_LOCK_UNLOCK_FAILED", "SD_COM_CRC_FAILED", "SD_ILLEGAL_CMD",
+    "SD_CARD_ECC_FAILED", "SD_CC_ERROR", "SD_GENERAL_UNKNOWN_ERROR", "SD_STREAM_READ_UNDERRUN",
+    "SD_STREAM_WRITE_OVERRUN", "SD_CID_CSD_OVERWRITE", "SD_WP_ERASE_SKIP", "SD_CARD_ECC_DISABLED",
+    "SD_ERASE_RESET", "SD_AKE_SEQ_ERROR", "SD_INVALID_VOLTRANGE", "SD_ADDR_OUT_OF_RANGE",
+    "SD_SWITCH_ERROR", "SD_SDMMC_DISABLED", "SD_SDMMC_FUNCTION_BUSY", "SD_SDMMC_FUNCTION_FAILED",
+    "SD_SDMMC_UNKNOWN_FUNCTION", "SD_OUT_OF_BOUND", "SD_INTERNAL_ERROR", "SD_NOT_CONFIGURED",
+    "SD_REQUEST_PENDING", "SD_REQUEST_NOT_APPLICABLE", "SD_INVALID_PARAMETER",
+    "SD_UNSUPPORTED_FEATURE", "SD_UNSUPPORTED_HW", "SD_ERROR", "SD_BUSY", "SD_IDMA_ERROR",
+    "SD_POWER_FAIL",
+]
+
+# SDMMC_STA bits (RM0433)
+STA_FLAGS = [
+    (0, "CCRCFAIL"), (1, "DCRCFAIL"), (2, "CTIMEOUT"), (3, "DTIMEOUT"), (4, "TXUNDERR"),
+    (5, "RXOVERR"), (6, "CMDREND"), (7, "CMDSENT"), (8, "DATAEND"), (9, "DHOLD"),
+    (10, "DBCKEND"), (11, "DABORT"), (12, "DPSMACT"), (13, "CPSMACT"), (14, "TXFIFOHE"),
+    (15, "RXFIFOHF"), (16, "TXFIFOF"), (17, "RXFIFOF"), (18, "TXFIFOE"), (19, "RXFIFOE"),
+    (20, "BUSYD0"), (21, "BUSYD0END"), (22, "SDIOIT"), (23, "ACKFAIL"), (24, "ACKTIMEOUT"),
+    (25, "VSWEND"), (26, "CKSTOP"), (27, "IDMATE"), (28, "IDMABTC"),
+]
+
+# R1 card status error bits
+R1_FLAGS = [
+    (31, "OUT_OF_RANGE"), (30, "ADDRESS_ERROR"), (29, "BLOCK_LEN_ERROR"), (28, "ERASE_SEQ_ERROR"),
+    (27, "ERASE_PARAM"), (26, "WP_VIOLATION"), (25, "CARD_IS_LOCKED"), (24, "LOCK_UNLOCK_FAILED"),
+    (23, "COM_CRC_ERROR"), (22, "ILLEGAL_COMMAND"), (21, "CARD_ECC_FAILED"), (20, "CC_ERROR"),
+    (19, "ERROR"), (16, "CSD_OVERWRITE"), (15, "WP_ERASE_SKIP"), (14, "CARD_ECC_DISABLED"),
+    (13, "ERASE_RESET"), (8, "READY_FOR_DATA"), (5, "APP_CMD"), (3, "AKE_SEQ_ERROR"),
+]
+
+CARD_STATES = ["idle", "ready", "ident", "stby", "tran", "data", "rcv", "prg", "dis"]
+
+# Commands whose RESP1 is not an R1 card status
+NON_R1 = {2, 3, 8, 9, 10, 41}
+
+
+def error_name(code):
+    return ERRORS[code] if code < len(ERRORS) else "error %d" % code
+
+
+def flags(value, table):
+    return "|".join(name for bit, name in table if value & (1 << bit)) or "-"
+
+
+def r1(value):
+    state = (value >> 9) & 0xF
+    state = CARD_STATES[state] if state < len(CARD_STATES) else "state %d" % state
+    return "%s %s" % (state, flags(value, R1_FLAGS))
+
+
+def describe(kind, aux, aux16, data):
+    if kind == 1:
+        name = COMMANDS.get(aux, "")
+        return "CMD%-2d %-20s arg=%08x" % (aux, name, data)
+    if kind == 2:
+        text = "CMD%-2d %s resp=%08x" % (aux, error_name(aux16), data)
+        if aux not in NON_R1:
+            text += " [%s]" % r1(data)
+        return text
+    if kind == 3:
+        site = "CMD%d" % aux16 if aux == 6 else SITES.get(aux, aux)
+        return "%-11s %s" % (site, flags(data, STA_FLAGS))
+    if kind == 4:
+        return "%s %d blocks buf=%08x" % ("tx" if aux else "rx", aux16, data)
+    if kind == 5:
+        op = ("multi" if aux & 1 else "single") + (" tx" if aux & 2 else " rx")
+        if aux & 4:
+            op += " queued"
+        return "%s dlen=%d" % (op, data)
+    if kind == 6:
+        return "%-11s %s sta=%s" % (SITES.get(aux, aux), error_name(aux16), flags(data, STA_FLAGS))
+    if kind == 7:
+        return "%s %d blocks @ %d" % (XFERS.get(aux, aux), aux16, data)
+    if kind == 8:
+        if aux == 0xFF:
+            return "qsr=%08x" % data
+        state = CQ_STATES.get(aux16, aux16)
+        if aux16 == 3:
+            return "task %d %s %s" % (aux, state, error_name(data))
+        return "task %d %s @ %d" % (aux, state, data)
+    if kind == 10:
+        remaining = data - (1 << 32) if data & 0x80000000 else data
+        return "%-10s %dus left" % (POWER_STAGES.get(aux, aux), remaining)
+    return "aux=%d aux16=%d data=%08x" % (aux, aux16, data)
+
+
+def parse_text(text):
+    entries, clock, lost, inside = [], None, 0, False
+    for line in text.splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[0] == "SDTRACE" and fields[1] == "BEGIN":
+            entries, inside = [], True
+            clock = int(fields[2]) if len(fields) > 2 else None
+        elif len(fields) >= 2 and fields[0] == "SDTRACE" and fields[1] == "END":
+            lost = int(fields[2]) if len(fields) > 2 else 0
+            inside = False
+        elif inside and len(fields) == 3:
+            try:
+                entries.append(tuple(int(f, 16) for f in fields))
+            except ValueError:
+                pass
+    return entries, clock, lost
+
+
+def parse_binary(blob):
+    magic, count, head = struct.unpack_from("<III", blob, 0)
+    if magic != TRACE_MAGIC:
+        raise ValueError("not an SD_TraceRing dump (magic %08x)" % magic)
+    if count == 0 or count & (count - 1):
+        raise ValueError("bad ring size %d" % count)
+    slots = [struct.unpack_from("<III", blob, 12 + 12 * i) for i in range(count)]
+    valid = min(head, count)
+    first = head - valid
+    return [slots[(first + i) & (count - 1)] for i in range(valid)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode an SDMMC driver trace")
+    parser.add_argument("file", help="UART capture or raw SD_TraceRing dump")
+    parser.add_argument("--clock", type=int, help="core clock in Hz (default from dump or 400 MHz)")
+    args = parser.parse_args()
+
+    with open(args.file, "rb") as f:
+        blob = f.read()
+
+    clock, lost = None, 0
+    if len(blob) >= 4 and struct.unpack_from("<I", blob, 0)[0] == TRACE_MAGIC:
+        entries = parse_binary(blob)
+    else:
+        entries, clock, lost = parse_text(blob.decode("ascii", "replace"))
+    clock = args.clock or clock or 400000000
+
+    if not entries:
+        print("no trace entries found", file=sys.stderr)
+        return 1
+
+    # CYCCNT is 32 bit, accumulate deltas so wraps between events are unwound
+    elapsed, previous = 0, entries[0][0]
+    for cycles, header, data in entries:
+        delta    = (cycles - previous) & 0xFFFFFFFF
+        elapsed += delta
+        previous = cycles
+        kind, aux, aux16 = header & 0xFF, (header >> 8) & 0xFF, header >> 16
+        print("%12.3f us %+10.3f  %-7s %s" % (elapsed * 1e6 / clock, delta * 1e6 / clock,
+                                            EVENTS.get(kind, "?%d" % kind),
+                                            describe(kind, aux, aux16, data)))
+
+    if lost:
+        print("%d events overwritten while dumping" % lost)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())